@@ -1,41 +1,101 @@
 // Configuration
-// IMPORTANT: Replace this IP with your Raspberry Pi's IP address
-var ipAddress = "172.20.10.2"; 
-var port = "8000";
+// When the page is served by the webhouse itself, connect back to the same
+// host. The fallback IP is only used when index.html is opened as a file.
+var ipAddress = location.hostname || "172.20.10.2";
+var port = location.port || "8000";
 
-// Create WebSocket connection
-var ws = new WebSocket("ws://" + ipAddress + ":" + port);
+// Offering the binary status protocol is optional; a server that does not
+// know it answers in text.
+var BINARY_PROTOCOL = "webhouse.bin.v1";
+var RECONNECT_MS = 2000;
+var ws = null;
 
 var statusText = document.getElementById("status");
 
-// Connection successful
-ws.onopen = function() {
-    statusText.innerHTML = "System connected";
-    statusText.style.color = "#4caf50";
-};
+// Topics of the state rendered below: temperature, alarm, lamps
+var TOPICS = "temp,alarm,lights";
 
-// Error handling
-ws.onerror = function() {
-    statusText.innerHTML = "Connection error";
-    statusText.style.color = "#f44336";
-};
+// Create the WebSocket connection. After a drop the page reconnects with the
+// version it has ("/?v=42"): the server replays the changes it missed, one
+// delta each, or sends the full state if it no longer has them all.
+function connect() {
+    var path = model.version !== undefined ? "/?v=" + model.version : "/";
+    ws = new WebSocket("ws://" + ipAddress + ":" + port + path, [BINARY_PROTOCOL]);
+    ws.binaryType = "arraybuffer";
 
-// Connection closed
-ws.onclose = function() {
-    statusText.innerHTML = "Connection closed";
-    statusText.style.color = "#888";
-};
+    // Connection successful
+    ws.onopen = function() {
+        statusText.innerHTML = "System connected";
+        statusText.style.color = "#4caf50";
+        // The server pushes the changes of what the page shows, as deltas;
+        // the reply to the subscription is the full state
+        ws.send("<Subscribe:" + TOPICS + ">");
+        sendWaiting();
+    };
+
+    // Error handling
+    ws.onerror = function() {
+        statusText.innerHTML = "Connection error";
+        statusText.style.color = "#f44336";
+    };
+
+    // Connection closed: commands in flight may or may not have been
+    // applied, the replayed changes will tell
+    ws.onclose = function() {
+        statusText.innerHTML = "Connection closed, reconnecting";
+        statusText.style.color = "#888";
+        inFlight = [];
+        setTimeout(connect, RECONNECT_MS);
+    };
+
+    ws.onmessage = receive;
+}
+
+// Commands go out with an id ("<L1on#42>") and stay in flight until a reply
+// acknowledges it ("Ack:42"). The server handles them in order, so an ack
+// covers every id before it too. Up to WINDOW commands are in flight at a
+// time; the others wait, and a waiting slider value is replaced by a newer
+// one of the same slider.
+var WINDOW = 8;
+var nextId = 1;
+var inFlight = [];
+var waiting = [];
 
-// Send command to server
+// Send command to server; while reconnecting it waits for the connection
 function send(command) {
-    if (ws.readyState === WebSocket.OPEN) {
-        ws.send(command);
-        console.log("Sent: " + command);
-    } else {
-        alert("No connection to server!");
+    var colon = command.indexOf(":");
+    if (colon > 0) {
+        var name = command.substring(0, colon + 1);
+        for (var i = 0; i < waiting.length; i++) {
+            if (waiting[i].indexOf(name) === 0) {
+                waiting[i] = command;
+                return;
+            }
+        }
+    }
+    waiting.push(command);
+    sendWaiting();
+}
+
+// Send waiting commands while the window has room
+function sendWaiting() {
+    while (inFlight.length < WINDOW && waiting.length > 0 && ws.readyState === WebSocket.OPEN) {
+        var command = waiting.shift();
+        var id = nextId++;
+        ws.send(command.substring(0, command.length - 1) + "#" + id + ">");
+        inFlight.push(id);
+        console.log("Sent: " + command + " as #" + id);
     }
 }
 
+// A reply acknowledged the commands up to id
+function acknowledge(id) {
+    while (inFlight.length > 0 && inFlight[0] <= id) {
+        inFlight.shift();
+    }
+    sendWaiting();
+}
+
 // Send dimmer command
 function sendDimmer(lamp, value) {
     var command = "<Dim" + lamp + ":" + value + ">";
@@ -48,51 +108,165 @@ function sendTargetTemp(value) {
     send(command);
 }
 
-// Receive message from server
-ws.onmessage = function(event) {
-    var message = event.data;
-    console.log("Received: " + message);
+// Update the temperature display
+function showTemperature(temperature) {
+    document.getElementById("tempDisplay").innerHTML = temperature + " °C";
+}
 
-    // Parse response: "Temp:22.5;AlarmArmed:1;AlarmTriggered:0"
-    var parts = message.split(";");
-    
-    for (var i = 0; i < parts.length; i++) {
-        if (parts[i].includes("Temp:")) {
-            var temperature = parts[i].split(":")[1]; 
-            document.getElementById("tempDisplay").innerHTML = temperature + " °C";
+// Update the armed/unarmed indicator
+function showAlarmArmed(armed) {
+    var statusElement = document.getElementById("alarmArmedStatus");
+    if (armed) {
+        statusElement.innerHTML = "ARMED";
+        statusElement.style.backgroundColor = "#ff9800";
+        statusElement.style.color = "#fff";
+    } else {
+        statusElement.innerHTML = "UNARMED";
+        statusElement.style.backgroundColor = "#4caf50";
+        statusElement.style.color = "#fff";
+    }
+}
+
+// Update the alarm sensor indicator
+function showAlarmTriggered(triggered) {
+    var triggerElement = document.getElementById("alarmTrigger");
+    if (triggered) {
+        triggerElement.innerHTML = "ALARM!";
+        triggerElement.style.backgroundColor = "#f44336";
+        triggerElement.style.color = "#fff";
+    } else {
+        triggerElement.innerHTML = "OK";
+        triggerElement.style.backgroundColor = "#4caf50";
+        triggerElement.style.color = "#fff";
+    }
+}
+
+// Move a dimmer slider unless the user is dragging it
+function showDimmer(id, level) {
+    var slider = document.getElementById(id);
+    if (slider && document.activeElement !== slider) {
+        slider.value = level;
+    }
+}
+
+// Local copy of the house state. The server sends a full snapshot first and
+// afterwards only the fields that changed, tagged with the state version.
+var model = {};
+
+// Show the model
+function render() {
+    if (model.temp !== undefined) {
+        showTemperature(model.temp);
+    }
+    showAlarmArmed(model.alarmArmed === 1);
+    showAlarmTriggered(model.alarmTriggered === 1);
+    if (model.dim1 !== undefined) {
+        showDimmer("dim1", model.dim1);
+        showDimmer("dim2", model.dim2);
+    }
+}
+
+// Binary status frames (webhouse.bin.v1), little-endian
+//   format 1: u8 format | u8 devices | i16 temp [1/100 °C] | u8 dimR | u8 dimS | u16 reserved
+//   format 2: u8 format | u8 fields | u32 version | [u32 ack] [u8 devices] [i16 temp]
+//             [u8 dimR] [u8 dimS]
+var STATUS_HEAT = 0x01;
+var STATUS_LED1 = 0x02;
+var STATUS_LED2 = 0x04;
+var STATUS_TV = 0x08;
+var STATUS_ALARM_ARMED = 0x10;
+var STATUS_ALARM_TRIGGERED = 0x20;
+
+var FIELD_DEVICES = 0x01;
+var FIELD_TEMP = 0x02;
+var FIELD_DIM_RLAMP = 0x04;
+var FIELD_DIM_SLAMP = 0x08;
+var FIELD_ACK = 0x10;
+
+function applyDevices(devices) {
+    model.heat = (devices & STATUS_HEAT) ? 1 : 0;
+    model.led1 = (devices & STATUS_LED1) ? 1 : 0;
+    model.led2 = (devices & STATUS_LED2) ? 1 : 0;
+    model.tv = (devices & STATUS_TV) ? 1 : 0;
+    model.alarmArmed = (devices & STATUS_ALARM_ARMED) ? 1 : 0;
+    model.alarmTriggered = (devices & STATUS_ALARM_TRIGGERED) ? 1 : 0;
+}
+
+function handleBinaryStatus(buffer) {
+    var view = new DataView(buffer);
+    var format = view.byteLength > 0 ? view.getUint8(0) : 0;
+
+    if (format === 1 && view.byteLength >= 8) {
+        applyDevices(view.getUint8(1));
+        model.temp = (view.getInt16(2, true) / 100).toFixed(1);
+        model.dim1 = view.getUint8(4);
+        model.dim2 = view.getUint8(5);
+    } else if (format === 2 && view.byteLength >= 6) {
+        var fields = view.getUint8(1);
+        var offset = 6;
+        var ack = -1;
+        model.version = view.getUint32(2, true);
+        if (fields & FIELD_ACK) {
+            ack = view.getUint32(offset, true);
+            offset += 4;
         }
-        else if (parts[i].includes("AlarmArmed:")) {
-            var armed = parts[i].split(":")[1];
-            var statusElement = document.getElementById("alarmArmedStatus");
-            if (armed === "1") {
-                statusElement.innerHTML = "ARMED";
-                statusElement.style.backgroundColor = "#ff9800";
-                statusElement.style.color = "#fff";
-            } else {
-                statusElement.innerHTML = "UNARMED";
-                statusElement.style.backgroundColor = "#4caf50";
-                statusElement.style.color = "#fff";
-            }
+        if (fields & FIELD_DEVICES) {
+            applyDevices(view.getUint8(offset));
+            offset += 1;
         }
-        else if (parts[i].includes("AlarmTriggered:")) {
-            var triggered = parts[i].split(":")[1];
-            var triggerElement = document.getElementById("alarmTrigger");
-            if (triggered === "1") {
-                triggerElement.innerHTML = "ALARM!";
-                triggerElement.style.backgroundColor = "#f44336";
-                triggerElement.style.color = "#fff";
-            } else {
-                triggerElement.innerHTML = "OK";
-                triggerElement.style.backgroundColor = "#4caf50";
-                triggerElement.style.color = "#fff";
-            }
+        if (fields & FIELD_TEMP) {
+            model.temp = (view.getInt16(offset, true) / 100).toFixed(1);
+            offset += 2;
+        }
+        if (fields & FIELD_DIM_RLAMP) {
+            model.dim1 = view.getUint8(offset);
+            offset += 1;
+        }
+        if (fields & FIELD_DIM_SLAMP) {
+            model.dim2 = view.getUint8(offset);
         }
+        if (ack >= 0) {
+            acknowledge(ack);
+        }
+    } else {
+        return;
     }
+    render();
+}
+
+// Text status, full ("Temp:22.5;AlarmArmed:1;AlarmTriggered:0") or
+// delta ("V:42;Ack:7;L1:1"); every other "key:value" pair updates the model
+var TEXT_FIELDS = {
+    "V": "version", "Temp": "temp", "Heat": "heat", "L1": "led1", "L2": "led2",
+    "TV": "tv", "AlarmArmed": "alarmArmed", "AlarmTriggered": "alarmTriggered",
+    "Dim1": "dim1", "Dim2": "dim2"
 };
 
-// Poll server every 2 seconds for status updates
-setInterval(function() {
-    if (ws.readyState === WebSocket.OPEN) {
-        ws.send("<GetStatus>"); 
+function handleTextStatus(message) {
+    var parts = message.split(";");
+    
+    for (var i = 0; i < parts.length; i++) {
+        var pair = parts[i].split(":");
+        var key = TEXT_FIELDS[pair[0]];
+        if (pair[0] === "Ack") {
+            acknowledge(parseInt(pair[1], 10));
+        } else if (key === "temp") {
+            model.temp = pair[1];
+        } else if (key !== undefined) {
+            model[key] = parseInt(pair[1], 10);
+        }
     }
-}, 2000);
\ No newline at end of file
+    render();
+}
+
+// Receive message from server
+function receive(event) {
+    if (event.data instanceof ArrayBuffer) {
+        handleBinaryStatus(event.data);
+    } else {
+        console.log("Received: " + event.data);
+        handleTextStatus(event.data);
+    }
+}
+
+connect();
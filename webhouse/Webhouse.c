@@ -22,6 +22,8 @@
  * 				getTVState
  * 				dimDLed
  * 				dimSLed
+ * 				getRLampLevel
+ * 				getSLampLevel
  * 				turnLED1On
  * 				turnLED1Off
  * 				getLED1State
@@ -32,10 +34,17 @@
  * 				turnHeizOff
  * 				getHeizState
  * 				getAlarmState
+ * 				getWebhouseState
+ * 				restoreWebhouseState
+ * 				getStateVersion
+ * 				waitStateChange
+ * 				pinWebhouseThreads
+ * 				setStateListener
  *             
  ******************************************************************************/
  
 //----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
 #include <bcm2835.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -43,8 +52,16 @@
 #include <limits.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/random.h>
 
 #include "Webhouse.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+#include "persist.h"
+#include "shmstate.h"
+#include "changelog.h"
 
 //----- Macros -----------------------------------------------------------------
 //PWM can only be used in privilege mode
@@ -78,23 +95,62 @@
 #define HEIZ_ON 1
 #define HEIZ_OFF 0
 
+//Tickless idle: threads sleep until something changes instead of ticking
+//while a lamp is fully on/off or the temperature is at its limit
+#ifndef TICKLESS_IDLE
+#define TICKLESS_IDLE 1
+#endif
+
+//Alarm sensor poll interval while the temperature thread is idle (ms)
+#define ALARM_POLL_MS 1000
+
 //----- Function prototypes ----------------------------------------------------
 static void * threadTemp(void *pdata);
+static void stateChanged(void);
+static void lockState(void);
+static void unlockState(void);
+static void publishState(void);
+static void readState(WebhouseState *state);
+static void writeOutput(uint8_t pin, uint8_t level);
+static void pollAlarm(void);
+static void wakeThreads(void);
+static void unlockWake(void *pdata);
+static void waitForChange(const volatile int *a, int aValue,
+                          const volatile int *b, int bValue, int timeoutMs);
 #ifndef PWM
+static void idleWhileSteady(uint8_t pin, const volatile int *duty);
 static void * threadDimRLamp(void *pdata);
 static void * threadDimSLamp(void *pdata);
 #endif
 
 //----- Data -------------------------------------------------------------------
 static pthread_t pThreadTemp;
-static int stateHeiz = HEIZ_OFF;
+static volatile int stateHeiz = HEIZ_OFF;
 static float localTemp = 16.0;
-static int alarmArmed = 0;  // 0 = disarmed, 1 = armed
+static volatile int alarmArmed = 0;  // 0 = disarmed, 1 = armed
+static int alarmLevel = 0;  // last seen level of the alarm sensor
+static uint32_t stateVersion = 0;
+static StateListener *stateListener = NULL;
+static volatile int dutyCycleRL = 0;
+static volatile int dutyCycleSL = 0;
+// Held while a device, the temperature or the alarm changes: the API is
+// called by all network workers at once. Recursive, restoreWebhouseState
+// calls the device functions under it. The new state is published after
+// the outermost unlock (unlockState), not under the lock.
+static pthread_mutex_t stateLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static int stateDepth = 0;           // lockState nesting, under stateLock
+static int statePending = 0;         // changed since the last unlock
+// Latest state to publish; a single thread publishes at a time and takes
+// the latest, so a change made meanwhile is published by it as well
+static pthread_mutex_t publishLock = PTHREAD_MUTEX_INITIALIZER;
+static WebhouseState publishedState;
+static int publishRequests = 0;      // atomic, not yet taken by the publisher
+static pthread_mutex_t wakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond;
+static pthread_cond_t versionCond;
 #ifndef PWM
 static pthread_t pThreadDimRLamp;
 static pthread_t pThreadDimSLamp;
-static int dutyCycleRL = 0;
-static int dutyCycleSL = 0;
 #endif
 
 //----- Implementation ---------------------------------------------------------
@@ -112,6 +168,11 @@ static int dutyCycleSL = 0;
  *
  ******************************************************************************/
 void initWebhouse(void){
+	// Versions of different runs must not meet: a client resuming with a
+	// version of the last run would get the changes of this one replayed
+	if (getrandom(&stateVersion, sizeof(stateVersion), GRND_NONBLOCK) != sizeof(stateVersion)) {
+		stateVersion = (uint32_t)time(NULL) << 8;
+	}
 	bcm2835_init();
 	printf("GPIO initializion\n");
 	
@@ -136,6 +197,13 @@ void initWebhouse(void){
     bcm2835_pwm_set_range(PWM_CHANNEL1, RANGE);
 #endif
 
+    pthread_condattr_t condAttr;
+    pthread_condattr_init(&condAttr);
+    pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wakeCond, &condAttr);
+    pthread_cond_init(&versionCond, &condAttr);
+    pthread_condattr_destroy(&condAttr);
+
     pthread_create(&pThreadTemp, NULL, threadTemp, NULL);
 #ifndef PWM
     pthread_create(&pThreadDimRLamp, NULL, threadDimRLamp, NULL);
@@ -176,7 +244,7 @@ void closeWebhouse(void){
  *
  ******************************************************************************/
 void turnTVOn(void){
-	bcm2835_gpio_write(GPIO_TV, HIGH);
+	writeOutput(GPIO_TV, HIGH);
 }
 
 /*******************************************************************************
@@ -192,7 +260,7 @@ void turnTVOn(void){
  *
  ******************************************************************************/
 void turnTVOff(void){
-	bcm2835_gpio_write(GPIO_TV, LOW);
+	writeOutput(GPIO_TV, LOW);
 }
 
 /*******************************************************************************
@@ -232,9 +300,15 @@ void dimSLamp(uint16_t dudtyCycle){
 	}
 #ifdef PWM
 	bcm2835_pwm_set_data(PWM_CHANNEL0, dudtyCycle);
-#else
-	dutyCycleSL = dudtyCycle;
+	metrics_inc(METRIC_GPIO_WRITES);
 #endif
+	lockState();
+	if (dutyCycleSL != dudtyCycle) {
+		dutyCycleSL = dudtyCycle;
+		stateChanged();
+		wakeThreads();
+	}
+	unlockState();
 }
 
 /*******************************************************************************
@@ -258,9 +332,43 @@ void dimRLamp(uint16_t dudtyCycle){
 	}
 #ifdef PWM
 	bcm2835_pwm_set_data(PWM_CHANNEL1, dudtyCycle);
-#else
-	dutyCycleRL = dudtyCycle;
+	metrics_inc(METRIC_GPIO_WRITES);
 #endif
+	lockState();
+	if (dutyCycleRL != dudtyCycle) {
+		dutyCycleRL = dudtyCycle;
+		stateChanged();
+		wakeThreads();
+	}
+	unlockState();
+}
+
+/*******************************************************************************
+ *  function :    getSLampLevel
+ ******************************************************************************/
+/** \brief        Get the dim level of the stand lamp
+ *
+ *  \type         global
+ *
+ *  \return       Dim level [0,100]
+ *
+ ******************************************************************************/
+int getSLampLevel(void){
+	return dutyCycleSL;
+}
+
+/*******************************************************************************
+ *  function :    getRLampLevel
+ ******************************************************************************/
+/** \brief        Get the dim level of the roof lamp
+ *
+ *  \type         global
+ *
+ *  \return       Dim level [0,100]
+ *
+ ******************************************************************************/
+int getRLampLevel(void){
+	return dutyCycleRL;
 }
 
 /*******************************************************************************
@@ -276,7 +384,7 @@ void dimRLamp(uint16_t dudtyCycle){
  *
  ******************************************************************************/
 void turnLED1On(void){
-	bcm2835_gpio_write(GPIO_LED1, HIGH);
+	writeOutput(GPIO_LED1, HIGH);
 }
 
 /*******************************************************************************
@@ -292,7 +400,7 @@ void turnLED1On(void){
  *
  ******************************************************************************/
 void turnLED1Off(void){
-	bcm2835_gpio_write(GPIO_LED1, LOW);
+	writeOutput(GPIO_LED1, LOW);
 }
 
 /*******************************************************************************
@@ -325,7 +433,7 @@ int getLED1State(void){
  *
  ******************************************************************************/
 void turnLED2On(void){
-	bcm2835_gpio_write(GPIO_LED2, HIGH);
+	writeOutput(GPIO_LED2, HIGH);
 }
 
 /*******************************************************************************
@@ -341,7 +449,7 @@ void turnLED2On(void){
  *
  ******************************************************************************/
 void turnLED2Off(void){
-	bcm2835_gpio_write(GPIO_LED2, LOW);
+	writeOutput(GPIO_LED2, LOW);
 }
 
 /*******************************************************************************
@@ -374,8 +482,11 @@ int getLED2State(void){
  *
  ******************************************************************************/
 void turnHeatOn(void){
-	bcm2835_gpio_write(GPIO_Heat, HIGH);
+	lockState();
+	writeOutput(GPIO_Heat, HIGH);
 	stateHeiz = HEIZ_ON;
+	wakeThreads();
+	unlockState();
 }
 
 /*******************************************************************************
@@ -391,8 +502,11 @@ void turnHeatOn(void){
  *
  ******************************************************************************/
 void turnHeatOff(void){
-	bcm2835_gpio_write(GPIO_Heat, LOW);
+	lockState();
+	writeOutput(GPIO_Heat, LOW);
 	stateHeiz = HEIZ_OFF;
+	wakeThreads();
+	unlockState();
 }
 
 /*******************************************************************************
@@ -454,8 +568,14 @@ int getAlarmState(void){
  *
  ******************************************************************************/
 void armAlarm(void){
-    alarmArmed = 1;
-    printf("Alarm armed\n");
+    lockState();
+    if (alarmArmed != 1) {
+        alarmArmed = 1;
+        stateChanged();
+        wakeThreads();
+    }
+    unlockState();
+    LOG_INFO("Alarm armed");
 }
 
 /*******************************************************************************
@@ -469,8 +589,14 @@ void armAlarm(void){
  *
  ******************************************************************************/
 void disarmAlarm(void){
-    alarmArmed = 0;
-    printf("Alarm disarmed\n");
+    lockState();
+    if (alarmArmed != 0) {
+        alarmArmed = 0;
+        stateChanged();
+        wakeThreads();
+    }
+    unlockState();
+    LOG_INFO("Alarm disarmed");
 }
 
 /*******************************************************************************
@@ -487,6 +613,345 @@ int getAlarmArmedState(void){
     return alarmArmed;
 }
 
+/*******************************************************************************
+ *  function :    getWebhouseState
+ ******************************************************************************/
+/** \brief        Read the state of all devices at once
+ *                The webhouse must be initialized (initWebhouse) before this
+ *                function can be called.
+ *
+ *  \type         global
+ *
+ *  \param[out]   state   Current state
+ *
+ *  \return       void
+ *
+ ******************************************************************************/
+void getWebhouseState(WebhouseState *state){
+	lockState();
+	pollAlarm();
+	readState(state);
+	unlockState();
+}
+
+/*******************************************************************************
+ *  function :    restoreWebhouseState
+ ******************************************************************************/
+/** \brief        Set all devices and the temperature to a saved state
+ *                (see persist_load). The version and the alarm sensor of the
+ *                state are ignored.
+ *                The webhouse must be initialized (initWebhouse) before this
+ *                function can be called.
+ *
+ *  \type         global
+ *
+ *  \param[in]    state   State to restore
+ *
+ *  \return       void
+ *
+ ******************************************************************************/
+void restoreWebhouseState(const WebhouseState *state){
+	lockState();
+	if (state->temp >= MIN_TEMP && state->temp <= MAX_TEMP) {
+		localTemp = state->temp;
+	}
+	if (state->heat) {
+		turnHeatOn();
+	} else {
+		turnHeatOff();
+	}
+	writeOutput(GPIO_LED1, state->led1 ? HIGH : LOW);
+	writeOutput(GPIO_LED2, state->led2 ? HIGH : LOW);
+	writeOutput(GPIO_TV, state->tv ? HIGH : LOW);
+	alarmArmed = state->alarmArmed ? 1 : 0;
+	dimRLamp(state->dimRLamp);
+	dimSLamp(state->dimSLamp);
+	stateChanged();
+	wakeThreads();
+	unlockState();
+}
+
+/*******************************************************************************
+ *  function :    getStateVersion
+ ******************************************************************************/
+/** \brief        Get the state version. It is incremented on every change of
+ *                a device, the temperature or the alarm sensor, so two equal
+ *                versions mean an equal state.
+ *
+ *  \type         global
+ *
+ *  \return       State version
+ *
+ ******************************************************************************/
+uint32_t getStateVersion(void){
+	return __atomic_load_n(&stateVersion, __ATOMIC_ACQUIRE);
+}
+
+/*******************************************************************************
+ *  function :    waitStateChange
+ ******************************************************************************/
+/** \brief        Sleep until the state version differs from the given one
+ *
+ *  \type         global
+ *
+ *  \param[in]    version     Last version seen by the caller
+ *  \param[in]    timeoutMs   Return after this time at the latest
+ *
+ *  \return       Current state version
+ *
+ ******************************************************************************/
+uint32_t waitStateChange(uint32_t version, int timeoutMs){
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&wakeLock);
+	pthread_cleanup_push(unlockWake, NULL);
+	while (__atomic_load_n(&stateVersion, __ATOMIC_ACQUIRE) == version) {
+		if (pthread_cond_timedwait(&versionCond, &wakeLock, &deadline) != 0) {
+			break;
+		}
+	}
+	pthread_cleanup_pop(1);
+	return __atomic_load_n(&stateVersion, __ATOMIC_ACQUIRE);
+}
+
+/*******************************************************************************
+ *  function :    pinWebhouseThreads
+ ******************************************************************************/
+/** \brief        Run the temperature and PWM threads on the given CPU only,
+ *                so that the network workers (pinned to the other CPUs) do
+ *                not delay the PWM ticks.
+ *                The webhouse must be initialized (initWebhouse) before this
+ *                function can be called.
+ *
+ *  \type         global
+ *
+ *  \param[in]    cpu   CPU number
+ *
+ *  \return       0 on success, else an error number
+ *
+ ******************************************************************************/
+int pinWebhouseThreads(int cpu){
+	cpu_set_t set;
+	int result;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	result = pthread_setaffinity_np(pThreadTemp, sizeof(set), &set);
+#ifndef PWM
+	if (result == 0) {
+		result = pthread_setaffinity_np(pThreadDimRLamp, sizeof(set), &set);
+	}
+	if (result == 0) {
+		result = pthread_setaffinity_np(pThreadDimSLamp, sizeof(set), &set);
+	}
+#endif
+	return result;
+}
+
+/*******************************************************************************
+ *  function :    setStateListener
+ ******************************************************************************/
+/** \brief        Register the function told about every state change, e.g.
+ *                to push it to the clients. Only one, NULL for none.
+ *
+ *  \type         global
+ *
+ *  \param[in]    listener   Called after the change, outside stateLock, by
+ *                           one thread at a time; may see only the latest
+ *                           of several changes
+ *
+ *  \return       void
+ *
+ ******************************************************************************/
+void setStateListener(StateListener *listener){
+	lockState();
+	stateListener = listener;
+	unlockState();
+}
+
+/*******************************************************************************
+ *  function :    stateChanged
+ ******************************************************************************/
+/** \brief        Count a state change (called by the device functions and
+ *                the simulation threads, with stateLock held)
+ *                <p>
+ *                Only the snapshot is taken here. The change log gets every
+ *                version in order, which costs a copy in memory; persisting,
+ *                shared memory and the listener follow in unlockState.
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void stateChanged(void){
+	WebhouseState state;
+
+	__atomic_add_fetch(&stateVersion, 1, __ATOMIC_RELEASE);
+	readState(&state);
+	changelog_append(&state);
+	pthread_mutex_lock(&publishLock);
+	publishedState = state;
+	pthread_mutex_unlock(&publishLock);
+	statePending = 1;
+}
+
+/*******************************************************************************
+ *  function :    lockState
+ ******************************************************************************/
+/** \brief        Take stateLock (recursive)
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void lockState(void){
+	pthread_mutex_lock(&stateLock);
+	stateDepth++;
+}
+
+/*******************************************************************************
+ *  function :    unlockState
+ ******************************************************************************/
+/** \brief        Release stateLock; after the outermost unlock, publish the
+ *                changes made under it
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void unlockState(void){
+	int changed = (--stateDepth == 0 && statePending);
+
+	if (changed) {
+		statePending = 0;
+	}
+	pthread_mutex_unlock(&stateLock);
+	if (changed) {
+		publishState();
+	}
+}
+
+/*******************************************************************************
+ *  function :    publishState
+ ******************************************************************************/
+/** \brief        Persist the latest state, publish it in shared memory and
+ *                tell the listener, then wake waitStateChange
+ *                <p>
+ *                If another thread is publishing, it is left to that one: it
+ *                goes round again until no request is left, and always takes
+ *                the latest state, so nothing is published out of order.
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void publishState(void){
+	int taken;
+
+	if (__atomic_fetch_add(&publishRequests, 1, __ATOMIC_ACQ_REL) == 0) {
+		do {
+			WebhouseState state;
+
+			taken = __atomic_load_n(&publishRequests, __ATOMIC_ACQUIRE);
+			pthread_mutex_lock(&publishLock);
+			state = publishedState;
+			pthread_mutex_unlock(&publishLock);
+
+			persist_save(&state);
+			shm_state_publish(&state);
+			if (stateListener != NULL) {
+				stateListener(&state);
+			}
+		} while (__atomic_sub_fetch(&publishRequests, taken, __ATOMIC_ACQ_REL) != 0);
+	}
+
+	pthread_mutex_lock(&wakeLock);
+	pthread_cond_broadcast(&versionCond);
+	pthread_mutex_unlock(&wakeLock);
+}
+
+/*******************************************************************************
+ *  function :    readState
+ ******************************************************************************/
+/** \brief        Read the state of all devices without polling the alarm
+ *                sensor (stateChanged is called by pollAlarm itself)
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void readState(WebhouseState *state){
+	state->version = __atomic_load_n(&stateVersion, __ATOMIC_ACQUIRE);
+	state->temp = localTemp;
+	state->heat = getHeatState();
+	state->led1 = getLED1State();
+	state->led2 = getLED2State();
+	state->tv = getTVState();
+	state->alarmArmed = alarmArmed;
+	state->alarmTriggered = alarmLevel;
+	state->dimRLamp = dutyCycleRL;
+	state->dimSLamp = dutyCycleSL;
+}
+
+/*******************************************************************************
+ *  function :    writeOutput
+ ******************************************************************************/
+/** \brief        Set an output pin and count a change of its level.
+ *                Reading the previous level and writing the new one is one
+ *                step under stateLock, so that a change is counted once.
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void writeOutput(uint8_t pin, uint8_t level){
+	lockState();
+	uint8_t previous = bcm2835_gpio_lev(pin);
+
+	TRACE_BEGIN(TRACE_GPIO, pin);
+	bcm2835_gpio_write(pin, level);
+	TRACE_END(TRACE_GPIO, pin);
+	metrics_inc(METRIC_GPIO_WRITES);
+	if (previous != level) {
+		stateChanged();
+	}
+	unlockState();
+}
+
+/*******************************************************************************
+ *  function :    pollAlarm
+ ******************************************************************************/
+/** \brief        Sample the alarm sensor and count a change of its level
+ *                (with stateLock held)
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void pollAlarm(void){
+	int level = bcm2835_gpio_lev(GPIO_Alarm);
+
+	if (level != alarmLevel) {
+		alarmLevel = level;
+		stateChanged();
+	}
+}
+
 /*******************************************************************************
  *  function :    threadTemp
  ******************************************************************************/
@@ -499,25 +964,147 @@ int getAlarmArmedState(void){
  *
  ******************************************************************************/
 static void * threadTemp(void *pdata){
+	trace_thread_name("temp");
 	// Never ending loop
 	for (;;) {
+		// Not cancelled by closeWebhouse while holding stateLock
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		lockState();
+		TRACE_BEGIN(TRACE_TEMP, 0);
 		if (stateHeiz == HEIZ_ON) {
 			if (localTemp < MAX_TEMP) {
 				localTemp += 0.05f;
+				stateChanged();
 			}
 		}
 		else {
 			if (localTemp > MIN_TEMP) {
 			   localTemp -= 0.05f;
+			   stateChanged();
 			}
 		}
 
-		usleep(1000000);
+		pollAlarm();
+		TRACE_END(TRACE_TEMP, 0);
+		unlockState();
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		// At the limit the model does not change until the heater is
+		// switched; only an armed alarm still needs its sensor polled
+		int heiz = stateHeiz;
+		if (TICKLESS_IDLE && ((heiz == HEIZ_ON && localTemp >= MAX_TEMP)
+		                      || (heiz == HEIZ_OFF && localTemp <= MIN_TEMP))) {
+			int armed = alarmArmed;
+			waitForChange(&stateHeiz, heiz, &alarmArmed, armed, armed ? ALARM_POLL_MS : -1);
+		} else {
+			usleep(1000000);
+		}
+		metrics_inc(METRIC_WAKEUPS);
 	}
 	return NULL;
 }
 
+/*******************************************************************************
+ *  function :    wakeThreads
+ ******************************************************************************/
+/** \brief        Wake the simulation threads after a change of the heater,
+ *                the alarm or a dimmer (see waitForChange)
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void wakeThreads(void){
+	pthread_mutex_lock(&wakeLock);
+	pthread_cond_broadcast(&wakeCond);
+	pthread_mutex_unlock(&wakeLock);
+}
+
+/*******************************************************************************
+ *  function :    unlockWake
+ ******************************************************************************/
+/** \brief        Cleanup handler of waitForChange
+ *
+ *  \type         module
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void unlockWake(void *pdata){
+	pthread_mutex_unlock(&wakeLock);
+}
+
+/*******************************************************************************
+ *  function :    waitForChange
+ ******************************************************************************/
+/** \brief        Sleep until *a or *b differs from the given value
+ *
+ *  \type         module
+ *
+ *  \param[in]    a, aValue    First value to watch and its current value
+ *  \param[in]    b, bValue    Second value to watch (b may be NULL)
+ *  \param[in]    timeoutMs    Return after this time at the latest,
+ *                             -1 to wait without timeout
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void waitForChange(const volatile int *a, int aValue,
+                          const volatile int *b, int bValue, int timeoutMs){
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&wakeLock);
+	// The threads are cancelled by closeWebhouse, possibly while waiting
+	pthread_cleanup_push(unlockWake, NULL);
+	while (*a == aValue && (b == NULL || *b == bValue)) {
+		if (timeoutMs < 0) {
+			pthread_cond_wait(&wakeCond, &wakeLock);
+		} else if (pthread_cond_timedwait(&wakeCond, &wakeLock, &deadline) != 0) {
+			break;
+		}
+	}
+	pthread_cleanup_pop(1);
+}
+
 #ifndef PWM
+/*******************************************************************************
+ *  function :    idleWhileSteady
+ ******************************************************************************/
+/** \brief        Hold a lamp at 0 or 100 without PWM ticks
+ *
+ *                Called at the start of every PWM period. A fully off or on
+ *                lamp only needs one write; the thread then sleeps until the
+ *                duty cycle is changed.
+ *
+ *  \type         module
+ *
+ *  \param[in]    pin     Lamp output
+ *  \param[in]    duty    Duty cycle of the lamp
+ *
+ *  \return
+ *
+ ******************************************************************************/
+static void idleWhileSteady(uint8_t pin, const volatile int *duty){
+	int current = *duty;
+
+	if (!TICKLESS_IDLE || (current > 0 && current < RANGE)) {
+		return;
+	}
+	bcm2835_gpio_write(pin, current > 0 ? HIGH : LOW);
+	metrics_inc(METRIC_GPIO_WRITES);
+	waitForChange(duty, current, NULL, 0, -1);
+	metrics_inc(METRIC_WAKEUPS);
+}
+
 /*******************************************************************************
  *  function :    threadDimRLamp
  ******************************************************************************/
@@ -530,17 +1117,23 @@ static void * threadTemp(void *pdata){
  ******************************************************************************/
 static void * threadDimRLamp(void *pdata){
 	int time = 0;
+	trace_thread_name("dim_rlamp");
 	// Never ending loop
 	for (;;) {
 		if (time <= dutyCycleRL) {
 			bcm2835_gpio_write(GPIO_dimRLamp, HIGH);
+			metrics_inc(METRIC_GPIO_WRITES);
 		} else if (time < RANGE) {
 			bcm2835_gpio_write(GPIO_dimRLamp, LOW);
+			metrics_inc(METRIC_GPIO_WRITES);
 		} else {
 			time = 0;
+			TRACE_INSTANT(TRACE_PWM_PERIOD, dutyCycleRL);
+			idleWhileSteady(GPIO_dimRLamp, &dutyCycleRL);
 		}
 		time++;
 		usleep(100);
+		metrics_inc(METRIC_WAKEUPS);
 	}
 	return NULL;
 }
@@ -557,17 +1150,23 @@ static void * threadDimRLamp(void *pdata){
  ******************************************************************************/
 static void * threadDimSLamp(void *pdata){
 	int time = 0;
+	trace_thread_name("dim_slamp");
 	// Never ending loop
 	for (;;) {
 		if (time <= dutyCycleSL) {
 			bcm2835_gpio_write(GPIO_dimSLamp, HIGH);
+			metrics_inc(METRIC_GPIO_WRITES);
 		} else if (time <= RANGE) {
 			bcm2835_gpio_write(GPIO_dimSLamp, LOW);
+			metrics_inc(METRIC_GPIO_WRITES);
 		} else {
 			time = 0;
+			TRACE_INSTANT(TRACE_PWM_PERIOD, dutyCycleSL);
+			idleWhileSteady(GPIO_dimSLamp, &dutyCycleSL);
 		}
 		time++;
 		usleep(100);
+		metrics_inc(METRIC_WAKEUPS);
 	}
 	return NULL;
 }
@@ -7,8 +7,22 @@
 //-----Macros----------------------------------------------------------------------
 
 //-----Data types------------------------------------------------------------------
+// Snapshot of all devices (see getWebhouseState)
+typedef struct {
+    uint32_t version;         // state version, see getStateVersion
+    float    temp;            // simulated room temperature in degree Celsius
+    int      heat;            // 1 = heater on
+    int      led1;            // 1 = LED 1 on
+    int      led2;            // 1 = LED 2 on
+    int      tv;              // 1 = TV on
+    int      alarmArmed;      // 1 = alarm armed
+    int      alarmTriggered;  // 1 = alarm sensor active
+    int      dimRLamp;        // roof lamp dim level [0,100]
+    int      dimSLamp;        // stand lamp dim level [0,100]
+} WebhouseState;
 
 //-----Function prototypes---------------------------------------------------------
+// May be called from any thread once initWebhouse has returned
 extern void initWebhouse(void);
 extern void closeWebhouse(void);
 
@@ -18,6 +32,8 @@ extern int  getTVState(void);
 
 extern void dimRLamp(uint16_t Duty_cycle);
 extern void dimSLamp(uint16_t Duty_cycle);
+extern int  getRLampLevel(void);
+extern int  getSLampLevel(void);
 
 extern void turnLED1On(void);
 extern void turnLED1Off(void);
@@ -37,4 +53,16 @@ extern void armAlarm(void);
 extern void disarmAlarm(void);
 extern int getAlarmArmedState(void);
 
+extern void getWebhouseState(WebhouseState *state);
+extern void restoreWebhouseState(const WebhouseState *state);
+extern uint32_t getStateVersion(void);
+extern uint32_t waitStateChange(uint32_t version, int timeoutMs);
+extern int pinWebhouseThreads(int cpu);
+
+// Called with the latest state after a change, without the state locked, on
+// whichever thread publishes it; one call may cover several changes (see
+// publishState in Webhouse.c). Must not block.
+typedef void StateListener(const WebhouseState *state);
+extern void setStateListener(StateListener *listener);
+
 #endif
@@ -0,0 +1,20 @@
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+
+// One dashboard file compiled into the binary by mkassets (generated assets.c).
+typedef struct {
+    const char          *path;           // URL path, e.g. "/index.html"
+    const char          *etag;           // Quoted SHA-1 of the gzip body
+    const unsigned char *response;       // Complete "200 OK" response, gzip body
+    size_t               headerLen;      // Header part of response (for HEAD)
+    size_t               responseLen;    // Header + body
+    const char          *notModified;    // Complete "304 Not Modified" response
+    size_t               notModifiedLen;
+} http_asset_t;
+
+extern const http_asset_t http_assets[];
+extern const size_t       http_assets_count;
+
+#endif // ASSETS_H
@@ -0,0 +1,458 @@
+/******************************************************************************/
+/** \file       bench.c
+ *******************************************************************************
+ *
+ * \brief      Microbenchmarks of the request path (make bench)
+ *
+ *             Times the handshake, the frame and command parsers, the
+ *             status encoders, metrics and trace points on inputs captured
+ *             from a Chrome dashboard session. Only the protocol code is
+ *             linked, so neither the bcm2835 library nor the hardware is
+ *             needed.
+ *
+ *             Every benchmark is warmed up, its iteration count calibrated to
+ *             run for at least the minimum time, and then measured several
+ *             times; the median run is reported. The output has one line per
+ *             benchmark with fixed names and columns, so the results of two
+ *             commits can be compared with diff.
+ *
+ *             Usage: webhouse_bench [-f filter] [-n iterations] [-r runs]
+ *                                   [-t min_ms]
+ *
+ *             -f  only run benchmarks whose name contains filter
+ *             -n  fixed iteration count instead of calibration
+ *
+ *             Cycles are read from the CPU cycle counter via perf_event_open;
+ *             "-" is printed if the kernel does not allow that
+ *             (see /proc/sys/kernel/perf_event_paranoid).
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * main
+ * * functions  local:
+ * now_ns
+ * cycles_open
+ * cycles_read
+ * run_batch
+ * compare_result
+ * bench_*
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "sha1.h"
+#include "base64.h"
+#include "handshake.h"
+#include "command.h"
+#include "status.h"
+#include "metrics.h"
+#include "trace.h"
+
+//----- Macros -----------------------------------------------------------------
+#define NS_PER_SEC       1000000000ULL
+#define DEFAULT_RUNS     5
+#define DEFAULT_MIN_MS   100
+#define MAX_RUNS         31
+#define WARMUP_ITER      1000
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    const char *name;
+    void      (*run)(void);
+} bench_t;
+
+typedef struct {
+    double ns;
+    double cycles;
+} result_t;
+
+//----- Data -------------------------------------------------------------------
+// Upgrade request of Chrome opening the dashboard
+static const char chromeUpgrade[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 172.20.10.2:8000\r\n"
+    "Connection: Upgrade\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Upgrade: websocket\r\n"
+    "Origin: http://172.20.10.2:8000\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+    "Sec-WebSocket-Protocol: webhouse.bin.v1\r\n"
+    "\r\n";
+
+// Key and GUID as hashed for Sec-WebSocket-Accept
+static const char acceptInput[] = "dGhlIHNhbXBsZSBub25jZQ==" MAGIC_STRING;
+
+// Masked client text frame "<GetStatus:42>"
+static const uint8_t getStatusFrame[] = {
+    0x81, 0x8e, 0x37, 0xfa, 0x21, 0x3d,
+    0x0b, 0xbd, 0x44, 0x49, 0x64, 0x8e, 0x40, 0x49, 0x42, 0x89,
+    0x1b, 0x09, 0x05, 0xc4
+};
+
+static const WebhouseState sampleState = {
+    .version = 42, .temp = 21.5f, .heat = 1, .led1 = 1, .led2 = 0, .tv = 0,
+    .alarmArmed = 1, .alarmTriggered = 0, .dimRLamp = 50, .dimSLamp = 75
+};
+
+static char textStatus[256];
+static uint8_t hashBlock[4096];
+static int cyclesFd = -1;
+
+// Results are stored here so the compiler cannot drop the work
+static volatile int sink;
+
+static char hsRequest[sizeof(chromeUpgrade)];
+static char hsResponse[WS_HS_RESPLEN];
+static char textBuf[256];
+static uint8_t frameBuf[WS_FRAME_HDR_MAX + 256];
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    now_ns
+ ******************************************************************************/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * function :    cycles_open
+ ******************************************************************************/
+/** \brief        Open the user space CPU cycle counter of this thread
+ *
+ * \type         static
+ *
+ * \return       File descriptor, -1 if not available
+ *
+ ******************************************************************************/
+static int cycles_open(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*******************************************************************************
+ * function :    cycles_read
+ ******************************************************************************/
+static uint64_t cycles_read(void) {
+    uint64_t value = 0;
+
+    if (cyclesFd < 0 || read(cyclesFd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
+/*******************************************************************************
+ * Benchmarks
+ ******************************************************************************/
+// Empty call: the loop and call overhead included in every other result
+static void bench_noop(void) {
+    sink = 0;
+}
+
+// get_handshake_response tokenizes the request in place, so the copy is part
+// of the cost (the server also has the request in its receive buffer)
+static void bench_handshake_response(void) {
+    ws_options_t options;
+
+    memcpy(hsRequest, chromeUpgrade, sizeof(chromeUpgrade));
+    sink = get_handshake_response(hsRequest, hsResponse, &options);
+}
+
+static void bench_sha1_accept(void) {
+    SHA1Context ctx;
+    uint8_t digest[SHA1HashSize];
+
+    SHA1Reset(&ctx);
+    SHA1Input(&ctx, (const uint8_t *)acceptInput, sizeof(acceptInput) - 1);
+    SHA1Result(&ctx, digest);
+    sink = digest[0];
+}
+
+static void bench_sha1_4k(void) {
+    SHA1Context ctx;
+    uint8_t digest[SHA1HashSize];
+
+    SHA1Reset(&ctx);
+    SHA1Input(&ctx, hashBlock, sizeof(hashBlock));
+    SHA1Result(&ctx, digest);
+    sink = digest[0];
+}
+
+static void bench_base64_accept(void) {
+    static const uint8_t digest[SHA1HashSize] = {
+        0xb3, 0x7a, 0x4f, 0x2c, 0xc0, 0x62, 0x4f, 0x16, 0x90, 0xf6,
+        0x46, 0x06, 0xcf, 0x38, 0x59, 0x45, 0xb2, 0xbe, 0xc4, 0xea
+    };
+    size_t len;
+    unsigned char *out = base64_encode(digest, sizeof(digest), &len);
+
+    sink = out[0];
+    free(out);
+}
+
+static void bench_decode_request(void) {
+    sink = decode_incoming_request((char *)getStatusFrame, textBuf);
+}
+
+// decode_incoming_frame unmasks in place, so it works on a copy
+static void bench_decode_frame(void) {
+    ws_frame_t frame;
+
+    memcpy(frameBuf, getStatusFrame, sizeof(getStatusFrame));
+    sink = decode_incoming_frame(frameBuf, sizeof(getStatusFrame), &frame);
+}
+
+static void bench_code_response(void) {
+    sink = code_outgoing_response(textStatus, (char *)frameBuf);
+}
+
+static void bench_code_frame(void) {
+    sink = code_outgoing_frame(WS_OP_TEXT, 0, (const uint8_t *)textStatus,
+                               strlen(textStatus), frameBuf);
+}
+
+// The last button in the match order, the worst case of the strstr chain
+static void bench_parse_button(void) {
+    Command cmd;
+
+    sink = parseCommand("<L2off>", &cmd);
+}
+
+static void bench_parse_getstatus(void) {
+    Command cmd;
+
+    sink = parseCommand("<GetStatus:42>", &cmd);
+}
+
+static void bench_parse_dim(void) {
+    Command cmd;
+
+    sink = parseCommand("<Dim2:75>", &cmd);
+}
+
+static void bench_parse_dim_id(void) {
+    Command cmd;
+
+    sink = parseCommand("<Dim2:75#1234>", &cmd);
+}
+
+static void bench_status_text(void) {
+    sink = status_encode_text(&sampleState, textBuf, sizeof(textBuf));
+}
+
+static void bench_status_binary(void) {
+    StatusFrame frame;
+
+    sink = status_encode_binary(&sampleState, &frame);
+}
+
+static void bench_status_binary_delta(void) {
+    WebhouseState state = sampleState;
+    uint8_t out[STATUS_DELTA_MAX];
+
+    state.version++;
+    state.dimRLamp = 60;
+    sink = status_encode_binary_delta(&sampleState, &state, NULL, out);
+}
+
+// Recording cost on the hot path (the clock read is measured separately)
+static void bench_metrics_inc(void) {
+    metrics_inc(METRIC_FRAMES_RECEIVED);
+}
+
+static void bench_metrics_observe(void) {
+    static uint64_t ns = 12345;
+
+    metrics_observe(HIST_RECV_TO_REPLY, ns++ & 0xfffff);
+}
+
+static void bench_clock_monotonic(void) {
+    sink = (int)metrics_now_ns();
+}
+
+// A trace point while tracing is off, then with tracing on
+static void bench_trace_disabled(void) {
+    trace_enabled = 0;
+    TRACE_INSTANT(TRACE_RECV, 1);
+}
+
+static void bench_trace_enabled(void) {
+    trace_enabled = 1;
+    TRACE_INSTANT(TRACE_RECV, 1);
+}
+
+static const bench_t benches[] = {
+    { "noop",                 bench_noop },
+    { "handshake_response",   bench_handshake_response },
+    { "sha1_accept",          bench_sha1_accept },
+    { "sha1_4k",              bench_sha1_4k },
+    { "base64_accept",        bench_base64_accept },
+    { "decode_request",       bench_decode_request },
+    { "decode_frame",         bench_decode_frame },
+    { "code_response",        bench_code_response },
+    { "code_frame",           bench_code_frame },
+    { "parse_button",         bench_parse_button },
+    { "parse_getstatus",      bench_parse_getstatus },
+    { "parse_dim",            bench_parse_dim },
+    { "parse_dim_id",         bench_parse_dim_id },
+    { "status_text",          bench_status_text },
+    { "status_binary",        bench_status_binary },
+    { "status_binary_delta",  bench_status_binary_delta },
+    { "metrics_inc",          bench_metrics_inc },
+    { "metrics_observe",      bench_metrics_observe },
+    { "clock_monotonic",      bench_clock_monotonic },
+    { "trace_disabled",       bench_trace_disabled },
+    { "trace_enabled",        bench_trace_enabled },
+};
+
+/*******************************************************************************
+ * function :    run_batch
+ ******************************************************************************/
+/** \brief        Run a benchmark iter times
+ *
+ * \type         static
+ *
+ * \param[out]   cycles  CPU cycles spent, 0 if not counted
+ *
+ * \return       Elapsed nanoseconds
+ *
+ ******************************************************************************/
+static uint64_t run_batch(const bench_t *b, uint64_t iter, uint64_t *cycles) {
+    uint64_t c0 = cycles_read();
+    uint64_t t0 = now_ns();
+
+    for (uint64_t i = 0; i < iter; i++) {
+        b->run();
+    }
+
+    uint64_t t1 = now_ns();
+    *cycles = cycles_read() - c0;
+    return t1 - t0;
+}
+
+/*******************************************************************************
+ * function :    compare_result
+ ******************************************************************************/
+static int compare_result(const void *a, const void *b) {
+    double x = ((const result_t *)a)->ns;
+    double y = ((const result_t *)b)->ns;
+
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+ * function :    main
+ ******************************************************************************/
+int main(int argc, char **argv) {
+    const char *filter = NULL;
+    uint64_t fixedIter = 0;
+    int runs = DEFAULT_RUNS;
+    uint64_t minNs = DEFAULT_MIN_MS * 1000000ULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:r:t:")) != -1) {
+        switch (opt) {
+        case 'f': filter = optarg; break;
+        case 'n': fixedIter = strtoull(optarg, NULL, 10); break;
+        case 'r': runs = atoi(optarg); break;
+        case 't': minNs = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+        default:
+            fprintf(stderr, "usage: %s [-f filter] [-n iterations] [-r runs] [-t min_ms]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        runs = DEFAULT_RUNS;
+    }
+
+    for (size_t i = 0; i < sizeof(hashBlock); i++) {
+        hashBlock[i] = (uint8_t)(i * 31 + 7);
+    }
+    status_encode_text(&sampleState, textStatus, sizeof(textStatus));
+
+    cyclesFd = cycles_open();
+    if (cyclesFd >= 0) {
+        ioctl(cyclesFd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cyclesFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    printf("# runs=%d min_ms=%llu cycles=%s\n", runs,
+           (unsigned long long)(minNs / 1000000ULL), cyclesFd >= 0 ? "perf" : "none");
+    printf("%-22s %12s %10s %10s\n", "benchmark", "iterations", "ns/op", "cycles/op");
+
+    for (size_t n = 0; n < sizeof(benches) / sizeof(benches[0]); n++) {
+        const bench_t *b = &benches[n];
+        result_t result[MAX_RUNS];
+        uint64_t cycles;
+        uint64_t iter;
+
+        if (filter != NULL && strstr(b->name, filter) == NULL) {
+            continue;
+        }
+
+        // Warm up caches and branch predictors
+        run_batch(b, WARMUP_ITER, &cycles);
+
+        // Double the iteration count until one run takes the minimum time
+        iter = fixedIter;
+        if (iter == 0) {
+            iter = WARMUP_ITER;
+            while (run_batch(b, iter, &cycles) < minNs) {
+                iter *= 2;
+            }
+        }
+
+        for (int r = 0; r < runs; r++) {
+            uint64_t ns = run_batch(b, iter, &cycles);
+            result[r].ns = (double)ns / iter;
+            result[r].cycles = (double)cycles / iter;
+        }
+        qsort(result, runs, sizeof(result[0]), compare_result);
+
+        result_t *median = &result[runs / 2];
+        if (cyclesFd >= 0) {
+            printf("%-22s %12llu %10.1f %10.1f\n", b->name,
+                   (unsigned long long)iter, median->ns, median->cycles);
+        } else {
+            printf("%-22s %12llu %10.1f %10s\n", b->name,
+                   (unsigned long long)iter, median->ns, "-");
+        }
+    }
+
+    if (cyclesFd >= 0) {
+        close(cyclesFd);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/******************************************************************************/
+/** \file       changelog.c
+ *******************************************************************************
+ *
+ * \brief      Log of the recent state changes, for resumed sessions
+ *
+ *             Every new state is appended with its version, into a ring of
+ *             the last CHANGELOG_SIZE states. The versions are consecutive
+ *             (stateChanged appends under the state lock), so the state of
+ *             a version is found at version % CHANGELOG_SIZE.
+ *
+ *             A client that reconnects after a gap tells the version it has
+ *             (see resumeSession in main.c) and is sent the states after it,
+ *             one delta each, so that an alarm that went off and back during
+ *             the gap is seen too. If its version has rolled out of the log,
+ *             it gets a full snapshot instead, as before.
+ *
+ *             Readers copy the states out, so the lock is never held while
+ *             a reply is encoded.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * changelog_append
+ * changelog_get
+ * changelog_read
+ * * functions  local:
+ * contains
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <pthread.h>
+
+#include "changelog.h"
+
+//----- Data -------------------------------------------------------------------
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static WebhouseState states[CHANGELOG_SIZE];
+static uint32_t latest;            // version of the last state appended
+static uint32_t count;             // states in the log
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    contains
+ ******************************************************************************/
+/** \brief        Whether the state of a version is in the log (lock held)
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int contains(uint32_t version) {
+    return count > 0 && latest - version < count;
+}
+
+/*******************************************************************************
+ * function :    changelog_append
+ ******************************************************************************/
+/** \brief        Append a new state, the oldest one drops out of a full log
+ *
+ *               Called by every state change. A version that does not follow
+ *               the last one (the counter was reset) starts the log over.
+ *
+ * \type         global
+ *
+ * \param[in]    state   New state
+ *
+ ******************************************************************************/
+void changelog_append(const WebhouseState *state) {
+    pthread_mutex_lock(&lock);
+    if (count > 0 && state->version != latest + 1) {
+        count = 0;
+    }
+    states[state->version % CHANGELOG_SIZE] = *state;
+    latest = state->version;
+    if (count < CHANGELOG_SIZE) {
+        count++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*******************************************************************************
+ * function :    changelog_get
+ ******************************************************************************/
+/** \brief        State of a version
+ *
+ * \type         global
+ *
+ * \param[in]    version   State version
+ * \param[out]   state     Its state
+ *
+ * \return       0, -1 if the version is not in the log (any more)
+ *
+ ******************************************************************************/
+int changelog_get(uint32_t version, WebhouseState *state) {
+    int result = -1;
+
+    pthread_mutex_lock(&lock);
+    if (contains(version)) {
+        *state = states[version % CHANGELOG_SIZE];
+        result = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+/*******************************************************************************
+ * function :    changelog_read
+ ******************************************************************************/
+/** \brief        The states after a version, oldest first
+ *
+ * \type         global
+ *
+ * \param[in]    after   Last version the caller has
+ * \param[out]   out     States after it
+ * \param[in]    max     Size of out
+ *
+ * \return       Number of states in out, 0 if after is the latest one,
+ *               -1 if after is not in the log (any more)
+ *
+ ******************************************************************************/
+int changelog_read(uint32_t after, WebhouseState out[], int max) {
+    int n = -1;
+
+    pthread_mutex_lock(&lock);
+    if (contains(after)) {
+        for (n = 0; n < max && after + n != latest; n++) {
+            out[n] = states[(after + n + 1) % CHANGELOG_SIZE];
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return n;
+}
@@ -0,0 +1,16 @@
+#ifndef CHANGELOG_H
+#define CHANGELOG_H
+
+#include <stdint.h>
+
+#include "Webhouse.h"
+
+// Recent states by version, for clients resuming a session, see changelog.c
+#define CHANGELOG_SIZE     512             // states kept, about 8 minutes of
+                                           // temperature steps
+
+extern void changelog_append (const WebhouseState *state);
+extern int  changelog_get    (uint32_t version, WebhouseState *state);
+extern int  changelog_read   (uint32_t after, WebhouseState out[], int max);
+
+#endif // CHANGELOG_H
@@ -0,0 +1,261 @@
+/******************************************************************************/
+/** \file       command.c
+ *******************************************************************************
+ *
+ * \brief      Parser for the commands sent by the dashboard
+ *
+ *             Only turns the text into a Command; executing it is up to the
+ *             caller (processCommand in main.c). Keeping the parser free of
+ *             hardware calls lets it be benchmarked without the webhouse.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * parseCommand
+ * commandName
+ * parseUint32
+ * * functions  local:
+ * parseTopics
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command.h"
+
+//----- Data -------------------------------------------------------------------
+// Button commands, matched anywhere in the text, first match wins
+static const struct {
+    const char  *text;
+    CommandType  type;
+} buttons[] = {
+    { "<HeatOn>",    CMD_HEAT_ON },
+    { "<HeatOff>",   CMD_HEAT_OFF },
+    { "<L1on>",      CMD_L1_ON },
+    { "<L1off>",     CMD_L1_OFF },
+    { "<TVon>",      CMD_TV_ON },
+    { "<TVoff>",     CMD_TV_OFF },
+    { "<AlarmOn>",   CMD_ALARM_ON },
+    { "<AlarmOff>",  CMD_ALARM_OFF },
+    { "<L2on>",      CMD_L2_ON },
+    { "<L2off>",     CMD_L2_OFF },
+    { "<GetStatus>", CMD_GET_STATUS },
+};
+
+static const char *names[CMD_COUNT] = {
+    [CMD_UNKNOWN]        = "unknown",
+    [CMD_HEAT_ON]        = "HeatOn",
+    [CMD_HEAT_OFF]       = "HeatOff",
+    [CMD_L1_ON]          = "L1on",
+    [CMD_L1_OFF]         = "L1off",
+    [CMD_TV_ON]          = "TVon",
+    [CMD_TV_OFF]         = "TVoff",
+    [CMD_ALARM_ON]       = "AlarmOn",
+    [CMD_ALARM_OFF]      = "AlarmOff",
+    [CMD_L2_ON]          = "L2on",
+    [CMD_L2_OFF]         = "L2off",
+    [CMD_GET_STATUS]     = "GetStatus",
+    [CMD_GET_STATUS_ACK] = "GetStatusAck",
+    [CMD_DIM1]           = "Dim1",
+    [CMD_DIM2]           = "Dim2",
+    [CMD_SET_TEMP]       = "SetTemp",
+    [CMD_HISTORY]        = "History",
+    [CMD_SUBSCRIBE]      = "Subscribe",
+};
+
+// Topic names of <Subscribe:...>
+static const struct {
+    const char *name;
+    unsigned    topic;
+} topics[] = {
+    { "temp",   TOPIC_TEMP },
+    { "heat",   TOPIC_HEAT },
+    { "lights", TOPIC_LIGHTS },
+    { "tv",     TOPIC_TV },
+    { "alarm",  TOPIC_ALARM },
+    { "all",    TOPIC_ALL },
+};
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    parseTopics
+ ******************************************************************************/
+/** \brief        Parse the comma separated topic list of <Subscribe:...>
+ *
+ *               Unknown names are skipped, so that a dashboard asking for a
+ *               newer topic still gets the ones this server knows.
+ *
+ * \type         static
+ *
+ * \param[in]    list   Topic names, ended by '>'
+ *
+ * \return       TOPIC_* bits, -1 without the closing '>'
+ *
+ ******************************************************************************/
+static long parseTopics(const char *list) {
+    const char *end = strchr(list, '>');
+    long mask = 0;
+
+    if (end == NULL || end[1] != '\0') {
+        return -1;
+    }
+    while (list < end) {
+        size_t len = strcspn(list, ",>");
+
+        for (size_t i = 0; i < sizeof(topics) / sizeof(topics[0]); i++) {
+            if (strlen(topics[i].name) == len && strncmp(list, topics[i].name, len) == 0) {
+                mask |= topics[i].topic;
+            }
+        }
+        list += len + (list[len] == ',');
+    }
+    return mask;
+}
+
+/*******************************************************************************
+ * function :    parseCommand
+ ******************************************************************************/
+/** \brief        Parse one command
+ *
+ *               Any command may carry an id before its closing '>', as in
+ *               <L1on#42> or <Dim1:50#43>. The id is taken off and the
+ *               rest parsed as without it.
+ *
+ * \type         global
+ *
+ * \param[in]    text   NUL terminated command text
+ * \param[out]   cmd    Parsed command
+ *
+ * \return       Command type, CMD_UNKNOWN if the text is not a command
+ *
+ ******************************************************************************/
+CommandType parseCommand(const char *text, Command *cmd) {
+    char stripped[COMMAND_TEXT_MAX];
+    const char *hash = strchr(text, '#');
+    uint32_t version;
+    int value;
+
+    cmd->type = CMD_UNKNOWN;
+    cmd->value = 0;
+    cmd->hasId = 0;
+    cmd->id = 0;
+
+    if (hash != NULL) {
+        uint32_t id;
+        int digits = parseUint32(hash + 1, &id);
+        const char *end = hash + 1 + digits;
+        int len;
+
+        if (digits == 0 || *end != '>') {
+            return cmd->type;
+        }
+        len = snprintf(stripped, sizeof(stripped), "%.*s%s", (int)(hash - text), text, end);
+        if (len < 0 || len >= (int)sizeof(stripped)) {
+            return cmd->type;
+        }
+        cmd->hasId = 1;
+        cmd->id = id;
+        text = stripped;
+    }
+
+    for (size_t i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+        if (strstr(text, buttons[i].text) != NULL) {
+            cmd->type = buttons[i].type;
+            return cmd->type;
+        }
+    }
+
+    // Commands with a value
+    if (strncmp(text, "<GetStatus:", 11) == 0) {
+        int digits = parseUint32(text + 11, &version);
+
+        if (digits > 0 && text[11 + digits] == '>') {
+            cmd->type = CMD_GET_STATUS_ACK;
+            cmd->value = version;
+        }
+    }
+    else if (strncmp(text, "<Dim1:", 6) == 0) {
+        if (sscanf(text, "<Dim1:%d>", &value) == 1) {
+            cmd->type = CMD_DIM1;
+            cmd->value = value;
+        }
+    }
+    else if (strncmp(text, "<Dim2:", 6) == 0) {
+        if (sscanf(text, "<Dim2:%d>", &value) == 1) {
+            cmd->type = CMD_DIM2;
+            cmd->value = value;
+        }
+    }
+    else if (strncmp(text, "<SetTemp:", 9) == 0) {
+        if (sscanf(text, "<SetTemp:%d>", &value) == 1) {
+            cmd->type = CMD_SET_TEMP;
+            cmd->value = value;
+        }
+    }
+    else if (strncmp(text, "<History:", 9) == 0) {
+        if (sscanf(text, "<History:%d>", &value) == 1 && value > 0) {
+            cmd->type = CMD_HISTORY;
+            cmd->value = value;
+        }
+    }
+    else if (strncmp(text, "<Subscribe:", 11) == 0) {
+        long mask = parseTopics(text + 11);
+
+        if (mask >= 0) {
+            cmd->type = CMD_SUBSCRIBE;
+            cmd->value = mask;
+        }
+    }
+
+    return cmd->type;
+}
+
+/*******************************************************************************
+ * function :    commandName
+ ******************************************************************************/
+/** \brief        Name of a command type, e.g. for statistics
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+const char *commandName(CommandType type) {
+    return (type >= 0 && type < CMD_COUNT) ? names[type] : names[CMD_UNKNOWN];
+}
+
+/*******************************************************************************
+ * function :    parseUint32
+ ******************************************************************************/
+/** \brief        Parse an unsigned 32 bit decimal number, digits only
+ *
+ *               Unlike strtoul, no sign or whitespace is accepted, and the
+ *               range is checked the same with a 32 bit long (Raspberry Pi).
+ *
+ * \type         global
+ *
+ * \param[in]    text    Text starting with the number
+ * \param[out]   value   Number
+ *
+ * \return       Number of digits, 0 if there are none or the number does
+ *               not fit into 32 bits
+ *
+ ******************************************************************************/
+int parseUint32(const char *text, uint32_t *value) {
+    uint64_t n = 0;
+    int digits = 0;
+
+    while (text[digits] >= '0' && text[digits] <= '9') {
+        n = n * 10 + (uint64_t)(text[digits] - '0');
+        if (n > UINT32_MAX) {
+            return 0;
+        }
+        digits++;
+    }
+    if (digits > 0) {
+        *value = (uint32_t)n;
+    }
+    return digits;
+}
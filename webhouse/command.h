@@ -0,0 +1,51 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdint.h>
+
+// Commands of the dashboard protocol ("<HeatOn>", "<Dim1:50>", ...)
+typedef enum {
+    CMD_UNKNOWN = 0,
+    CMD_HEAT_ON,
+    CMD_HEAT_OFF,
+    CMD_L1_ON,
+    CMD_L1_OFF,
+    CMD_TV_ON,
+    CMD_TV_OFF,
+    CMD_ALARM_ON,
+    CMD_ALARM_OFF,
+    CMD_L2_ON,
+    CMD_L2_OFF,
+    CMD_GET_STATUS,
+    CMD_GET_STATUS_ACK,     // <GetStatus:version>, value = acknowledged version
+    CMD_DIM1,               // value = level
+    CMD_DIM2,               // value = level
+    CMD_SET_TEMP,           // value = target temperature
+    CMD_HISTORY,            // value = seconds of history
+    CMD_SUBSCRIBE,          // <Subscribe:temp,alarm>, value = TOPIC_* bits
+    CMD_COUNT
+} CommandType;
+
+// Topics of <Subscribe:...>, each a group of state fields
+#define TOPIC_TEMP      0x01    // temp
+#define TOPIC_HEAT      0x02    // heat
+#define TOPIC_LIGHTS    0x04    // led1, led2, dimRLamp, dimSLamp
+#define TOPIC_TV        0x08    // tv
+#define TOPIC_ALARM     0x10    // alarmArmed, alarmTriggered
+#define TOPIC_ALL       0x1f
+
+// Longest command text with an id, "<SetTemp:22#4294967295>" and some
+#define COMMAND_TEXT_MAX        64
+
+typedef struct {
+    CommandType type;
+    long        value;
+    int         hasId;      // "#id" before the closing '>', e.g. <L1on#42>
+    uint32_t    id;
+} Command;
+
+extern CommandType parseCommand(const char *text, Command *cmd);
+extern const char *commandName(CommandType type);
+extern int         parseUint32(const char *text, uint32_t *value);
+
+#endif // COMMAND_H
@@ -0,0 +1,588 @@
+/******************************************************************************/
+/** \file       ctlsock.c
+ *******************************************************************************
+ *
+ * \brief      Local control socket (AF_UNIX, SOCK_SEQPACKET)
+ *
+ *             Daemons on the same host send the commands of the dashboard
+ *             protocol ("<L1on>", "<GetStatus:17>", ...) without HTTP
+ *             upgrade, framing or masking: every message is one command,
+ *             every reply one message, the same text a WebSocket client
+ *             gets in its frame. SOCK_SEQPACKET keeps the message
+ *             boundaries, so there is no parsing of a byte stream. A
+ *             command with several replies, such as a resume with
+ *             <GetStatus:version> that replays the changes missed, gets
+ *             them as that many messages.
+ *
+ *             Every command comes with the credentials of its sender
+ *             (SO_PASSCRED, SCM_CREDENTIALS, checked by the kernel). A
+ *             sender may change the state if it is root, the user of the
+ *             server or a member of the group given with -G, as primary or
+ *             supplementary group; anyone else who can open the socket may
+ *             only read (GetStatus, History) and gets "<Denied>" for the
+ *             rest. The control socket gets no pushed state changes, so
+ *             <Subscribe:...> is answered with "<Unsupported>".
+ *
+ *             The socket is served by a thread of its own with a small
+ *             epoll loop, independent of the WebSocket backends. A reply
+ *             the client does not take stops the reading of its commands
+ *             until it does.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * ctl_start
+ * ctl_stop
+ * * functions  local:
+ * read_only
+ * in_group
+ * may_control
+ * conn_accept
+ * conn_close
+ * conn_flush
+ * conn_commands
+ * conn_writable
+ * ctl_thread
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "ctlsock.h"
+#include "netconn.h"
+#include "command.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+#define KEY_LISTEN         0
+#define KEY_STOP           1
+#define KEY_CONN           2       // + index
+
+#define CTL_POOL_CHUNKS    64      // replies wait here only while not taken
+#define CTL_BATCH          64      // commands per connection and wakeup
+#define CTL_IOV            16      // chunks of one reply, a History fits
+
+#define DENIED_REPLY       "<Denied>"
+#define UNSUPPORTED_REPLY  "<Unsupported>"
+
+#define CTL_GROUPS         32      // groups of a user, before asking for more
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    int        sock;               // -1: free
+    int        blocked;            // reply not taken, waiting for EPOLLOUT
+    ws_conn_t  ws;                 // raw: replies without frames
+    tx_queue_t tx;
+    int        checked;            // member is known for checkedUid
+    uid_t      checkedUid;
+    int        member;             // checkedUid is in the control group
+} ctl_conn_t;
+
+//----- Data -------------------------------------------------------------------
+static int listenSock = -1;
+static int epfd = -1;
+static int controlGroup = -1;      // may change the state (-G)
+static char sockPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static pthread_t thread;
+static int running;
+static tx_pool_t pool;
+static ctl_conn_t conns[CTL_MAX_CONNS];
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    read_only
+ ******************************************************************************/
+/** \brief        Commands that do not change the state
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int read_only(CommandType type) {
+    return type == CMD_UNKNOWN || type == CMD_GET_STATUS
+           || type == CMD_GET_STATUS_ACK || type == CMD_HISTORY;
+}
+
+/*******************************************************************************
+ * function :    in_group
+ ******************************************************************************/
+/** \brief        Whether a user is a member of a group, as primary or as
+ *               supplementary group (usermod -aG)
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int in_group(uid_t uid, gid_t gid) {
+    struct passwd pw;
+    struct passwd *found = NULL;
+    char buf[1024];
+    gid_t local[CTL_GROUPS];
+    gid_t *groups = local;
+    int count = CTL_GROUPS;
+    int member = FALSE;
+
+    if (getpwuid_r(uid, &pw, buf, sizeof(buf), &found) != 0 || found == NULL) {
+        return FALSE;
+    }
+    if (getgrouplist(pw.pw_name, pw.pw_gid, groups, &count) < 0) {
+        // count is now the number of groups of the user
+        groups = malloc(count * sizeof(gid_t));
+        if (groups == NULL || getgrouplist(pw.pw_name, pw.pw_gid, groups, &count) < 0) {
+            free(groups);
+            return FALSE;
+        }
+    }
+    for (int i = 0; i < count && !member; i++) {
+        member = (groups[i] == gid);
+    }
+    if (groups != local) {
+        free(groups);
+    }
+    return member;
+}
+
+/*******************************************************************************
+ * function :    may_control
+ ******************************************************************************/
+/** \brief        May the sender of a message change the state
+ *
+ *               The group membership is looked up once per connection and
+ *               sender, not for every command.
+ *
+ * \type         static
+ *
+ * \param[in]    c      Connection of the message
+ * \param[in]    cred   Credentials of the message, NULL if it had none
+ *
+ ******************************************************************************/
+static int may_control(ctl_conn_t *c, const struct ucred *cred) {
+    if (cred == NULL) {
+        return FALSE;
+    }
+    if (cred->uid == 0 || cred->uid == geteuid()) {
+        return TRUE;
+    }
+    if (controlGroup < 0) {
+        return FALSE;
+    }
+    if (cred->gid == (gid_t)controlGroup) {
+        return TRUE;
+    }
+    if (!c->checked || c->checkedUid != cred->uid) {
+        c->member = in_group(cred->uid, (gid_t)controlGroup);
+        c->checkedUid = cred->uid;
+        c->checked = TRUE;
+    }
+    return c->member;
+}
+
+/*******************************************************************************
+ * function :    conn_accept
+ ******************************************************************************/
+/** \brief        Take the pending connections into the table
+ *
+ *               SO_PASSCRED is inherited from the listening socket.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_accept(void) {
+    for (;;) {
+        int sock = accept4(listenSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        int index = 0;
+
+        if (sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_WARN("Control socket accept: %s", strerror(errno));
+            }
+            return;
+        }
+        while (index < CTL_MAX_CONNS && conns[index].sock >= 0) {
+            index++;
+        }
+        if (index == CTL_MAX_CONNS) {
+            LOG_WARN("Control socket: %d connections, refused", CTL_MAX_CONNS);
+            close(sock);
+            continue;
+        }
+
+        ctl_conn_t *c = &conns[index];
+        struct epoll_event event = { .events = EPOLLIN, .data.u32 = KEY_CONN + index };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &event) < 0) {
+            close(sock);
+            continue;
+        }
+        c->sock = sock;
+        c->blocked = FALSE;
+        c->checked = FALSE;
+        tx_queue_init(&c->tx, &pool);
+        memset(&c->ws, 0, sizeof(c->ws));
+        c->ws.sock = sock;
+        c->ws.tx = &c->tx;
+        c->ws.raw = TRUE;
+        LOG_INFO("Control client connected");
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_close
+ ******************************************************************************/
+static void conn_close(ctl_conn_t *c) {
+    tx_queue_clear(&c->tx);
+    ws_conn_free(&c->ws);
+    close(c->sock);                // also leaves the epoll set
+    c->sock = -1;
+    LOG_INFO("Control client disconnected");
+}
+
+/*******************************************************************************
+ * function :    conn_flush
+ ******************************************************************************/
+/** \brief        Send the queued replies, each as one message
+ *
+ *               Every reply is queued behind its length (ws_conn_send on a
+ *               raw connection), so the replies of one command, such as the
+ *               changes a resume replays, stay messages of their own.
+ *
+ * \type         static
+ *
+ * \return       0 if all sent (or none), 1 if the socket is full, -1 on error
+ *
+ ******************************************************************************/
+static int conn_flush(ctl_conn_t *c) {
+    struct iovec iov[CTL_IOV];
+    struct msghdr msg;
+
+    while (c->tx.bytes > 0) {
+        uint8_t header[WS_RAW_HDR];
+        uint32_t size;
+        size_t got = 0;
+        int count = tx_queue_peek(&c->tx, 0, iov, CTL_IOV);
+
+        // The length may be split over two chunks
+        for (int i = 0; i < count && got < WS_RAW_HDR; i++) {
+            size_t n = iov[i].iov_len < WS_RAW_HDR - got ? iov[i].iov_len : WS_RAW_HDR - got;
+            memcpy(header + got, iov[i].iov_base, n);
+            got += n;
+        }
+        memcpy(&size, header, WS_RAW_HDR);
+
+        count = tx_queue_peek(&c->tx, WS_RAW_HDR, iov, CTL_IOV);
+        got = 0;
+        for (int i = 0; i < count; i++) {
+            if (got + iov[i].iov_len >= size) {
+                iov[i].iov_len = size - got;
+                count = i + 1;
+            }
+            got += iov[i].iov_len;
+        }
+        if (got != size) {
+            LOG_ERROR("Control reply of %u bytes does not fit %d chunks", size, CTL_IOV);
+            return -1;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        for (;;) {
+            ssize_t n = sendmsg(c->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            metrics_inc(METRIC_NET_SYSCALLS);
+            if (n >= 0) {
+                // A message is sent as a whole or not at all
+                tx_queue_consume(&c->tx, WS_RAW_HDR + size);
+                metrics_add(METRIC_BYTES_SENT, n);
+                break;
+            }
+            if (errno != EINTR) {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    conn_commands
+ ******************************************************************************/
+/** \brief        Handle the commands of a readable connection
+ *
+ *               Each command is answered before the next one is read. If
+ *               its replies do not fit in the socket, reading stops until
+ *               they are sent.
+ *
+ * \type         static
+ *
+ * \return       0, -1 if the connection is to be closed
+ *
+ ******************************************************************************/
+static int conn_commands(ctl_conn_t *c, unsigned key) {
+    char command[CTL_MSG_MAX + 1];
+    union {
+        struct cmsghdr header;
+        uint8_t        space[CMSG_SPACE(sizeof(struct ucred))];
+    } control;
+
+    for (int i = 0; i < CTL_BATCH; i++) {
+        struct iovec iov = { command, CTL_MSG_MAX };
+        struct msghdr msg;
+        struct ucred *cred = NULL;
+        Command cmd;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(c->sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        metrics_inc(METRIC_NET_SYSCALLS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        c->ws.rx_ns = metrics_now_ns();
+        metrics_inc(METRIC_FRAMES_RECEIVED);
+        metrics_add(METRIC_BYTES_RECEIVED, n);
+        if (msg.msg_flags & MSG_TRUNC) {
+            LOG_WARN("Control command longer than %d bytes, ignored", CTL_MSG_MAX);
+            continue;
+        }
+        command[n] = '\0';
+
+        for (struct cmsghdr *h = CMSG_FIRSTHDR(&msg); h != NULL; h = CMSG_NXTHDR(&msg, h)) {
+            if (h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_CREDENTIALS) {
+                cred = (struct ucred *)CMSG_DATA(h);
+            }
+        }
+
+        parseCommand(command, &cmd);
+        if (cmd.type == CMD_SUBSCRIBE) {
+            ws_conn_send(&c->ws, WS_OP_TEXT, UNSUPPORTED_REPLY, strlen(UNSUPPORTED_REPLY));
+        } else if (read_only(cmd.type) || may_control(c, cred)) {
+            processCommand(command, &c->ws);
+        } else {
+            LOG_WARN("Control command %s of uid %d denied", commandName(cmd.type),
+                     cred ? (int)cred->uid : -1);
+            metrics_inc(METRIC_CONTROL_DENIED);
+            ws_conn_send(&c->ws, WS_OP_TEXT, DENIED_REPLY, strlen(DENIED_REPLY));
+        }
+
+        int result = conn_flush(c);
+        if (result < 0) {
+            return -1;
+        }
+        if (result > 0) {
+            struct epoll_event event = { .events = EPOLLOUT, .data.u32 = key };
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &event);
+            c->blocked = TRUE;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    conn_writable
+ ******************************************************************************/
+/** \brief        Send the held reply, then read the commands again
+ *
+ * \type         static
+ *
+ * \return       0, -1 if the connection is to be closed
+ *
+ ******************************************************************************/
+static int conn_writable(ctl_conn_t *c, unsigned key) {
+    int result = conn_flush(c);
+
+    if (result != 0) {
+        return result < 0 ? -1 : 0;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = key };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &event);
+    c->blocked = FALSE;
+    return conn_commands(c, key);
+}
+
+/*******************************************************************************
+ * function :    ctl_thread
+ ******************************************************************************/
+/** \brief        Serve the control socket until the stop eventfd is readable
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void *ctl_thread(void *pdata) {
+    (void)pdata;
+    trace_thread_name("ctl");
+
+    for (;;) {
+        struct epoll_event events[CTL_MAX_CONNS + 2];
+        int n = epoll_wait(epfd, events, CTL_MAX_CONNS + 2, -1);
+        metrics_inc(METRIC_WAKEUPS);
+        if (n < 0 && errno != EINTR) {
+            LOG_ERROR("Control socket: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            unsigned key = events[i].data.u32;
+            if (key == KEY_STOP) {
+                goto stop;
+            }
+            if (key == KEY_LISTEN) {
+                conn_accept();
+                continue;
+            }
+
+            ctl_conn_t *c = &conns[key - KEY_CONN];
+            int result;
+            if (c->sock < 0) {
+                continue;
+            }
+            if (c->blocked) {
+                result = events[i].events & EPOLLOUT ? conn_writable(c, key) : -1;
+            } else {
+                result = conn_commands(c, key);
+            }
+            if (result < 0) {
+                conn_close(c);
+            }
+        }
+    }
+stop:
+    for (int i = 0; i < CTL_MAX_CONNS; i++) {
+        if (conns[i].sock >= 0) {
+            conn_close(&conns[i]);
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * function :    ctl_start
+ ******************************************************************************/
+/** \brief        Open the control socket and start its thread
+ *
+ *               A socket file left over from a previous run is replaced.
+ *               The file is writable for everyone; what a sender may do is
+ *               decided per command by its credentials.
+ *
+ * \type         global
+ *
+ * \param[in]    path         File name of the socket
+ * \param[in]    controlGid   Group that may change the state besides root
+ *                            and the server's user, -1: none
+ * \param[in]    stopFd       Readable when the server shuts down (eventfd)
+ *
+ * \return       0 on success, -1 with errno set on error
+ *
+ ******************************************************************************/
+int ctl_start(const char *path, int controlGid, int stopFd) {
+    struct sockaddr_un addr;
+    struct epoll_event event;
+    int option = 1;
+    int result;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    controlGroup = controlGid;
+    for (int i = 0; i < CTL_MAX_CONNS; i++) {
+        conns[i].sock = -1;
+    }
+    if (tx_pool_init(&pool, CTL_POOL_CHUNKS) != 0) {
+        return -1;
+    }
+
+    listenSock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (listenSock < 0 || epfd < 0) {
+        goto error;
+    }
+    setsockopt(listenSock, SOL_SOCKET, SO_PASSCRED, &option, sizeof(option));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        goto error;
+    }
+    strcpy(sockPath, path);
+    if (chmod(path, 0666) < 0 || listen(listenSock, CTL_MAX_CONNS) < 0) {
+        goto error;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = KEY_LISTEN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenSock, &event);
+    event.data.u32 = KEY_STOP;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, stopFd, &event);
+
+    result = pthread_create(&thread, NULL, ctl_thread, NULL);
+    if (result != 0) {
+        errno = result;
+        goto error;
+    }
+    running = TRUE;
+    return 0;
+
+error:
+    result = errno;
+    ctl_stop();
+    errno = result;
+    return -1;
+}
+
+/*******************************************************************************
+ * function :    ctl_stop
+ ******************************************************************************/
+/** \brief        Wait for the thread (stopFd must be readable by now), close
+ *               and remove the socket
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void ctl_stop(void) {
+    if (running) {
+        pthread_join(thread, NULL);
+        running = FALSE;
+    }
+    if (listenSock >= 0) {
+        close(listenSock);
+        listenSock = -1;
+    }
+    if (sockPath[0] != '\0') {
+        unlink(sockPath);
+        sockPath[0] = '\0';
+    }
+    if (epfd >= 0) {
+        close(epfd);
+        epfd = -1;
+    }
+    tx_pool_free(&pool);
+}
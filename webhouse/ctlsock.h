@@ -0,0 +1,12 @@
+#ifndef CTLSOCK_H
+#define CTLSOCK_H
+
+// Local control socket for automation on the same host, see ctlsock.c
+#define CTL_DEFAULT_PATH   "webhouse.ctl"  // -u
+#define CTL_MAX_CONNS      16
+#define CTL_MSG_MAX        256             // largest command message
+
+extern int  ctl_start (const char *path, int controlGid, int stopFd);
+extern void ctl_stop  (void);
+
+#endif // CTLSOCK_H
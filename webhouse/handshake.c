@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 /**
  * @dir src/handshake
@@ -72,12 +73,169 @@ static int get_handshake_accept(char *wsKey, unsigned char **dest)
     return (0);
 }
 
+/**
+ * @brief Parses one permessage-deflate offer of the
+ * Sec-WebSocket-Extensions header (RFC 7692, section 7).
+ *
+ * @param offer   Parameters of the offer, after "permessage-deflate".
+ * @param options Negotiated options, filled on success.
+ *
+ * @return Returns 0 if the offer is acceptable and a negative number
+ * otherwise (unknown or duplicated parameter, invalid window bits).
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int parse_deflate_offer(char *offer, ws_options_t *options)
+{
+    char *saveptr; /* strtok_r() pointer. */
+    char *param;   /* Current parameter.  */
+    int seen;      /* Parameters seen.    */
+
+    options->server_no_context_takeover = 0;
+    options->client_no_context_takeover = 0;
+    options->server_max_window_bits     = WS_DEFLATE_MAX_WINDOW_BITS;
+    options->client_max_window_bits     = 0;
+
+    seen    = 0;
+    saveptr = NULL;
+    for (param = strtok_r(offer, ";", &saveptr); param != NULL;
+         param = strtok_r(NULL, ";", &saveptr))
+    {
+        char *value;
+        int bit;
+
+        param += strspn(param, " \t");
+        param[strcspn(param, " \t")] = '\0';
+        if (*param == '\0')
+            continue;
+
+        value = strchr(param, '=');
+        if (value != NULL)
+        {
+            *value++ = '\0';
+            if (*value == '"')
+                value++;
+        }
+
+        if (strcmp(param, "server_no_context_takeover") == 0)
+        {
+            bit = 1;
+            options->server_no_context_takeover = 1;
+        }
+        else if (strcmp(param, "client_no_context_takeover") == 0)
+        {
+            bit = 2;
+            options->client_no_context_takeover = 1;
+        }
+        else if (strcmp(param, "server_max_window_bits") == 0)
+        {
+            int bits = value ? atoi(value) : 0;
+            bit = 4;
+            /* zlib cannot produce a raw deflate stream with a 256 byte
+             * window, so 8 is declined like any invalid value. */
+            if (bits < 9 || bits > 15)
+                return (-1);
+            if (bits < options->server_max_window_bits)
+                options->server_max_window_bits = bits;
+        }
+        else if (strcmp(param, "client_max_window_bits") == 0)
+        {
+            int bits = value ? atoi(value) : 15;
+            bit = 8;
+            if (bits < 8 || bits > 15)
+                return (-1);
+            options->client_max_window_bits = value ? bits : 0;
+        }
+        else
+            return (-1);
+
+        if (seen & bit)
+            return (-1);
+        seen |= bit;
+    }
+
+    /* We always ask for a fresh context per message if configured so. */
+    if (WS_DEFLATE_NO_CONTEXT_TAKEOVER)
+        options->server_no_context_takeover = 1;
+
+    return (0);
+}
+
+/**
+ * @brief Picks the first acceptable permessage-deflate offer from a
+ * Sec-WebSocket-Extensions header line.
+ *
+ * @param line    Header line (modified).
+ * @param options Negotiated options.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void negotiate_extensions(char *line, ws_options_t *options)
+{
+    char *saveptr; /* strtok_r() pointer. */
+    char *offer;   /* Current offer.      */
+
+    line = strchr(line, ':');
+    if (line == NULL)
+        return;
+
+    saveptr = NULL;
+    for (offer = strtok_r(line + 1, ",", &saveptr); offer != NULL;
+         offer = strtok_r(NULL, ",", &saveptr))
+    {
+        offer += strspn(offer, " \t");
+        if (strncmp(offer, "permessage-deflate", 18) != 0 ||
+            (offer[18] != '\0' && offer[18] != ';' && offer[18] != ' '))
+            continue;
+
+        if (parse_deflate_offer(offer + 18, options) == 0)
+        {
+            options->deflate = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Picks a subprotocol from a Sec-WebSocket-Protocol header line.
+ *
+ * @param line Header line (modified).
+ *
+ * @return Returns the WS_PROTO_* value of the first offered protocol the
+ * server speaks, WS_PROTO_NONE if there is none.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int negotiate_subprotocol(char *line)
+{
+    char *saveptr; /* strtok_r() pointer. */
+    char *proto;   /* Current protocol.   */
+
+    line = strchr(line, ':');
+    if (line == NULL)
+        return (WS_PROTO_NONE);
+
+    saveptr = NULL;
+    for (proto = strtok_r(line + 1, ", \t", &saveptr); proto != NULL;
+         proto = strtok_r(NULL, ", \t", &saveptr))
+    {
+        if (strcmp(proto, WS_PROTO_BINARY_NAME) == 0)
+            return (WS_PROTO_BINARY);
+    }
+    return (WS_PROTO_NONE);
+}
+
 /**
  * @brief Gets the complete response to accomplish a succesfully
  * handshake.
  *
  * @param hsrequest  Client request.
- * @param hsresponse Server response.
+ * @param hsresponse Server response, at least WS_HS_RESPLEN bytes.
+ * @param options    Negotiated extensions and subprotocol (may be NULL
+ *                   to decline all).
  *
  * @return Returns 0 if success and a negative number
  * otherwise.
@@ -86,27 +244,38 @@ static int get_handshake_accept(char *wsKey, unsigned char **dest)
  * for completeness.
  */
 
-int get_handshake_response(char hsrequest[], char hsresponse[])
+int get_handshake_response(char hsrequest[], char hsresponse[],
+                           ws_options_t *options)
 {
     unsigned char *accept; /* Accept message.     */
     char *saveptr;         /* strtok_r() pointer. */
     char *s;               /* Current string.     */
+    char *key;             /* Key header line.    */
+    char *ext;             /* Extensions line.    */
+    char *proto;           /* Subprotocol line.   */
     int ret;               /* Return value.       */
 
+    key     = NULL;
+    ext     = NULL;
+    proto   = NULL;
     saveptr = NULL;
     for (s = strtok_r(hsrequest, "\r\n", &saveptr); s != NULL;
          s = strtok_r(NULL, "\r\n", &saveptr))
     {
         if (strstr(s, WS_HS_REQ) != NULL)
-            break;
+            key = s;
+        else if (strncasecmp(s, WS_HS_EXT, sizeof(WS_HS_EXT) - 1) == 0)
+            ext = s;
+        else if (strncasecmp(s, WS_HS_PROTO, sizeof(WS_HS_PROTO) - 1) == 0)
+            proto = s;
     }
 
     /* Ensure that we have a valid pointer. */
-    if (s == NULL)
+    if (key == NULL)
         return (-1);
 
     saveptr = NULL;
-    s       = strtok_r(s, " ", &saveptr);
+    s       = strtok_r(key, " ", &saveptr);
     s       = strtok_r(NULL, " ", &saveptr);
 
     ret = get_handshake_accept(s, &accept);
@@ -115,9 +284,40 @@ int get_handshake_response(char hsrequest[], char hsresponse[])
 
     strcpy(hsresponse, WS_HS_ACCEPT);
     strcat(hsresponse, (const char *)accept);
-    strcat(hsresponse, "\r\n\r\n");
-
+    strcat(hsresponse, "\r\n");
     free(accept);
+
+    if (options != NULL)
+    {
+        memset(options, 0, sizeof(*options));
+        if (ext != NULL && WS_DEFLATE_ENABLE)
+            negotiate_extensions(ext, options);
+        if (proto != NULL)
+            options->subprotocol = negotiate_subprotocol(proto);
+
+        if (options->subprotocol == WS_PROTO_BINARY)
+            sprintf(hsresponse + strlen(hsresponse), "%s: %s\r\n",
+                    WS_HS_PROTO, WS_PROTO_BINARY_NAME);
+
+        if (options->deflate)
+        {
+            char *p = hsresponse + strlen(hsresponse);
+            p += sprintf(p, "%s: permessage-deflate", WS_HS_EXT);
+            if (options->server_no_context_takeover)
+                p += sprintf(p, "; server_no_context_takeover");
+            if (options->client_no_context_takeover)
+                p += sprintf(p, "; client_no_context_takeover");
+            if (options->server_max_window_bits < 15)
+                p += sprintf(p, "; server_max_window_bits=%d",
+                             options->server_max_window_bits);
+            if (options->client_max_window_bits)
+                p += sprintf(p, "; client_max_window_bits=%d",
+                             options->client_max_window_bits);
+            strcpy(p, "\r\n");
+        }
+    }
+
+    strcat(hsresponse, "\r\n");
     return (0);
 }
 
@@ -167,3 +367,111 @@ int code_outgoing_response (char response[], char coded_response[]){
 
     return (size);
 }
+
+/**
+ * @brief Decodes one (client to server) frame from a receive buffer.
+ * The payload is unmasked in place.
+ *
+ * @param buf   Received bytes.
+ * @param len   Number of received bytes.
+ * @param frame Decoded frame; payload points into @p buf.
+ *
+ * @return Returns the number of bytes the frame occupies in @p buf,
+ * 0 if the frame is not complete yet and a negative number if the
+ * frame is invalid: unmasked (clients must mask, RFC 6455, section 5.1)
+ * or too large.
+ */
+int decode_incoming_frame(uint8_t buf[], size_t len, ws_frame_t *frame)
+{
+    size_t header; /* Header length.  */
+    uint64_t size; /* Payload length. */
+    uint8_t *mask; /* Masking key.    */
+    size_t i;
+
+    if (len < 2)
+        return (0);
+    if (!(buf[1] & WS_MASK))
+        return (-1);
+
+    frame->fin    = (buf[0] & WS_FIN) != 0;
+    frame->rsv1   = (buf[0] & WS_RSV1) != 0;
+    frame->opcode = buf[0] & 0x0F;
+
+    header = 2;
+    size   = buf[1] & 0x7F;
+    if (size == 126)
+    {
+        if (len < 4)
+            return (0);
+        size    = ((uint64_t)buf[2] << 8) | buf[3];
+        header += 2;
+    }
+    else if (size == 127)
+    {
+        if (len < 10)
+            return (0);
+        size = 0;
+        for (i = 0; i < 8; i++)
+            size = (size << 8) | buf[2 + i];
+        header += 8;
+    }
+
+    /* Nothing we accept comes close to this, refuse instead of buffering. */
+    if (size > WS_MAX_PAYLOAD)
+        return (-1);
+
+    mask    = buf + header;
+    header += 4;
+
+    if (len < header + size)
+        return (0);
+
+    frame->payload = buf + header;
+    frame->length  = size;
+    for (i = 0; i < size; i++)
+        frame->payload[i] ^= mask[i & 3];
+
+    return (int)(header + size);
+}
+
+/**
+ * @brief Builds an unmasked (server to client) frame.
+ *
+ * @param opcode  Frame opcode (WS_OP_TEXT, WS_OP_BINARY, ...).
+ * @param flags   Extra header bits, e.g. WS_RSV1 for a compressed message.
+ * @param payload Payload bytes.
+ * @param len     Payload length.
+ * @param frame   Output, at least len + WS_FRAME_HDR_MAX bytes.
+ *
+ * @return Returns the total frame length.
+ */
+int code_outgoing_frame(int opcode, int flags, const uint8_t payload[],
+                        size_t len, uint8_t frame[])
+{
+    size_t header; /* Header length. */
+
+    frame[0] = WS_FIN | flags | (opcode & 0x0F);
+    if (len < 126)
+    {
+        frame[1] = len;
+        header   = 2;
+    }
+    else if (len <= 0xFFFF)
+    {
+        frame[1] = 126;
+        frame[2] = len >> 8;
+        frame[3] = len & 0xFF;
+        header   = 4;
+    }
+    else
+    {
+        int i;
+        frame[1] = 127;
+        for (i = 0; i < 8; i++)
+            frame[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        header = 10;
+    }
+
+    memcpy(frame + header, payload, len);
+    return (int)(header + len);
+}
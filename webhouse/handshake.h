@@ -1,9 +1,34 @@
 #ifndef HANDSHAKE_H
 #define HANDSHAKE_H
 
-extern int get_handshake_response  (char request[],       char hsresponse[]);
+#include <stddef.h>
+#include <stdint.h>
+
+// Extensions negotiated during the handshake.
+typedef struct {
+    int deflate;                     // permessage-deflate accepted
+    int server_no_context_takeover;  // reset our compressor after every message
+    int client_no_context_takeover;  // client resets its compressor
+    int server_max_window_bits;      // LZ77 window of our compressor (9..15)
+    int client_max_window_bits;      // 0 = not limited
+    int subprotocol;                 // WS_PROTO_*
+} ws_options_t;
+
+// One decoded frame; payload points into the receive buffer.
+typedef struct {
+    int      fin;
+    int      rsv1;
+    int      opcode;
+    uint8_t *payload;
+    size_t   length;
+} ws_frame_t;
+
+extern int get_handshake_response  (char request[],       char hsresponse[], ws_options_t *options);
 extern int decode_incoming_request (char coded_request[], char request[]);
 extern int code_outgoing_response  (char response[],      char coded_response[]);
+extern int decode_incoming_frame   (uint8_t buf[], size_t len, ws_frame_t *frame);
+extern int code_outgoing_frame     (int opcode, int flags, const uint8_t payload[],
+                                    size_t len, uint8_t frame[]);
 
 #define WS_KEY_LEN     24
 // Magic string length.
@@ -14,8 +39,14 @@ extern int code_outgoing_response  (char response[],      char coded_response[])
 #define MAGIC_STRING   "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 // Alias for 'Sec-WebSocket-Key'.
 #define WS_HS_REQ      "Sec-WebSocket-Key"
+// Alias for 'Sec-WebSocket-Extensions'.
+#define WS_HS_EXT      "Sec-WebSocket-Extensions"
+// Alias for 'Sec-WebSocket-Protocol'.
+#define WS_HS_PROTO    "Sec-WebSocket-Protocol"
 // Handshake accept message length.
 #define WS_HS_ACCLEN   130
+// Handshake response buffer size, including negotiated extensions.
+#define WS_HS_RESPLEN  512
 // Handshake accept message.
 #define WS_HS_ACCEPT                       \
     "HTTP/1.1 101 Switching Protocols\r\n" \
@@ -23,4 +54,37 @@ extern int code_outgoing_response  (char response[],      char coded_response[])
     "Connection: Upgrade\r\n"              \
     "Sec-WebSocket-Accept: "
 
+// Frame header bits and opcodes (RFC 6455, section 5.2).
+#define WS_FIN         0x80
+#define WS_RSV1        0x40
+#define WS_MASK        0x80            // second byte: payload masked
+#define WS_OP_CONT     0x0
+#define WS_OP_TEXT     0x1
+#define WS_OP_BINARY   0x2
+#define WS_OP_CLOSE    0x8
+#define WS_OP_PING     0x9
+#define WS_OP_PONG     0xA
+// Largest server frame header (2 + 8 byte length, no mask).
+#define WS_FRAME_HDR_MAX 10
+// Largest client payload that is accepted.
+#define WS_MAX_PAYLOAD   65536
+
+// Subprotocols (Sec-WebSocket-Protocol) understood by the server.
+#define WS_PROTO_NONE         0    // legacy text status replies
+#define WS_PROTO_BINARY       1    // binary StatusFrame, see status.h
+#define WS_PROTO_BINARY_NAME  "webhouse.bin.v1"
+
+// permessage-deflate (RFC 7692) defaults, may be overridden with -D.
+#ifndef WS_DEFLATE_ENABLE
+#define WS_DEFLATE_ENABLE               1
+#endif
+// 1: always reset the compressor per message (less memory, worse ratio).
+#ifndef WS_DEFLATE_NO_CONTEXT_TAKEOVER
+#define WS_DEFLATE_NO_CONTEXT_TAKEOVER  0
+#endif
+// Upper bound for our LZ77 window; 2^(bits+2) bytes of zlib memory each.
+#ifndef WS_DEFLATE_MAX_WINDOW_BITS
+#define WS_DEFLATE_MAX_WINDOW_BITS      15
+#endif
+
 #endif // HANDSHAKE_H
@@ -0,0 +1,667 @@
+/******************************************************************************/
+/** \file       history.c
+ *******************************************************************************
+ *
+ * \brief      In-memory history of temperature, heater, dimmers and alarms
+ *
+ *             A sampler thread records the state on every change and at
+ *             least every HISTORY_HEARTBEAT_MS. Each sample goes into a ring
+ *             of the last HISTORY_RAW_SIZE samples and is added to four
+ *             levels of aggregate buckets (10 s, 1 min, 10 min, 1 h), each
+ *             level a ring of its own. All memory is allocated statically,
+ *             so the history never grows.
+ *
+ *             Averages are time weighted: a sample counts for as long as
+ *             it was the current state, so a burst of changes does not
+ *             outweigh hours of a steady state.
+ *
+ *             With a store (tsdb, see history_start) every sample is also
+ *             appended to disk, stamped with CLOCK_REALTIME so the file
+ *             outlives restarts.
+ *
+ *             A query of up to HISTORY_MAX_POINTS steps below 10 s reads the
+ *             raw samples, every longer one the finest level that covers
+ *             the range within HISTORY_MAX_SCAN buckets. A day is read from
+ *             144 ten minute buckets, a month from 720 hour buckets.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * history_start
+ * history_stop
+ * history_add
+ * history_query
+ * history_encode_text
+ * * functions  local:
+ * now_ms
+ * wall_ms
+ * agg_reset
+ * agg_sample
+ * agg_hold
+ * agg_merge
+ * agg_point
+ * level_bucket
+ * hold
+ * query_raw
+ * query_level
+ * sampler_thread
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "history.h"
+#include "metrics.h"
+#include "trace.h"
+
+//----- Macros -----------------------------------------------------------------
+#define RAW_MASK            (HISTORY_RAW_SIZE - 1)
+
+// Bits of history_sample_t.flags
+#define SAMPLE_HEAT         0x01
+#define SAMPLE_ALARM        0x02    // alarm sensor active
+#define SAMPLE_ALARM_EVENT  0x04    // sensor became active with this sample
+
+#define LEVELS              (sizeof(levels) / sizeof(levels[0]))
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    uint64_t ms;            // CLOCK_MONOTONIC
+    float    temp;
+    uint8_t  flags;         // SAMPLE_* bits
+    uint8_t  dimRLamp;
+    uint8_t  dimSLamp;
+} history_sample_t;
+
+// Aggregate of one time bucket. The sums are value * ms held in the bucket.
+typedef struct {
+    uint64_t         seq;           // bucket number + 1, 0 = unused
+    uint32_t         samples;
+    uint32_t         alarms;
+    float            tempMin;
+    float            tempMax;
+    double           weight;        // ms covered
+    double           tempSum;
+    double           heatSum;
+    double           dimRSum;
+    double           dimSSum;
+    history_sample_t last;          // for buckets that cover no time yet
+} history_agg_t;
+
+typedef struct {
+    uint32_t       widthMs;
+    uint32_t       count;
+    history_agg_t *buckets;
+} history_level_t;
+
+//----- Data -------------------------------------------------------------------
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static history_sample_t raw[HISTORY_RAW_SIZE];
+static uint64_t rawHead;            // samples added so far
+
+static pthread_mutex_t storeLock = PTHREAD_MUTEX_INITIALIZER;
+static tsdb_t *store;               // NULL without a store or after history_stop
+
+static history_sample_t current;    // last sample, held until the next one
+static uint64_t heldUntil;          // current is accounted for up to here (ms)
+static int hasCurrent;
+
+static history_agg_t level10s[360];     // 1 hour
+static history_agg_t level1m[1440];     // 1 day
+static history_agg_t level10m[1008];    // 1 week
+static history_agg_t level1h[744];      // 31 days
+
+static const history_level_t levels[] = {
+    {    10000, sizeof(level10s) / sizeof(level10s[0]), level10s },
+    {    60000, sizeof(level1m) / sizeof(level1m[0]),   level1m },
+    {   600000, sizeof(level10m) / sizeof(level10m[0]), level10m },
+    {  3600000, sizeof(level1h) / sizeof(level1h[0]),   level1h },
+};
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    now_ms
+ ******************************************************************************/
+/** \brief        CLOCK_MONOTONIC in milliseconds
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static uint64_t now_ms(void) {
+    return metrics_now_ns() / 1000000ULL;
+}
+
+/*******************************************************************************
+ * function :    wall_ms
+ ******************************************************************************/
+/** \brief        CLOCK_REALTIME in milliseconds, for the store
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*******************************************************************************
+ * function :    agg_reset
+ ******************************************************************************/
+/** \brief        Empty a bucket and assign it a new bucket number
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void agg_reset(history_agg_t *agg, uint64_t seq) {
+    memset(agg, 0, sizeof(*agg));
+    agg->seq = seq;
+    agg->tempMin = FLT_MAX;
+    agg->tempMax = -FLT_MAX;
+}
+
+/*******************************************************************************
+ * function :    agg_sample
+ ******************************************************************************/
+/** \brief        Count a sample taken within the bucket
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void agg_sample(history_agg_t *agg, const history_sample_t *s) {
+    agg->samples++;
+    if (s->flags & SAMPLE_ALARM_EVENT) {
+        agg->alarms++;
+    }
+    if (s->temp < agg->tempMin) {
+        agg->tempMin = s->temp;
+    }
+    if (s->temp > agg->tempMax) {
+        agg->tempMax = s->temp;
+    }
+    agg->last = *s;
+}
+
+/*******************************************************************************
+ * function :    agg_hold
+ ******************************************************************************/
+/** \brief        Account for a sample being the state for some time
+ *
+ * \type         static
+ *
+ * \param[in]    ms   Time within the bucket the sample was the state
+ *
+ ******************************************************************************/
+static void agg_hold(history_agg_t *agg, const history_sample_t *s, uint64_t ms) {
+    agg->weight += ms;
+    agg->tempSum += (double)s->temp * ms;
+    agg->heatSum += (s->flags & SAMPLE_HEAT) ? ms : 0;
+    agg->dimRSum += (double)s->dimRLamp * ms;
+    agg->dimSSum += (double)s->dimSLamp * ms;
+    if (s->temp < agg->tempMin) {
+        agg->tempMin = s->temp;
+    }
+    if (s->temp > agg->tempMax) {
+        agg->tempMax = s->temp;
+    }
+    if (agg->samples == 0) {
+        agg->last = *s;
+    }
+}
+
+/*******************************************************************************
+ * function :    agg_merge
+ ******************************************************************************/
+/** \brief        Add a later bucket to an aggregate
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void agg_merge(history_agg_t *dst, const history_agg_t *src) {
+    if (src->samples == 0 && src->weight == 0) {
+        return;
+    }
+    dst->samples += src->samples;
+    dst->alarms += src->alarms;
+    dst->weight += src->weight;
+    dst->tempSum += src->tempSum;
+    dst->heatSum += src->heatSum;
+    dst->dimRSum += src->dimRSum;
+    dst->dimSSum += src->dimSSum;
+    if (src->tempMin < dst->tempMin) {
+        dst->tempMin = src->tempMin;
+    }
+    if (src->tempMax > dst->tempMax) {
+        dst->tempMax = src->tempMax;
+    }
+    dst->last = src->last;
+}
+
+/*******************************************************************************
+ * function :    agg_point
+ ******************************************************************************/
+/** \brief        Turn an aggregate into a query result
+ *
+ * \type         static
+ *
+ * \return       1 if the aggregate holds data, 0 if it is empty
+ *
+ ******************************************************************************/
+static int agg_point(const history_agg_t *agg, uint32_t age, history_point_t *p) {
+    if (agg->samples == 0 && agg->weight == 0) {
+        return 0;
+    }
+    p->age = age;
+    p->tempMin = agg->tempMin;
+    p->tempMax = agg->tempMax;
+    p->alarms = agg->alarms;
+    if (agg->weight > 0) {
+        p->tempAvg = agg->tempSum / agg->weight;
+        p->heat = agg->heatSum / agg->weight;
+        p->dimRLamp = agg->dimRSum / agg->weight;
+        p->dimSLamp = agg->dimSSum / agg->weight;
+    } else {
+        p->tempAvg = agg->last.temp;
+        p->heat = (agg->last.flags & SAMPLE_HEAT) ? 1 : 0;
+        p->dimRLamp = agg->last.dimRLamp;
+        p->dimSLamp = agg->last.dimSLamp;
+    }
+    return 1;
+}
+
+/*******************************************************************************
+ * function :    level_bucket
+ ******************************************************************************/
+/** \brief        Bucket of a level for a bucket number, reused if stale
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static history_agg_t *level_bucket(const history_level_t *level, uint64_t index) {
+    history_agg_t *agg = &level->buckets[index % level->count];
+
+    if (agg->seq != index + 1) {
+        agg_reset(agg, index + 1);
+    }
+    return agg;
+}
+
+/*******************************************************************************
+ * function :    hold
+ ******************************************************************************/
+/** \brief        Account for the current sample up to the given time
+ *
+ *               Called with the lock held.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void hold(uint64_t until) {
+    if (!hasCurrent || until <= heldUntil) {
+        return;
+    }
+    for (unsigned l = 0; l < LEVELS; l++) {
+        const history_level_t *level = &levels[l];
+        uint64_t from = heldUntil;
+
+        // Never more than count buckets, even after a long stall
+        if (until - from > (uint64_t)level->widthMs * level->count) {
+            from = until - (uint64_t)level->widthMs * level->count;
+        }
+        while (from < until) {
+            uint64_t index = from / level->widthMs;
+            uint64_t end = (index + 1) * level->widthMs;
+
+            if (end > until) {
+                end = until;
+            }
+            agg_hold(level_bucket(level, index), &current, end - from);
+            from = end;
+        }
+    }
+    heldUntil = until;
+}
+
+/*******************************************************************************
+ * function :    history_add
+ ******************************************************************************/
+/** \brief        Record a sample
+ *
+ *               Normally called by the sampler thread only; the benchmarks
+ *               use it to fill the history with made up data.
+ *
+ * \type         global
+ *
+ * \param[in]    state   State to record
+ * \param[in]    nowMs   CLOCK_MONOTONIC in ms, not before the last sample
+ *
+ ******************************************************************************/
+void history_add(const WebhouseState *state, uint64_t nowMs) {
+    history_sample_t s;
+
+    pthread_mutex_lock(&lock);
+    if (hasCurrent && nowMs < heldUntil) {
+        nowMs = heldUntil;
+    }
+    hold(nowMs);
+
+    s.ms = nowMs;
+    s.temp = state->temp;
+    s.flags = (state->heat ? SAMPLE_HEAT : 0) | (state->alarmTriggered ? SAMPLE_ALARM : 0);
+    if (state->alarmTriggered && !(hasCurrent && (current.flags & SAMPLE_ALARM))) {
+        s.flags |= SAMPLE_ALARM_EVENT;
+    }
+    s.dimRLamp = state->dimRLamp;
+    s.dimSLamp = state->dimSLamp;
+
+    raw[rawHead & RAW_MASK] = s;
+    rawHead++;
+    for (unsigned l = 0; l < LEVELS; l++) {
+        agg_sample(level_bucket(&levels[l], nowMs / levels[l].widthMs), &s);
+    }
+
+    current = s;
+    heldUntil = nowMs;
+    hasCurrent = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+/*******************************************************************************
+ * function :    query_raw
+ ******************************************************************************/
+/** \brief        Downsample the raw samples of a range into steps of stepMs
+ *
+ *               Called with the lock held, after hold(nowMs).
+ *
+ * \type         static
+ *
+ * \return       Number of points
+ *
+ ******************************************************************************/
+static int query_raw(uint64_t from, uint64_t nowMs, uint64_t stepMs,
+                     history_point_t points[HISTORY_MAX_POINTS]) {
+    history_agg_t out[HISTORY_MAX_POINTS];
+    uint64_t oldest = rawHead > HISTORY_RAW_SIZE ? rawHead - HISTORY_RAW_SIZE : 0;
+    uint64_t lo = oldest;
+    uint64_t hi = rawHead;
+    unsigned steps = (nowMs - from + stepMs - 1) / stepMs;
+    int count = 0;
+
+    if (steps > HISTORY_MAX_POINTS) {
+        steps = HISTORY_MAX_POINTS;
+    }
+    for (unsigned i = 0; i < steps; i++) {
+        agg_reset(&out[i], i + 1);
+    }
+
+    // First sample after from; the one before it was the state at from
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (raw[mid & RAW_MASK].ms <= from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > oldest) {
+        lo--;
+    }
+
+    for (uint64_t i = lo; i < rawHead; i++) {
+        const history_sample_t *s = &raw[i & RAW_MASK];
+        uint64_t start = s->ms > from ? s->ms : from;
+        uint64_t until = i + 1 < rawHead ? raw[(i + 1) & RAW_MASK].ms : nowMs;
+
+        if (s->ms >= from) {
+            unsigned step = (s->ms - from) / stepMs;
+            agg_sample(&out[step < steps ? step : steps - 1], s);
+        }
+        while (start < until) {
+            unsigned step = (start - from) / stepMs;
+            uint64_t end = from + (uint64_t)(step + 1) * stepMs;
+
+            if (step >= steps) {
+                break;
+            }
+            if (end > until) {
+                end = until;
+            }
+            agg_hold(&out[step], s, end - start);
+            start = end;
+        }
+    }
+
+    for (unsigned i = 0; i < steps; i++) {
+        count += agg_point(&out[i], (nowMs - from - (uint64_t)i * stepMs) / 1000, &points[count]);
+    }
+    return count;
+}
+
+/*******************************************************************************
+ * function :    query_level
+ ******************************************************************************/
+/** \brief        Merge the buckets of a level into at most HISTORY_MAX_POINTS
+ *
+ *               Called with the lock held, after hold(nowMs).
+ *
+ * \type         static
+ *
+ * \param[in]    buckets   Buckets to read, ending with the current one
+ * \param[in]    merge     Buckets per point
+ *
+ * \return       Number of points
+ *
+ ******************************************************************************/
+static int query_level(const history_level_t *level, uint64_t nowMs,
+                       unsigned buckets, unsigned merge,
+                       history_point_t points[HISTORY_MAX_POINTS]) {
+    uint64_t last = nowMs / level->widthMs;
+    unsigned groups = (buckets + merge - 1) / merge;
+    uint64_t first = 0;
+    int count = 0;
+
+    if (last + 1 >= (uint64_t)groups * merge) {
+        first = last + 1 - (uint64_t)groups * merge;
+    } else {
+        groups = (last + merge) / merge;
+    }
+
+    for (unsigned g = 0; g < groups; g++) {
+        uint64_t start = first + (uint64_t)g * merge;
+        history_agg_t sum;
+
+        agg_reset(&sum, 0);
+        for (unsigned b = 0; b < merge; b++) {
+            const history_agg_t *agg = &level->buckets[(start + b) % level->count];
+            if (agg->seq == start + b + 1) {
+                agg_merge(&sum, agg);
+            }
+        }
+        uint64_t startMs = start * level->widthMs;
+        count += agg_point(&sum, nowMs > startMs ? (nowMs - startMs) / 1000 : 0, &points[count]);
+    }
+    return count;
+}
+
+/*******************************************************************************
+ * function :    history_query
+ ******************************************************************************/
+/** \brief        Downsampled history of the last seconds
+ *
+ *               Reads at most HISTORY_RAW_SIZE samples or HISTORY_MAX_SCAN
+ *               buckets, however long the range is.
+ *
+ * \type         global
+ *
+ * \param[in]    seconds   Range, clamped to what the coarsest level holds
+ * \param[in]    nowMs     CLOCK_MONOTONIC in ms
+ * \param[out]   step      Seconds per point
+ * \param[out]   points    Points with data, oldest first
+ *
+ * \return       Number of points
+ *
+ ******************************************************************************/
+int history_query(uint32_t seconds, uint64_t nowMs, uint32_t *step,
+                  history_point_t points[HISTORY_MAX_POINTS]) {
+    uint64_t range = (uint64_t)seconds * 1000;
+    uint64_t stepMs = (range + HISTORY_MAX_POINTS - 1) / HISTORY_MAX_POINTS;
+    const history_level_t *level = &levels[LEVELS - 1];
+    unsigned buckets = level->count < HISTORY_MAX_SCAN ? level->count : HISTORY_MAX_SCAN;
+    int count;
+
+    *step = 0;
+    if (seconds == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (hasCurrent && nowMs < heldUntil) {
+        nowMs = heldUntil;
+    }
+    hold(nowMs);
+
+    // Short ranges from the raw samples, in whole seconds per point
+    uint64_t from = nowMs > range ? nowMs - range : 0;
+    stepMs = (stepMs + 999) / 1000 * 1000;
+    if (stepMs < levels[0].widthMs && rawHead > 0
+        && (rawHead <= HISTORY_RAW_SIZE || raw[rawHead & RAW_MASK].ms <= from)) {
+        *step = stepMs / 1000;
+        count = query_raw(from, nowMs, stepMs, points);
+        pthread_mutex_unlock(&lock);
+        return count;
+    }
+
+    // Otherwise the finest level that covers the range in few enough buckets
+    for (unsigned l = 0; l < LEVELS; l++) {
+        uint64_t n = range / levels[l].widthMs + 1;
+        if (n <= levels[l].count && n <= HISTORY_MAX_SCAN) {
+            level = &levels[l];
+            buckets = n;
+            break;
+        }
+    }
+    unsigned merge = (buckets + HISTORY_MAX_POINTS - 1) / HISTORY_MAX_POINTS;
+
+    *step = merge * level->widthMs / 1000;
+    count = query_level(level, nowMs, buckets, merge, points);
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+/*******************************************************************************
+ * function :    history_encode_text
+ ******************************************************************************/
+/** \brief        Answer to <History:seconds>
+ *
+ *               "History:3600;Step:30;P:<age>,<min>,<max>,<avg>,<heat %>,
+ *               <dim1>,<dim2>,<alarms>;P:..." with one P per point, oldest
+ *               first. age is the number of seconds from the start of the
+ *               point to now.
+ *
+ * \type         global
+ *
+ * \return       Length of the text
+ *
+ ******************************************************************************/
+int history_encode_text(uint32_t seconds, char out[], size_t size) {
+    history_point_t points[HISTORY_MAX_POINTS];
+    uint32_t step;
+    int count = history_query(seconds, now_ms(), &step, points);
+    int len = snprintf(out, size, "History:%u;Step:%u", seconds, step);
+
+    for (int i = 0; i < count && len < (int)size; i++) {
+        const history_point_t *p = &points[i];
+        len += snprintf(out + len, size - len, ";P:%u,%.1f,%.1f,%.1f,%d,%d,%d,%u",
+                        p->age, p->tempMin, p->tempMax, p->tempAvg,
+                        (int)(p->heat * 100 + 0.5f), (int)(p->dimRLamp + 0.5f),
+                        (int)(p->dimSLamp + 0.5f), p->alarms);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/*******************************************************************************
+ * function :    sampler_thread
+ ******************************************************************************/
+/** \brief        Record the state on every change and every heartbeat
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void *sampler_thread(void *pdata) {
+    WebhouseState state;
+
+    trace_thread_name("history");
+    for (;;) {
+        getWebhouseState(&state);
+        history_add(&state, now_ms());
+
+        // Appends cost nothing but a memory write until a block is full
+        pthread_mutex_lock(&storeLock);
+        if (store != NULL
+            && tsdb_append(store, wall_ms(), state.temp,
+                           HISTORY_STATE(state.heat, state.alarmTriggered,
+                                         state.dimRLamp, state.dimSLamp)) != 0) {
+            perror("History store");
+        }
+        pthread_mutex_unlock(&storeLock);
+
+        waitStateChange(state.version, HISTORY_HEARTBEAT_MS);
+        metrics_inc(METRIC_WAKEUPS);
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * function :    history_start
+ ******************************************************************************/
+/** \brief        Start the sampler thread; the webhouse must be initialized
+ *
+ * \type         global
+ *
+ * \param[in]    db   Store to append every sample to, NULL for none. Owned
+ *                    by the history from now on, closed by history_stop.
+ *
+ * \return       0 on success, -1 if the thread could not be started
+ *
+ ******************************************************************************/
+int history_start(tsdb_t *db) {
+    pthread_t thread;
+    int result;
+
+    store = db;
+    result = pthread_create(&thread, NULL, sampler_thread, NULL);
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    history_stop
+ ******************************************************************************/
+/** \brief        Write the samples not yet on disk and close the store
+ *
+ *               The in-memory history keeps being recorded.
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void history_stop(void) {
+    pthread_mutex_lock(&storeLock);
+    if (store != NULL && tsdb_close(store) != 0) {
+        perror("History store");
+    }
+    store = NULL;
+    pthread_mutex_unlock(&storeLock);
+}
@@ -0,0 +1,51 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Webhouse.h"
+#include "tsdb.h"
+
+// A sample is taken on every state change, and at least this often
+#define HISTORY_HEARTBEAT_MS   10000
+
+// Raw samples kept for short queries. Power of two.
+#define HISTORY_RAW_SIZE       4096
+
+// Points returned per query at most; longer ranges are downsampled
+#define HISTORY_MAX_POINTS     120
+
+// Aggregate buckets a query may read at most, see history_query
+#define HISTORY_MAX_SCAN       720
+
+// Size of the reply to <History:seconds>, see history_encode_text
+#define HISTORY_TEXT_MAX       (32 + HISTORY_MAX_POINTS * 64)
+
+// State word of a sample in the on-disk store (tsdb), next to the temperature
+#define HISTORY_STATE_HEAT     0x01
+#define HISTORY_STATE_ALARM    0x02
+#define HISTORY_STATE(heat, alarm, dimR, dimS)                                \
+    (((heat) ? HISTORY_STATE_HEAT : 0) | ((alarm) ? HISTORY_STATE_ALARM : 0)  \
+     | ((uint32_t)(dimR) & 0xff) << 8 | ((uint32_t)(dimS) & 0xff) << 16)
+
+// One downsampled point of a query
+typedef struct {
+    uint32_t age;        // seconds from the start of the bucket to now
+    float    tempMin;
+    float    tempMax;
+    float    tempAvg;    // time weighted
+    float    heat;       // fraction of the time the heater was on [0,1]
+    float    dimRLamp;   // time weighted roof lamp level [0,100]
+    float    dimSLamp;   // time weighted stand lamp level [0,100]
+    uint32_t alarms;     // alarm events (sensor became active)
+} history_point_t;
+
+extern int  history_start       (tsdb_t *store);
+extern void history_stop        (void);
+extern void history_add         (const WebhouseState *state, uint64_t nowMs);
+extern int  history_query       (uint32_t seconds, uint64_t nowMs, uint32_t *step,
+                                 history_point_t points[HISTORY_MAX_POINTS]);
+extern int  history_encode_text (uint32_t seconds, char out[], size_t size);
+
+#endif // HISTORY_H
@@ -0,0 +1,483 @@
+/******************************************************************************/
+/** \file       httpapi.c
+ *******************************************************************************
+ *
+ * \brief      REST API for scripts, on the port of the dashboard
+ *
+ *             GET  /api/state          state of all devices as JSON
+ *             POST /api/devices/{id}   switch or dim a device, answered with
+ *                                      the new state
+ *
+ *             Devices and request bodies:
+ *               heat                   {"on":true} or {"target":22} (degree C)
+ *               led1, led2, tv, alarm  {"on":true}
+ *               dimRLamp, dimSLamp     {"level":50} (0..100)
+ *
+ *             Other than the dashboard files, the API is HTTP/1.1 with
+ *             keep-alive: a script that polls the state or switches a few
+ *             devices keeps its connection, and may pipeline the requests.
+ *             A request is parsed where it was received, in the receive
+ *             buffer of the connection; http_request_t only points into it.
+ *             The responses go into the send queue of the connection, like
+ *             WebSocket frames, and the event loop sends them in order.
+ *
+ *             The state is formatted straight into the send queue
+ *             (tx_queue_reserve, status_encode_json), without a JSON tree
+ *             for the frequent GET /api/state. Only the small POST bodies are
+ *             parsed with jansson.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * http_api_is_request
+ * http_parse_request
+ * http_api_serve
+ * http_api_error
+ * * functions  local:
+ * has_token
+ * parse_length
+ * reason
+ * send_json
+ * device_command
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "jansson.h"
+#include "httpapi.h"
+#include "status.h"
+#include "Webhouse.h"
+#include "metrics.h"
+#include "logger.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+// Room for Content-Length, filled in once the body is written: the value is
+// right aligned, the spaces before it are optional whitespace (RFC 9110)
+#define HTTP_LENGTH_FIELD     "      "
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    const char  *id;
+    CommandType  on;               // {"on":true}, CMD_UNKNOWN: none
+    CommandType  off;              // {"on":false}
+    const char  *key;              // member with a value, NULL: none
+    CommandType  set;              // command for the value
+    long         min;
+    long         max;
+} http_device_t;
+
+//----- Data -------------------------------------------------------------------
+static const http_device_t devices[] = {
+    { "heat",     CMD_HEAT_ON,  CMD_HEAT_OFF,  "target", CMD_SET_TEMP, 0, 40  },
+    { "led1",     CMD_L1_ON,    CMD_L1_OFF,    NULL,     CMD_UNKNOWN,  0, 0   },
+    { "led2",     CMD_L2_ON,    CMD_L2_OFF,    NULL,     CMD_UNKNOWN,  0, 0   },
+    { "tv",       CMD_TV_ON,    CMD_TV_OFF,    NULL,     CMD_UNKNOWN,  0, 0   },
+    { "alarm",    CMD_ALARM_ON, CMD_ALARM_OFF, NULL,     CMD_UNKNOWN,  0, 0   },
+    { "dimRLamp", CMD_UNKNOWN,  CMD_UNKNOWN,   "level",  CMD_DIM1,     0, 100 },
+    { "dimSLamp", CMD_UNKNOWN,  CMD_UNKNOWN,   "level",  CMD_DIM2,     0, 100 },
+};
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    http_api_is_request
+ ******************************************************************************/
+/** \brief        Whether the request in the buffer is for the API, by the
+ *               target of its request line
+ *
+ * \type         global
+ *
+ * \param[in]    request   Request, NUL terminated
+ *
+ ******************************************************************************/
+int http_api_is_request(const char request[]) {
+    const char *target = strchr(request, ' ');
+    const char *end = strpbrk(request, "\r\n");
+
+    return target != NULL && (end == NULL || target < end)
+           && strncmp(target + 1, HTTP_API_PREFIX, strlen(HTTP_API_PREFIX)) == 0;
+}
+
+/*******************************************************************************
+ * function :    has_token
+ ******************************************************************************/
+/** \brief        Whether a comma separated header value contains a token,
+ *               ignoring case ("Connection: keep-alive, Upgrade")
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int has_token(const char *value, size_t len, const char *token) {
+    size_t tokenLen = strlen(token);
+    const char *end = value + len;
+
+    while (value < end) {
+        const char *comma = memchr(value, ',', end - value);
+        const char *next = comma != NULL ? comma : end;
+        const char *last = next;
+
+        while (value < next && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t')) {
+            last--;
+        }
+        if ((size_t)(last - value) == tokenLen && strncasecmp(value, token, tokenLen) == 0) {
+            return TRUE;
+        }
+        value = next + 1;
+    }
+    return FALSE;
+}
+
+/*******************************************************************************
+ * function :    parse_length
+ ******************************************************************************/
+/** \brief        Content-Length value: digits only, no sign, no list
+ *
+ * \type         static
+ *
+ * \return       0, -1 if it is not a number or unreasonably large
+ *
+ ******************************************************************************/
+static int parse_length(const char *value, size_t len, size_t *length) {
+    size_t n = 0;
+
+    if (len == 0 || len > 9) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return -1;
+        }
+        n = n * 10 + (size_t)(value[i] - '0');
+    }
+    *length = n;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    http_parse_request
+ ******************************************************************************/
+/** \brief        Parse the request at the start of buf, in place
+ *
+ *               Only the request line and the headers that matter for the
+ *               API are looked at: Content-Length, Connection, and
+ *               Transfer-Encoding, which is refused. HTTP/1.1 keeps the
+ *               connection unless "Connection: close", HTTP/1.0 only with
+ *               "Connection: keep-alive".
+ *
+ * \type         global
+ *
+ * \param[in]    buf   Received bytes, possibly several pipelined requests
+ * \param[in]    len   Number of bytes
+ * \param[out]   req   Request, pointing into buf
+ *
+ * \return       1 if the request is complete (req->length bytes), 0 if more
+ *               is needed, -1 if it is malformed (req->status)
+ *
+ ******************************************************************************/
+int http_parse_request(const char buf[], size_t len, http_request_t *req) {
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    const char *lineEnd;
+    const char *space;
+    const char *version;
+    size_t contentLength = 0;
+    int close = FALSE;
+    int keepAlive = FALSE;
+
+    memset(req, 0, sizeof(*req));
+    if (end == NULL) {
+        return 0;
+    }
+    req->status = 400;
+
+    // Request line: method SP target SP HTTP/1.x
+    lineEnd = memmem(buf, end + 2 - buf, "\r\n", 2);
+    space = memchr(buf, ' ', lineEnd - buf);
+    if (space == NULL || space == buf) {
+        return -1;
+    }
+    req->method = buf;
+    req->methodLen = space - buf;
+    req->target = space + 1;
+    space = memchr(req->target, ' ', lineEnd - req->target);
+    if (space == NULL || space == req->target) {
+        return -1;
+    }
+    req->targetLen = space - req->target;
+    version = space + 1;
+    if (lineEnd - version != 8 || memcmp(version, "HTTP/1.", 7) != 0
+            || (version[7] != '0' && version[7] != '1')) {
+        return -1;
+    }
+    req->minor = version[7] - '0';
+
+    // Header lines, up to the empty line at end + 2
+    for (const char *line = lineEnd + 2; line < end + 2; line = lineEnd + 2) {
+        lineEnd = memmem(line, end + 2 - line, "\r\n", 2);
+        const char *colon = memchr(line, ':', lineEnd - line);
+        if (colon == NULL) {
+            return -1;
+        }
+        size_t nameLen = colon - line;
+        const char *value = colon + 1;
+        while (value < lineEnd && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        size_t valueLen = lineEnd - value;
+        while (valueLen > 0 && (value[valueLen - 1] == ' ' || value[valueLen - 1] == '\t')) {
+            valueLen--;
+        }
+
+#define HEADER_IS(name) (nameLen == strlen(name) && strncasecmp(line, name, nameLen) == 0)
+        if (HEADER_IS("Content-Length")) {
+            if (parse_length(value, valueLen, &contentLength) < 0) {
+                return -1;
+            }
+        } else if (HEADER_IS("Transfer-Encoding")) {
+            req->status = 501;
+            return -1;
+        } else if (HEADER_IS("Connection")) {
+            close |= has_token(value, valueLen, "close");
+            keepAlive |= has_token(value, valueLen, "keep-alive");
+        }
+#undef HEADER_IS
+    }
+
+    if (contentLength > HTTP_API_BODY_MAX) {
+        req->status = 413;
+        return -1;
+    }
+    req->status = 0;
+    req->keepAlive = !close && (req->minor >= 1 || keepAlive);
+    req->body = end + 4;
+    req->bodyLen = contentLength;
+    req->length = (size_t)(req->body - buf) + contentLength;
+    return len >= req->length ? 1 : 0;
+}
+
+/*******************************************************************************
+ * function :    reason
+ ******************************************************************************/
+static const char *reason(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Content Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 501: return "Not Implemented";
+    default:  return "Error";
+    }
+}
+
+/*******************************************************************************
+ * function :    send_json
+ ******************************************************************************/
+/** \brief        Queue a response with the state, or an error, as JSON body
+ *
+ *               Head and body are written in place into the send queue;
+ *               the body is formatted behind the head, and its length then
+ *               filled into the Content-Length field left blank.
+ *
+ * \type         static
+ *
+ * \param[out]   tx        Send queue of the connection
+ * \param[in]    req       Request answered, for the Connection header
+ * \param[in]    status    HTTP status
+ * \param[in]    headers   More header lines, each ending with CRLF, or ""
+ * \param[in]    state     State for the body, NULL for an error
+ * \param[in]    error     Error message for the body
+ *
+ * \return       status, -1 if nothing could be queued
+ *
+ ******************************************************************************/
+static int send_json(tx_queue_t *tx, const http_request_t *req, int status,
+                     const char *headers, const WebhouseState *state, const char *error) {
+    char *out = tx_queue_reserve(tx, HTTP_API_RESPONSE_MAX);
+    char digits[16];
+    int head;
+    int body;
+
+    if (out == NULL) {
+        return -1;
+    }
+    head = snprintf(out, HTTP_API_RESPONSE_MAX,
+                    "HTTP/1.1 %d %s\r\n"
+                    "Content-Type: application/json\r\n"
+                    "Cache-Control: no-store\r\n"
+                    "%s%s"
+                    "Content-Length:" HTTP_LENGTH_FIELD "\r\n"
+                    "\r\n",
+                    status, reason(status), headers,
+                    !req->keepAlive ? "Connection: close\r\n"
+                    : req->minor == 0 ? "Connection: keep-alive\r\n" : "");
+    if (head < 0 || head >= HTTP_API_RESPONSE_MAX) {
+        tx_queue_commit(tx, 0);
+        return -1;
+    }
+    if (state != NULL) {
+        body = status_encode_json(state, out + head, HTTP_API_RESPONSE_MAX - head);
+    } else {
+        body = snprintf(out + head, HTTP_API_RESPONSE_MAX - head, "{\"error\":\"%s\"}", error);
+    }
+    if (body < 0 || head + body >= HTTP_API_RESPONSE_MAX) {
+        tx_queue_commit(tx, 0);
+        return -1;
+    }
+
+    snprintf(digits, sizeof(digits), "%*d", (int)strlen(HTTP_LENGTH_FIELD), body);
+    memcpy(out + head - strlen(HTTP_LENGTH_FIELD "\r\n\r\n"), digits, strlen(HTTP_LENGTH_FIELD));
+    tx_queue_commit(tx, head + body);
+    return status;
+}
+
+/*******************************************************************************
+ * function :    device_command
+ ******************************************************************************/
+/** \brief        The command for POST /api/devices/{id}
+ *
+ * \type         static
+ *
+ * \param[in]    id      Device id, from the path
+ * \param[in]    idLen   Length of the id
+ * \param[in]    req     Request, with the JSON body
+ * \param[out]   cmd     Command
+ * \param[out]   error   Error message, unless 200
+ *
+ * \return       HTTP status: 200, 404 for an unknown device, 400 for a bad body
+ *
+ ******************************************************************************/
+static int device_command(const char *id, size_t idLen, const http_request_t *req,
+                          Command *cmd, const char **error) {
+    const http_device_t *device = NULL;
+    json_error_t jsonError;
+    json_t *root;
+    json_t *on;
+    json_t *value;
+    int status = 400;
+
+    for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+        if (strlen(devices[i].id) == idLen && memcmp(devices[i].id, id, idLen) == 0) {
+            device = &devices[i];
+            break;
+        }
+    }
+    if (device == NULL) {
+        *error = "unknown device";
+        return 404;
+    }
+
+    memset(cmd, 0, sizeof(*cmd));
+    root = json_loadb(req->body, req->bodyLen, 0, &jsonError);
+    if (!json_is_object(root)) {
+        *error = "body is not a JSON object";
+        json_decref(root);
+        return 400;
+    }
+    on = json_object_get(root, "on");
+    value = device->key != NULL ? json_object_get(root, device->key) : NULL;
+    if (device->on != CMD_UNKNOWN && json_is_boolean(on) && value == NULL) {
+        cmd->type = json_is_true(on) ? device->on : device->off;
+        status = 200;
+    } else if (json_is_integer(value) && on == NULL
+               && json_integer_value(value) >= device->min
+               && json_integer_value(value) <= device->max) {
+        cmd->type = device->set;
+        cmd->value = (long)json_integer_value(value);
+        status = 200;
+    } else {
+        *error = "invalid value for the device";
+    }
+    json_decref(root);
+    return status;
+}
+
+/*******************************************************************************
+ * function :    http_api_serve
+ ******************************************************************************/
+/** \brief        Answer a complete API request
+ *
+ * \type         global
+ *
+ * \param[in]    req   Request, parsed by http_parse_request
+ * \param[out]   tx    Send queue of the connection, for the response
+ *
+ * \return       HTTP status of the response, -1 if it could not be queued
+ *
+ ******************************************************************************/
+int http_api_serve(const http_request_t *req, tx_queue_t *tx) {
+    size_t prefixLen = strlen(HTTP_API_PREFIX);
+    const char *path = req->target + prefixLen;
+    size_t pathLen;
+    WebhouseState state;
+    Command cmd;
+    const char *error;
+    int status;
+
+    metrics_inc(METRIC_API_REQUESTS);
+    if (req->targetLen < prefixLen || memcmp(req->target, HTTP_API_PREFIX, prefixLen) != 0) {
+        return send_json(tx, req, 404, "", NULL, "not found");
+    }
+    pathLen = req->targetLen - prefixLen;
+    for (size_t i = 0; i < pathLen; i++) {
+        if (path[i] == '?') {
+            pathLen = i;
+            break;
+        }
+    }
+
+#define METHOD_IS(name) (req->methodLen == strlen(name) && memcmp(req->method, name, req->methodLen) == 0)
+    if (pathLen == 5 && memcmp(path, "state", 5) == 0) {
+        if (!METHOD_IS("GET")) {
+            return send_json(tx, req, 405, "Allow: GET\r\n", NULL, "method not allowed");
+        }
+        getWebhouseState(&state);
+        return send_json(tx, req, 200, "", &state, NULL);
+    }
+    if (pathLen > 8 && memcmp(path, "devices/", 8) == 0) {
+        if (!METHOD_IS("POST")) {
+            return send_json(tx, req, 405, "Allow: POST\r\n", NULL, "method not allowed");
+        }
+        status = device_command(path + 8, pathLen - 8, req, &cmd, &error);
+        if (status != 200) {
+            return send_json(tx, req, status, "", NULL, error);
+        }
+        LOG_INFO("API %.*s -> %s", (int)pathLen, path, commandName(cmd.type));
+        metrics_command(cmd.type);
+        applyCommand(&cmd);
+        getWebhouseState(&state);
+        return send_json(tx, req, 200, "", &state, NULL);
+    }
+#undef METHOD_IS
+
+    return send_json(tx, req, 404, "", NULL, "not found");
+}
+
+/*******************************************************************************
+ * function :    http_api_error
+ ******************************************************************************/
+/** \brief        Queue an error response for a request that could not be
+ *               parsed; the connection is closed after it
+ *
+ * \type         global
+ *
+ * \return       status, -1 if nothing could be queued
+ *
+ ******************************************************************************/
+int http_api_error(const http_request_t *req, tx_queue_t *tx, int status) {
+    http_request_t closing = *req;
+
+    closing.keepAlive = FALSE;
+    return send_json(tx, &closing, status, "", NULL, reason(status));
+}
@@ -0,0 +1,36 @@
+#ifndef HTTPAPI_H
+#define HTTPAPI_H
+
+#include <stddef.h>
+
+#include "txqueue.h"
+#include "command.h"
+
+// REST API on the WebSocket port, with keep-alive, see httpapi.c
+#define HTTP_API_PREFIX        "/api/"
+#define HTTP_API_BODY_MAX      256       // largest request body
+#define HTTP_API_RESPONSE_MAX  512       // head and body of a response
+
+// One request, parsed in place: the pointers point into the receive buffer
+typedef struct {
+    const char *method;
+    size_t      methodLen;
+    const char *target;                  // path and query
+    size_t      targetLen;
+    const char *body;
+    size_t      bodyLen;
+    int         minor;                   // HTTP/1.<minor>
+    int         keepAlive;               // the connection stays open
+    size_t      length;                  // head and body
+    int         status;                  // why it could not be parsed
+} http_request_t;
+
+extern int http_api_is_request (const char request[]);
+extern int http_parse_request  (const char buf[], size_t len, http_request_t *req);
+extern int http_api_serve      (const http_request_t *req, tx_queue_t *tx);
+extern int http_api_error      (const http_request_t *req, tx_queue_t *tx, int status);
+
+// The application (main.c): controls the hardware for a device command
+extern void applyCommand(const Command *cmd);
+
+#endif // HTTPAPI_H
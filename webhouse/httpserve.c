@@ -0,0 +1,691 @@
+/******************************************************************************/
+/** \file       httpserve.c
+ *******************************************************************************
+ *
+ * \brief      Plain HTTP/1.1 file server for the dashboard assets in static/
+ *
+ *             Requests that are not a WebSocket upgrade are answered here.
+ *             Nothing is sent from here: the head of a response is queued in
+ *             the send queue of the connection, and the body (http_body_t)
+ *             is sent behind it by the event loop as the socket takes it,
+ *             files zero-copy with sendfile() (http_body_send). A loop
+ *             without sendfile (io_uring) has the body copied into its send
+ *             queue instead, a few chunks at a time (http_body_queue).
+ *             If the client accepts
+ *             it, a precompressed "<file>.br" or "<file>.gz" next to the
+ *             original is sent instead. Every response carries a strong ETag
+ *             so a reload of the panel is answered with 304 Not Modified.
+ *             By default the copies compiled into the binary are served
+ *             (http_serve_embedded); a directory given with -s is served
+ *             from disk instead (http_serve_static).
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * http_is_websocket_upgrade
+ * http_serve_static
+ * http_serve_embedded
+ * http_path_is
+ * http_serve_metrics
+ * http_serve_trace
+ * http_body_init
+ * http_body_free
+ * http_body_send
+ * http_body_queue
+ * * functions  local:
+ * find_header
+ * accepts_encoding
+ * etag_matches
+ * queue_status
+ * parse_path
+ * queue_error
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "httpserve.h"
+#include "mimetype.h"
+#include "assets.h"
+#include "metrics.h"
+#include "trace.h"
+
+//----- Macros -----------------------------------------------------------------
+#define HTTP_HEADER_SIZE 512
+#define HTTP_ETAG_SIZE   64
+#define HTTP_METRICS_SIZE 32768
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    const char *ext;       /* Encoding file suffix, e.g. ".gz".  */
+    const char *token;     /* Accept-Encoding token.              */
+} http_encoding_t;
+
+//----- Data -------------------------------------------------------------------
+/* Preferred first: brotli is smaller than gzip for text assets. */
+static const http_encoding_t encodings[] = {
+    { ".br", "br"   },
+    { ".gz", "gzip" },
+};
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    find_header
+ ******************************************************************************/
+/** \brief        Look up a request header (case-insensitive name)
+ *
+ * \type         static
+ *
+ * \param[in]    request   NUL terminated request head
+ * \param[in]    name      Header name without colon
+ * \param[out]   len       Length of the value (up to CR/LF)
+ *
+ * \return       Pointer to the first value character, NULL if not present
+ *
+ ******************************************************************************/
+static const char *find_header(const char *request, const char *name, size_t *len) {
+    size_t nameLen = strlen(name);
+    const char *line = strstr(request, "\r\n");
+
+    while (line != NULL && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        if (strncasecmp(line, name, nameLen) == 0 && line[nameLen] == ':') {
+            const char *value = line + nameLen + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            *len = strcspn(value, "\r\n");
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * function :    accepts_encoding
+ ******************************************************************************/
+/** \brief        Check whether an Accept-Encoding value allows a coding
+ *               ("gzip;q=0" explicitly refuses it)
+ *
+ * \type         static
+ *
+ * \return       1 if accepted, 0 otherwise
+ *
+ ******************************************************************************/
+static int accepts_encoding(const char *value, size_t len, const char *token) {
+    size_t tokenLen = strlen(token);
+    const char *end = value + len;
+    const char *p = value;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+        const char *item = p;
+        while (p < end && *p != ',') {
+            p++;
+        }
+        size_t itemLen = strcspn(item, ";, \r\n");
+        if (itemLen == tokenLen && strncasecmp(item, token, tokenLen) == 0) {
+            const char *q = memmem(item, p - item, "q=", 2);
+            return (q == NULL || strtod(q + 2, NULL) > 0.0);
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    etag_matches
+ ******************************************************************************/
+/** \brief        Compare our ETag against an If-None-Match list
+ *
+ * \type         static
+ *
+ * \return       1 if the client copy is current, 0 otherwise
+ *
+ ******************************************************************************/
+static int etag_matches(const char *value, size_t len, const char *etag) {
+    size_t etagLen = strlen(etag);
+
+    if (len == 1 && value[0] == '*') {
+        return 1;
+    }
+    return memmem(value, len, etag, etagLen) != NULL;
+}
+
+/*******************************************************************************
+ * function :    queue_status
+ ******************************************************************************/
+/** \brief        Queue a body-less error/status response
+ *
+ * \type         static
+ *
+ * \return       The status code, -1 if out of memory
+ *
+ ******************************************************************************/
+static int queue_status(tx_queue_t *tx, int status, const char *reason) {
+    char header[HTTP_HEADER_SIZE];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 %d %s\r\n"
+                       "Content-Length: 0\r\n"
+                       "Connection: close\r\n\r\n",
+                       status, reason);
+    return tx_queue_append(tx, header, len) < 0 ? -1 : status;
+}
+
+/*******************************************************************************
+ * function :    http_is_websocket_upgrade
+ ******************************************************************************/
+/** \brief        Check whether a GET request asks for a WebSocket upgrade
+ *
+ * \type         global
+ *
+ * \param[in]    request   NUL terminated request head
+ *
+ * \return       1 for an upgrade request, 0 for a plain HTTP request
+ *
+ ******************************************************************************/
+int http_is_websocket_upgrade(const char request[]) {
+    size_t len;
+    const char *value = find_header(request, "Upgrade", &len);
+
+    return (value != NULL && len >= 9 && strncasecmp(value, "websocket", 9) == 0);
+}
+
+/*******************************************************************************
+ * function :    parse_path
+ ******************************************************************************/
+/** \brief        Extract and validate the path of a GET/HEAD request line
+ *
+ *               "/" maps to "/index.html"; queries and fragments are cut off.
+ *
+ * \type         static
+ *
+ * \param[in]    request   NUL terminated request head
+ * \param[out]   path      Buffer for the path
+ * \param[in]    size      Size of path
+ * \param[out]   isHead    1 for a HEAD request
+ *
+ * \return       0 on success, otherwise the HTTP error status to send
+ *
+ ******************************************************************************/
+static int parse_path(const char *request, char *path, size_t size, int *isHead) {
+    size_t len;
+
+    // Request line: METHOD SP PATH[?QUERY] SP VERSION
+    if (strncmp(request, "GET ", 4) == 0) {
+        *isHead = 0;
+    } else if (strncmp(request, "HEAD ", 5) == 0) {
+        *isHead = 1;
+    } else {
+        return 405;
+    }
+
+    const char *uri = strchr(request, ' ') + 1;
+    len = strcspn(uri, " ?#\r\n");
+    if (len == 0 || uri[0] != '/' || len >= size - 16) {
+        return 400;
+    }
+    memcpy(path, uri, len);
+    path[len] = '\0';
+    if (strstr(path, "..") != NULL) {
+        return 403;
+    }
+    if (strcmp(path, "/") == 0) {
+        strcpy(path, "/index.html");
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    queue_error
+ ******************************************************************************/
+/** \brief        Queue the status returned by parse_path
+ *
+ * \type         static
+ *
+ * \return       The status code, -1 if out of memory
+ *
+ ******************************************************************************/
+static int queue_error(tx_queue_t *tx, int status) {
+    switch (status) {
+    case 400: return queue_status(tx, 400, "Bad Request");
+    case 403: return queue_status(tx, 403, "Forbidden");
+    case 405: return queue_status(tx, 405, "Method Not Allowed");
+    case 406: return queue_status(tx, 406, "Not Acceptable");
+    default:  return queue_status(tx, 404, "Not Found");
+    }
+}
+
+/*******************************************************************************
+ * function :    http_serve_embedded
+ ******************************************************************************/
+/** \brief        Answer a GET/HEAD request from the assets compiled into the
+ *               binary (see mkassets.c)
+ *
+ *               The complete response, headers included, is prebuilt, so this
+ *               is a table lookup, and the response is sent from where it
+ *               is, as the body: no file I/O and no compression at run
+ *               time. The bodies are gzip only; a client that explicitly
+ *               refuses gzip gets 406.
+ *
+ * \type         global
+ *
+ * \param[in]    tx        Send queue of the connection
+ * \param[out]   body      Body to send behind tx
+ * \param[in]    request   NUL terminated request head
+ *
+ * \return       HTTP status code, -1 if out of memory
+ *
+ ******************************************************************************/
+int http_serve_embedded(tx_queue_t *tx, http_body_t *body, const char request[]) {
+    char path[PATH_MAX];
+    const char *value;
+    size_t len;
+    int isHead;
+    int status;
+
+    status = parse_path(request, path, sizeof(path), &isHead);
+    if (status != 0) {
+        return queue_error(tx, status);
+    }
+
+    for (size_t i = 0; i < http_assets_count; i++) {
+        const http_asset_t *asset = &http_assets[i];
+        if (strcmp(asset->path, path) != 0) {
+            continue;
+        }
+
+        value = find_header(request, "If-None-Match", &len);
+        if (value != NULL && etag_matches(value, len, asset->etag)) {
+            return tx_queue_append(tx, asset->notModified, asset->notModifiedLen) < 0 ? -1 : 304;
+        }
+
+        value = find_header(request, "Accept-Encoding", &len);
+        if (value != NULL && !accepts_encoding(value, len, "gzip")) {
+            return queue_error(tx, 406);
+        }
+
+        body->data = asset->response;
+        body->offset = 0;
+        body->end = isHead ? asset->headerLen : asset->responseLen;
+        return 200;
+    }
+
+    return queue_error(tx, 404);
+}
+
+/*******************************************************************************
+ * function :    http_serve_static
+ ******************************************************************************/
+/** \brief        Answer a GET/HEAD request with a file below root
+ *
+ *               "/" maps to "/index.html". The connection is answered with
+ *               "Connection: close"; the caller closes the socket after the
+ *               body. The file stays open in the body until then.
+ *
+ * \type         global
+ *
+ * \param[in]    tx        Send queue of the connection
+ * \param[out]   body      Body to send behind tx
+ * \param[in]    request   NUL terminated request head
+ * \param[in]    root      Document root directory
+ *
+ * \return       HTTP status code, -1 if out of memory
+ *
+ ******************************************************************************/
+int http_serve_static(tx_queue_t *tx, http_body_t *body, const char request[], const char root[]) {
+    char path[PATH_MAX];
+    char filePath[PATH_MAX];
+    char etag[HTTP_ETAG_SIZE];
+    char header[HTTP_HEADER_SIZE];
+    const char *encoding = NULL;
+    const char *value;
+    struct stat st;
+    size_t len;
+    int isHead;
+    int status;
+    int fd = -1;
+
+    status = parse_path(request, path, sizeof(path), &isHead);
+    if (status != 0) {
+        return queue_error(tx, status);
+    }
+
+    // Prefer a precompressed variant if the client accepts it
+    value = find_header(request, "Accept-Encoding", &len);
+    for (size_t i = 0; value != NULL && i < sizeof(encodings) / sizeof(encodings[0]); i++) {
+        if (!accepts_encoding(value, len, encodings[i].token)) {
+            continue;
+        }
+        snprintf(filePath, sizeof(filePath), "%s%s%s", root, path, encodings[i].ext);
+        fd = open(filePath, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            encoding = encodings[i].token;
+            break;
+        }
+    }
+    if (fd < 0) {
+        snprintf(filePath, sizeof(filePath), "%s%s", root, path);
+        fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        return queue_error(tx, 404);
+    }
+
+    // Strong validator: identity of the exact byte sequence that is sent
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx%s%s\"",
+             (unsigned long)st.st_ino, (unsigned long)st.st_size,
+             (unsigned long)(st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec),
+             encoding ? "-" : "", encoding ? encoding : "");
+
+    const char *cacheControl = strcmp(path, "/index.html") == 0 ? "no-cache" : NULL;
+    char maxAge[32];
+    if (cacheControl == NULL) {
+        snprintf(maxAge, sizeof(maxAge), "max-age=%d", HTTP_STATIC_MAX_AGE);
+        cacheControl = maxAge;
+    }
+
+    value = find_header(request, "If-None-Match", &len);
+    if (value != NULL && etag_matches(value, len, etag)) {
+        close(fd);
+        len = snprintf(header, sizeof(header),
+                       "HTTP/1.1 304 Not Modified\r\n"
+                       "ETag: %s\r\n"
+                       "Cache-Control: %s\r\n"
+                       "Vary: Accept-Encoding\r\n"
+                       "Connection: close\r\n\r\n",
+                       etag, cacheControl);
+        return tx_queue_append(tx, header, len) < 0 ? -1 : 304;
+    }
+
+    len = snprintf(header, sizeof(header),
+                   "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: %s\r\n"
+                   "Content-Length: %ld\r\n"
+                   "%s%s%s"
+                   "ETag: %s\r\n"
+                   "Cache-Control: %s\r\n"
+                   "Vary: Accept-Encoding\r\n"
+                   "Connection: close\r\n\r\n",
+                   mime_type(path), (long)st.st_size,
+                   encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+                   encoding ? "\r\n" : "",
+                   etag, cacheControl);
+
+    if (tx_queue_append(tx, header, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (isHead) {
+        close(fd);
+        return 200;
+    }
+
+    // Body straight from the page cache, see http_body_send
+    body->fd = fd;
+    body->offset = 0;
+    body->end = st.st_size;
+    return 200;
+}
+
+/*******************************************************************************
+ * function :    http_path_is
+ ******************************************************************************/
+/** \brief        Check the path of a GET/HEAD request, query ignored
+ *
+ * \type         global
+ *
+ * \return       1 if the request is for path, 0 otherwise
+ *
+ ******************************************************************************/
+int http_path_is(const char request[], const char path[]) {
+    char requested[PATH_MAX];
+    int isHead;
+
+    return parse_path(request, requested, sizeof(requested), &isHead) == 0
+           && strcmp(requested, path) == 0;
+}
+
+/*******************************************************************************
+ * function :    http_serve_metrics
+ ******************************************************************************/
+/** \brief        Answer a scrape of /metrics in the Prometheus text format
+ *
+ * \type         global
+ *
+ * \param[in]    tx        Send queue of the connection
+ * \param[out]   body      Body to send behind tx
+ * \param[in]    request   NUL terminated request head
+ *
+ * \return       HTTP status code, -1 if out of memory
+ *
+ ******************************************************************************/
+int http_serve_metrics(tx_queue_t *tx, http_body_t *body, const char request[]) {
+    char header[HTTP_HEADER_SIZE];
+    char path[PATH_MAX];
+    int isHead;
+    int status;
+
+    status = parse_path(request, path, sizeof(path), &isHead);
+    if (status != 0) {
+        return queue_error(tx, status);
+    }
+
+    char *text = malloc(HTTP_METRICS_SIZE);
+    int bodyLen = text ? metrics_render(text, HTTP_METRICS_SIZE) : -1;
+    if (bodyLen < 0) {
+        free(text);
+        return queue_status(tx, 500, "Internal Server Error");
+    }
+
+    int headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                             "Content-Length: %d\r\n"
+                             "Cache-Control: no-store\r\n"
+                             "Connection: close\r\n\r\n",
+                             bodyLen);
+    if (tx_queue_append(tx, header, headerLen) < 0) {
+        free(text);
+        return -1;
+    }
+    body->data = (const uint8_t *)text;
+    body->owned = text;
+    body->offset = 0;
+    body->end = isHead ? 0 : bodyLen;
+    return 200;
+}
+
+/*******************************************************************************
+ * function :    http_serve_trace
+ ******************************************************************************/
+/** \brief        Answer GET /trace with the trace rings as Chrome trace JSON
+ *
+ *               Save the body as a .json file and open it in
+ *               ui.perfetto.dev or chrome://tracing.
+ *
+ * \type         global
+ *
+ * \param[in]    tx        Send queue of the connection
+ * \param[out]   body      Body to send behind tx
+ * \param[in]    request   NUL terminated request head
+ *
+ * \return       HTTP status code, -1 if out of memory
+ *
+ ******************************************************************************/
+int http_serve_trace(tx_queue_t *tx, http_body_t *body, const char request[]) {
+    char header[HTTP_HEADER_SIZE];
+    char path[PATH_MAX];
+    char *json = NULL;
+    size_t bodyLen = 0;
+    int isHead;
+    int status;
+
+    status = parse_path(request, path, sizeof(path), &isHead);
+    if (status != 0) {
+        return queue_error(tx, status);
+    }
+
+    FILE *out = open_memstream(&json, &bodyLen);
+    if (out == NULL) {
+        return queue_status(tx, 500, "Internal Server Error");
+    }
+    status = trace_write_json(out);
+    if (fclose(out) != 0 || status < 0) {
+        free(json);
+        return queue_status(tx, 500, "Internal Server Error");
+    }
+
+    int headerLen = snprintf(header, sizeof(header),
+                             "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: application/json\r\n"
+                             "Content-Length: %zu\r\n"
+                             "Content-Disposition: attachment; filename=\"webhouse-trace.json\"\r\n"
+                             "Cache-Control: no-store\r\n"
+                             "Connection: close\r\n\r\n",
+                             bodyLen);
+    if (tx_queue_append(tx, header, headerLen) < 0) {
+        free(json);
+        return -1;
+    }
+    body->data = (const uint8_t *)json;
+    body->owned = json;
+    body->offset = 0;
+    body->end = isHead ? 0 : (off_t)bodyLen;
+    return 200;
+}
+
+/*******************************************************************************
+ * function :    http_body_init
+ ******************************************************************************/
+/** \brief        Set up an empty body
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void http_body_init(http_body_t *body) {
+    body->data = NULL;
+    body->owned = NULL;
+    body->fd = -1;
+    body->offset = 0;
+    body->end = 0;
+}
+
+/*******************************************************************************
+ * function :    http_body_free
+ ******************************************************************************/
+/** \brief        Close the file of a body, free its memory, and empty it
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void http_body_free(http_body_t *body) {
+    if (body->fd >= 0) {
+        close(body->fd);
+    }
+    free(body->owned);
+    http_body_init(body);
+}
+
+/*******************************************************************************
+ * function :    http_body_send
+ ******************************************************************************/
+/** \brief        Send as much of the body as the socket takes right now
+ *
+ *               For a non-blocking socket whose send queue is empty: files
+ *               go with sendfile(), straight from the page cache, memory
+ *               with send(). The offset is advanced by what was sent, so
+ *               the next call, when the socket is writable again, goes on
+ *               from there.
+ *
+ * \type         global
+ *
+ * \return       0 if all was sent or the socket is full, -1 on error
+ *
+ ******************************************************************************/
+int http_body_send(http_body_t *body, int sock) {
+    while (body->offset < body->end) {
+        size_t len = http_body_left(body);
+        ssize_t n;
+
+        if (body->data != NULL) {
+            n = send(sock, body->data + body->offset, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) {
+                body->offset += n;
+            }
+        } else {
+            n = sendfile(sock, body->fd, &body->offset, len);
+        }
+        metrics_inc(METRIC_NET_SYSCALLS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;             // the file was truncated meanwhile
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    http_body_queue
+ ******************************************************************************/
+/** \brief        Copy the next part of the body into the send queue
+ *
+ *               For an event loop that only sends from its queue: up to
+ *               max bytes are queued, one chunk per message, and the offset
+ *               advanced; the loop calls this again once they are sent.
+ *
+ * \type         global
+ *
+ * \return       Bytes queued, -1 on error (out of memory, file not readable)
+ *
+ ******************************************************************************/
+int http_body_queue(http_body_t *body, tx_queue_t *tx, size_t max) {
+    size_t queued = 0;
+
+    while (body->offset < body->end && queued < max) {
+        size_t len = http_body_left(body);
+        if (len > TX_RESERVE_MAX) {
+            len = TX_RESERVE_MAX;
+        }
+        uint8_t *room = tx_queue_reserve(tx, len);
+        if (room == NULL) {
+            return -1;
+        }
+
+        ssize_t n = len;
+        if (body->data != NULL) {
+            memcpy(room, body->data + body->offset, len);
+        } else {
+            n = pread(body->fd, room, len, body->offset);
+            if (n <= 0) {
+                tx_queue_commit(tx, 0);
+                return -1;
+            }
+        }
+        tx_queue_commit(tx, n);
+        body->offset += n;
+        queued += n;
+    }
+    return (int)queued;
+}
@@ -0,0 +1,40 @@
+#ifndef HTTPSERVE_H
+#define HTTPSERVE_H
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "txqueue.h"
+
+// Cache lifetime (seconds) for sub-resources; index.html is always revalidated.
+#define HTTP_STATIC_MAX_AGE   3600
+
+// Body of a response, sent by the event loop behind the head queued in tx:
+// from memory (an embedded asset, or a rendered page it owns) or a file
+typedef struct {
+    const uint8_t *data;               // NULL: from fd
+    void          *owned;              // freed with the body
+    int            fd;                 // -1: no file
+    off_t          offset;             // next byte to send
+    off_t          end;
+} http_body_t;
+
+extern int  http_is_websocket_upgrade (const char request[]);
+extern int  http_serve_static         (tx_queue_t *tx, http_body_t *body, const char request[],
+                                       const char root[]);
+extern int  http_serve_embedded       (tx_queue_t *tx, http_body_t *body, const char request[]);
+extern int  http_path_is              (const char request[], const char path[]);
+extern int  http_serve_metrics        (tx_queue_t *tx, http_body_t *body, const char request[]);
+extern int  http_serve_trace          (tx_queue_t *tx, http_body_t *body, const char request[]);
+extern void http_body_init            (http_body_t *body);
+extern void http_body_free            (http_body_t *body);
+extern int  http_body_send            (http_body_t *body, int sock);
+extern int  http_body_queue           (http_body_t *body, tx_queue_t *tx, size_t max);
+
+// Bytes of the body not sent (or queued) yet
+static inline size_t http_body_left(const http_body_t *body) {
+    return (size_t)(body->end - body->offset);
+}
+
+#endif // HTTPSERVE_H
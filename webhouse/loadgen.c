@@ -0,0 +1,854 @@
+/******************************************************************************/
+/** \file       loadgen.c
+ *******************************************************************************
+ *
+ * \brief      WebSocket load generator for the webhouse server
+ *
+ *             Opens N connections, performs the real WebSocket handshake
+ *             (the Sec-WebSocket-Accept value is verified) and sends a mix of
+ *             <L1on>, <Dim1:x>, <SetTemp:x> and <GetStatus> commands, either
+ *             paced at a target rate (open loop) or as fast as the replies
+ *             come back (closed loop, -r 0). Every command is answered by
+ *             exactly one status message, so the round trip of a command is
+ *             the time from its send() to the arrival of the matching reply.
+ *
+ *             With -R it measures connection setup instead (reconnect storm,
+ *             as after a server restart or a Wi-Fi hiccup): every connection
+ *             is closed as soon as it is upgraded and opened again at once;
+ *             the latency is the time from connect() to the verified 101
+ *             response. The client resets its connections (SO_LINGER 0), so
+ *             that the ports do not run out in TIME_WAIT.
+ *
+ *             With -U it sends the same commands to the local control socket
+ *             (ctlsock.c) instead: one message per command and reply, no
+ *             handshake, framing or masking, for comparison with the
+ *             loopback WebSocket path.
+ *
+ *             Usage: loadgen [-h host] [-p port] [-c connections] [-r rate]
+ *                            [-d seconds] [-w warmup] [-m mix] [-B] [-j] [-R]
+ *                            [-U control_socket] [-I] [-W window]
+ *
+ *             -m  weights of L1on,Dim1,SetTemp,GetStatus, e.g. "1,1,1,4"
+ *             -B  negotiate the binary status subprotocol
+ *             -j  print the result as one JSON line (for regression tracking)
+ *             -R  reconnect storm with -c connections at a time
+ *             -U  path of the control socket of the server
+ *             -I  send every command with an id (<L1on#42>) and check that
+ *                 each reply acknowledges the right one
+ *             -W  commands in flight per connection in the closed loop
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * main
+ * * functions  local:
+ * now_ns
+ * next_random
+ * connect_client
+ * send_handshake
+ * check_handshake
+ * send_command
+ * add_sample
+ * check_ack
+ * handle_messages
+ * handle_input
+ * compare_u32
+ * percentile
+ * mean
+ * reconnect
+ * run_storm
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "sha1.h"
+#include "base64.h"
+#include "handshake.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+#define MAX_INFLIGHT     64          // commands in flight per connection
+#define RX_BUFFER_SIZE   4096
+#define NS_PER_SEC       1000000000ULL
+
+//----- Data types -------------------------------------------------------------
+enum { CMD_L1ON, CMD_DIM1, CMD_SETTEMP, CMD_GETSTATUS, CMD_COUNT };
+
+typedef struct {
+    int      sock;
+    int      upgraded;
+    char     key[WS_KEY_LEN + 1];
+    uint8_t  rx[RX_BUFFER_SIZE];
+    size_t   rxFill;
+    uint64_t sent[MAX_INFLIGHT];     // send timestamps, FIFO
+    unsigned head;
+    unsigned tail;
+    uint64_t connected;              // connect() called (-R)
+} client_t;
+
+//----- Data -------------------------------------------------------------------
+static const char *commandNames[CMD_COUNT] = { "L1on", "Dim1", "SetTemp", "GetStatus" };
+
+static uint64_t randomState = 0x9E3779B97F4A7C15ULL;
+
+static const char *unixPath;         // -U: control socket instead of TCP
+static int useIds;                   // -I
+static uint64_t ackErrors;           // replies with a wrong or no Ack (-I)
+
+static uint32_t *samples;            // round trip times in ns
+static size_t    sampleCount;
+static size_t    sampleCapacity;
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    now_ns
+ ******************************************************************************/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * function :    next_random
+ ******************************************************************************/
+/** \brief        xorshift64*, good enough to pick commands and values
+ ******************************************************************************/
+static uint32_t next_random(void) {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (uint32_t)((randomState * 2685821657736338717ULL) >> 32);
+}
+
+/*******************************************************************************
+ * function :    connect_client
+ ******************************************************************************/
+/** \brief        Open a non-blocking TCP connection, or a connection to the
+ *               control socket with -U
+ *
+ * \return       Socket, -1 on error
+ ******************************************************************************/
+static int connect_client(const struct sockaddr_in *server) {
+    int sock;
+    int option = 1;
+
+    if (unixPath != NULL) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", unixPath);
+        sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+        if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if (sock < 0) {
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    if (connect(sock, (const struct sockaddr *)server, sizeof(*server)) < 0
+            && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*******************************************************************************
+ * function :    send_handshake
+ ******************************************************************************/
+/** \brief        Send the upgrade request with a random key
+ ******************************************************************************/
+static int send_handshake(client_t *c, const char *host, int port, int binary) {
+    uint8_t nonce[16];
+    unsigned char *key;
+    char request[512];
+    int len;
+
+    for (int i = 0; i < 16; i++) {
+        nonce[i] = next_random();
+    }
+    key = base64_encode(nonce, sizeof(nonce), NULL);
+    if (key == NULL) {
+        return -1;
+    }
+    snprintf(c->key, sizeof(c->key), "%.*s", WS_KEY_LEN, key);
+    free(key);
+
+    len = snprintf(request, sizeof(request),
+                   "GET / HTTP/1.1\r\n"
+                   "Host: %s:%d\r\n"
+                   "Upgrade: websocket\r\n"
+                   "Connection: Upgrade\r\n"
+                   "Sec-WebSocket-Key: %s\r\n"
+                   "Sec-WebSocket-Version: 13\r\n"
+                   "%s\r\n",
+                   host, port, c->key,
+                   binary ? WS_HS_PROTO ": " WS_PROTO_BINARY_NAME "\r\n" : "");
+    return send(c->sock, request, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+/*******************************************************************************
+ * function :    check_handshake
+ ******************************************************************************/
+/** \brief        Verify the 101 response and its Sec-WebSocket-Accept value
+ *
+ * \return       Length of the response head, 0 if incomplete, -1 if invalid
+ ******************************************************************************/
+static int check_handshake(client_t *c) {
+    char keyMagic[WS_KEYMS_LEN + 1];
+    uint8_t hash[SHA1HashSize];
+    SHA1Context ctx;
+    unsigned char *expected;
+    char *end;
+    int ok;
+
+    c->rx[c->rxFill] = '\0';
+    end = strstr((char *)c->rx, "\r\n\r\n");
+    if (end == NULL) {
+        return 0;
+    }
+
+    snprintf(keyMagic, sizeof(keyMagic), "%s%s", c->key, MAGIC_STRING);
+    SHA1Reset(&ctx);
+    SHA1Input(&ctx, (const uint8_t *)keyMagic, WS_KEYMS_LEN);
+    SHA1Result(&ctx, hash);
+    expected = base64_encode(hash, SHA1HashSize, NULL);
+    if (expected == NULL) {
+        return -1;
+    }
+    expected[strcspn((char *)expected, "\n")] = '\0';
+
+    ok = strncmp((char *)c->rx, "HTTP/1.1 101", 12) == 0
+         && strstr((char *)c->rx, (char *)expected) != NULL;
+    free(expected);
+    return ok ? (int)(end + 4 - (char *)c->rx) : -1;
+}
+
+/*******************************************************************************
+ * function :    send_command
+ ******************************************************************************/
+/** \brief        Send one masked text frame with a command from the mix, or
+ *               the bare command to the control socket
+ ******************************************************************************/
+static int send_command(client_t *c, const unsigned *weights, unsigned weightSum,
+                        uint64_t *perCommand) {
+    char command[32];
+    uint8_t frame[64];
+    unsigned pick = next_random() % weightSum;
+    int type = 0;
+    int len;
+
+    while (pick >= weights[type]) {
+        pick -= weights[type];
+        type++;
+    }
+
+    switch (type) {
+    case CMD_L1ON:    len = snprintf(command, sizeof(command), "<L1on>"); break;
+    case CMD_DIM1:    len = snprintf(command, sizeof(command), "<Dim1:%u>", next_random() % 101); break;
+    case CMD_SETTEMP: len = snprintf(command, sizeof(command), "<SetTemp:%u>", 15 + next_random() % 16); break;
+    default:          len = snprintf(command, sizeof(command), "<GetStatus>"); break;
+    }
+    if (useIds) {
+        // The id is the position in the FIFO of sent commands
+        len += snprintf(command + len - 1, sizeof(command) - len + 1, "#%u>", c->head) - 1;
+    }
+
+    if (unixPath != NULL) {
+        c->sent[c->head++ % MAX_INFLIGHT] = now_ns();
+        if (send(c->sock, command, len, MSG_NOSIGNAL) != len) {
+            return -1;
+        }
+        perCommand[type]++;
+        return 0;
+    }
+
+    // Client frames must be masked (RFC 6455, section 5.3)
+    uint32_t mask = next_random();
+    frame[0] = WS_FIN | WS_OP_TEXT;
+    frame[1] = 0x80 | len;
+    memcpy(frame + 2, &mask, 4);
+    for (int i = 0; i < len; i++) {
+        frame[6 + i] = command[i] ^ frame[2 + (i & 3)];
+    }
+
+    c->sent[c->head++ % MAX_INFLIGHT] = now_ns();
+    if (send(c->sock, frame, 6 + len, MSG_NOSIGNAL) != 6 + len) {
+        return -1;
+    }
+    perCommand[type]++;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    add_sample
+ ******************************************************************************/
+static void add_sample(uint64_t ns) {
+    if (sampleCount == sampleCapacity) {
+        sampleCapacity = sampleCapacity ? 2 * sampleCapacity : 65536;
+        samples = realloc(samples, sampleCapacity * sizeof(*samples));
+        if (samples == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    samples[sampleCount++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+/*******************************************************************************
+ * function :    check_ack
+ ******************************************************************************/
+/** \brief        Count a reply that does not acknowledge the oldest command
+ *               in flight (-I)
+ ******************************************************************************/
+static void check_ack(const client_t *c, const uint8_t *payload, size_t len, int binary) {
+    const char *ack;
+    char text[16];
+
+    if (!useIds) {
+        return;
+    }
+    if (binary) {
+        // Delta frame: u8 format | u8 fields | u32 version | u32 ack
+        uint32_t id;
+        if (len < 10 || payload[0] != 2 || !(payload[1] & 0x10)) {
+            ackErrors++;
+            return;
+        }
+        memcpy(&id, payload + 6, sizeof(id));
+        ackErrors += id != c->tail;
+        return;
+    }
+    ack = memmem(payload, len, ";Ack:", 5);
+    if (ack == NULL) {
+        ackErrors++;
+        return;
+    }
+    ack += 5;
+    snprintf(text, sizeof(text), "%.*s", (int)((const char *)payload + len - ack), ack);
+    ackErrors += strtoul(text, NULL, 10) != c->tail;
+}
+
+/*******************************************************************************
+ * function :    handle_messages
+ ******************************************************************************/
+/** \brief        Read the replies from the control socket: each message is
+ *               one reply
+ *
+ * \return       Number of replies, -1 if the connection failed
+ ******************************************************************************/
+static int handle_messages(client_t *c, int record) {
+    int replies = 0;
+
+    for (;;) {
+        ssize_t n = recv(c->sock, c->rx, RX_BUFFER_SIZE, 0);
+        uint64_t now = now_ns();
+
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            return -1;
+        }
+        if (n < 0) {
+            return replies;
+        }
+        if (c->tail != c->head) {
+            check_ack(c, c->rx, n, FALSE);
+            uint64_t rtt = now - c->sent[c->tail++ % MAX_INFLIGHT];
+            if (record) {
+                add_sample(rtt);
+            }
+            replies++;
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    handle_input
+ ******************************************************************************/
+/** \brief        Read replies and record the round trip of each command
+ *
+ * \return       Number of replies, -1 if the connection failed
+ ******************************************************************************/
+static int handle_input(client_t *c, int record) {
+    if (unixPath != NULL) {
+        return handle_messages(c, record);
+    }
+
+    ssize_t n = recv(c->sock, c->rx + c->rxFill, RX_BUFFER_SIZE - 1 - c->rxFill, 0);
+    uint64_t now = now_ns();
+    size_t offset = 0;
+    int replies = 0;
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        return -1;
+    }
+    if (n < 0) {
+        return 0;
+    }
+    c->rxFill += n;
+
+    if (!c->upgraded) {
+        int head = check_handshake(c);
+        if (head <= 0) {
+            return head;
+        }
+        c->upgraded = TRUE;
+        offset = head;
+    }
+
+    // Server frames are unmasked: 2 byte header (+2 for >= 126 bytes)
+    while (c->rxFill - offset >= 2) {
+        size_t len = c->rx[offset + 1] & 0x7F;
+        size_t header = 2;
+        if (len == 126) {
+            if (c->rxFill - offset < 4) break;
+            len = (c->rx[offset + 2] << 8) | c->rx[offset + 3];
+            header = 4;
+        }
+        if (c->rxFill - offset < header + len) break;
+
+        int opcode = c->rx[offset] & 0x0F;
+        const uint8_t *payload = c->rx + offset + header;
+        offset += header + len;
+        if (opcode != WS_OP_TEXT && opcode != WS_OP_BINARY) {
+            continue;
+        }
+        if (c->tail != c->head) {
+            check_ack(c, payload, len, opcode == WS_OP_BINARY);
+            uint64_t rtt = now - c->sent[c->tail++ % MAX_INFLIGHT];
+            if (record) {
+                add_sample(rtt);
+            }
+            replies++;
+        }
+    }
+
+    memmove(c->rx, c->rx + offset, c->rxFill - offset);
+    c->rxFill -= offset;
+    return replies;
+}
+
+/*******************************************************************************
+ * function :    compare_u32
+ ******************************************************************************/
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+ * function :    percentile
+ ******************************************************************************/
+/** \brief        Percentile of the sorted samples in microseconds
+ ******************************************************************************/
+static double percentile(double p) {
+    if (sampleCount == 0) {
+        return 0.0;
+    }
+    size_t index = (size_t)(p / 100.0 * (sampleCount - 1) + 0.5);
+    return samples[index] / 1000.0;
+}
+
+/*******************************************************************************
+ * function :    mean
+ ******************************************************************************/
+/** \brief        Mean of the samples in microseconds
+ ******************************************************************************/
+static double mean(void) {
+    double sum = 0.0;
+
+    for (size_t i = 0; i < sampleCount; i++) {
+        sum += samples[i];
+    }
+    return sampleCount ? sum / sampleCount / 1000.0 : 0.0;
+}
+
+/*******************************************************************************
+ * function :    reconnect
+ ******************************************************************************/
+/** \brief        Reset the connection of a client and open a new one (-R)
+ *
+ * \return       0 on success, -1 if connect failed
+ ******************************************************************************/
+static int reconnect(int epfd, client_t *c, unsigned id, const struct sockaddr_in *server) {
+    struct epoll_event ev = { .events = EPOLLOUT, .data.u32 = id };
+
+    if (c->sock >= 0) {
+        struct linger reset = { 1, 0 };
+        setsockopt(c->sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(c->sock);              // also leaves the epoll set
+    }
+    c->upgraded = FALSE;
+    c->rxFill = 0;
+    c->connected = now_ns();
+    c->sock = connect_client(server);
+    if (c->sock < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    run_storm
+ ******************************************************************************/
+/** \brief        Reconnect storm: measure connect() to verified 101 while
+ *               all connections reconnect as fast as they can (-R)
+ *
+ * \return       Number of failed setups
+ ******************************************************************************/
+static int run_storm(const struct sockaddr_in *server, const char *host, int port,
+                     int connections, double duration, double warmup, int binary, int json) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    client_t *clients = calloc(connections, sizeof(client_t));
+    uint64_t setups = 0;
+    int failed = 0;
+
+    if (epfd < 0 || clients == NULL) {
+        perror("setup");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < connections; i++) {
+        clients[i].sock = -1;
+        if (reconnect(epfd, &clients[i], i, server) < 0) {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t measureStart = now_ns() + (uint64_t)(warmup * NS_PER_SEC);
+    uint64_t end = measureStart + (uint64_t)(duration * NS_PER_SEC);
+    while (now_ns() < end) {
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, 100);
+        for (int i = 0; i < n; i++) {
+            unsigned id = events[i].data.u32;
+            client_t *c = &clients[id];
+            int result = 0;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                result = -1;
+            } else if (events[i].events & EPOLLOUT) {
+                struct epoll_event ev = { .events = EPOLLIN, .data.u32 = id };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+                result = send_handshake(c, host, port, binary);
+            } else {
+                result = handle_input(c, FALSE);
+            }
+
+            if (result >= 0 && !c->upgraded) {
+                continue;
+            }
+            uint64_t now = now_ns();
+            if (now >= measureStart) {
+                if (result < 0) {
+                    failed++;
+                } else {
+                    add_sample(now - c->connected);
+                    setups++;
+                }
+            }
+            if (reconnect(epfd, c, id, server) < 0) {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    qsort(samples, sampleCount, sizeof(*samples), compare_u32);
+    if (json) {
+        printf("{\"mode\":\"reconnect\",\"connections\":%d,\"duration_s\":%.3f,"
+               "\"setups\":%llu,\"rate\":%.1f,\"errors\":%d,"
+               "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,"
+               "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+               connections, duration, (unsigned long long)setups, setups / duration, failed,
+               mean(), percentile(50), percentile(90), percentile(99), percentile(99.9),
+               percentile(100));
+    } else {
+        printf("reconnect storm, %d connections, %.1f s measured after %.1f s warm-up\n",
+               connections, duration, warmup);
+        printf("%.1f setups/s, %d errors\n", setups / duration, failed);
+        printf("setup latency us: mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               mean(), percentile(50), percentile(90), percentile(99), percentile(99.9),
+               percentile(100));
+    }
+
+    for (int i = 0; i < connections; i++) {
+        if (clients[i].sock >= 0) {
+            close(clients[i].sock);
+        }
+    }
+    free(clients);
+    close(epfd);
+    return failed;
+}
+
+/*******************************************************************************
+ * function :    main
+ ******************************************************************************/
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = 8000;
+    int connections = 1;
+    double rate = 1000.0;
+    double duration = 10.0;
+    double warmup = 1.0;
+    int binary = FALSE;
+    int json = FALSE;
+    int storm = FALSE;
+    int window = 1;
+    unsigned weights[CMD_COUNT] = { 1, 1, 1, 1 };
+    unsigned weightSum = 0;
+    uint64_t perCommand[CMD_COUNT] = { 0 };
+    uint64_t backlogged = 0;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:r:d:w:m:BjRU:IW:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%u,%u,%u,%u", &weights[0], &weights[1],
+                       &weights[2], &weights[3]) != CMD_COUNT) {
+                fprintf(stderr, "-m expects four weights: L1on,Dim1,SetTemp,GetStatus\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B': binary = TRUE; break;
+        case 'j': json = TRUE; break;
+        case 'R': storm = TRUE; break;
+        case 'U': unixPath = optarg; break;
+        case 'I': useIds = TRUE; break;
+        case 'W': window = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-r rate/s, 0 = closed loop]\n"
+                            "       [-d seconds] [-w warmup seconds] [-m L1on,Dim1,SetTemp,GetStatus] [-B] [-j] [-R]\n"
+                            "       [-U control_socket] [-I] [-W window]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < CMD_COUNT; i++) {
+        weightSum += weights[i];
+    }
+    if (window < 1 || window > MAX_INFLIGHT) {
+        fprintf(stderr, "Window must be 1..%d\n", MAX_INFLIGHT);
+        return EXIT_FAILURE;
+    }
+    if (connections < 1 || weightSum == 0) {
+        fprintf(stderr, "Need at least one connection and one command\n");
+        return EXIT_FAILURE;
+    }
+    if (unixPath != NULL && (storm || binary)) {
+        fprintf(stderr, "-U has no handshake: not with -R or -B\n");
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IPv4 address: %s\n", host);
+        return EXIT_FAILURE;
+    }
+    if (storm) {
+        int stormFailed = run_storm(&server, host, port, connections, duration, warmup, binary, json);
+        free(samples);
+        return stormFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    client_t *clients = calloc(connections, sizeof(client_t));
+    if (epfd < 0 || clients == NULL) {
+        perror("setup");
+        return EXIT_FAILURE;
+    }
+
+    // Connect and upgrade all clients before the clock starts
+    uint64_t deadline = now_ns() + 10 * NS_PER_SEC;
+    int upgraded = 0;
+    for (int i = 0; i < connections; i++) {
+        struct epoll_event ev = { .events = unixPath ? EPOLLIN : EPOLLOUT, .data.u32 = i };
+        clients[i].sock = connect_client(&server);
+        if (clients[i].sock < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].sock, &ev) < 0) {
+            perror("connect");
+            return EXIT_FAILURE;
+        }
+        // The control socket needs no upgrade
+        clients[i].upgraded = unixPath != NULL;
+        upgraded += clients[i].upgraded;
+    }
+    while (upgraded < connections && now_ns() < deadline) {
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, 100);
+        for (int i = 0; i < n; i++) {
+            client_t *c = &clients[events[i].data.u32];
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                fprintf(stderr, "Connection %u failed\n", events[i].data.u32);
+                return EXIT_FAILURE;
+            }
+            if (events[i].events & EPOLLOUT) {
+                struct epoll_event ev = { .events = EPOLLIN, .data.u32 = events[i].data.u32 };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev);
+                if (send_handshake(c, host, port, binary) < 0) {
+                    perror("handshake");
+                    return EXIT_FAILURE;
+                }
+            } else if (!c->upgraded) {
+                if (handle_input(c, FALSE) < 0) {
+                    fprintf(stderr, "Handshake of connection %u failed\n", events[i].data.u32);
+                    return EXIT_FAILURE;
+                }
+                upgraded += c->upgraded;
+            }
+        }
+    }
+    if (upgraded < connections) {
+        fprintf(stderr, "Only %d of %d connections upgraded (does the server accept "
+                        "concurrent clients?)\n", upgraded, connections);
+        return EXIT_FAILURE;
+    }
+
+    // Load phase
+    uint64_t start = now_ns();
+    uint64_t measureStart = start + (uint64_t)(warmup * NS_PER_SEC);
+    uint64_t end = measureStart + (uint64_t)(duration * NS_PER_SEC);
+    uint64_t interval = rate > 0 ? (uint64_t)(NS_PER_SEC / rate) : 0;
+    uint64_t nextSend = start;
+    uint64_t measuredReplies = 0;
+    unsigned roundRobin = 0;
+
+    if (rate <= 0) {
+        for (int i = 0; i < connections; i++) {
+            for (int k = 0; k < window; k++) {
+                send_command(&clients[i], weights, weightSum, perCommand);
+            }
+        }
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= end) {
+            break;
+        }
+
+        // Open loop: keep the schedule; a send that finds every window full
+        // is counted as backlogged instead of silently lowering the rate
+        while (interval && now >= nextSend) {
+            int sentOne = FALSE;
+            for (int k = 0; k < connections && !sentOne; k++) {
+                client_t *c = &clients[roundRobin++ % connections];
+                if (c->head - c->tail < MAX_INFLIGHT) {
+                    if (send_command(c, weights, weightSum, perCommand) < 0) {
+                        failed++;
+                    }
+                    sentOne = TRUE;
+                }
+            }
+            if (!sentOne) {
+                backlogged++;
+            }
+            nextSend += interval;
+        }
+
+        int timeout = 1;
+        if (interval && nextSend > now) {
+            timeout = (nextSend - now) / 1000000;
+        }
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, timeout);
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            client_t *c = &clients[events[i].data.u32];
+            int got = handle_input(c, now >= measureStart);
+            if (got < 0) {
+                fprintf(stderr, "Connection %u closed by server\n", events[i].data.u32);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+                failed++;
+                continue;
+            }
+            if (now >= measureStart) {
+                measuredReplies += got;
+            }
+            // Closed loop: the next command goes out as soon as the reply is in
+            for (int k = 0; interval == 0 && k < got; k++) {
+                send_command(c, weights, weightSum, perCommand);
+            }
+        }
+    }
+
+    double seconds = (end - measureStart) / (double)NS_PER_SEC;
+    qsort(samples, sampleCount, sizeof(*samples), compare_u32);
+
+    if (json) {
+        printf("{\"transport\":\"%s\",\"connections\":%d,\"target_rate\":%.0f,\"duration_s\":%.3f,"
+               "\"binary\":%d,\"window\":%d,\"ids\":%d,\"replies\":%llu,\"throughput\":%.1f,"
+               "\"backlogged\":%llu,\"errors\":%d,\"ack_errors\":%llu,"
+               "\"sent\":{\"L1on\":%llu,\"Dim1\":%llu,\"SetTemp\":%llu,\"GetStatus\":%llu},"
+               "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,"
+               "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+               unixPath ? "unix" : "websocket", connections, rate, seconds, binary, window,
+               useIds, (unsigned long long)measuredReplies, measuredReplies / seconds,
+               (unsigned long long)backlogged, failed, (unsigned long long)ackErrors,
+               (unsigned long long)perCommand[CMD_L1ON], (unsigned long long)perCommand[CMD_DIM1],
+               (unsigned long long)perCommand[CMD_SETTEMP], (unsigned long long)perCommand[CMD_GETSTATUS],
+               mean(), percentile(50), percentile(90), percentile(99), percentile(99.9),
+               percentile(100));
+    } else {
+        printf("%s, connections %d, target %.0f/s%s, %.1f s measured after %.1f s warm-up\n",
+               unixPath ? "control socket" : "websocket", connections, rate,
+               rate > 0 ? "" : " (closed loop)", seconds, warmup);
+        printf("sent:");
+        for (int i = 0; i < CMD_COUNT; i++) {
+            printf(" %s=%llu", commandNames[i], (unsigned long long)perCommand[i]);
+        }
+        printf("\nthroughput %.1f replies/s, %llu backlogged, %d errors\n",
+               measuredReplies / seconds, (unsigned long long)backlogged, failed);
+        if (useIds) {
+            printf("ids: %llu replies without the right Ack\n", (unsigned long long)ackErrors);
+        }
+        printf("latency us: mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+               mean(), percentile(50), percentile(90), percentile(99), percentile(99.9),
+               percentile(100));
+    }
+
+    for (int i = 0; i < connections; i++) {
+        close(clients[i].sock);
+    }
+    free(clients);
+    free(samples);
+    close(epfd);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
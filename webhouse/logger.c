@@ -0,0 +1,627 @@
+/******************************************************************************/
+/** \file       logger.c
+ *******************************************************************************
+ *
+ * \brief      Asynchronous logger
+ *
+ *             log_write (LOG_INFO, ...) never blocks and never formats:
+ *             it copies the format pointer and the raw arguments (strings
+ *             by value) into a queue owned by the calling thread. A writer
+ *             thread turns the records into text and write()s them, so a
+ *             slow stdout (a journald pipe, a terminal on a serial line)
+ *             only delays the log, not the network or the control threads.
+ *
+ *             Every queue has a single producer (its thread) and a single
+ *             consumer (the writer), so no locks are needed. When a queue
+ *             is full the message is dropped and counted; the writer
+ *             reports the number of dropped messages in the log.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * log_init
+ * log_close
+ * log_dropped
+ * log_write
+ * * functions  local:
+ * parse_spec
+ * capture
+ * render
+ * log_register
+ * write_all
+ * writer_thread
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+
+//----- Macros -----------------------------------------------------------------
+#define LOG_MAX_ARGS      8
+#define LOG_TEXT_SIZE     120        // string arguments of one record
+#define LOG_MAX_THREADS   16
+#define LOG_LINE_SIZE     512
+#define LOG_OUT_SIZE      8192
+#define LOG_IDLE_MIN_NS   5000000    // writer poll interval after output
+#define LOG_IDLE_MAX_NS   500000000  // ... doubled up to this while idle
+#define LOG_SPEC_SIZE     32
+
+//----- Data types -------------------------------------------------------------
+typedef union {
+    long long           i;
+    unsigned long long  u;
+    double              d;
+    const void         *p;
+    size_t              text;       // offset of a string in log_record_t.text
+} log_arg_t;
+
+typedef struct {
+    uint64_t     ts;
+    const char  *format;            // NULL: text holds the formatted message
+    uint8_t      level;
+    uint16_t     textLen;
+    log_arg_t    args[LOG_MAX_ARGS];
+    char         text[LOG_TEXT_SIZE];
+} log_record_t;
+
+typedef struct {
+    uint32_t      head __attribute__((aligned(METRICS_CACHE_LINE)));  // owner
+    unsigned long dropped;                                             // owner
+    uint32_t      tail __attribute__((aligned(METRICS_CACHE_LINE)));  // writer
+    log_record_t  records[LOG_QUEUE_SIZE];
+} log_queue_t;
+
+// One conversion specification of a format string
+typedef struct {
+    size_t len;                     // characters from '%' to the conversion
+    int    stars;                   // '*' width/precision arguments
+    char   length;                  // 0, 'H' (hh), 'h', 'l', 'q' (ll), 'z', 'j', 't'
+    char   conv;
+} log_spec_t;
+
+//----- Data -------------------------------------------------------------------
+static __thread log_queue_t *queueSelf;
+static log_queue_t *queues[LOG_MAX_THREADS];
+static unsigned queueCount;
+static unsigned long unregisteredDrops;
+
+static pthread_t writer;
+static int running;
+static int stopping;
+
+static const char *levelPrefix[] = { "error: ", "warning: ", "", "" };
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    parse_spec
+ ******************************************************************************/
+/** \brief        Parse the conversion specification at p (p[0] == '%')
+ *
+ * \type         static
+ *
+ * \return       0 on success, -1 for conversions the logger does not support
+ *
+ ******************************************************************************/
+static int parse_spec(const char *p, log_spec_t *spec) {
+    const char *s = p + 1;
+
+    spec->stars = 0;
+    spec->length = 0;
+
+    s += strspn(s, "-+ #0");
+    if (*s == '*') {
+        spec->stars++;
+        s++;
+    } else {
+        s += strspn(s, "0123456789");
+    }
+    if (*s == '.') {
+        s++;
+        if (*s == '*') {
+            spec->stars++;
+            s++;
+        } else {
+            s += strspn(s, "0123456789");
+        }
+    }
+
+    switch (*s) {
+    case 'h':
+        spec->length = (s[1] == 'h') ? 'H' : 'h';
+        s += (s[1] == 'h') ? 2 : 1;
+        break;
+    case 'l':
+        spec->length = (s[1] == 'l') ? 'q' : 'l';
+        s += (s[1] == 'l') ? 2 : 1;
+        break;
+    case 'z':
+    case 'j':
+    case 't':
+        spec->length = *s++;
+        break;
+    }
+
+    spec->conv = *s;
+    spec->len = s + 1 - p;
+    if (spec->conv == '\0' || strchr("diuxXocsfFeEgGaAp%", spec->conv) == NULL) {
+        return -1;
+    }
+    if (spec->length != 0 && strchr("cspfFeEgGaA%", spec->conv) != NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    capture
+ ******************************************************************************/
+/** \brief        Copy the arguments of a message into a record
+ *
+ *               Integers are stored already narrowed to their printf type,
+ *               strings are copied (and cut at the end of record text).
+ *
+ * \type         static
+ *
+ * \return       0 on success, -1 if the record cannot hold the arguments
+ *
+ ******************************************************************************/
+static int capture(log_record_t *rec, const char *format, va_list args) {
+    unsigned n = 0;
+    log_spec_t spec;
+
+    rec->textLen = 0;
+    for (const char *p = strchr(format, '%'); p != NULL; p = strchr(p, '%')) {
+        if (parse_spec(p, &spec) < 0) {
+            return -1;
+        }
+        p += spec.len;
+        if (spec.conv == '%') {
+            continue;
+        }
+        if (n + spec.stars + 1 > LOG_MAX_ARGS) {
+            return -1;
+        }
+        for (int i = 0; i < spec.stars; i++) {
+            rec->args[n++].i = va_arg(args, int);
+        }
+
+        log_arg_t *arg = &rec->args[n++];
+        switch (spec.conv) {
+        case 'd':
+        case 'i':
+            switch (spec.length) {
+            case 'H': arg->i = (signed char)va_arg(args, int); break;
+            case 'h': arg->i = (short)va_arg(args, int); break;
+            case 'l': arg->i = va_arg(args, long); break;
+            case 'q': arg->i = va_arg(args, long long); break;
+            case 'z': arg->i = va_arg(args, ssize_t); break;
+            case 'j': arg->i = va_arg(args, intmax_t); break;
+            case 't': arg->i = va_arg(args, ptrdiff_t); break;
+            default:  arg->i = va_arg(args, int); break;
+            }
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            switch (spec.length) {
+            case 'H': arg->u = (unsigned char)va_arg(args, unsigned); break;
+            case 'h': arg->u = (unsigned short)va_arg(args, unsigned); break;
+            case 'l': arg->u = va_arg(args, unsigned long); break;
+            case 'q': arg->u = va_arg(args, unsigned long long); break;
+            case 'z': arg->u = va_arg(args, size_t); break;
+            case 'j': arg->u = va_arg(args, uintmax_t); break;
+            case 't': arg->u = va_arg(args, ptrdiff_t); break;
+            default:  arg->u = va_arg(args, unsigned); break;
+            }
+            break;
+        case 'c':
+            arg->i = va_arg(args, int);
+            break;
+        case 'p':
+            arg->p = va_arg(args, void *);
+            break;
+        case 's': {
+            const char *s = va_arg(args, const char *);
+            size_t room = LOG_TEXT_SIZE - rec->textLen;
+            size_t len;
+
+            if (s == NULL) {
+                s = "(null)";
+            }
+            if (room == 0) {
+                return -1;
+            }
+            len = strnlen(s, room - 1);
+            memcpy(rec->text + rec->textLen, s, len);
+            rec->text[rec->textLen + len] = '\0';
+            arg->text = rec->textLen;
+            rec->textLen += len + 1;
+            break;
+        }
+        default:
+            arg->d = va_arg(args, double);
+            break;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    render
+ ******************************************************************************/
+/** \brief        Format a record into one line of text
+ *
+ * \type         static
+ *
+ * \return       Length of the line, newline included
+ *
+ ******************************************************************************/
+static size_t render(const log_record_t *rec, char line[], size_t size) {
+    const char *format = rec->format;
+    size_t len;
+    unsigned n = 0;
+
+    len = snprintf(line, size, "%s", levelPrefix[rec->level]);
+
+    if (format == NULL) {
+        len += snprintf(line + len, size - len, "%s", rec->text);
+        format = "";
+    }
+
+    while (*format != '\0' && len < size - 1) {
+        const char *p = strchr(format, '%');
+        log_spec_t spec;
+        char fmt[LOG_SPEC_SIZE];
+        int stars[2] = { 0, 0 };
+        int written = 0;
+
+        if (p == NULL) {
+            p = format + strlen(format);
+        }
+        size_t literal = p - format;
+        if (literal > size - 1 - len) {
+            literal = size - 1 - len;
+        }
+        memcpy(line + len, format, literal);
+        len += literal;
+        format = p;
+        if (*p == '\0' || len >= size - 1) {
+            break;
+        }
+
+        // Already validated by capture
+        parse_spec(p, &spec);
+        format += spec.len;
+        if (spec.conv == '%') {
+            line[len++] = '%';
+            continue;
+        }
+        for (int i = 0; i < spec.stars; i++) {
+            stars[i] = (int)rec->args[n++].i;
+        }
+        const log_arg_t *arg = &rec->args[n++];
+
+        // Integers are stored as long long, so print them as such
+        size_t specLen = spec.len - 1;
+        if (spec.length != 0) {
+            specLen -= (spec.length == 'H' || spec.length == 'q') ? 2 : 1;
+        }
+        if (specLen + 3 > sizeof(fmt)) {
+            break;
+        }
+        memcpy(fmt, p, specLen);
+        if (strchr("diuxXo", spec.conv) != NULL) {
+            fmt[specLen++] = 'l';
+            fmt[specLen++] = 'l';
+        }
+        fmt[specLen++] = spec.conv;
+        fmt[specLen] = '\0';
+
+#define FORMAT_VALUE(value)                                                          \
+        switch (spec.stars) {                                                        \
+        case 0:  written = snprintf(line + len, size - len, fmt, value); break;     \
+        case 1:  written = snprintf(line + len, size - len, fmt, stars[0], value); break; \
+        default: written = snprintf(line + len, size - len, fmt, stars[0], stars[1], value); break; \
+        }
+
+        switch (spec.conv) {
+        case 'd':
+        case 'i': FORMAT_VALUE(arg->i); break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': FORMAT_VALUE(arg->u); break;
+        case 'c': FORMAT_VALUE((int)arg->i); break;
+        case 'p': FORMAT_VALUE(arg->p); break;
+        case 's': FORMAT_VALUE(rec->text + arg->text); break;
+        default:  FORMAT_VALUE(arg->d); break;
+        }
+#undef FORMAT_VALUE
+
+        if (written > 0) {
+            len += ((size_t)written < size - len) ? (size_t)written : size - 1 - len;
+        }
+    }
+
+    if (len > size - 2) {
+        len = size - 2;
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+/*******************************************************************************
+ * function :    log_register
+ ******************************************************************************/
+/** \brief        Allocate the queue of the calling thread
+ *
+ * \type         static
+ *
+ * \return       The queue, NULL if there are too many threads or no memory
+ *
+ ******************************************************************************/
+static log_queue_t *log_register(void) {
+    log_queue_t *queue;
+    unsigned index = __atomic_load_n(&queueCount, __ATOMIC_RELAXED);
+
+    do {
+        if (index >= LOG_MAX_THREADS) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&queueCount, &index, index + 1, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    queue = aligned_alloc(METRICS_CACHE_LINE, sizeof(log_queue_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+    memset(queue, 0, sizeof(*queue));
+    queueSelf = queue;
+    __atomic_store_n(&queues[index], queue, __ATOMIC_RELEASE);
+    return queue;
+}
+
+/*******************************************************************************
+ * function :    log_write
+ ******************************************************************************/
+/** \brief        Queue a message, printf syntax without the trailing newline
+ *
+ *               Before log_init and after log_close the message is printed
+ *               directly.
+ *
+ * \type         global
+ *
+ * \param[in]    level    LOG_LEVEL_ERROR ... LOG_LEVEL_DEBUG
+ * \param[in]    format   printf format, must stay valid (a string literal)
+ *
+ ******************************************************************************/
+void log_write(int level, const char *format, ...) {
+    log_queue_t *queue = queueSelf;
+    va_list args;
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        va_start(args, format);
+        fputs(levelPrefix[level], stdout);
+        vprintf(format, args);
+        putchar('\n');
+        fflush(stdout);
+        va_end(args);
+        return;
+    }
+
+    if (queue == NULL && (queue = log_register()) == NULL) {
+        __atomic_fetch_add(&unregisteredDrops, 1, __ATOMIC_RELAXED);
+        metrics_inc(METRIC_LOG_DROPPED);
+        return;
+    }
+
+    uint32_t head = queue->head;
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= LOG_QUEUE_SIZE) {
+        __atomic_store_n(&queue->dropped, queue->dropped + 1, __ATOMIC_RELAXED);
+        metrics_inc(METRIC_LOG_DROPPED);
+        return;
+    }
+
+    log_record_t *rec = &queue->records[head % LOG_QUEUE_SIZE];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->level = level;
+    rec->format = format;
+
+    va_start(args, format);
+    if (capture(rec, format, args) < 0) {
+        // Too many or unsupported arguments: format right away
+        va_end(args);
+        va_start(args, format);
+        vsnprintf(rec->text, sizeof(rec->text), format, args);
+        rec->format = NULL;
+    }
+    va_end(args);
+
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ * function :    log_dropped
+ ******************************************************************************/
+/** \brief        Number of messages dropped because a queue was full
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+unsigned long log_dropped(void) {
+    unsigned long dropped = __atomic_load_n(&unregisteredDrops, __ATOMIC_RELAXED);
+    unsigned count = __atomic_load_n(&queueCount, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < count && i < LOG_MAX_THREADS; i++) {
+        log_queue_t *queue = __atomic_load_n(&queues[i], __ATOMIC_ACQUIRE);
+        if (queue != NULL) {
+            dropped += __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+        }
+    }
+    return dropped;
+}
+
+/*******************************************************************************
+ * function :    write_all
+ ******************************************************************************/
+/** \brief        write() to stdout until everything is out or it fails
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;             // nowhere left to report it
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*******************************************************************************
+ * function :    writer_thread
+ ******************************************************************************/
+/** \brief        Format the queued records and write them to stdout
+ *
+ *               Records of different threads are merged by timestamp. The
+ *               output is collected and written with one write() per pass.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void *writer_thread(void *pdata) {
+    static char out[LOG_OUT_SIZE];
+    char line[LOG_LINE_SIZE];
+    unsigned long reported = 0;
+    size_t fill = 0;
+    long idleNs = LOG_IDLE_MIN_NS;
+
+    trace_thread_name("logger");
+    for (;;) {
+        int idle = 1;
+
+        for (;;) {
+            log_queue_t *best = NULL;
+            const log_record_t *first = NULL;
+            unsigned count = __atomic_load_n(&queueCount, __ATOMIC_RELAXED);
+
+            for (unsigned i = 0; i < count && i < LOG_MAX_THREADS; i++) {
+                log_queue_t *queue = __atomic_load_n(&queues[i], __ATOMIC_ACQUIRE);
+                if (queue == NULL) {
+                    continue;
+                }
+                uint32_t tail = queue->tail;
+                if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+                    continue;
+                }
+                const log_record_t *rec = &queue->records[tail % LOG_QUEUE_SIZE];
+                if (first == NULL || rec->ts < first->ts) {
+                    best = queue;
+                    first = rec;
+                }
+            }
+            if (best == NULL) {
+                break;
+            }
+
+            size_t len = render(first, line, sizeof(line));
+            __atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+            idle = 0;
+
+            if (fill + len > sizeof(out)) {
+                write_all(out, fill);
+                fill = 0;
+            }
+            memcpy(out + fill, line, len);
+            fill += len;
+        }
+
+        unsigned long dropped = log_dropped();
+        if (dropped != reported) {
+            if (fill + LOG_LINE_SIZE > sizeof(out)) {
+                write_all(out, fill);
+                fill = 0;
+            }
+            fill += snprintf(out + fill, sizeof(out) - fill,
+                             "warning: log queue full, %lu messages dropped\n",
+                             dropped - reported);
+            reported = dropped;
+        }
+        if (fill > 0) {
+            write_all(out, fill);
+            fill = 0;
+        }
+
+        if (!idle) {
+            idleNs = LOG_IDLE_MIN_NS;
+        } else if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        } else if (idleNs < LOG_IDLE_MAX_NS) {
+            idleNs *= 2;
+        }
+        // An idle writer backs off, so a quiet house causes few wakeups
+        struct timespec wait = { 0, idleNs < LOG_IDLE_MAX_NS ? idleNs : LOG_IDLE_MAX_NS };
+        nanosleep(&wait, NULL);
+        metrics_inc(METRIC_WAKEUPS);
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * function :    log_init
+ ******************************************************************************/
+/** \brief        Start the writer thread; until then messages are printed
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 if the thread could not be started
+ *
+ ******************************************************************************/
+int log_init(void) {
+    fflush(stdout);
+    stopping = 0;
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    log_close
+ ******************************************************************************/
+/** \brief        Write all queued messages and stop the writer thread
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void log_close(void) {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+}
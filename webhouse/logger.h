@@ -0,0 +1,46 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#define LOG_LEVEL_ERROR   0
+#define LOG_LEVEL_WARN    1
+#define LOG_LEVEL_INFO    2
+#define LOG_LEVEL_DEBUG   3
+
+// Messages above this level are not compiled in, e.g. -DLOG_LEVEL=3 for debug
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Records queued per thread before messages are dropped
+#ifndef LOG_QUEUE_SIZE
+#define LOG_QUEUE_SIZE    256
+#endif
+
+extern int           log_init    (void);
+extern void          log_close   (void);
+extern unsigned long log_dropped (void);
+extern void          log_write   (int level, const char *format, ...)
+                                 __attribute__((format(printf, 2, 3)));
+
+// The format must be a string literal: it is only read by the writer thread.
+#define LOG_ERROR(...)  log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...)   log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...)   do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...)   log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)   do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)  log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)  do { } while (0)
+#endif
+
+#endif // LOGGER_H
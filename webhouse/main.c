@@ -15,9 +15,14 @@
 /*
  * functions  global:
  * main
+ * processCommand
+ * applyCommand
+ * sendStatus
+ * publishStatus
+ * resumeSession
  * * functions  local:
+ * sendState
  * shutdownHook
- * processCommand
  * * Autor      Elham Firouzi
  *
  ******************************************************************************/
@@ -30,6 +35,7 @@ typedef int int32_t;
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
 #include <signal.h>
 #include <pthread.h>
 #include <math.h>
@@ -38,25 +44,42 @@ typedef int int32_t;
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/socketvar.h>
+#include <sys/eventfd.h>
 
 #include "jansson.h"
 #include "Webhouse.h"
 #include "handshake.h"
+#include "wsconn.h"
+#include "netconn.h"
+#include "netloop.h"
+#include "sockopt.h"
+#include "ctlsock.h"
+#include "httpapi.h"
+#include "status.h"
+#include "command.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+#include "history.h"
+#include "tsdb.h"
+#include "persist.h"
+#include "shmstate.h"
+#include "changelog.h"
 
 //----- Macros -----------------------------------------------------------------
 #define TRUE 1
 #define FALSE 0
 
 #define PORT 8000               
-#define RX_BUFFER_SIZE 1024
-#define WS_HS_ACCLEN 130
+
+#define REPLAY_CHUNK 32         // states copied from the change log at once
 
 //----- Function prototypes ----------------------------------------------------
 static void shutdownHook (int32_t sig);
-void processCommand(char *command, int com_sock_id);
+static void sendState    (ws_conn_t *conn, const WebhouseState *current);
 
 //----- Data -------------------------------------------------------------------
-static volatile int eShutdown = FALSE;
+static int stopFd = -1;        // eventfd, wakes the event loop on shutdown
 
 //----- Implementation ---------------------------------------------------------
 
@@ -72,110 +95,183 @@ static volatile int eShutdown = FALSE;
  *
  ******************************************************************************/
 int main(int argc, char **argv) {
-    int bind_status;
-    int listen_status;
-    int server_sock_id;
-    int com_sock_id;
-    struct sockaddr_in server;
-    struct sockaddr_in client;
-    int addrlen = sizeof (struct sockaddr_in);
-    
-    char rxBuf[RX_BUFFER_SIZE];
-    int rx_data_len;
+    int listen_socks[NET_MAX_WORKERS];
+    net_config_t net_config = { NET_BACKEND_EPOLL, FALSE, NET_MAX_CONNS, 1, -1 };
+    long tx_limit = NET_TX_LIMIT;
+    int evict_ms = NET_TX_EVICT_MS;
+    int ping_ms = NET_PING_MS;
+    sock_options_t sock_options = SOCK_OPTIONS_DEFAULT;
+    const char *static_root = NULL;
+    const char *store_path = NULL;
+    const char *state_path = PERSIST_DEFAULT_PATH;
+    const char *ctl_path = CTL_DEFAULT_PATH;
+    int ctl_gid = -1;
+    tsdb_t *store = NULL;
+    WebhouseState saved;
+    int restored = FALSE;
+    int trace_on = FALSE;
+    int opt;
+    uint64_t start_ns = metrics_now_ns();
+    uint64_t restore_ns;
+
+    while ((opt = getopt(argc, argv, "s:d:p:tb:fw:c:l:e:k:q:D:F:y:u:G:")) != -1) {
+        switch (opt) {
+        case 's':
+            static_root = optarg;
+            break;
+        case 'd':
+            store_path = optarg;
+            break;
+        case 'p':
+            state_path = optarg;
+            break;
+        case 't':
+            trace_on = TRUE;
+            break;
+        case 'b':
+            if (net_parse_backend(optarg, &net_config.backend) == 0) {
+                break;
+            }
+            fprintf(stderr, "Unknown backend %s (epoll, uring)\n", optarg);
+            exit(EXIT_FAILURE);
+        case 'f':
+            net_config.fixed = TRUE;
+            break;
+        case 'w':
+            net_config.workers = atoi(optarg);
+            if (net_config.workers >= 1 && net_config.workers <= NET_MAX_WORKERS) {
+                break;
+            }
+            fprintf(stderr, "Workers must be 1..%d\n", NET_MAX_WORKERS);
+            exit(EXIT_FAILURE);
+        case 'c':
+            net_config.controlCpu = atoi(optarg);
+            break;
+        case 'l':
+            tx_limit = atol(optarg);
+            if (tx_limit > 0) {
+                break;
+            }
+            fprintf(stderr, "Send queue limit must be > 0 bytes\n");
+            exit(EXIT_FAILURE);
+        case 'e':
+            evict_ms = atoi(optarg);
+            break;
+        case 'k':
+            ping_ms = atoi(optarg);
+            break;
+        case 'q':
+            sock_options.backlog = atoi(optarg);
+            break;
+        case 'D':
+            sock_options.deferAcceptS = atoi(optarg);
+            break;
+        case 'F':
+            sock_options.fastOpenQlen = atoi(optarg);
+            break;
+        case 'y':
+            sock_options.busyPollUs = atoi(optarg);
+            break;
+        case 'u':
+            ctl_path = optarg;
+            break;
+        case 'G':
+            ctl_gid = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s static_dir] [-d history_file] [-p state_file] [-t]"
+                            " [-b epoll|uring] [-f] [-w workers] [-c control_cpu]"
+                            " [-l tx_limit] [-e evict_ms] [-k ping_ms] [-q backlog]"
+                            " [-D defer_accept_s] [-F fastopen_qlen] [-y busy_poll_us]"
+                            " [-u control_socket, \"\": none] [-G control_gid]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
     
+    stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stopFd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
     signal(SIGINT, shutdownHook);
 
+    // Before initWebhouse: its threads inherit the blocked trace signals
+    trace_init(trace_on);
+    trace_thread_name("webhouse");
+
+    // Read the saved state before initWebhouse starts threads that change it
+    restore_ns = metrics_now_ns();
+    if (persist_open(state_path) != 0) {
+        perror(state_path);
+    } else {
+        restored = persist_load(&saved) == 0;
+    }
+    restore_ns = metrics_now_ns() - restore_ns;
+
+    // Local readers (see shmwatch.c) get every state from initWebhouse on
+    if (shm_state_open() != 0) {
+        perror("Shared memory " SHM_STATE_NAME);
+    }
+
     initWebhouse();
+    if (net_config.controlCpu >= 0 && pinWebhouseThreads(net_config.controlCpu) != 0) {
+        fprintf(stderr, "Cannot pin the webhouse threads to CPU %d\n", net_config.controlCpu);
+        net_config.controlCpu = -1;
+    }
+    if (restored) {
+        uint64_t t = metrics_now_ns();
+        restoreWebhouseState(&saved);
+        restore_ns += metrics_now_ns() - t;
+    }
+    persist_start();
     printf("Init Webhouse... Done.\n");
     fflush(stdout);
 
-    // Create TCP socket
-    server_sock_id = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (server_sock_id < 0) {
-        perror("Socket Error");
-        exit(EXIT_FAILURE);
+    // History on disk only on request: it is written to the SD card
+    if (store_path != NULL && (store = tsdb_open(store_path)) == NULL) {
+        perror(store_path);
     }
-
-    // Allow port reuse
-    int option = 1;
-    setsockopt(server_sock_id, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
-
-    // Configure server address
-    memset(&server, 0, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(PORT);            
-    server.sin_addr.s_addr = htonl(INADDR_ANY); 
-
-    // Bind socket to address
-    bind_status = bind(server_sock_id, (struct sockaddr *)&server, sizeof(server));
-    if (bind_status < 0) {
-        perror("Bind Error");
-        close(server_sock_id);
-        exit(EXIT_FAILURE);
+    if (history_start(store) != 0) {
+        perror("History");
     }
 
-    // Listen for connections
-    listen_status = listen(server_sock_id, 5);
-    if (listen_status < 0) {
-        perror("Listen Error");
-        close(server_sock_id);
-        exit(EXIT_FAILURE);
+    // One listening socket per worker, all on the same port (SO_REUSEPORT)
+    for (int i = 0; i < net_config.workers; i++) {
+        listen_socks[i] = sock_listen(PORT, &sock_options);
+        if (listen_socks[i] < 0) {
+            perror("Listen Error");
+            exit(EXIT_FAILURE);
+        }
     }
 
     printf("Server listening on Port %d\n", PORT);
+    printf("Startup: %.3f ms, state %s in %.3f ms\n", (metrics_now_ns() - start_ns) / 1e6,
+           restored ? "restored" : "reset", restore_ns / 1e6);
     fflush(stdout);
 
-    // Main loop: accept and handle connections
-    while (eShutdown == FALSE) {
-        
-        com_sock_id = accept(server_sock_id, (struct sockaddr *)&client, (socklen_t*)&addrlen);
-        
-        if (com_sock_id < 0) {
-            if (eShutdown) break;
-            perror("Accept Error");
-            continue;
-        }
+    // From here on messages go through the logger thread
+    log_init();
 
-        printf("Client connected!\n");
-        fflush(stdout);
+    // Local automation: the same commands without WebSocket (ctlsock.c)
+    if (ctl_path[0] != '\0' && ctl_start(ctl_path, ctl_gid, stopFd) != 0) {
+        LOG_ERROR("Control socket %s: %s", ctl_path, strerror(errno));
+    }
 
-        // Communication loop with connected client
-        while (1) {
-            memset(rxBuf, 0, RX_BUFFER_SIZE);
-            
-            // Receive data from client
-            rx_data_len = recv(com_sock_id, rxBuf, RX_BUFFER_SIZE - 1, 0);
+    // Main loop: accept and handle connections until Ctrl-C
+    net_conn_setup(static_root, tx_limit, evict_ms, ping_ms);
+    net_serve(listen_socks, stopFd, &net_config);
 
-            if (rx_data_len <= 0) {
-                printf("Client disconnected.\n");
-                close(com_sock_id);
-                break;
-            }
-
-            rxBuf[rx_data_len] = '\0';
-
-            // Handle WebSocket handshake
-            if (strncmp(rxBuf, "GET", 3) == 0) {
-                printf("Handshake Request received.\n");
-                
-                char response[WS_HS_ACCLEN];
-                get_handshake_response(rxBuf, response);
-                send(com_sock_id, response, strlen(response), 0);
-                printf("Handshake sent.\n");
-            
-            } else {
-                // Decode and process command
-                char command[rx_data_len + 1];
-                decode_incoming_request(rxBuf, command);
-                command[strlen(command)] = '\0';
-                processCommand(command, com_sock_id);
-            }
-            fflush(stdout);
-        }
-    }
+    ctl_stop();
 
+    history_stop();
+    persist_close();
+    shm_state_close();
+    log_close();
     closeWebhouse();
-    close(server_sock_id);
+    for (int i = 0; i < net_config.workers; i++) {
+        close(listen_socks[i]);
+    }
+    close(stopFd);
     printf ("Close Webhouse\n");
     fflush (stdout);
 
@@ -187,88 +283,279 @@ int main(int argc, char **argv) {
  ******************************************************************************/
 /** \brief        Parses the HTML command string and controls hardware
  * \param[in]    command       Decoded string from WebSocket
- * \param[in]    com_sock_id   Socket ID to send responses back
+ * \param[in]    conn          Connection to send responses back
  ******************************************************************************/
-void processCommand(char *command, int com_sock_id) {
-    printf("Processing Command: %s\n", command);
+void processCommand(char *command, ws_conn_t *conn) {
+    LOG_DEBUG("Processing Command: %s", command);
+
+    Command cmd;
+    TRACE_BEGIN(TRACE_PARSE, 0);
+    parseCommand(command, &cmd);
+    TRACE_END(TRACE_PARSE, cmd.type);
+    metrics_command(cmd.type);
+
+    // A command with an id is acknowledged in a versioned reply. Commands
+    // are processed in order, so a reply held back acknowledges the last
+    // id, which covers the ones before it.
+    if (cmd.hasId) {
+        conn->delta_mode = TRUE;
+        conn->ack = cmd.id;
+        conn->ack_pending = TRUE;
+    }
+
+    TRACE_BEGIN(TRACE_APPLY, cmd.type);
+    switch (cmd.type) {
+    case CMD_GET_STATUS:
+        // Status request only - response sent at end
+        break;
+    case CMD_GET_STATUS_ACK:
+        // Status request acknowledging a state version: switch to deltas.
+        // As the first status of a connection, the client reconnected with
+        // the version it had and is sent what it missed. Later, any other
+        // version than the last one sent means the client missed
+        // something, so it gets a full snapshot.
+        if (!conn->has_sent) {
+            resumeSession(conn, (uint32_t)cmd.value);
+        } else if ((uint32_t)cmd.value != conn->sent.version) {
+            conn->has_sent = FALSE;
+        }
+        conn->delta_mode = TRUE;
+        break;
+    case CMD_SUBSCRIBE:
+        // State changes of these topics are pushed from now on (see
+        // publishStatus), as deltas; <Subscribe:> stops the pushes
+        conn->topics = (unsigned)cmd.value;
+        conn->delta_mode = TRUE;
+        break;
+    case CMD_HISTORY: {
+        // Answered with the history instead of the status
+        char history[HISTORY_TEXT_MAX + 16];
+        int len = history_encode_text((uint32_t)cmd.value, history, HISTORY_TEXT_MAX);
+        if (conn->ack_pending) {
+            len += snprintf(history + len, sizeof(history) - len, ";Ack:%u", (unsigned)conn->ack);
+            conn->ack_pending = FALSE;
+        }
+        TRACE_END(TRACE_APPLY, cmd.type);
+        ws_conn_send(conn, WS_OP_TEXT, history, len);
+        metrics_observe(HIST_RECV_TO_REPLY, metrics_now_ns() - conn->rx_ns);
+        return;
+    }
+    default:
+        applyCommand(&cmd);
+        break;
+    }
+
+    TRACE_END(TRACE_APPLY, cmd.type);
+    metrics_observe(HIST_RECV_TO_APPLY, metrics_now_ns() - conn->rx_ns);
 
+    // A client that does not keep up only gets the latest state, once its
+    // send queue has drained (see net_conn_sent)
+    if (conn->status_pending || tx_queue_over(conn->tx)) {
+        conn->status_pending = TRUE;
+        metrics_inc(METRIC_STATUS_COLLAPSED);
+        return;
+    }
+
+    sendStatus(conn);
+    metrics_observe(HIST_RECV_TO_REPLY, metrics_now_ns() - conn->rx_ns);
+}
+
+/*******************************************************************************
+ * function :    applyCommand
+ ******************************************************************************/
+/** \brief        Controls the hardware for a button, slider or temperature
+ *               command; other commands change nothing
+ * \param[in]    cmd           Parsed command
+ ******************************************************************************/
+void applyCommand(const Command *cmd) {
+    switch (cmd->type) {
     // Process button commands
-    if (strstr(command, "<HeatOn>") != NULL) {
+    case CMD_HEAT_ON:
         turnHeatOn();
-    } 
-    else if (strstr(command, "<HeatOff>") != NULL) {
+        break;
+    case CMD_HEAT_OFF:
         turnHeatOff();
-    }
-    else if (strstr(command, "<L1on>") != NULL) {
+        break;
+    case CMD_L1_ON:
         turnLED1On();
-    }
-    else if (strstr(command, "<L1off>") != NULL) {
+        break;
+    case CMD_L1_OFF:
         turnLED1Off();
-    }
-    else if (strstr(command, "<TVon>") != NULL) {
+        break;
+    case CMD_TV_ON:
         turnTVOn();
-    }
-    else if (strstr(command, "<TVoff>") != NULL) {
+        break;
+    case CMD_TV_OFF:
         turnTVOff();
-    }
-    else if (strstr(command, "<AlarmOn>") != NULL) {
+        break;
+    case CMD_ALARM_ON:
         armAlarm();
-    }
-    else if (strstr(command, "<AlarmOff>") != NULL) {
+        break;
+    case CMD_ALARM_OFF:
         disarmAlarm();
-    }
-    else if (strstr(command, "<L2on>") != NULL) {
-        printf("LED 2 On\n");
+        break;
+    case CMD_L2_ON:
+        LOG_INFO("LED 2 On");
         turnLED2On();
-    }
-    else if (strstr(command, "<L2off>") != NULL) {
-        printf("LED 2 Off\n");
+        break;
+    case CMD_L2_OFF:
+        LOG_INFO("LED 2 Off");
         turnLED2Off();
-    }
-    else if (strstr(command, "<GetStatus>") != NULL) {
-        // Status request only - response sent at end
-    }
-    
+        break;
+
     // Process slider commands
-    else if (strncmp(command, "<Dim1:", 6) == 0) {
-        int value = 0;
-        if (sscanf(command, "<Dim1:%d>", &value) == 1) {
-            printf("Dimmer 1 set to: %d\n", value);
-            dimRLamp((uint16_t)value); 
+    case CMD_DIM1:
+        LOG_INFO("Dimmer 1 set to: %ld", cmd->value);
+        dimRLamp((uint16_t)cmd->value);
+        break;
+    case CMD_DIM2:
+        LOG_INFO("Dimmer 2 set to: %ld", cmd->value);
+        dimSLamp((uint16_t)cmd->value);
+        break;
+    case CMD_SET_TEMP: {
+        LOG_INFO("Target temperature set: %ld°C", cmd->value);
+        // Simple bang-bang temperature control
+        float currentTemp = getTemp();
+        if (currentTemp < (float)cmd->value) {
+            turnHeatOn();
+        } else {
+            turnHeatOff();
         }
+        break;
     }
-    else if (strncmp(command, "<Dim2:", 6) == 0) {
-        int value = 0;
-        if (sscanf(command, "<Dim2:%d>", &value) == 1) {
-            printf("Dimmer 2 set to: %d\n", value);
-            dimSLamp((uint16_t)value);
-        }
+    default:
+        break;
+    }
+}
+
+/*******************************************************************************
+ * function :    sendStatus
+ ******************************************************************************/
+/** \brief        Queue a status reply with the current state
+ * \param[in]    conn          Connection to send the status to
+ ******************************************************************************/
+void sendStatus(ws_conn_t *conn) {
+    WebhouseState state;
+    getWebhouseState(&state);
+    sendState(conn, &state);
+}
+
+/*******************************************************************************
+ * function :    publishStatus
+ ******************************************************************************/
+/** \brief        Push a state change to a connection subscribed to its topics
+ *
+ *               Called by the event loop of the connection for every change
+ *               of the state, see net_conn_publish.
+ *
+ * \param[in]    conn          Connection
+ * \param[in]    state         Current state
+ * \return       TRUE if a reply was queued
+ ******************************************************************************/
+int publishStatus(ws_conn_t *conn, const WebhouseState *state) {
+    if (conn->topics == 0
+            || (conn->has_sent && !(conn->topics & status_topics(&conn->sent, state)))) {
+        return FALSE;
     }
-    else if (strncmp(command, "<SetTemp:", 9) == 0) {
-        int targetTemp = 0;
-        if (sscanf(command, "<SetTemp:%d>", &targetTemp) == 1) {
-            printf("Target temperature set: %d°C\n", targetTemp);
-            // Simple bang-bang temperature control
-            float currentTemp = getTemp();
-            if (currentTemp < (float)targetTemp) {
-                turnHeatOn();
-            } else {
-                turnHeatOff();
+    if (conn->status_pending || tx_queue_over(conn->tx)) {
+        conn->status_pending = TRUE;
+        metrics_inc(METRIC_STATUS_COLLAPSED);
+        return FALSE;
+    }
+    sendState(conn, state);
+    metrics_inc(METRIC_STATUS_PUSHED);
+    return TRUE;
+}
+
+/*******************************************************************************
+ * function :    resumeSession
+ ******************************************************************************/
+/** \brief        Queue the state changes a reconnected client missed
+ *
+ *               One delta per change after the given version, from the
+ *               change log (changelog.c), so that short-lived changes such
+ *               as an alarm edge are not lost. If the version has left the
+ *               log, nothing is queued and the next reply is a snapshot.
+ *               Either way the connection is in delta mode afterwards.
+ *
+ * \param[in]    conn          Connection that has not been sent a state yet
+ * \param[in]    version       Last state version the client has
+ ******************************************************************************/
+void resumeSession(ws_conn_t *conn, uint32_t version) {
+    WebhouseState states[REPLAY_CHUNK];
+    unsigned topics = conn->topics != 0 ? conn->topics : TOPIC_ALL;
+    int n;
+
+    conn->delta_mode = TRUE;
+    conn->has_sent = changelog_get(version, &conn->sent) == 0;
+    if (!conn->has_sent) {
+        metrics_inc(METRIC_RESUME_SNAPSHOTS);
+        return;
+    }
+    while ((n = changelog_read(version, states, REPLAY_CHUNK)) > 0) {
+        for (int i = 0; i < n; i++) {
+            // Changes the client would not see (a temperature step below
+            // 0.1 degree, topics not subscribed) are left out
+            if (topics & status_topics(&conn->sent, &states[i])) {
+                sendState(conn, &states[i]);
             }
         }
+        version = states[n - 1].version;
     }
+    if (n < 0) {
+        // Rolled over while reading: the next reply is a snapshot
+        conn->has_sent = FALSE;
+        metrics_inc(METRIC_RESUME_SNAPSHOTS);
+        return;
+    }
+    metrics_inc(METRIC_SESSIONS_RESUMED);
+}
 
-    // Send response with current status
-    char response_raw[100];
-    float temp = getTemp();
-    int alarmArmed = getAlarmArmedState();
-    int alarmTriggered = getAlarmState();
-    
-    sprintf(response_raw, "Temp:%.1f;AlarmArmed:%d;AlarmTriggered:%d", temp, alarmArmed, alarmTriggered);
-    
-    char codedResponse[strlen(response_raw) + 10];
-    code_outgoing_response(response_raw, codedResponse);
-    send(com_sock_id, codedResponse, strlen(codedResponse), 0);
+/*******************************************************************************
+ * function :    sendState
+ ******************************************************************************/
+/** \brief        Queue a status reply with the given state
+ *
+ * \type         static
+ *
+ * \param[in]    conn          Connection to send the status to
+ * \param[in]    current       State to send
+ ******************************************************************************/
+static void sendState(ws_conn_t *conn, const WebhouseState *current) {
+    TRACE_BEGIN(TRACE_STATUS, 0);
+    WebhouseState state = *current;
+
+    if (conn->delta_mode) {
+        // Replies arrive in order, so the client has applied the last reply
+        // by the time it reads this one: diff against it.
+        const WebhouseState *base = conn->has_sent ? &conn->sent : NULL;
+        const uint32_t *ack = conn->ack_pending ? &conn->ack : NULL;
+        if (base != NULL && conn->topics != 0) {
+            // Topics not subscribed stay as the client has them
+            status_mask(&state, base, conn->topics);
+        }
+        if (conn->options.subprotocol == WS_PROTO_BINARY) {
+            uint8_t frame[STATUS_DELTA_MAX];
+            int len = status_encode_binary_delta(base, &state, ack, frame);
+            ws_conn_send(conn, WS_OP_BINARY, frame, len);
+        } else {
+            char response_raw[160];
+            int len = status_encode_text_delta(base, &state, ack, response_raw, sizeof(response_raw));
+            ws_conn_send(conn, WS_OP_TEXT, response_raw, len);
+        }
+        conn->sent = state;
+        conn->has_sent = TRUE;
+        conn->ack_pending = FALSE;
+    } else if (conn->options.subprotocol == WS_PROTO_BINARY) {
+        StatusFrame frame;
+        int len = status_encode_binary(&state, &frame);
+        ws_conn_send(conn, WS_OP_BINARY, &frame, len);
+    } else {
+        char response_raw[100];
+        int len = status_encode_text(&state, response_raw, sizeof(response_raw));
+        ws_conn_send(conn, WS_OP_TEXT, response_raw, len);
+    }
+    TRACE_END(TRACE_STATUS, 0);
 }
 
 /*******************************************************************************
@@ -284,7 +571,11 @@ void processCommand(char *command, int com_sock_id) {
  *
  ******************************************************************************/
 static void shutdownHook(int32_t sig) {
+    uint64_t one = 1;
+
     printf("Ctrl-C pressed....shutdown hook in main\n");
     fflush(stdout);
-    eShutdown = TRUE;
+    if (write(stopFd, &one, sizeof(one)) < 0) {
+        // Already signalled
+    }
 }
\ No newline at end of file
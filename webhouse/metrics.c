@@ -0,0 +1,332 @@
+/******************************************************************************/
+/** \file       metrics.c
+ *******************************************************************************
+ *
+ * \brief      Counters, gauges and latency histograms, exported for Prometheus
+ *
+ *             Every thread records into a slot of its own (see metrics.h),
+ *             so recording is a couple of loads and stores without locks or
+ *             shared cache lines. Only a scrape of GET /metrics walks all
+ *             slots and sums them up. Wakeups and CPU time are also
+ *             exported per thread, to see which thread keeps the Pi busy.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * metrics_register
+ * metrics_render
+ * * functions  local:
+ * append
+ * sum_counter
+ * sum_gauge
+ * render_histogram
+ * render_threads
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "metrics.h"
+
+//----- Macros -----------------------------------------------------------------
+// Exported histogram buckets: every half power of two from 2^10 ns (~1 us)
+// to 2^35 ns (~34 s). Both fall on HDR bucket boundaries.
+#define EXPORT_MIN_BITS   10
+#define EXPORT_MAX_BITS   35
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    char   *buf;
+    size_t  size;
+    size_t  len;
+    int     truncated;
+} text_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    int         ns;                // counted in ns, exported in seconds
+} metric_info_t;
+
+//----- Data -------------------------------------------------------------------
+__thread metrics_slot_t *metrics_self;
+
+static metrics_slot_t slots[METRICS_MAX_THREADS];
+static unsigned slotCount;
+
+static const metric_info_t counterInfo[METRIC_COMMANDS] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = { "connections_accepted", "TCP connections accepted." },
+    [METRIC_HANDSHAKE_FAILURES]   = { "handshake_failures",   "WebSocket handshakes rejected." },
+    [METRIC_FRAMES_RECEIVED]      = { "frames_received",      "WebSocket frames received." },
+    [METRIC_FRAMES_SENT]          = { "frames_sent",          "WebSocket frames sent." },
+    [METRIC_BYTES_RECEIVED]       = { "bytes_received",       "Bytes received from clients." },
+    [METRIC_BYTES_SENT]           = { "bytes_sent",           "WebSocket bytes sent, frame headers included." },
+    [METRIC_GPIO_WRITES]          = { "gpio_writes",          "GPIO and PWM writes." },
+    [METRIC_LOG_DROPPED]          = { "log_dropped",          "Log messages dropped because a queue was full." },
+    [METRIC_WAKEUPS]              = { "wakeups",              "Returns from sleeping or blocking calls, all threads." },
+    [METRIC_NET_SYSCALLS]         = { "net_syscalls",         "System calls of the network event loops." },
+    [METRIC_STATUS_COLLAPSED]     = { "status_collapsed",     "Status replies held back because the send queue was over its limit." },
+    [METRIC_CLIENTS_EVICTED]      = { "clients_evicted",      "Connections closed for staying over their send queue limit." },
+    [METRIC_HANDSHAKE_TIMEOUTS]   = { "handshake_timeouts",   "Connections closed for not completing the handshake in time." },
+    [METRIC_PINGS_SENT]           = { "pings_sent",           "Keepalive pings sent to silent clients." },
+    [METRIC_PING_TIMEOUTS]        = { "ping_timeouts",        "Connections closed because the client did not answer a ping." },
+    [METRIC_CONTROL_DENIED]       = { "control_denied",       "Control socket commands refused for the credentials of the sender." },
+    [METRIC_STATUS_PUSHED]        = { "status_pushed",        "State changes pushed to connections subscribed to their topics." },
+    [METRIC_SESSIONS_RESUMED]     = { "sessions_resumed",     "Reconnected clients sent only the state changes they missed." },
+    [METRIC_RESUME_SNAPSHOTS]     = { "resume_snapshots",     "Reconnected clients sent a full snapshot, their version had left the change log." },
+    [METRIC_API_REQUESTS]         = { "api_requests",         "Requests to the HTTP API (/api/) answered." },
+    [METRIC_DEFLATE_FRAMES]       = { "deflate_frames",       "Messages sent compressed (permessage-deflate)." },
+    [METRIC_DEFLATE_SKIPPED]      = { "deflate_skipped",      "Messages on compressing connections sent as is, below the minimum size." },
+    [METRIC_DEFLATE_BYTES_IN]     = { "deflate_bytes_in",     "Payload bytes of the compressed messages before compression." },
+    [METRIC_DEFLATE_BYTES_OUT]    = { "deflate_bytes_out",    "Payload bytes of the compressed messages after compression." },
+    [METRIC_DEFLATE_CPU_NS]       = { "deflate_cpu_seconds",  "Thread CPU time spent compressing messages.", 1 },
+};
+
+static const metric_info_t gaugeInfo[METRIC_GAUGES] = {
+    [GAUGE_TX_QUEUED_BYTES] = { "tx_queued_bytes",          "Bytes waiting in the send queues of all connections." },
+    [GAUGE_TX_BACKLOGGED]   = { "tx_backlogged_connections", "Connections over their send queue limit." },
+};
+
+static const metric_info_t histInfo[METRIC_HISTOGRAMS] = {
+    [HIST_RECV_TO_APPLY] = { "recv_to_apply_seconds", "Time from receiving a command to applying it." },
+    [HIST_RECV_TO_REPLY] = { "recv_to_reply_seconds", "Time from receiving a command to sending the status reply." },
+    [HIST_PING_RTT]      = { "ping_rtt_seconds",      "Time from sending a keepalive ping to receiving its pong." },
+};
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    metrics_register
+ ******************************************************************************/
+/** \brief        Assign a slot to the calling thread
+ *
+ *               Called once per thread by the first recording. Threads beyond
+ *               METRICS_MAX_THREADS share the last slot, which may lose
+ *               an increment now and then but never blocks.
+ *
+ * \type         global
+ *
+ * \return       The slot of the calling thread
+ *
+ ******************************************************************************/
+metrics_slot_t *metrics_register(void) {
+    unsigned index = __atomic_fetch_add(&slotCount, 1, __ATOMIC_RELAXED);
+
+    if (index >= METRICS_MAX_THREADS) {
+        // Shared slot: its name and CPU clock belong to the first owner
+        metrics_self = &slots[METRICS_MAX_THREADS - 1];
+        return metrics_self;
+    }
+
+    metrics_slot_t *slot = &slots[index];
+    pthread_getname_np(pthread_self(), slot->name, sizeof(slot->name));
+    slot->hasCpuClock = (pthread_getcpuclockid(pthread_self(), &slot->cpuClock) == 0);
+    metrics_self = slot;
+    return slot;
+}
+
+/*******************************************************************************
+ * function :    append
+ ******************************************************************************/
+static void append(text_t *text, const char *format, ...) {
+    va_list args;
+    int n;
+
+    if (text->truncated) {
+        return;
+    }
+    va_start(args, format);
+    n = vsnprintf(text->buf + text->len, text->size - text->len, format, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= text->size - text->len) {
+        text->truncated = 1;
+        return;
+    }
+    text->len += n;
+}
+
+/*******************************************************************************
+ * function :    sum_counter
+ ******************************************************************************/
+static uint64_t sum_counter(unsigned used, unsigned counter) {
+    uint64_t sum = 0;
+
+    for (unsigned i = 0; i < used; i++) {
+        sum += __atomic_load_n(&slots[i].counters[counter], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/*******************************************************************************
+ * function :    sum_gauge
+ ******************************************************************************/
+static int64_t sum_gauge(unsigned used, unsigned gauge) {
+    int64_t sum = 0;
+
+    for (unsigned i = 0; i < used; i++) {
+        sum += (int64_t)__atomic_load_n((uint64_t *)&slots[i].gauges[gauge], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/*******************************************************************************
+ * function :    render_histogram
+ ******************************************************************************/
+/** \brief        Append one histogram summed over all slots
+ *
+ *               The cumulative buckets are taken from the bucket array, not
+ *               from the separately stored count, so they stay consistent
+ *               even while other threads are recording.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void render_histogram(text_t *text, unsigned used, metric_hist_t id) {
+    const char *name = histInfo[id].name;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    unsigned bucket = 0;
+
+    append(text, "# HELP webhouse_%s %s\n", name, histInfo[id].help);
+    append(text, "# TYPE webhouse_%s histogram\n", name);
+
+    for (unsigned bits = EXPORT_MIN_BITS; bits <= EXPORT_MAX_BITS; bits++) {
+        for (unsigned half = 0; half < 2; half++) {
+            // Upper limit of this exported bucket: 2^bits or 1.5 * 2^bits
+            uint64_t limit = (1ULL << bits) + half * (1ULL << (bits - 1));
+            unsigned last = metrics_bucket(limit);
+
+            for (; bucket < last; bucket++) {
+                for (unsigned i = 0; i < used; i++) {
+                    total += __atomic_load_n(&slots[i].hist[id].buckets[bucket], __ATOMIC_RELAXED);
+                }
+            }
+            append(text, "webhouse_%s_bucket{le=\"%.9g\"} %llu\n",
+                   name, limit / 1e9, (unsigned long long)total);
+        }
+    }
+    for (; bucket < METRICS_BUCKETS; bucket++) {
+        for (unsigned i = 0; i < used; i++) {
+            total += __atomic_load_n(&slots[i].hist[id].buckets[bucket], __ATOMIC_RELAXED);
+        }
+    }
+    for (unsigned i = 0; i < used; i++) {
+        sum += __atomic_load_n(&slots[i].hist[id].sum, __ATOMIC_RELAXED);
+    }
+
+    append(text, "webhouse_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)total);
+    append(text, "webhouse_%s_sum %.9f\n", name, sum / 1e9);
+    append(text, "webhouse_%s_count %llu\n", name, (unsigned long long)total);
+}
+
+/*******************************************************************************
+ * function :    render_threads
+ ******************************************************************************/
+/** \brief        Append wakeups and CPU time per thread and of the process
+ *
+ *               The CPU time of another thread is read through its
+ *               CLOCK_THREAD_CPUTIME_ID clock (pthread_getcpuclockid), the
+ *               process totals come from getrusage.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void render_threads(text_t *text, unsigned used) {
+    struct rusage usage;
+    struct timespec ts;
+
+    append(text, "# HELP webhouse_thread_wakeups_total Returns from sleeping or blocking calls.\n");
+    append(text, "# TYPE webhouse_thread_wakeups_total counter\n");
+    for (unsigned i = 0; i < used; i++) {
+        append(text, "webhouse_thread_wakeups_total{thread=\"%s\",slot=\"%u\"} %llu\n",
+               slots[i].name, i,
+               (unsigned long long)__atomic_load_n(&slots[i].counters[METRIC_WAKEUPS], __ATOMIC_RELAXED));
+    }
+
+    append(text, "# HELP webhouse_thread_cpu_seconds_total CPU time used by the thread.\n");
+    append(text, "# TYPE webhouse_thread_cpu_seconds_total counter\n");
+    for (unsigned i = 0; i < used; i++) {
+        if (slots[i].hasCpuClock && clock_gettime(slots[i].cpuClock, &ts) == 0) {
+            append(text, "webhouse_thread_cpu_seconds_total{thread=\"%s\",slot=\"%u\"} %ld.%09ld\n",
+                   slots[i].name, i, (long)ts.tv_sec, ts.tv_nsec);
+        }
+    }
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        append(text, "# HELP webhouse_process_cpu_seconds_total CPU time of the process.\n");
+        append(text, "# TYPE webhouse_process_cpu_seconds_total counter\n");
+        append(text, "webhouse_process_cpu_seconds_total{mode=\"user\"} %ld.%06ld\n",
+               (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec);
+        append(text, "webhouse_process_cpu_seconds_total{mode=\"system\"} %ld.%06ld\n",
+               (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec);
+        append(text, "# HELP webhouse_process_context_switches_total Context switches of the process.\n");
+        append(text, "# TYPE webhouse_process_context_switches_total counter\n");
+        append(text, "webhouse_process_context_switches_total{kind=\"voluntary\"} %ld\n",
+               usage.ru_nvcsw);
+        append(text, "webhouse_process_context_switches_total{kind=\"involuntary\"} %ld\n",
+               usage.ru_nivcsw);
+    }
+}
+
+/*******************************************************************************
+ * function :    metrics_render
+ ******************************************************************************/
+/** \brief        Sum up all slots in the Prometheus text format (0.0.4)
+ *
+ * \type         global
+ *
+ * \param[out]   out    Text buffer
+ * \param[in]    size   Size of out
+ *
+ * \return       Length of the text, -1 if out is too small
+ *
+ ******************************************************************************/
+int metrics_render(char out[], size_t size) {
+    text_t text = { out, size, 0, 0 };
+    unsigned used = __atomic_load_n(&slotCount, __ATOMIC_RELAXED);
+
+    if (used > METRICS_MAX_THREADS) {
+        used = METRICS_MAX_THREADS;
+    }
+
+    for (unsigned c = 0; c < METRIC_COMMANDS; c++) {
+        append(&text, "# HELP webhouse_%s_total %s\n", counterInfo[c].name, counterInfo[c].help);
+        append(&text, "# TYPE webhouse_%s_total counter\n", counterInfo[c].name);
+        unsigned long long value = sum_counter(used, c);
+        if (counterInfo[c].ns) {
+            append(&text, "webhouse_%s_total %llu.%09llu\n", counterInfo[c].name,
+                   value / 1000000000ULL, value % 1000000000ULL);
+        } else {
+            append(&text, "webhouse_%s_total %llu\n", counterInfo[c].name, value);
+        }
+    }
+
+    append(&text, "# HELP webhouse_commands_total Commands received, by type.\n");
+    append(&text, "# TYPE webhouse_commands_total counter\n");
+    for (unsigned t = 0; t < CMD_COUNT; t++) {
+        append(&text, "webhouse_commands_total{command=\"%s\"} %llu\n", commandName(t),
+               (unsigned long long)sum_counter(used, METRIC_COMMANDS + t));
+    }
+
+    for (unsigned g = 0; g < METRIC_GAUGES; g++) {
+        append(&text, "# HELP webhouse_%s %s\n", gaugeInfo[g].name, gaugeInfo[g].help);
+        append(&text, "# TYPE webhouse_%s gauge\n", gaugeInfo[g].name);
+        append(&text, "webhouse_%s %lld\n", gaugeInfo[g].name, (long long)sum_gauge(used, g));
+    }
+
+    for (unsigned h = 0; h < METRIC_HISTOGRAMS; h++) {
+        render_histogram(&text, used, h);
+    }
+
+    render_threads(&text, used);
+
+    return text.truncated ? -1 : (int)text.len;
+}
@@ -0,0 +1,155 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "command.h"
+
+// Counters, exported as webhouse_<name>_total
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED = 0,
+    METRIC_HANDSHAKE_FAILURES,
+    METRIC_FRAMES_RECEIVED,
+    METRIC_FRAMES_SENT,
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_GPIO_WRITES,
+    METRIC_LOG_DROPPED,
+    METRIC_WAKEUPS,                                // returns from sleeping/blocking calls
+    METRIC_NET_SYSCALLS,                           // system calls of the event loops
+    METRIC_STATUS_COLLAPSED,                       // status replies held back (backlog)
+    METRIC_CLIENTS_EVICTED,                        // closed for staying backlogged
+    METRIC_HANDSHAKE_TIMEOUTS,                     // closed before the upgrade
+    METRIC_PINGS_SENT,                             // keepalive pings to silent clients
+    METRIC_PING_TIMEOUTS,                          // closed: no answer to the ping
+    METRIC_CONTROL_DENIED,                         // control socket commands refused
+    METRIC_STATUS_PUSHED,                          // state changes pushed to subscribers
+    METRIC_SESSIONS_RESUMED,                       // reconnects sent only what they missed
+    METRIC_RESUME_SNAPSHOTS,                       // reconnects older than the change log
+    METRIC_API_REQUESTS,                           // HTTP API requests answered
+    METRIC_DEFLATE_FRAMES,                         // messages sent compressed
+    METRIC_DEFLATE_SKIPPED,                        // below the minimum size, sent as is
+    METRIC_DEFLATE_BYTES_IN,                       // payload bytes before compression
+    METRIC_DEFLATE_BYTES_OUT,                      // payload bytes after compression
+    METRIC_DEFLATE_CPU_NS,                         // thread CPU time in deflate()
+    METRIC_COMMANDS,                               // one counter per CommandType
+    METRIC_COUNTERS = METRIC_COMMANDS + CMD_COUNT
+} metric_counter_t;
+
+// Latency histograms, exported in seconds
+typedef enum {
+    HIST_RECV_TO_APPLY = 0,        // recv() returned -> command applied
+    HIST_RECV_TO_REPLY,            // recv() returned -> status reply sent
+    HIST_PING_RTT,                 // keepalive ping sent -> pong received
+    METRIC_HISTOGRAMS
+} metric_hist_t;
+
+// Gauges, exported as webhouse_<name>. Every thread adds its changes to its
+// own slot; the sum over the slots is the value.
+typedef enum {
+    GAUGE_TX_QUEUED_BYTES = 0,     // bytes in the send queues of all connections
+    GAUGE_TX_BACKLOGGED,           // connections above their send queue limit
+    METRIC_GAUGES
+} metric_gauge_t;
+
+// HDR-style log-linear buckets: 2^METRICS_SUB_BITS buckets per power of two,
+// i.e. a relative error below 1 / 2^METRICS_SUB_BITS, for values up to
+// 2^METRICS_MAX_BITS ns (about 18 minutes).
+#define METRICS_SUB_BITS      4
+#define METRICS_SUB_COUNT     (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS      40
+#define METRICS_BUCKETS       ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_COUNT)
+
+// Threads with a slot of their own; further threads share the last one
+#define METRICS_MAX_THREADS   16
+
+#define METRICS_CACHE_LINE    64
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;                          // ns
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+// Written by its thread only, read by metrics_render. Aligned so that no two
+// threads ever write to the same cache line.
+typedef struct {
+    uint64_t            counters[METRIC_COUNTERS];
+    metrics_histogram_t hist[METRIC_HISTOGRAMS];
+    int64_t             gauges[METRIC_GAUGES];
+    char                name[16];          // thread name at registration
+    clockid_t           cpuClock;          // CPU time clock of the thread
+    int                 hasCpuClock;
+} __attribute__((aligned(METRICS_CACHE_LINE))) metrics_slot_t;
+
+extern __thread metrics_slot_t *metrics_self;
+
+extern metrics_slot_t *metrics_register (void);
+extern int             metrics_render   (char out[], size_t size);
+
+/*******************************************************************************
+ * Recording (hot path)
+ *
+ * Every thread only adds to its own slot, so a plain load and store is enough:
+ * no lock, no atomic read-modify-write. The relaxed atomics only keep the
+ * reader from seeing a torn 64 bit value.
+ ******************************************************************************/
+static inline metrics_slot_t *metrics_slot(void) {
+    metrics_slot_t *slot = metrics_self;
+
+    if (__builtin_expect(slot == NULL, 0)) {
+        slot = metrics_register();
+    }
+    return slot;
+}
+
+static inline void metrics_inc_by(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_add(metric_counter_t counter, uint64_t n) {
+    metrics_inc_by(&metrics_slot()->counters[counter], n);
+}
+
+static inline void metrics_inc(metric_counter_t counter) {
+    metrics_add(counter, 1);
+}
+
+static inline void metrics_gauge_add(metric_gauge_t gauge, int64_t delta) {
+    metrics_inc_by((uint64_t *)&metrics_slot()->gauges[gauge], (uint64_t)delta);
+}
+
+static inline void metrics_command(CommandType type) {
+    metrics_inc((metric_counter_t)(METRIC_COMMANDS + type));
+}
+
+static inline unsigned metrics_bucket(uint64_t ns) {
+    if (ns < METRICS_SUB_COUNT) {
+        return ns;
+    }
+    if (ns >= (1ULL << METRICS_MAX_BITS)) {
+        return METRICS_BUCKETS - 1;
+    }
+    unsigned exp = 63 - __builtin_clzll(ns);
+    return (exp - METRICS_SUB_BITS + 1) * METRICS_SUB_COUNT
+           + ((ns >> (exp - METRICS_SUB_BITS)) & (METRICS_SUB_COUNT - 1));
+}
+
+static inline void metrics_observe(metric_hist_t id, uint64_t ns) {
+    metrics_histogram_t *h = &metrics_slot()->hist[id];
+
+    metrics_inc_by(&h->buckets[metrics_bucket(ns)], 1);
+    metrics_inc_by(&h->sum, ns);
+    metrics_inc_by(&h->count, 1);
+}
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif // METRICS_H
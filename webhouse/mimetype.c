@@ -0,0 +1,47 @@
+/******************************************************************************/
+/** \file       mimetype.c
+ *******************************************************************************
+ *
+ * \brief      Content-Type lookup for the dashboard files
+ *
+ *             Shared by the HTTP server and the mkassets build tool.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * mime_type
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <string.h>
+
+#include "mimetype.h"
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    mime_type
+ ******************************************************************************/
+/** \brief        Map a file extension to its MIME type
+ *
+ * \type         global
+ *
+ * \param[in]    path   File or URL path
+ *
+ * \return       MIME type string
+ *
+ ******************************************************************************/
+const char *mime_type(const char path[]) {
+    const char *ext = strrchr(path, '.');
+
+    if (ext == NULL)                   return "application/octet-stream";
+    if (strcmp(ext, ".html") == 0)     return "text/html; charset=utf-8";
+    if (strcmp(ext, ".css") == 0)      return "text/css; charset=utf-8";
+    if (strcmp(ext, ".js") == 0)       return "text/javascript; charset=utf-8";
+    if (strcmp(ext, ".json") == 0)     return "application/json";
+    if (strcmp(ext, ".svg") == 0)      return "image/svg+xml";
+    if (strcmp(ext, ".png") == 0)      return "image/png";
+    if (strcmp(ext, ".ico") == 0)      return "image/x-icon";
+    return "application/octet-stream";
+}
@@ -0,0 +1,6 @@
+#ifndef MIMETYPE_H
+#define MIMETYPE_H
+
+extern const char *mime_type (const char path[]);
+
+#endif // MIMETYPE_H
@@ -0,0 +1,193 @@
+/******************************************************************************/
+/** \file       mkassets.c
+ *******************************************************************************
+ *
+ * \brief      Build tool: turns gzip-compressed dashboard files into C source
+ *
+ *             Usage: mkassets assets/index.html.gz ... > assets.c
+ *
+ *             For every "<name>.gz" the complete HTTP responses for the URL
+ *             "/<name>" are generated as constant arrays: the "200 OK"
+ *             response (headers with Content-Length, SHA-1 ETag and
+ *             Cache-Control, followed by the gzip body) and the matching
+ *             "304 Not Modified". The server only has to send() them
+ *             (see http_serve_embedded).
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * main
+ * * functions  local:
+ * read_file
+ * emit_bytes
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+
+#include "sha1.h"
+#include "httpserve.h"
+#include "mimetype.h"
+
+//----- Macros -----------------------------------------------------------------
+#define MAX_HEADER 512
+#define MAX_PATH   256
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    char   path[MAX_PATH];
+    char   hash[2 * SHA1HashSize + 1];
+    int    headerLen;
+} asset_info_t;
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    read_file
+ ******************************************************************************/
+/** \brief        Read a whole file into a malloc'ed buffer
+ *
+ * \type         static
+ *
+ * \return       Buffer, NULL on error
+ *
+ ******************************************************************************/
+static unsigned char *read_file(const char *name, size_t *len) {
+    FILE *f = fopen(name, "rb");
+    unsigned char *buf;
+
+    if (f == NULL) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(*len + 1);
+    if (buf != NULL && fread(buf, 1, *len, f) != *len) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+/*******************************************************************************
+ * function :    emit_bytes
+ ******************************************************************************/
+/** \brief        Print a byte range as the body of a C array initializer
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void emit_bytes(const unsigned char *buf, size_t len, size_t *column) {
+    for (size_t i = 0; i < len; i++) {
+        if (*column % 12 == 0) {
+            printf("\n   ");
+        }
+        printf(" 0x%02x,", buf[i]);
+        (*column)++;
+    }
+}
+
+/*******************************************************************************
+ * function :    main
+ ******************************************************************************/
+int main(int argc, char **argv) {
+    asset_info_t *info = calloc(argc, sizeof(asset_info_t));
+
+    if (info == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    printf("/* Generated by mkassets from static/ - do not edit. */\n");
+    printf("#include \"assets.h\"\n");
+
+    for (int i = 1; i < argc; i++) {
+        char name[MAX_PATH];
+        char *path = info[i].path;
+        char etag[2 * SHA1HashSize + 3];
+        char header[MAX_HEADER];
+        char notModified[MAX_HEADER];
+        uint8_t hash[SHA1HashSize];
+        SHA1Context ctx;
+        size_t len;
+        size_t column = 0;
+
+        unsigned char *body = read_file(argv[i], &len);
+        if (body == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        // "dir/style.css.gz" -> "/style.css"
+        snprintf(name, sizeof(name), "%s", argv[i]);
+        snprintf(path, MAX_PATH, "/%s", basename(name));
+        char *ext = strstr(path, ".gz");
+        if (ext == NULL || ext[3] != '\0') {
+            fprintf(stderr, "%s: not a .gz file\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        *ext = '\0';
+
+        SHA1Reset(&ctx);
+        SHA1Input(&ctx, body, len);
+        SHA1Result(&ctx, hash);
+        for (int j = 0; j < SHA1HashSize; j++) {
+            sprintf(&info[i].hash[2 * j], "%02x", hash[j]);
+        }
+        snprintf(etag, sizeof(etag), "\"%s\"", info[i].hash);
+
+        char cacheControl[32];
+        if (strcmp(path, "/index.html") == 0) {
+            strcpy(cacheControl, "no-cache");
+        } else {
+            snprintf(cacheControl, sizeof(cacheControl), "max-age=%d", HTTP_STATIC_MAX_AGE);
+        }
+
+        int headerLen = info[i].headerLen = snprintf(header, sizeof(header),
+                                 "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "Content-Length: %zu\r\n"
+                                 "Content-Encoding: gzip\r\n"
+                                 "ETag: %s\r\n"
+                                 "Cache-Control: %s\r\n"
+                                 "Vary: Accept-Encoding\r\n"
+                                 "Connection: close\r\n\r\n",
+                                 mime_type(path), len, etag, cacheControl);
+        int notModifiedLen = snprintf(notModified, sizeof(notModified),
+                                      "HTTP/1.1 304 Not Modified\r\n"
+                                      "ETag: %s\r\n"
+                                      "Cache-Control: %s\r\n"
+                                      "Vary: Accept-Encoding\r\n"
+                                      "Connection: close\r\n\r\n",
+                                      etag, cacheControl);
+
+        printf("\n/* %s: %zu bytes gzip */\n", path, len);
+        printf("static const unsigned char asset%d_response[] = {", i);
+        emit_bytes((const unsigned char *)header, headerLen, &column);
+        emit_bytes(body, len, &column);
+        printf("\n};\n");
+        printf("static const char asset%d_not_modified[] = {", i);
+        column = 0;
+        emit_bytes((const unsigned char *)notModified, notModifiedLen, &column);
+        printf("\n};\n");
+        free(body);
+    }
+
+    printf("\nconst http_asset_t http_assets[] = {\n");
+    for (int i = 1; i < argc; i++) {
+        printf("    { \"%s\", \"\\\"%s\\\"\",\n"
+               "      asset%d_response, %d, sizeof(asset%d_response),\n"
+               "      asset%d_not_modified, sizeof(asset%d_not_modified) },\n",
+               info[i].path, info[i].hash,
+               i, info[i].headerLen, i, i, i);
+    }
+    printf("};\n");
+    printf("const size_t http_assets_count = %d;\n", argc - 1);
+    free(info);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,830 @@
+/******************************************************************************/
+/** \file       netconn.c
+ *******************************************************************************
+ *
+ * \brief      Protocol handling of one client connection
+ *
+ *             What used to be the receive loop in main(): collect the request
+ *             head, serve plain HTTP or upgrade to a WebSocket, then decode
+ *             frames and pass the commands to processCommand. It does no
+ *             socket I/O of its own except for HTTP responses: the event
+ *             loop (netepoll.c or neturing.c) hands in the bytes it received
+ *             and sends what was queued in tx.
+ *
+ *             The send queue of a connection is bounded: a client that does
+ *             not read (bad Wi-Fi, suspended tab) must not fill the memory of
+ *             the server. Above the limit, the loop stops reading from the
+ *             connection (backpressure), so the queue grows by at most what
+ *             was already received, and status replies are held back: only
+ *             the latest state is sent once the queue has drained to half the
+ *             limit. A client that stays above the limit for evictMs is
+ *             closed: its unsent replies are dropped and a close frame (1008)
+ *             is queued instead, sent as far as the socket takes it.
+ *
+ *             Every connection has one timer on the wheel of its loop
+ *             (timerwheel.c): a client that has not completed the handshake
+ *             after NET_HANDSHAKE_MS is closed. After pingMs without data
+ *             from an upgraded client it gets a ping, and if nothing arrives
+ *             for another pingMs the peer is taken for dead (a tablet that
+ *             lost power never sends a FIN) and the connection is closed.
+ *
+ *             A connection subscribed to topics (<Subscribe:...>) is pushed
+ *             the state changes of these topics. The loop only hears of a
+ *             change while one of its connections is subscribed, see
+ *             net_publish_t; it then calls net_conn_publish for each of them.
+ *
+ *             A client reconnecting with "GET /?v=<version>" is sent the
+ *             state changes it missed right after the handshake, see
+ *             resumeSession in main.c.
+ *
+ *             Requests to the REST API (/api/, see httpapi.c) are answered
+ *             in tx like frames, and the connection is kept for the next
+ *             ones, until it stays idle for NET_KEEPALIVE_MS. Pipelined
+ *             requests are parsed in the receive buffer, one after the
+ *             other; a request of another kind behind them waits until
+ *             their responses are sent.
+ *
+ *             Other HTTP requests (the dashboard, /metrics, /trace) get one
+ *             response each, and the connection is closed once it is sent.
+ *             Its head is queued in tx and its body (a file, an embedded
+ *             asset or a rendered page) follows as the socket takes it, see
+ *             httpserve.c: with sendfile() at an offset of the connection
+ *             that the epoll loop advances when the socket is writable, or
+ *             copied into tx a few chunks at a time by the io_uring loop as
+ *             the previous ones complete (copyBody). A client that takes
+ *             nothing of it, including of what the socket holds, for
+ *             NET_HTTP_TIMEOUT_MS is closed.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * net_conn_setup
+ * net_conn_open
+ * net_conn_rx_space
+ * net_conn_received
+ * net_conn_input
+ * net_conn_sent
+ * net_conn_backlogged
+ * net_conn_timeout
+ * net_conn_publish
+ * net_conn_release
+ * * functions  local:
+ * serveHttp
+ * serveApi
+ * handleRequest
+ * handleFrames
+ * countTx
+ * evict
+ * countSubscriber
+ * resumeVersion
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+
+#include "netconn.h"
+#include "httpserve.h"
+#include "httpapi.h"
+#include "command.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+//----- Function prototypes ----------------------------------------------------
+static int  serveHttp(net_conn_t *conn);
+static int  serveApi(net_conn_t *conn);
+static int  handleRequest(net_conn_t *conn);
+static int  handleFrames(ws_conn_t *conn, uint8_t *buf, size_t *fill);
+static void countTx(net_conn_t *conn);
+static int  evict(net_conn_t *conn);
+static void countSubscriber(net_conn_t *conn);
+static int  resumeVersion(const char *request, uint32_t *version);
+
+//----- Data -------------------------------------------------------------------
+static const char *static_root;    // -s, NULL for the embedded dashboard
+static size_t tx_limit = NET_TX_LIMIT;
+static uint64_t evict_ns = NET_TX_EVICT_MS * 1000000ULL;
+static __thread int backlogged;    // connections of this loop over tx_limit
+static uint64_t ping_ns = NET_PING_MS * 1000000ULL;
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    net_conn_setup
+ ******************************************************************************/
+/** \brief        Set the options of all connections, before the loops start
+ *
+ * \type         global
+ *
+ * \param[in]    staticRoot   Directory of the dashboard files, NULL to serve
+ *                            the embedded ones
+ * \param[in]    txLimit      Send queue limit per connection (bytes)
+ * \param[in]    evictMs      Close a client that stays over the limit this
+ *                            long, 0 to never close it
+ * \param[in]    pingMs       Ping a client silent this long, close it if it
+ *                            stays silent as long again; 0: no pings
+ *
+ ******************************************************************************/
+void net_conn_setup(const char *staticRoot, size_t txLimit, int evictMs, int pingMs) {
+    static_root = staticRoot;
+    tx_limit = txLimit;
+    evict_ns = evictMs > 0 ? (uint64_t)evictMs * 1000000ULL : UINT64_MAX;
+    ping_ns = pingMs > 0 ? (uint64_t)pingMs * 1000000ULL : 0;
+}
+
+/*******************************************************************************
+ * function :    net_conn_open
+ ******************************************************************************/
+/** \brief        Set up the state of an accepted connection
+ *
+ *               Starts its handshake timeout; when the timer of a connection
+ *               expires the loop calls net_conn_timeout.
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void net_conn_open(net_conn_t *conn, int sock, tx_pool_t *pool, tw_wheel_t *wheel,
+                   net_publish_t *publish) {
+    conn->sock = sock;
+    conn->upgraded = FALSE;
+    conn->api = FALSE;
+    conn->responding = FALSE;
+    http_body_init(&conn->body);
+    conn->copyBody = FALSE;
+    conn->rxFill = 0;
+    tx_queue_init(&conn->tx, pool);
+    conn->tx.limit = tx_limit;
+    conn->txCounted = 0;
+    conn->overSince = 0;
+    conn->lastRx = metrics_now_ns();
+    conn->wheel = wheel;
+    conn->timer.data = conn;
+    conn->publish = publish;
+    conn->subscribed = FALSE;
+    tw_schedule(wheel, &conn->timer, conn->lastRx + NET_HANDSHAKE_MS * 1000000ULL);
+}
+
+/*******************************************************************************
+ * function :    net_conn_rx_space
+ ******************************************************************************/
+/** \brief        Free part of the receive buffer, to recv() into
+ *
+ * \type         global
+ *
+ * \param[in]    conn   Connection
+ * \param[out]   len    Size of the free part
+ *
+ * \return       Start of the free part
+ *
+ ******************************************************************************/
+uint8_t *net_conn_rx_space(net_conn_t *conn, size_t *len) {
+    // One byte is kept for the NUL that terminates a request head
+    *len = NET_RX_BUFFER_SIZE - 1 - conn->rxFill;
+    return conn->rx + conn->rxFill;
+}
+
+/*******************************************************************************
+ * function :    net_conn_received
+ ******************************************************************************/
+/** \brief        Handle len bytes received into net_conn_rx_space
+ *
+ * \type         global
+ *
+ * \param[in]    conn    Connection
+ * \param[in]    len     Bytes received
+ * \param[in]    rx_ns   When they were received, for the latency metrics
+ *
+ * \return       0 to keep the connection, -1 to close it once tx is sent
+ *
+ ******************************************************************************/
+int net_conn_received(net_conn_t *conn, size_t len, uint64_t rx_ns) {
+    int result;
+
+    metrics_add(METRIC_BYTES_RECEIVED, len);
+    conn->lastRx = rx_ns;
+    conn->rxFill += len;
+    conn->rx[conn->rxFill] = '\0';
+
+    if (conn->responding) {
+        conn->rxFill = 0;          // the last request, nothing more is read
+        return 0;
+    }
+    if (!conn->upgraded) {
+        return handleRequest(conn);
+    }
+
+    conn->ws.rx_ns = rx_ns;
+    TRACE_BEGIN(TRACE_FRAMES, 0);
+    result = handleFrames(&conn->ws, conn->rx, &conn->rxFill);
+    TRACE_END(TRACE_FRAMES, 0);
+    countSubscriber(conn);
+    return result;
+}
+
+/*******************************************************************************
+ * function :    net_conn_input
+ ******************************************************************************/
+/** \brief        Handle bytes received into a buffer of the event loop
+ *
+ *               Complete frames are decoded in place; only an incomplete
+ *               last frame is copied into the receive buffer of the
+ *               connection. data may be modified (unmasked).
+ *
+ * \type         global
+ *
+ * \param[in]    conn    Connection
+ * \param[in]    data    Bytes received
+ * \param[in]    len     Number of bytes
+ * \param[in]    rx_ns   When they were received, for the latency metrics
+ *
+ * \return       0 to keep the connection, -1 to close it once tx is sent
+ *
+ ******************************************************************************/
+int net_conn_input(net_conn_t *conn, uint8_t data[], size_t len, uint64_t rx_ns) {
+    if (conn->upgraded && conn->rxFill == 0) {
+        metrics_add(METRIC_BYTES_RECEIVED, len);
+        conn->lastRx = rx_ns;
+        conn->ws.rx_ns = rx_ns;
+        TRACE_BEGIN(TRACE_FRAMES, 0);
+        int result = handleFrames(&conn->ws, data, &len);
+        TRACE_END(TRACE_FRAMES, 0);
+        countSubscriber(conn);
+        if (result < 0 || len >= NET_RX_BUFFER_SIZE - 1) {
+            return -1;
+        }
+        memcpy(conn->rx, data, len);
+        conn->rxFill = len;
+        return 0;
+    }
+
+    while (len > 0) {
+        size_t room;
+        uint8_t *space = net_conn_rx_space(conn, &room);
+        size_t n = len < room ? len : room;
+        if (n == 0) {
+            return -1;
+        }
+        memcpy(space, data, n);
+        data += n;
+        len -= n;
+        if (net_conn_received(conn, n, rx_ns) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    net_conn_sent
+ ******************************************************************************/
+/** \brief        Check the send queue after a send, or while backlogged
+ *
+ *               Queues the held back status reply once the queue has
+ *               drained, handles a request that waited for the API
+ *               responses before it, closes a client that stays over
+ *               the limit, and a connection whose HTTP response is sent.
+ *
+ * \type         global
+ *
+ * \param[in]    conn   Connection
+ * \param[in]    now    Current time (metrics_now_ns)
+ *
+ * \return       0 if nothing was queued, 1 if more is queued to be sent,
+ *               -1 to close the connection once tx is sent
+ *
+ ******************************************************************************/
+int net_conn_sent(net_conn_t *conn, uint64_t now) {
+    int queued = 0;
+
+    if (conn->upgraded && conn->ws.status_pending && conn->tx.bytes <= tx_limit / 2) {
+        conn->ws.status_pending = FALSE;
+        sendStatus(&conn->ws);
+        queued = 1;
+    }
+    if (conn->responding) {
+        if (conn->tx.bytes == 0 && http_body_left(&conn->body) == 0) {
+            return -1;
+        }
+        if (conn->copyBody && conn->tx.bytes == 0) {
+            int n = http_body_queue(&conn->body, &conn->tx, NET_BODY_QUEUE);
+            if (n < 0) {
+                return -1;
+            }
+            queued = n > 0;
+        }
+    } else if (!conn->upgraded && conn->rxFill > 0 && conn->tx.bytes == 0) {
+        if (handleRequest(conn) < 0) {
+            return -1;
+        }
+        queued = conn->tx.bytes > 0;
+    }
+
+    if (tx_queue_over(&conn->tx)) {
+        if (conn->overSince == 0) {
+            conn->overSince = now;
+            backlogged++;
+            metrics_gauge_add(GAUGE_TX_BACKLOGGED, 1);
+        }
+        if (now - conn->overSince >= evict_ns) {
+            return evict(conn);
+        }
+    } else if (conn->overSince != 0) {
+        conn->overSince = 0;
+        backlogged--;
+        metrics_gauge_add(GAUGE_TX_BACKLOGGED, -1);
+    }
+    countTx(conn);
+    return queued;
+}
+
+/*******************************************************************************
+ * function :    net_conn_backlogged
+ ******************************************************************************/
+/** \brief        Number of connections of the calling loop over the limit;
+ *               while there are any, the loop calls net_conn_sent for them
+ *               every NET_TX_CHECK_MS
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+int net_conn_backlogged(void) {
+    return backlogged;
+}
+
+/*******************************************************************************
+ * function :    net_conn_timeout
+ ******************************************************************************/
+/** \brief        The timer of the connection expired
+ *
+ *               Closes a connection still without handshake, an idle API
+ *               connection or one whose HTTP response does not get out,
+ *               pings a silent
+ *               client and closes one that did not answer. Otherwise the
+ *               timer is scheduled again, pingMs after the last data.
+ *
+ * \type         global
+ *
+ * \param[in]    conn   Connection
+ * \param[in]    now    Current time (metrics_now_ns)
+ *
+ * \return       0 if nothing was queued, 1 if a ping is queued to be sent,
+ *               -1 to close the connection
+ *
+ ******************************************************************************/
+int net_conn_timeout(net_conn_t *conn, uint64_t now) {
+    if (conn->responding) {
+        // Progress includes what the client took from the socket buffer:
+        // a slow reader frees too little of it to make the loop send more
+        int unsent = 0;
+        ioctl(conn->sock, SIOCOUTQ, &unsent);
+        size_t left = conn->tx.bytes + http_body_left(&conn->body) + (size_t)unsent;
+        if (left != conn->responseLeft) {
+            conn->responseLeft = left;
+            conn->lastTx = now;
+        }
+        if (now - conn->lastTx < NET_HTTP_TIMEOUT_MS * 1000000ULL) {
+            tw_schedule(conn->wheel, &conn->timer, conn->lastTx + NET_HTTP_TIMEOUT_MS * 1000000ULL);
+            return 0;
+        }
+        LOG_INFO("HTTP response timeout.");
+        return -1;
+    }
+    if (!conn->upgraded && conn->api) {
+        LOG_DEBUG("Keep-alive timeout.");
+        return -1;
+    }
+    if (!conn->upgraded) {
+        metrics_inc(METRIC_HANDSHAKE_TIMEOUTS);
+        LOG_INFO("Handshake timeout.");
+        return -1;
+    }
+    if (ping_ns == 0) {
+        return 0;
+    }
+    if (now - conn->lastRx < ping_ns) {
+        tw_schedule(conn->wheel, &conn->timer, conn->lastRx + ping_ns);
+        return 0;
+    }
+    if (conn->ws.ping_ns > conn->lastRx) {
+        // Nothing since the ping, not even the pong
+        metrics_inc(METRIC_PING_TIMEOUTS);
+        LOG_INFO("No answer to ping, client gone.");
+        return -1;
+    }
+
+    conn->ws.ping_ns = now;
+    ws_conn_send(&conn->ws, WS_OP_PING, &conn->ws.ping_ns, sizeof(conn->ws.ping_ns));
+    metrics_inc(METRIC_PINGS_SENT);
+    countTx(conn);
+    tw_schedule(conn->wheel, &conn->timer, now + ping_ns);
+    return 1;
+}
+
+/*******************************************************************************
+ * function :    net_conn_publish
+ ******************************************************************************/
+/** \brief        Push a state change to an upgraded connection, if it is
+ *               subscribed to one of the topics that changed
+ *
+ * \type         global
+ *
+ * \param[in]    state   Current state
+ *
+ * \return       1 if a reply was queued, 0 if not
+ *
+ ******************************************************************************/
+int net_conn_publish(net_conn_t *conn, const WebhouseState *state) {
+    if (!conn->subscribed || !publishStatus(&conn->ws, state)) {
+        return 0;
+    }
+    countTx(conn);
+    return 1;
+}
+
+/*******************************************************************************
+ * function :    net_conn_release
+ ******************************************************************************/
+/** \brief        Free the state of a connection; the socket is closed by the
+ *               event loop
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void net_conn_release(net_conn_t *conn) {
+    tw_cancel(conn->wheel, &conn->timer);
+    if (conn->upgraded) {
+        ws_conn_free(&conn->ws);
+    }
+    if (conn->overSince != 0) {
+        conn->overSince = 0;
+        backlogged--;
+        metrics_gauge_add(GAUGE_TX_BACKLOGGED, -1);
+    }
+    tx_queue_clear(&conn->tx);
+    countTx(conn);
+    http_body_free(&conn->body);
+    conn->upgraded = FALSE;
+    conn->api = FALSE;
+    conn->responding = FALSE;
+    conn->rxFill = 0;
+    countSubscriber(conn);
+}
+
+/*******************************************************************************
+ * function :    handleRequest
+ ******************************************************************************/
+/** \brief        Handle the request head: API request, plain HTTP or
+ *               WebSocket upgrade
+ *
+ * \type         static
+ *
+ * \return       0 to keep the connection, -1 to close it
+ *
+ ******************************************************************************/
+static int handleRequest(net_conn_t *conn) {
+    char *request = (char *)conn->rx;
+
+    // Wait for the complete request head
+    if (strstr(request, "\r\n\r\n") == NULL && conn->rxFill < NET_RX_BUFFER_SIZE - 1) {
+        return 0;
+    }
+
+    // REST API: answered in tx, the connection is kept
+    if (http_api_is_request(request)) {
+        return serveApi(conn);
+    }
+
+    // Anything else waits for the API responses before it to be sent
+    if (conn->tx.bytes > 0) {
+        return 0;
+    }
+
+    // Plain HTTP request: serve the dashboard, drop the connection after it
+    if ((strncmp(request, "GET", 3) == 0 || strncmp(request, "HEAD", 4) == 0)
+            && !http_is_websocket_upgrade(request)) {
+        return serveHttp(conn);
+    }
+
+    // Handle WebSocket handshake
+    LOG_INFO("Handshake Request received.");
+    uint32_t version;
+    int resume = resumeVersion(request, &version) == 0;
+    const char *head = strstr(request, "\r\n\r\n");
+    size_t used = head != NULL ? (size_t)(head + 4 - request) : conn->rxFill;
+    TRACE_BEGIN(TRACE_HANDSHAKE, 0);
+    int hs_result = ws_conn_upgrade(&conn->ws, conn->sock, &conn->tx, request);
+    TRACE_END(TRACE_HANDSHAKE, 0);
+    if (hs_result < 0) {
+        metrics_inc(METRIC_HANDSHAKE_FAILURES);
+        LOG_INFO("Handshake failed.");
+        return -1;
+    }
+    conn->upgraded = TRUE;
+    if (resume) {
+        // The missed changes, then the current state: a client that is up
+        // to date gets just the version
+        resumeSession(&conn->ws, version);
+        sendStatus(&conn->ws);
+    }
+    if (ping_ns > 0) {
+        tw_schedule(conn->wheel, &conn->timer, conn->lastRx + ping_ns);
+    } else {
+        tw_cancel(conn->wheel, &conn->timer);
+    }
+    LOG_INFO("Handshake sent%s.", conn->ws.options.deflate ? " (permessage-deflate)" : "");
+
+    // Frames the client sent right behind the request head, without
+    // waiting for the handshake (a resumed dashboard subscribes at once)
+    memmove(conn->rx, conn->rx + used, conn->rxFill - used);
+    conn->rxFill -= used;
+    if (conn->rxFill == 0) {
+        return 0;
+    }
+    conn->ws.rx_ns = conn->lastRx;
+    int result = handleFrames(&conn->ws, conn->rx, &conn->rxFill);
+    countSubscriber(conn);
+    return result;
+}
+
+/*******************************************************************************
+ * function :    serveHttp
+ ******************************************************************************/
+/** \brief        Answer a plain HTTP request
+ *
+ *               The head of the response is queued in tx, its body set up
+ *               for the loop (see the file comment); net_conn_sent closes
+ *               the connection once both are sent.
+ *
+ * \type         static
+ *
+ * \return       0 to send the response, -1 to close the connection
+ *
+ ******************************************************************************/
+static int serveHttp(net_conn_t *conn) {
+    const char *request = (const char *)conn->rx;
+    int status;
+
+    TRACE_BEGIN(TRACE_HTTP, 0);
+    if (http_path_is(request, "/metrics")) {
+        status = http_serve_metrics(&conn->tx, &conn->body, request);
+    } else if (http_path_is(request, "/trace")) {
+        status = http_serve_trace(&conn->tx, &conn->body, request);
+    } else if (static_root) {
+        status = http_serve_static(&conn->tx, &conn->body, request, static_root);
+    } else {
+        status = http_serve_embedded(&conn->tx, &conn->body, request);
+    }
+    TRACE_END(TRACE_HTTP, status);
+    LOG_INFO("HTTP %.*s -> %d", (int)strcspn(request, "\r\n"), request, status);
+
+    conn->rxFill = 0;
+    conn->responding = TRUE;
+    conn->responseLeft = conn->tx.bytes + http_body_left(&conn->body);
+    conn->lastTx = metrics_now_ns();
+    tw_schedule(conn->wheel, &conn->timer, conn->lastTx + NET_HTTP_TIMEOUT_MS * 1000000ULL);
+    if (status >= 0 && conn->copyBody && http_body_queue(&conn->body, &conn->tx, NET_BODY_QUEUE) < 0) {
+        status = -1;
+    }
+    countTx(conn);
+    return status < 0 ? -1 : 0;
+}
+
+/*******************************************************************************
+ * function :    serveApi
+ ******************************************************************************/
+/** \brief        Answer the API requests at the start of the receive buffer
+ *
+ *               All complete requests are parsed where they are and their
+ *               responses queued in order; the rest is moved to the buffer
+ *               start once. A malformed request is answered with an error,
+ *               and the connection closed after it, as after a request with
+ *               "Connection: close".
+ *
+ * \type         static
+ *
+ * \return       0 to keep the connection, -1 to close it once tx is sent
+ *
+ ******************************************************************************/
+static int serveApi(net_conn_t *conn) {
+    const char *buf = (const char *)conn->rx;
+    size_t offset = 0;
+    http_request_t req;
+    int result = 0;
+
+    while (offset < conn->rxFill && http_api_is_request(buf + offset)) {
+        int parsed = http_parse_request(buf + offset, conn->rxFill - offset, &req);
+        if (parsed == 0) {
+            // A request that can never fit into the buffer
+            if (offset == 0 && conn->rxFill >= NET_RX_BUFFER_SIZE - 1) {
+                http_api_error(&req, &conn->tx, 431);
+                result = -1;
+            }
+            break;
+        }
+        if (parsed < 0) {
+            http_api_error(&req, &conn->tx, req.status);
+            result = -1;
+            break;
+        }
+        TRACE_BEGIN(TRACE_HTTP, 0);
+        int status = http_api_serve(&req, &conn->tx);
+        TRACE_END(TRACE_HTTP, status);
+        offset += req.length;
+        if (status < 0 || !req.keepAlive) {
+            result = -1;
+            break;
+        }
+    }
+
+    memmove(conn->rx, conn->rx + offset, conn->rxFill - offset);
+    conn->rxFill -= offset;
+    conn->rx[conn->rxFill] = '\0';
+    conn->api = TRUE;
+    countTx(conn);
+    if (result == 0) {
+        tw_schedule(conn->wheel, &conn->timer, conn->lastRx + NET_KEEPALIVE_MS * 1000000ULL);
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * function :    handleFrames
+ ******************************************************************************/
+/** \brief        Handle all complete frames in the receive buffer
+ *
+ *               Data frames are passed to processCommand, pings answered,
+ *               pongs timed and a close frame ends the connection. An incomplete last frame
+ *               is moved to the buffer start to be completed by the next recv.
+ *
+ *               Commands are short and sent in one frame, so fragmented
+ *               messages (RFC 6455, section 5.4) are not reassembled: a
+ *               fragment, like an invalid or unmasked frame, fails the
+ *               connection with a close frame (1002). Running it as a
+ *               command would also put the inflate stream of a compressed
+ *               connection out of step.
+ *
+ * \type         static
+ *
+ * \param[in]    conn    Upgraded connection
+ * \param[in]    buf     Receive buffer
+ * \param[inout] fill    Number of bytes in buf
+ *
+ * \return       0 to keep the connection, -1 to close it
+ *
+ ******************************************************************************/
+static int handleFrames(ws_conn_t *conn, uint8_t *buf, size_t *fill) {
+    static const uint8_t protocolError[] = { 1002 >> 8, 1002 & 0xff };
+    size_t offset = 0;
+    ws_frame_t frame;
+    int used;
+
+    while ((used = decode_incoming_frame(buf + offset, *fill - offset, &frame)) > 0) {
+        offset += used;
+        metrics_inc(METRIC_FRAMES_RECEIVED);
+
+        if (!frame.fin || frame.opcode == WS_OP_CONT) {
+            LOG_WARN("Fragmented WebSocket message, connection failed");
+            ws_conn_send(conn, WS_OP_CLOSE, protocolError, sizeof(protocolError));
+            return -1;
+        }
+        if (frame.opcode == WS_OP_CLOSE) {
+            ws_conn_send(conn, WS_OP_CLOSE, frame.payload, frame.length < 2 ? frame.length : 2);
+            return -1;
+        }
+        if (frame.opcode == WS_OP_PING) {
+            ws_conn_send(conn, WS_OP_PONG, frame.payload, frame.length);
+            continue;
+        }
+        if (frame.opcode == WS_OP_PONG) {
+            // Answer to our ping: round trip time, including the client's
+            // event loop (a browser tab in the background is slow)
+            if (conn->ping_ns != 0 && frame.length == sizeof(conn->ping_ns)
+                    && memcmp(frame.payload, &conn->ping_ns, sizeof(conn->ping_ns)) == 0) {
+                metrics_observe(HIST_PING_RTT, conn->rx_ns - conn->ping_ns);
+            }
+            continue;
+        }
+        if (frame.opcode != WS_OP_TEXT && frame.opcode != WS_OP_BINARY) {
+            continue;
+        }
+
+        // Decode and process command
+        uint8_t command[NET_RX_BUFFER_SIZE];
+        if (ws_conn_message(conn, &frame, command, sizeof(command)) < 0) {
+            return -1;
+        }
+        processCommand((char *)command, conn);
+    }
+
+    // Invalid frame, or a frame that can never fit into the buffer
+    if (used < 0) {
+        LOG_WARN("Invalid WebSocket frame, connection failed");
+        ws_conn_send(conn, WS_OP_CLOSE, protocolError, sizeof(protocolError));
+        return -1;
+    }
+    if (offset == 0 && *fill >= NET_RX_BUFFER_SIZE - 1) {
+        return -1;
+    }
+
+    memmove(buf, buf + offset, *fill - offset);
+    *fill -= offset;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    countTx
+ ******************************************************************************/
+/** \brief        Bring GAUGE_TX_QUEUED_BYTES up to date with the queue
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void countTx(net_conn_t *conn) {
+    if (conn->tx.bytes != conn->txCounted) {
+        metrics_gauge_add(GAUGE_TX_QUEUED_BYTES, (int64_t)conn->tx.bytes - (int64_t)conn->txCounted);
+        conn->txCounted = conn->tx.bytes;
+    }
+}
+
+/*******************************************************************************
+ * function :    evict
+ ******************************************************************************/
+/** \brief        Replace the unsent replies of a backlogged client by a
+ *               close frame
+ *
+ * \type         static
+ *
+ * \return       -1: the connection is closed
+ *
+ ******************************************************************************/
+static int evict(net_conn_t *conn) {
+    static const uint8_t policyViolation[] = { 1008 >> 8, 1008 & 0xff };
+    size_t dropped = tx_queue_truncate(&conn->tx, conn->tx.inflight);
+
+    metrics_inc(METRIC_CLIENTS_EVICTED);
+    LOG_WARN("Slow client evicted, %zu bytes dropped", dropped);
+    if (!conn->upgraded) {
+        return -1;
+    }
+    ws_conn_send(&conn->ws, WS_OP_CLOSE, policyViolation, sizeof(policyViolation));
+    countTx(conn);
+    return -1;
+}
+
+/*******************************************************************************
+ * function :    countSubscriber
+ ******************************************************************************/
+/** \brief        Count the connection in the subscribers of its loop once it
+ *               subscribed to some topics, and no longer after <Subscribe:>
+ *               or when it is closed
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void countSubscriber(net_conn_t *conn) {
+    int subscribed = conn->upgraded && conn->ws.topics != 0;
+
+    if (subscribed != conn->subscribed) {
+        conn->subscribed = subscribed;
+        __atomic_add_fetch(&conn->publish->subscribers, subscribed ? 1 : -1, __ATOMIC_RELAXED);
+    }
+}
+
+/*******************************************************************************
+ * function :    resumeVersion
+ ******************************************************************************/
+/** \brief        The version of a resumed session, "v=" in the query of the
+ *               request target ("GET /?v=4711 HTTP/1.1")
+ *
+ * \type         static
+ *
+ * \return       0, -1 if the request has none
+ *
+ ******************************************************************************/
+static int resumeVersion(const char *request, uint32_t *version) {
+    const char *end = strpbrk(request, "\r\n");
+    const char *query = strchr(request, '?');
+
+    if (query == NULL || (end != NULL && query > end)) {
+        return -1;
+    }
+    for (const char *param = query + 1; param != NULL && *param != ' '; ) {
+        if (strncmp(param, "v=", 2) == 0) {
+            int digits = parseUint32(param + 2, version);
+            return (digits > 0 && (param[2 + digits] == '&' || param[2 + digits] == ' ')) ? 0 : -1;
+        }
+        param = strpbrk(param, "& ");
+        param = (param != NULL && *param == '&') ? param + 1 : NULL;
+    }
+    return -1;
+}
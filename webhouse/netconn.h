@@ -0,0 +1,73 @@
+#ifndef NETCONN_H
+#define NETCONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wsconn.h"
+#include "txqueue.h"
+#include "timerwheel.h"
+#include "httpserve.h"
+
+#define NET_RX_BUFFER_SIZE   1024      // largest request head or frame
+#define NET_HTTP_TIMEOUT_MS  2000      // HTTP response without progress
+#define NET_BODY_QUEUE       (8 * 1024) // body copied into tx at a time (io_uring)
+#define NET_TX_LIMIT         (32 * 1024) // send queue limit per connection (-l)
+#define NET_TX_EVICT_MS      10000     // close a client over the limit this long (-e)
+#define NET_TX_CHECK_MS      500       // loop wakeup interval while clients are backlogged
+#define NET_HANDSHAKE_MS     5000      // to complete the request head and upgrade
+#define NET_KEEPALIVE_MS     10000     // idle HTTP API connection kept open
+#define NET_PING_MS          20000     // ping after this long without data (-k)
+
+// State changes for the connections of one event loop: the loop reads fd
+// (eventfd), which is only written while some connection is subscribed
+typedef struct {
+    int        fd;
+    int        subscribers;            // atomic, connections with topics
+} net_publish_t;
+
+// One client connection, independent of the I/O backend: the bytes received
+// go in, the replies come out in tx.
+typedef struct {
+    int        sock;
+    int        upgraded;               // WebSocket, else still HTTP
+    int        api;                    // HTTP API requests answered, keep-alive
+    int        responding;             // HTTP response, closed once it is sent
+    http_body_t body;                  // of the response, behind its head in tx
+    int        copyBody;               // no sendfile: the loop sends tx only
+    size_t     responseLeft;           // tx, body and socket to send, at lastTx
+    uint64_t   lastTx;                 // progress of the response (ns)
+    size_t     rxFill;
+    uint8_t    rx[NET_RX_BUFFER_SIZE];
+    ws_conn_t  ws;
+    tx_queue_t tx;
+    size_t     txCounted;              // tx.bytes as counted in the gauge
+    uint64_t   overSince;              // tx over its limit since (ns), 0: not
+    uint64_t   lastRx;                 // last data received (ns)
+    tw_wheel_t *wheel;                 // of the event loop
+    tw_timer_t timer;                  // handshake, ping or pong timeout
+    net_publish_t *publish;            // of the event loop
+    int        subscribed;             // counted in publish->subscribers
+} net_conn_t;
+
+extern void     net_conn_setup    (const char *staticRoot, size_t txLimit, int evictMs, int pingMs);
+extern void     net_conn_open     (net_conn_t *conn, int sock, tx_pool_t *pool, tw_wheel_t *wheel,
+                                   net_publish_t *publish);
+extern uint8_t *net_conn_rx_space (net_conn_t *conn, size_t *len);
+extern int      net_conn_received (net_conn_t *conn, size_t len, uint64_t rx_ns);
+extern int      net_conn_input    (net_conn_t *conn, uint8_t data[], size_t len, uint64_t rx_ns);
+extern int      net_conn_sent     (net_conn_t *conn, uint64_t now);
+extern int      net_conn_backlogged (void);
+extern int      net_conn_timeout  (net_conn_t *conn, uint64_t now);
+extern int      net_conn_publish  (net_conn_t *conn, const WebhouseState *state);
+extern void     net_conn_release  (net_conn_t *conn);
+
+// The application (main.c): handles one command of an upgraded connection,
+// and queues a status reply; pushes a state change to a subscriber; replays
+// the changes a reconnected client missed
+extern void processCommand(char *command, ws_conn_t *conn);
+extern void sendStatus(ws_conn_t *conn);
+extern int  publishStatus(ws_conn_t *conn, const WebhouseState *state);
+extern void resumeSession(ws_conn_t *conn, uint32_t version);
+
+#endif // NETCONN_H
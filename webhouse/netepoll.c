@@ -0,0 +1,470 @@
+/******************************************************************************/
+/** \file       netepoll.c
+ *******************************************************************************
+ *
+ * \brief      epoll event loop
+ *
+ *             Non-blocking sockets in one epoll set, level triggered. A
+ *             readable connection gets one recv; the replies it queued are
+ *             sent right away with one sendmsg. Only if the socket buffer is
+ *             full the connection waits for EPOLLOUT and the rest is sent
+ *             when it becomes writable, so a slow client never blocks the
+ *             loop. The body of an HTTP response goes the same way, with
+ *             sendfile() behind the queue. A connection over its send queue limit is not read from
+ *             until the queue has drained, and while there are any, the loop
+ *             wakes up every NET_TX_CHECK_MS to evict those that stay there
+ *             (see netconn.c). The timerfd of the timer wheel is in the set
+ *             too, for the handshake and ping timeouts, and the eventfd of
+ *             the state changes, pushed to the subscribed connections.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * net_epoll_run
+ * * functions  local:
+ * conn_accept
+ * conn_update
+ * conn_flush
+ * conn_readable
+ * conn_close
+ * check_backlogged
+ * conn_timeout
+ * publish_state
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "netloop.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+#define MAX_EVENTS         64
+#define MAX_ACCEPTS        64      // per wakeup of the listening socket
+#define KEY_LISTEN         0       // epoll keys; connections are index + KEY_CONN
+#define KEY_STOP           1
+#define KEY_TIMER          2
+#define KEY_PUBLISH        3
+#define KEY_CONN           4
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    net_conn_t conn;
+    int        used;
+    uint32_t   events;             // registered: EPOLLIN unless over the
+                                   // send limit, EPOLLOUT with replies left
+    uint64_t   closeBy;            // closing: end of the grace period (ns)
+} epoll_conn_t;
+
+typedef struct {
+    int           epfd;
+    tx_pool_t     pool;
+    epoll_conn_t *conns;
+    int          *freeList;        // unused indexes, a stack
+    int           freeCount;
+    int           lingering;       // closing connections with replies left
+    tw_wheel_t    wheel;           // connection timeouts
+    net_publish_t *publish;        // state changes to push
+} epoll_loop_t;
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    conn_close
+ ******************************************************************************/
+/** \brief        Send what is queued if possible, then close the connection
+ *
+ *               If the socket does not take all of it (the close frame of
+ *               an evicted client, say), the connection waits for EPOLLOUT
+ *               up to NET_TX_CHECK_MS before it is closed anyway. Nothing is
+ *               received any more meanwhile.
+ *
+ * \type         static
+ *
+ * \param[in]    force   Close at once, also with replies left
+ *
+ ******************************************************************************/
+static void conn_close(epoll_loop_t *loop, int index, int force) {
+    epoll_conn_t *ec = &loop->conns[index];
+
+    if (net_flush_now(&ec->conn) == 0 && !force
+            && (ec->conn.tx.bytes > 0 || http_body_left(&ec->conn.body) > 0)) {
+        if (ec->closeBy == 0) {
+            struct epoll_event event = { EPOLLOUT, { .u64 = KEY_CONN + index } };
+            ec->closeBy = metrics_now_ns() + NET_TX_CHECK_MS * 1000000ULL;
+            loop->lingering++;
+            epoll_ctl(loop->epfd, EPOLL_CTL_MOD, ec->conn.sock, &event);
+            metrics_inc(METRIC_NET_SYSCALLS);
+        }
+        return;
+    }
+    if (ec->closeBy != 0) {
+        ec->closeBy = 0;
+        loop->lingering--;
+    }
+    close(ec->conn.sock);
+    net_conn_release(&ec->conn);
+    ec->used = FALSE;
+    loop->freeList[loop->freeCount++] = index;
+    LOG_INFO("Client disconnected.");
+}
+
+/*******************************************************************************
+ * function :    conn_accept
+ ******************************************************************************/
+/** \brief        Accept the connections waiting in the listen queue
+ *
+ *               Up to MAX_ACCEPTS per wakeup, so that a reconnect storm
+ *               costs one epoll_wait per batch, not per connection, but
+ *               cannot starve the connections already open.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_accept(epoll_loop_t *loop, int listenSock) {
+    for (int i = 0; i < MAX_ACCEPTS; i++) {
+        struct epoll_event event;
+        int sock = accept4(listenSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        metrics_inc(METRIC_NET_SYSCALLS);
+        if (sock < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG_ERROR("Accept Error: %s", strerror(errno));
+            }
+            return;
+        }
+        if (loop->freeCount == 0) {
+            LOG_WARN("Connection table full, client refused");
+            close(sock);
+            continue;
+        }
+
+        int index = loop->freeList[--loop->freeCount];
+        epoll_conn_t *ec = &loop->conns[index];
+        net_conn_open(&ec->conn, sock, &loop->pool, &loop->wheel, loop->publish);
+        ec->used = TRUE;
+        ec->events = EPOLLIN;
+        ec->closeBy = 0;
+
+        event.events = EPOLLIN;
+        event.data.u64 = KEY_CONN + index;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sock, &event) != 0) {
+            LOG_ERROR("epoll_ctl: %s", strerror(errno));
+            conn_close(loop, index, TRUE);
+            continue;
+        }
+
+        metrics_inc(METRIC_CONNECTIONS_ACCEPTED);
+        TRACE_INSTANT(TRACE_ACCEPT, sock);
+        LOG_INFO("Client connected!");
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_update
+ ******************************************************************************/
+/** \brief        Wait for EPOLLOUT while replies, or the body of an HTTP
+ *               response, are left over, and stop reading while the send
+ *               queue is over its limit
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int conn_update(epoll_loop_t *loop, int index) {
+    epoll_conn_t *ec = &loop->conns[index];
+    struct epoll_event event;
+
+    event.events = (tx_queue_over(&ec->conn.tx) ? 0 : EPOLLIN)
+                 | (ec->conn.tx.bytes > 0 || http_body_left(&ec->conn.body) > 0 ? EPOLLOUT : 0);
+    if (event.events == ec->events) {
+        return 0;
+    }
+    event.data.u64 = KEY_CONN + index;
+    metrics_inc(METRIC_NET_SYSCALLS);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, ec->conn.sock, &event) != 0) {
+        return -1;
+    }
+    ec->events = event.events;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    conn_flush
+ ******************************************************************************/
+static int conn_flush(epoll_loop_t *loop, int index) {
+    net_conn_t *conn = &loop->conns[index].conn;
+    int result;
+
+    do {
+        if (net_flush_now(conn) < 0) {
+            return -1;
+        }
+        // May queue a held back status reply, or evict the client
+        result = net_conn_sent(conn, metrics_now_ns());
+    } while (result > 0);
+    if (result < 0) {
+        return -1;
+    }
+    return conn_update(loop, index);
+}
+
+/*******************************************************************************
+ * function :    check_backlogged
+ ******************************************************************************/
+/** \brief        Retry the connections over their send queue limit, evict
+ *               those that stayed there too long, and close those whose
+ *               grace period for closing is over
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void check_backlogged(epoll_loop_t *loop, int maxConns, uint64_t now) {
+    for (int i = 0; i < maxConns; i++) {
+        epoll_conn_t *ec = &loop->conns[i];
+        if (!ec->used) {
+            continue;
+        }
+        if (ec->closeBy != 0) {
+            conn_close(loop, i, now >= ec->closeBy);
+        } else if (ec->conn.overSince != 0 && conn_flush(loop, i) < 0) {
+            conn_close(loop, i, FALSE);
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_timeout
+ ******************************************************************************/
+/** \brief        The timer of a connection expired (tw_expire_t)
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_timeout(tw_timer_t *timer, void *arg) {
+    epoll_loop_t *loop = arg;
+    epoll_conn_t *ec = (epoll_conn_t *)timer->data;    // conn is the first member
+    int index = (int)(ec - loop->conns);
+
+    if (ec->closeBy != 0) {
+        return;                    // closing anyway
+    }
+    int result = net_conn_timeout(&ec->conn, metrics_now_ns());
+    if (result > 0) {
+        result = conn_flush(loop, index);
+    }
+    if (result < 0) {
+        conn_close(loop, index, FALSE);
+    }
+}
+
+/*******************************************************************************
+ * function :    publish_state
+ ******************************************************************************/
+/** \brief        Push the current state to the subscribed connections
+ *
+ *               A bitmask test per connection (net_conn_publish): with at
+ *               most maxConns per loop and a change every second or so, a
+ *               scan costs less than keeping subscriber lists per topic.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void publish_state(epoll_loop_t *loop, int maxConns) {
+    WebhouseState state;
+    uint64_t changes;
+
+    metrics_inc(METRIC_NET_SYSCALLS);
+    if (read(loop->publish->fd, &changes, sizeof(changes)) != sizeof(changes)) {
+        return;
+    }
+    getWebhouseState(&state);
+    for (int i = 0; i < maxConns; i++) {
+        epoll_conn_t *ec = &loop->conns[i];
+        if (!ec->used || ec->closeBy != 0) {
+            continue;
+        }
+        int result = net_conn_publish(&ec->conn, &state);
+        if (result > 0) {
+            result = conn_flush(loop, i);
+        }
+        if (result < 0) {
+            conn_close(loop, i, FALSE);
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_readable
+ ******************************************************************************/
+/** \brief        Receive and handle what arrived, send the replies
+ *
+ * \type         static
+ *
+ * \return       0 to keep the connection, -1 to close it
+ *
+ ******************************************************************************/
+static int conn_readable(epoll_loop_t *loop, int index) {
+    net_conn_t *conn = &loop->conns[index].conn;
+    size_t room;
+    uint8_t *space = net_conn_rx_space(conn, &room);
+
+    ssize_t len = recv(conn->sock, space, room, 0);
+    uint64_t rx_ns = metrics_now_ns();
+    metrics_inc(METRIC_NET_SYSCALLS);
+    TRACE_INSTANT(TRACE_RECV, len);
+
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (len <= 0) {
+        return -1;
+    }
+    if (net_conn_received(conn, len, rx_ns) < 0) {
+        return -1;
+    }
+    return conn_flush(loop, index);
+}
+
+/*******************************************************************************
+ * function :    net_epoll_run
+ ******************************************************************************/
+/** \brief        Run the epoll event loop until stopFd becomes readable
+ *
+ * \type         global
+ *
+ * \return       0 after shutdown, -1 if the loop could not be set up
+ *
+ ******************************************************************************/
+int net_epoll_run(int listenSock, int stopFd, net_publish_t *publish,
+                  const net_config_t *config) {
+    epoll_loop_t loop;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    int maxConns = config->maxConns > 0 ? config->maxConns : NET_MAX_CONNS;
+    int stopped = FALSE;
+    uint64_t lastCheck = 0;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop.conns = calloc(maxConns, sizeof(*loop.conns));
+    loop.freeList = malloc(maxConns * sizeof(*loop.freeList));
+    loop.wheel.fd = -1;
+    loop.publish = publish;
+    if (loop.epfd < 0 || loop.conns == NULL || loop.freeList == NULL
+            || tw_open(&loop.wheel) != 0
+            || tx_pool_init(&loop.pool, TX_POOL_CHUNKS) != 0) {
+        if (loop.epfd >= 0) close(loop.epfd);
+        tw_close(&loop.wheel);
+        free(loop.conns);
+        free(loop.freeList);
+        return -1;
+    }
+    for (int i = maxConns; i-- > 0; ) {
+        loop.freeList[loop.freeCount++] = i;
+    }
+
+    event.events = EPOLLIN;
+    event.data.u64 = KEY_LISTEN;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenSock, &event);
+    event.data.u64 = KEY_STOP;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, stopFd, &event);
+    event.data.u64 = KEY_TIMER;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wheel.fd, &event);
+    event.data.u64 = KEY_PUBLISH;
+    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, publish->fd, &event);
+    LOG_INFO("Event loop: epoll");
+
+    while (!stopped) {
+        int checking = net_conn_backlogged() > 0 || loop.lingering > 0;
+        int timeout = checking ? NET_TX_CHECK_MS : -1;
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout);
+        metrics_inc(METRIC_WAKEUPS);
+        metrics_inc(METRIC_NET_SYSCALLS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t key = events[i].data.u64;
+            if (key == KEY_LISTEN) {
+                conn_accept(&loop, listenSock);
+                continue;
+            }
+            if (key == KEY_STOP) {
+                stopped = TRUE;
+                continue;
+            }
+            if (key == KEY_TIMER) {
+                uint64_t ticks;
+                if (read(loop.wheel.fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+                    tw_advance(&loop.wheel, metrics_now_ns(), conn_timeout, &loop);
+                }
+                metrics_inc(METRIC_NET_SYSCALLS);
+                continue;
+            }
+            if (key == KEY_PUBLISH) {
+                publish_state(&loop, maxConns);
+                continue;
+            }
+
+            int index = (int)(key - KEY_CONN);
+            if (!loop.conns[index].used) {
+                continue;              // closed by an earlier event of this batch
+            }
+            if (loop.conns[index].closeBy != 0) {
+                conn_close(&loop, index, (events[i].events & (EPOLLHUP | EPOLLERR)) != 0);
+                continue;
+            }
+            int result = 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                result = conn_readable(&loop, index);
+            }
+            if (result == 0 && (events[i].events & EPOLLOUT)) {
+                result = conn_flush(&loop, index);
+            }
+            if (result < 0) {
+                conn_close(&loop, index, FALSE);
+            }
+        }
+
+        if (checking) {
+            uint64_t now = metrics_now_ns();
+            if (now - lastCheck >= NET_TX_CHECK_MS * 1000000ULL) {
+                lastCheck = now;
+                check_backlogged(&loop, maxConns, now);
+            }
+        }
+    }
+
+    for (int i = 0; i < maxConns; i++) {
+        if (loop.conns[i].used) {
+            conn_close(&loop, i, TRUE);
+        }
+    }
+    close(loop.epfd);
+    tw_close(&loop.wheel);
+    tx_pool_free(&loop.pool);
+    free(loop.conns);
+    free(loop.freeList);
+    return 0;
+}
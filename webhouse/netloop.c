@@ -0,0 +1,333 @@
+/******************************************************************************/
+/** \file       netloop.c
+ *******************************************************************************
+ *
+ * \brief      Choice of the event loop backend
+ *
+ *             Two backends serve the connections, with the same protocol
+ *             code (netconn.c):
+ *
+ *             epoll   readiness based: epoll_wait, then recv and send per
+ *                     connection. Works everywhere.
+ *             uring   completion based (io_uring, Linux 6.0): one multishot
+ *                     accept, one multishot recv per connection into a ring
+ *                     of provided buffers, replies as linked sends. All of
+ *                     it is submitted and reaped with one io_uring_enter per
+ *                     loop iteration, however many connections are busy.
+ *
+ *             The backend is chosen with -b; if io_uring is not available
+ *             (old kernel, disabled by sysctl or seccomp) epoll is used.
+ *
+ *             With -w N there are N workers, each a thread with its own
+ *             listening socket on the same port (SO_REUSEPORT, sockopt.c),
+ *             its own event loop and connection table: the kernel spreads the
+ *             incoming connections over the sockets, and the workers share
+ *             nothing but the device state (Webhouse.h) and the metrics.
+ *             With -c CPU the workers are pinned to the other CPUs, so that
+ *             CPU is left to the temperature and PWM threads.
+ *
+ *             Every worker has an eventfd for the changes of the state, to
+ *             push them to its subscribed connections (netconn.c). It is only
+ *             written for workers with subscribers, so the loops of a server
+ *             without any do not wake up for the temperature every second.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * net_serve
+ * net_run
+ * net_parse_backend
+ * net_backend_name
+ * net_flush_now
+ * * functions  local:
+ * worker_cpus
+ * worker_main
+ * state_changed
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "netloop.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    pthread_t             thread;
+    int                   index;
+    int                   listenSock;
+    int                   stopFd;
+    int                   cpu;             // -1: not pinned
+    const net_config_t   *config;
+} net_worker_t;
+
+//----- Data -------------------------------------------------------------------
+// Of the workers, for state_changed
+static net_publish_t publishers[NET_MAX_WORKERS];
+static int publisherCount;
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    worker_cpus
+ ******************************************************************************/
+/** \brief        CPUs for the workers: all allowed ones but controlCpu
+ *
+ * \type         static
+ *
+ * \return       Number of CPUs in cpus
+ *
+ ******************************************************************************/
+static int worker_cpus(int controlCpu, int cpus[], int max) {
+    cpu_set_t allowed;
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+        if (cpu != controlCpu && CPU_ISSET(cpu, &allowed)) {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+/*******************************************************************************
+ * function :    worker_main
+ ******************************************************************************/
+/** \brief        Thread of one worker: pin it, then run its event loop
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void *worker_main(void *pdata) {
+    net_worker_t *worker = pdata;
+    char name[16];
+
+    if (worker->index > 0) {
+        snprintf(name, sizeof(name), "net%d", worker->index);
+        trace_thread_name(name);
+    }
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (result != 0) {
+            LOG_WARN("Worker %d: CPU %d: %s", worker->index, worker->cpu, strerror(result));
+        }
+    }
+    if (net_run(worker->listenSock, worker->stopFd, &publishers[worker->index],
+                worker->config) != 0) {
+        LOG_ERROR("Worker %d: event loop: %s", worker->index, strerror(errno));
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * function :    state_changed
+ ******************************************************************************/
+/** \brief        Wake the workers with subscribed connections after a change
+ *               of the state (StateListener, called unlocked on the thread
+ *               that publishes; one call may stand for several changes)
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void state_changed(const WebhouseState *state) {
+    uint64_t one = 1;
+
+    (void)state;                   // the loops read the latest when they wake
+    for (int i = 0; i < publisherCount; i++) {
+        if (__atomic_load_n(&publishers[i].subscribers, __ATOMIC_RELAXED) > 0
+                && write(publishers[i].fd, &one, sizeof(one)) < 0) {
+            LOG_WARN("Worker %d: eventfd: %s", i, strerror(errno));
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    net_serve
+ ******************************************************************************/
+/** \brief        Run config->workers event loops until stopFd becomes readable
+ *
+ *               Worker 0 runs in the calling thread, the others in threads
+ *               of their own.
+ *
+ * \type         global
+ *
+ * \param[in]    listenSocks   One listening socket per worker (sock_listen)
+ * \param[in]    stopFd        Readable when the server shuts down (eventfd)
+ * \param[in]    config        Backend, workers and their options
+ *
+ * \return       0 after shutdown, -1 if the loops could not be set up
+ *
+ ******************************************************************************/
+int net_serve(const int listenSocks[], int stopFd, const net_config_t *config) {
+    net_worker_t workers[NET_MAX_WORKERS];
+    int cpus[CPU_SETSIZE];
+    int cpuCount = 0;
+    int count = config->workers < 1 ? 1 : config->workers;
+
+    if (count > NET_MAX_WORKERS) {
+        count = NET_MAX_WORKERS;
+    }
+    if (config->controlCpu >= 0) {
+        cpuCount = worker_cpus(config->controlCpu, cpus, CPU_SETSIZE);
+        if (cpuCount == 0) {
+            LOG_WARN("No CPU left besides CPU %d, workers not pinned", config->controlCpu);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        publishers[i].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        publishers[i].subscribers = 0;
+        if (publishers[i].fd < 0) {
+            LOG_ERROR("Worker %d: eventfd: %s", i, strerror(errno));
+            while (i-- > 0) {
+                close(publishers[i].fd);
+            }
+            return -1;
+        }
+    }
+    publisherCount = count;
+    setStateListener(state_changed);
+
+    for (int i = 0; i < count; i++) {
+        workers[i].index = i;
+        workers[i].listenSock = listenSocks[i];
+        workers[i].stopFd = stopFd;
+        workers[i].cpu = cpuCount > 0 ? cpus[i % cpuCount] : -1;
+        workers[i].config = config;
+    }
+    for (int i = 1; i < count; i++) {
+        int result = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (result != 0) {
+            LOG_ERROR("Worker %d: %s", i, strerror(result));
+            count = i;
+            break;
+        }
+    }
+    LOG_INFO("%d worker%s", count, count > 1 ? "s" : "");
+
+    worker_main(&workers[0]);
+    for (int i = 1; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    setStateListener(NULL);
+    for (int i = 0; i < publisherCount; i++) {
+        close(publishers[i].fd);
+    }
+    publisherCount = 0;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    net_run
+ ******************************************************************************/
+/** \brief        Serve the listening socket until stopFd becomes readable
+ *
+ * \type         global
+ *
+ * \param[in]    listenSock   Listening socket
+ * \param[in]    stopFd       Readable when the server shuts down (eventfd)
+ * \param[in]    publish      State changes for the subscribed connections
+ * \param[in]    config       Backend and its options
+ *
+ * \return       0 after shutdown, -1 on error
+ *
+ ******************************************************************************/
+int net_run(int listenSock, int stopFd, net_publish_t *publish, const net_config_t *config) {
+    if (config->backend == NET_BACKEND_URING) {
+        if (net_uring_run(listenSock, stopFd, publish, config) == 0) {
+            return 0;
+        }
+        LOG_WARN("io_uring not available (%s), using epoll", strerror(errno));
+    }
+    return net_epoll_run(listenSock, stopFd, publish, config);
+}
+
+/*******************************************************************************
+ * function :    net_parse_backend
+ ******************************************************************************/
+/** \brief        Backend by name ("epoll", "uring")
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 if the name is unknown
+ *
+ ******************************************************************************/
+int net_parse_backend(const char *name, net_backend_t *backend) {
+    if (strcmp(name, "epoll") == 0) {
+        *backend = NET_BACKEND_EPOLL;
+    } else if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0) {
+        *backend = NET_BACKEND_URING;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    net_backend_name
+ ******************************************************************************/
+const char *net_backend_name(net_backend_t backend) {
+    return backend == NET_BACKEND_URING ? "io_uring" : "epoll";
+}
+
+/*******************************************************************************
+ * function :    net_flush_now
+ ******************************************************************************/
+/** \brief        Send as much of the queue, and then of the body of an HTTP
+ *               response, as the socket takes right now
+ *
+ *               sendmsg with all queued chunks, without blocking. Not for
+ *               a queue with sends in flight (io_uring).
+ *
+ * \type         global
+ *
+ * \return       0 if all was sent or the socket is full, -1 on error
+ *
+ ******************************************************************************/
+int net_flush_now(net_conn_t *conn) {
+    struct iovec iov[16];
+    struct msghdr msg;
+    int result = 0;
+
+    TRACE_BEGIN(TRACE_SEND, conn->tx.bytes);
+    while (conn->tx.bytes > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = tx_queue_peek(&conn->tx, 0, iov, 16);
+        // A response head goes out in one segment with its body
+        int more = http_body_left(&conn->body) > 0 ? MSG_MORE : 0;
+        ssize_t n = sendmsg(conn->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | more);
+        metrics_inc(METRIC_NET_SYSCALLS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            break;
+        }
+        tx_queue_consume(&conn->tx, n);
+    }
+    if (result == 0 && conn->tx.bytes == 0 && http_body_left(&conn->body) > 0) {
+        result = http_body_send(&conn->body, conn->sock);
+    }
+    TRACE_END(TRACE_SEND, 0);
+    return result;
+}
@@ -0,0 +1,37 @@
+#ifndef NETLOOP_H
+#define NETLOOP_H
+
+#include "netconn.h"
+
+// Event loop serving the listening socket, see netloop.c
+typedef enum {
+    NET_BACKEND_EPOLL = 0,
+    NET_BACKEND_URING
+} net_backend_t;
+
+#define NET_MAX_CONNS      1024    // connections per loop
+#define NET_MAX_WORKERS    8       // event loops
+
+typedef struct {
+    net_backend_t backend;
+    int           fixed;           // io_uring: register files and send buffers
+    int           maxConns;
+    int           workers;         // event loops, one listening socket each
+    int           controlCpu;      // CPU left to the webhouse threads, the
+                                   // workers run on the others; -1: no pinning
+} net_config_t;
+
+extern int         net_serve         (const int listenSocks[], int stopFd, const net_config_t *config);
+extern int         net_run           (int listenSock, int stopFd, net_publish_t *publish,
+                                      const net_config_t *config);
+extern int         net_parse_backend (const char *name, net_backend_t *backend);
+extern const char *net_backend_name  (net_backend_t backend);
+extern int         net_flush_now     (net_conn_t *conn);
+
+// Backends: -1 with errno set if the loop could not be set up
+extern int net_epoll_run (int listenSock, int stopFd, net_publish_t *publish,
+                          const net_config_t *config);
+extern int net_uring_run (int listenSock, int stopFd, net_publish_t *publish,
+                          const net_config_t *config);
+
+#endif // NETLOOP_H
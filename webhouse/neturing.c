@@ -0,0 +1,1149 @@
+/******************************************************************************/
+/** \file       neturing.c
+ *******************************************************************************
+ *
+ * \brief      io_uring event loop
+ *
+ *             Completion based: the kernel does the I/O, the loop only
+ *             handles the results. Requests in flight:
+ *
+ *             - one multishot accept on the listening socket
+ *             - one multishot recv per connection, into buffers taken from a
+ *               ring of provided buffers (no buffer per idle connection)
+ *             - per connection with queued replies, one send per chunk of
+ *               the queue, linked so they complete in order; MSG_WAITALL
+ *               makes the kernel finish a short send before the next
+ *
+ *             Replies are collected for all completions of one iteration and
+ *             submitted together with the next wait: one io_uring_enter per
+ *             iteration, however many connections were served.
+ *
+ *             With -f the connections are registered as fixed files and the
+ *             send chunks as one fixed buffer, which saves the file lookup
+ *             and the page pinning per request. The sends are then zero-copy
+ *             (SEND_ZC), so sent chunks are only reused after the kernel
+ *             signals that it is done with them.
+ *
+ *             While the send queue of a connection is over its limit, its
+ *             recv is cancelled, so it is not read from until the queue has
+ *             drained. While there are such clients, a timeout request wakes
+ *             the loop every NET_TX_CHECK_MS to evict those that stay there
+ *             (see netconn.c). An evicted client, or one that timed out,
+ *             may never read again, so its sends in flight would never
+ *             complete: if they are not done after NET_TX_CHECK_MS, its
+ *             socket is shut down. Zero-copy pages still wait in the
+ *             socket for an ACK that never comes, so one check later the
+ *             socket is closed with a reset, which frees them.
+ *
+ *             There is no sendfile request: the body of an HTTP response
+ *             is copied into the send queue NET_BODY_QUEUE bytes at a time,
+ *             the next part when the sends of the last one have completed
+ *             (see netconn.c).
+ *
+ *             The timer wheel of the connection timeouts is driven by a read
+ *             of its timerfd, always in flight, and so are the pushes of the
+ *             state changes to the subscribed connections, by a read of the
+ *             eventfd of the loop.
+ *
+ *             No liburing: the few ring operations needed are below, on top
+ *             of the kernel interface in <linux/io_uring.h>.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * net_uring_run
+ * * functions  local:
+ * sys_io_uring_setup
+ * sys_io_uring_enter
+ * sys_io_uring_register
+ * ring_open
+ * ring_close
+ * ring_sqe
+ * ring_submit
+ * ring_supports
+ * buffers_open
+ * buffer_recycle
+ * arm_accept
+ * arm_recv
+ * arm_stop
+ * arm_timer
+ * arm_tick
+ * arm_publish
+ * conn_pause
+ * conn_send
+ * conn_drop_socket
+ * conn_close
+ * conn_evict
+ * conn_sent
+ * conn_timeout
+ * check_backlogged
+ * conn_finish
+ * conn_put
+ * handle_accept
+ * handle_recv
+ * handle_send
+ * handle_publish
+ * handle_completion
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+
+#include "netloop.h"
+#include "metrics.h"
+#include "trace.h"
+#include "logger.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+#define SQ_ENTRIES         256
+#define CQ_ENTRIES         4096
+#define RECV_BUFFERS       256     // provided buffers, power of two
+#define RECV_BUFFER_SIZE   2048
+#define RECV_GROUP         0
+#define MAX_LINKED_SENDS   16      // sends per connection in flight
+
+// user_data: operation in the upper half, connection index in the lower
+#define OP_ACCEPT          1
+#define OP_RECV            2
+#define OP_SEND            3
+#define OP_STOP            4
+#define OP_TIMER           5
+#define OP_CANCEL          6
+#define OP_TICK            7
+#define OP_PUBLISH         8
+#define USER_DATA(op, index)   (((uint64_t)(op) << 32) | (uint32_t)(index))
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    int                  fd;
+    unsigned             sqEntries;
+    unsigned            *sqHead;
+    unsigned            *sqTail;
+    unsigned            *sqMask;
+    unsigned            *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned             sqLocal;      // tail including prepared entries
+    unsigned             toSubmit;
+    unsigned            *cqHead;
+    unsigned            *cqTail;
+    unsigned            *cqMask;
+    struct io_uring_cqe *cqes;
+    void                *sqMap;
+    size_t               sqMapSize;
+    void                *cqMap;
+    size_t               cqMapSize;
+    size_t               sqeMapSize;
+} ring_t;
+
+typedef struct {
+    net_conn_t conn;
+    int        used;
+    int        refs;               // completions still to come, +1 while open
+    int        receiving;          // multishot recv armed
+    int        paused;             // over the send limit, recv cancelled
+    int        sends;              // sends in flight
+    int        notifs;             // zero-copy notifications to come
+    int        closing;
+    int        dirty;              // in the list of connections to send
+    uint64_t   closeBy;            // evicted: shut down after this (ns)
+    int        shut;               // evicted and shut down, reset next
+} uring_conn_t;
+
+typedef struct {
+    ring_t                  ring;
+    int                     fixed;
+    int                     listenSock;
+    int                     stopFd;
+    int                     stopped;
+    int                     timerArmed;
+    int                     lingering; // evicted connections not yet freed
+    struct __kernel_timespec timeout;  // of the timer, read at submission
+    tw_wheel_t              wheel;     // connection timeouts
+    uint64_t                ticks;     // read from wheel.fd
+    net_publish_t          *publish;   // state changes to push
+    uint64_t                changes;   // read from publish->fd
+    tx_pool_t               pool;
+    struct io_uring_buf_ring *bufRing;
+    uint8_t                *bufs;
+    unsigned                bufTail;
+    uring_conn_t           *conns;
+    int                     maxConns;
+    int                    *freeList;
+    int                     freeCount;
+    int                    *dirty;     // connections with replies to submit
+    int                     dirtyCount;
+} uring_loop_t;
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    sys_io_uring_setup
+ ******************************************************************************/
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+/*******************************************************************************
+ * function :    sys_io_uring_enter
+ ******************************************************************************/
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+/*******************************************************************************
+ * function :    sys_io_uring_register
+ ******************************************************************************/
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nrArgs) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/*******************************************************************************
+ * function :    ring_open
+ ******************************************************************************/
+/** \brief        Create the ring and map its queues
+ *
+ *               Only this thread submits (SINGLE_ISSUER), and completion
+ *               work runs when it waits (DEFER_TASKRUN), not in between;
+ *               kernels before 6.1 do without.
+ *
+ * \type         static
+ *
+ * \return       0 on success, -1 on error (errno set)
+ *
+ ******************************************************************************/
+static int ring_open(ring_t *ring) {
+    struct io_uring_params params;
+    uint8_t *sq;
+    uint8_t *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = CQ_ENTRIES;
+    ring->fd = sys_io_uring_setup(SQ_ENTRIES, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = CQ_ENTRIES;
+        ring->fd = sys_io_uring_setup(SQ_ENTRIES, &params);
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cqMapSize > ring->sqMapSize) {
+        ring->sqMapSize = ring->cqMapSize;
+    }
+    ring->sqeMapSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, ring->sqeMapSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int error = errno;
+        if (ring->sqMap != MAP_FAILED) munmap(ring->sqMap, ring->sqMapSize);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqeMapSize);
+        close(ring->fd);
+        errno = error;
+        return -1;
+    }
+    ring->cqMap = ring->sqMap;     // IORING_FEAT_SINGLE_MMAP
+
+    sq = ring->sqMap;
+    cq = ring->cqMap;
+    ring->sqEntries = params.sq_entries;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sqLocal = *ring->sqTail;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    ring_close
+ ******************************************************************************/
+static void ring_close(ring_t *ring) {
+    munmap(ring->sqes, ring->sqeMapSize);
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+}
+
+/*******************************************************************************
+ * function :    ring_submit
+ ******************************************************************************/
+/** \brief        Submit the prepared entries, optionally wait for completions
+ *
+ * \type         static
+ *
+ * \return       Result of io_uring_enter
+ *
+ ******************************************************************************/
+static int ring_submit(ring_t *ring, unsigned minComplete) {
+    int result;
+
+    __atomic_store_n(ring->sqTail, ring->sqLocal, __ATOMIC_RELEASE);
+    result = sys_io_uring_enter(ring->fd, ring->toSubmit, minComplete,
+                                minComplete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    metrics_inc(METRIC_NET_SYSCALLS);
+    if (result > 0) {
+        ring->toSubmit -= (unsigned)result < ring->toSubmit ? (unsigned)result : ring->toSubmit;
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * function :    ring_sqe
+ ******************************************************************************/
+/** \brief        Next free submission entry, cleared
+ *
+ *               Submits the prepared ones first if the queue is full.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static struct io_uring_sqe *ring_sqe(ring_t *ring) {
+    while (ring->sqLocal - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        if (ring_submit(ring, 0) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            LOG_ERROR("io_uring_enter: %s", strerror(errno));
+        }
+    }
+
+    unsigned index = ring->sqLocal & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocal++;
+    ring->toSubmit++;
+    return sqe;
+}
+
+/*******************************************************************************
+ * function :    ring_supports
+ ******************************************************************************/
+/** \brief        Whether the kernel knows an operation
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int ring_supports(ring_t *ring, int op) {
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = FALSE;
+
+    if (probe != NULL
+            && sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0
+            && op <= probe->last_op) {
+        supported = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    return supported;
+}
+
+/*******************************************************************************
+ * function :    buffers_open
+ ******************************************************************************/
+/** \brief        Register the ring of provided receive buffers
+ *
+ * \type         static
+ *
+ * \return       0 on success, -1 on error (errno set)
+ *
+ ******************************************************************************/
+static int buffers_open(uring_loop_t *loop) {
+    struct io_uring_buf_reg reg;
+    size_t ringSize = RECV_BUFFERS * sizeof(struct io_uring_buf);
+
+    loop->bufRing = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop->bufs = mmap(NULL, RECV_BUFFERS * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->bufRing == MAP_FAILED || loop->bufs == MAP_FAILED) {
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->bufRing;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_GROUP;
+    if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return -1;
+    }
+    for (unsigned bid = 0; bid < RECV_BUFFERS; bid++) {
+        struct io_uring_buf *buf = &loop->bufRing->bufs[loop->bufTail++ & (RECV_BUFFERS - 1)];
+        buf->addr = (uint64_t)(uintptr_t)(loop->bufs + bid * RECV_BUFFER_SIZE);
+        buf->len = RECV_BUFFER_SIZE;
+        buf->bid = bid;
+    }
+    __atomic_store_n(&loop->bufRing->tail, (uint16_t)loop->bufTail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    buffer_recycle
+ ******************************************************************************/
+/** \brief        Give a receive buffer back to the kernel
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void buffer_recycle(uring_loop_t *loop, unsigned bid) {
+    struct io_uring_buf *buf = &loop->bufRing->bufs[loop->bufTail++ & (RECV_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(loop->bufs + bid * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&loop->bufRing->tail, (uint16_t)loop->bufTail, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ * function :    arm_accept
+ ******************************************************************************/
+static void arm_accept(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenSock;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = USER_DATA(OP_ACCEPT, 0);
+}
+
+/*******************************************************************************
+ * function :    arm_stop
+ ******************************************************************************/
+static void arm_stop(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->stopFd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = USER_DATA(OP_STOP, 0);
+}
+
+/*******************************************************************************
+ * function :    arm_timer
+ ******************************************************************************/
+/** \brief        Complete after NET_TX_CHECK_MS, to check the backlogged
+ *               connections
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void arm_timer(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    loop->timeout.tv_sec = NET_TX_CHECK_MS / 1000;
+    loop->timeout.tv_nsec = (NET_TX_CHECK_MS % 1000) * 1000000LL;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->timeout;
+    sqe->len = 1;
+    sqe->user_data = USER_DATA(OP_TIMER, 0);
+    loop->timerArmed = TRUE;
+}
+
+/*******************************************************************************
+ * function :    arm_tick
+ ******************************************************************************/
+/** \brief        Read the timerfd of the wheel: completes with its next tick
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void arm_tick(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wheel.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->ticks;
+    sqe->len = sizeof(loop->ticks);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = USER_DATA(OP_TICK, 0);
+}
+
+/*******************************************************************************
+ * function :    arm_publish
+ ******************************************************************************/
+/** \brief        Read the eventfd of the state changes: completes with the
+ *               next change while there are subscribers
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void arm_publish(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->publish->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->changes;
+    sqe->len = sizeof(loop->changes);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = USER_DATA(OP_PUBLISH, 0);
+}
+
+/*******************************************************************************
+ * function :    arm_recv
+ ******************************************************************************/
+/** \brief        Multishot recv: one completion per arrival until it fails
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void arm_recv(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+    struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = loop->fixed ? index : uc->conn.sock;
+    sqe->flags = IOSQE_BUFFER_SELECT | (loop->fixed ? IOSQE_FIXED_FILE : 0);
+    sqe->buf_group = RECV_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = USER_DATA(OP_RECV, index);
+    uc->receiving = TRUE;
+    uc->refs++;
+}
+
+/*******************************************************************************
+ * function :    conn_pause
+ ******************************************************************************/
+/** \brief        Stop receiving while the send queue is over its limit,
+ *               receive again once it is not
+ *
+ *               The recv is cancelled; its last completion does not rearm
+ *               it while paused.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_pause(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+    int over = tx_queue_over(&uc->conn.tx);
+
+    if (over && !uc->paused) {
+        uc->paused = TRUE;
+        if (uc->receiving) {
+            struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = USER_DATA(OP_RECV, index);
+            sqe->user_data = USER_DATA(OP_CANCEL, index);
+        }
+    } else if (!over && uc->paused) {
+        uc->paused = FALSE;
+        if (!uc->receiving) {
+            arm_recv(loop, index);
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_send
+ ******************************************************************************/
+/** \brief        Submit the queued replies of a connection as linked sends
+ *
+ *               Only one chain per connection is in flight, so later
+ *               replies cannot overtake earlier ones.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_send(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+    tx_queue_t *tx = &uc->conn.tx;
+    struct iovec iov[MAX_LINKED_SENDS];
+
+    if (uc->sends > 0 || tx->bytes == tx->inflight) {
+        return;
+    }
+    int count = tx_queue_peek(tx, tx->inflight, iov, MAX_LINKED_SENDS);
+    TRACE_INSTANT(TRACE_SEND, tx->bytes - tx->inflight);
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = ring_sqe(&loop->ring);
+        sqe->fd = loop->fixed ? index : uc->conn.sock;
+        sqe->addr = (uint64_t)(uintptr_t)iov[i].iov_base;
+        sqe->len = iov[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data = USER_DATA(OP_SEND, index);
+        if (loop->fixed) {
+            sqe->opcode = IORING_OP_SEND_ZC;
+            sqe->flags = IOSQE_FIXED_FILE;
+            // Every zero-copy send posts one notification, also when it
+            // fails: a send cancelled with its chain completes without
+            // IORING_CQE_F_MORE, but its notification still follows
+            uc->notifs++;
+            uc->refs++;
+            if (tx_pool_owns(&loop->pool, iov[i].iov_base)) {
+                sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+                sqe->buf_index = 0;
+            }
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+        }
+        if (i + 1 < count) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        tx->inflight += iov[i].iov_len;
+        uc->sends++;
+        uc->refs++;
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_drop_socket
+ ******************************************************************************/
+/** \brief        Unregister and close the socket of a connection
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_drop_socket(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+
+    if (uc->conn.sock < 0) {
+        return;
+    }
+    if (loop->fixed) {
+        int none = -1;
+        struct io_uring_files_update update = { .offset = index, .fds = (uint64_t)(uintptr_t)&none };
+        sys_io_uring_register(loop->ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    }
+    close(uc->conn.sock);
+    uc->conn.sock = -1;
+}
+
+/*******************************************************************************
+ * function :    conn_put
+ ******************************************************************************/
+/** \brief        Drop a reference; the last one frees the connection slot
+ *
+ *               Only when no completion can refer to the slot any more it is
+ *               reused, so a late completion never hits a new connection.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_put(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+
+    if (--uc->refs > 0) {
+        return;
+    }
+    if (uc->closeBy != 0) {
+        loop->lingering--;
+    }
+    conn_drop_socket(loop, index);
+    net_conn_release(&uc->conn);
+    uc->used = FALSE;
+    loop->freeList[loop->freeCount++] = index;
+    LOG_INFO("Client disconnected.");
+}
+
+/*******************************************************************************
+ * function :    conn_finish
+ ******************************************************************************/
+/** \brief        Continue closing: once the replies are out, end the recv
+ *
+ *               shutdown() makes the multishot recv complete, after which
+ *               the last reference is dropped.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_finish(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+
+    if (uc->sends > 0) {
+        return;
+    }
+    if (uc->receiving) {
+        shutdown(uc->conn.sock, SHUT_RDWR);
+        metrics_inc(METRIC_NET_SYSCALLS);
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_close
+ ******************************************************************************/
+/** \brief        Close a connection after its queued replies are sent
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_close(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+
+    if (uc->closing) {
+        return;
+    }
+    uc->closing = TRUE;
+    conn_send(loop, index);
+    conn_finish(loop, index);
+    conn_put(loop, index);         // the reference of the open connection
+}
+
+/*******************************************************************************
+ * function :    conn_evict
+ ******************************************************************************/
+/** \brief        Close a client evicted by net_conn_sent, or timed out
+ *
+ *               Like any other connection it is closed after its replies,
+ *               now the close frame, are sent; check_backlogged shuts it
+ *               down if that takes longer than NET_TX_CHECK_MS.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_evict(uring_loop_t *loop, int index) {
+    uring_conn_t *uc = &loop->conns[index];
+
+    uc->closeBy = metrics_now_ns() + NET_TX_CHECK_MS * 1000000ULL;
+    loop->lingering++;
+    conn_close(loop, index);
+}
+
+/*******************************************************************************
+ * function :    conn_sent
+ ******************************************************************************/
+/** \brief        Check the send queue (net_conn_sent) and send what it
+ *               queued, or evict the client; pause or resume receiving
+ *
+ *               A connection whose HTTP response is sent is closed without
+ *               a deadline: the end of the response may still be in the
+ *               socket, for a slow reader, and zero-copy pages wait for its
+ *               ACKs. Its timer (net_conn_timeout) keeps watching it.
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_sent(uring_loop_t *loop, int index) {
+    net_conn_t *conn = &loop->conns[index].conn;
+    int result = net_conn_sent(conn, metrics_now_ns());
+
+    if (result < 0 && conn->responding) {
+        conn_close(loop, index);
+    } else if (result < 0) {
+        conn_evict(loop, index);
+    } else {
+        conn_send(loop, index);
+        conn_pause(loop, index);
+    }
+}
+
+/*******************************************************************************
+ * function :    conn_timeout
+ ******************************************************************************/
+/** \brief        The timer of a connection expired (tw_expire_t)
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void conn_timeout(tw_timer_t *timer, void *arg) {
+    uring_loop_t *loop = arg;
+    uring_conn_t *uc = (uring_conn_t *)timer->data;    // conn is the first member
+    int index = (int)(uc - loop->conns);
+
+    if (uc->closeBy != 0 || (uc->closing && !uc->conn.responding)) {
+        return;
+    }
+    int result = net_conn_timeout(&uc->conn, metrics_now_ns());
+    if (result < 0) {
+        conn_evict(loop, index);
+    } else if (result > 0 && !uc->dirty) {
+        uc->dirty = TRUE;
+        loop->dirty[loop->dirtyCount++] = index;
+    }
+}
+
+/*******************************************************************************
+ * function :    check_backlogged
+ ******************************************************************************/
+static void check_backlogged(uring_loop_t *loop) {
+    uint64_t now = metrics_now_ns();
+
+    for (int i = 0; i < loop->maxConns; i++) {
+        uring_conn_t *uc = &loop->conns[i];
+        if (!uc->used) {
+            continue;
+        }
+        if (uc->closeBy != 0 && now >= uc->closeBy && !uc->shut) {
+            // Evicted, still not done: end the sends stuck in flight
+            shutdown(uc->conn.sock, SHUT_RDWR);
+            metrics_inc(METRIC_NET_SYSCALLS);
+            uc->closeBy = now + NET_TX_CHECK_MS * 1000000ULL;
+            uc->shut = TRUE;
+        } else if (uc->closeBy != 0 && now >= uc->closeBy) {
+            // Only zero-copy notifications left: reset the connection
+            struct linger reset = { 1, 0 };
+            setsockopt(uc->conn.sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            conn_drop_socket(loop, i);
+        } else if (!uc->closing && uc->conn.overSince != 0) {
+            conn_sent(loop, i);
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    handle_accept
+ ******************************************************************************/
+static void handle_accept(uring_loop_t *loop, const struct io_uring_cqe *cqe) {
+    int sock = cqe->res;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !loop->stopped) {
+        arm_accept(loop);
+    }
+    if (sock < 0) {
+        if (sock != -EAGAIN && sock != -EINTR) {
+            LOG_ERROR("Accept Error: %s", strerror(-sock));
+        }
+        return;
+    }
+    if (loop->freeCount == 0) {
+        LOG_WARN("Connection table full, client refused");
+        close(sock);
+        return;
+    }
+
+    int index = loop->freeList[--loop->freeCount];
+    uring_conn_t *uc = &loop->conns[index];
+    int dirty = uc->dirty;         // may still be listed from its last use
+    memset(uc, 0, sizeof(*uc));
+    uc->dirty = dirty;
+    net_conn_open(&uc->conn, sock, &loop->pool, &loop->wheel, loop->publish);
+    uc->used = TRUE;
+    uc->refs = 1;
+    if (loop->fixed) {
+        struct io_uring_files_update update = { .offset = index, .fds = (uint64_t)(uintptr_t)&sock };
+        metrics_inc(METRIC_NET_SYSCALLS);
+        if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+            LOG_ERROR("Fixed file: %s", strerror(errno));
+            conn_put(loop, index);
+            return;
+        }
+        uc->conn.tx.hold = TRUE;   // zero-copy sends, see tx_queue_release
+    }
+    uc->conn.copyBody = TRUE;      // no sendfile, the bodies go through tx
+    arm_recv(loop, index);
+
+    metrics_inc(METRIC_CONNECTIONS_ACCEPTED);
+    TRACE_INSTANT(TRACE_ACCEPT, sock);
+    LOG_INFO("Client connected!");
+}
+
+/*******************************************************************************
+ * function :    handle_recv
+ ******************************************************************************/
+static void handle_recv(uring_loop_t *loop, int index, const struct io_uring_cqe *cqe) {
+    uring_conn_t *uc = &loop->conns[index];
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    TRACE_INSTANT(TRACE_RECV, cqe->res);
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !uc->closing) {
+            uint64_t rx_ns = metrics_now_ns();
+            if (net_conn_input(&uc->conn, loop->bufs + bid * RECV_BUFFER_SIZE, cqe->res, rx_ns) < 0) {
+                conn_close(loop, index);
+            } else if (!uc->dirty && uc->conn.tx.bytes > uc->conn.tx.inflight) {
+                uc->dirty = TRUE;
+                loop->dirty[loop->dirtyCount++] = index;
+            }
+        }
+        buffer_recycle(loop, bid);
+    }
+
+    if (more) {
+        return;
+    }
+    // The multishot recv ended: out of buffers, stopped by the kernel or
+    // cancelled (rearm unless paused), end of stream or error
+    uc->receiving = FALSE;
+    if ((cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) && !uc->closing) {
+        if (!uc->paused) {
+            arm_recv(loop, index);
+        }
+    } else if (!uc->closing) {
+        conn_close(loop, index);
+    }
+    conn_put(loop, index);
+}
+
+/*******************************************************************************
+ * function :    handle_send
+ ******************************************************************************/
+static void handle_send(uring_loop_t *loop, int index, const struct io_uring_cqe *cqe) {
+    uring_conn_t *uc = &loop->conns[index];
+    tx_queue_t *tx = &uc->conn.tx;
+
+    if (cqe->flags & IORING_CQE_F_NOTIF) {
+        // The kernel is done with the pages of a zero-copy send
+        if (--uc->notifs == 0) {
+            tx_queue_release(tx);
+        }
+        conn_put(loop, index);
+        return;
+    }
+    uc->sends--;
+    if (cqe->res > 0) {
+        tx_queue_consume(tx, cqe->res);
+        tx->inflight -= cqe->res;
+    }
+    if (cqe->res < 0 && !uc->closing) {
+        // The rest of the chain is cancelled; nothing more can be sent
+        conn_close(loop, index);
+    }
+    if (uc->sends == 0) {
+        if (cqe->res < 0) {
+            tx->inflight = 0;
+        }
+        if (!uc->closing) {
+            conn_sent(loop, index);
+        } else if (cqe->res >= 0) {
+            conn_send(loop, index);
+        }
+        if (uc->closing) {
+            conn_finish(loop, index);
+        }
+        if (uc->notifs == 0) {
+            tx_queue_release(tx);
+        }
+    }
+    conn_put(loop, index);
+}
+
+/*******************************************************************************
+ * function :    handle_publish
+ ******************************************************************************/
+/** \brief        Push the current state to the subscribed connections, a
+ *               bitmask test per connection (see netepoll.c)
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void handle_publish(uring_loop_t *loop) {
+    WebhouseState state;
+
+    getWebhouseState(&state);
+    for (int i = 0; i < loop->maxConns; i++) {
+        uring_conn_t *uc = &loop->conns[i];
+        if (uc->used && !uc->closing && net_conn_publish(&uc->conn, &state) > 0 && !uc->dirty) {
+            uc->dirty = TRUE;
+            loop->dirty[loop->dirtyCount++] = i;
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    handle_completion
+ ******************************************************************************/
+static void handle_completion(uring_loop_t *loop, const struct io_uring_cqe *cqe) {
+    int op = (int)(cqe->user_data >> 32);
+    int index = (int)(uint32_t)cqe->user_data;
+
+    switch (op) {
+    case OP_ACCEPT:
+        handle_accept(loop, cqe);
+        break;
+    case OP_RECV:
+        handle_recv(loop, index, cqe);
+        break;
+    case OP_SEND:
+        handle_send(loop, index, cqe);
+        break;
+    case OP_STOP:
+        loop->stopped = TRUE;
+        break;
+    case OP_TIMER:
+        loop->timerArmed = FALSE;
+        check_backlogged(loop);
+        break;
+    case OP_TICK:
+        if (cqe->res == sizeof(loop->ticks)) {
+            tw_advance(&loop->wheel, metrics_now_ns(), conn_timeout, loop);
+        }
+        if (!loop->stopped) {
+            arm_tick(loop);
+        }
+        break;
+    case OP_PUBLISH:
+        if (cqe->res == sizeof(loop->changes)) {
+            handle_publish(loop);
+        }
+        if (!loop->stopped) {
+            arm_publish(loop);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/*******************************************************************************
+ * function :    net_uring_run
+ ******************************************************************************/
+/** \brief        Run the io_uring event loop until stopFd becomes readable
+ *
+ * \type         global
+ *
+ * \return       0 after shutdown, -1 if io_uring is not available (errno
+ *               set), before any connection was accepted
+ *
+ ******************************************************************************/
+int net_uring_run(int listenSock, int stopFd, net_publish_t *publish,
+                  const net_config_t *config) {
+    uring_loop_t loop;
+    int error = 0;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.listenSock = listenSock;
+    loop.stopFd = stopFd;
+    loop.publish = publish;
+    loop.fixed = config->fixed;
+    loop.maxConns = config->maxConns > 0 ? config->maxConns : NET_MAX_CONNS;
+    loop.bufRing = MAP_FAILED;
+    loop.bufs = MAP_FAILED;
+    loop.wheel.fd = -1;
+
+    if (ring_open(&loop.ring) != 0) {
+        return -1;
+    }
+    // Multishot recv and zero-copy send came with Linux 6.0
+    if (!ring_supports(&loop.ring, IORING_OP_SEND_ZC)) {
+        error = ENOSYS;
+    }
+
+    if (!error && loop.fixed) {
+        // The fixed file table counts against the open file limit
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)loop.maxConns + 16) {
+            loop.maxConns = limit.rlim_cur > 16 ? (int)limit.rlim_cur - 16 : 1;
+        }
+    }
+    loop.conns = calloc(loop.maxConns, sizeof(*loop.conns));
+    loop.freeList = malloc(loop.maxConns * sizeof(*loop.freeList));
+    loop.dirty = malloc(loop.maxConns * sizeof(*loop.dirty));
+    if (!error && (loop.conns == NULL || loop.freeList == NULL || loop.dirty == NULL
+                   || tx_pool_init(&loop.pool, TX_POOL_CHUNKS) != 0
+                   || tw_open(&loop.wheel) != 0
+                   || buffers_open(&loop) != 0)) {
+        error = errno;
+    }
+
+    if (!error && loop.fixed) {
+        int *files = malloc(loop.maxConns * sizeof(int));
+        struct iovec region = { loop.pool.base, loop.pool.size };
+        if (files == NULL) {
+            error = ENOMEM;
+        } else {
+            for (int i = 0; i < loop.maxConns; i++) {
+                files[i] = -1;     // empty slots
+            }
+            if (sys_io_uring_register(loop.ring.fd, IORING_REGISTER_FILES, files, loop.maxConns) != 0
+                    || sys_io_uring_register(loop.ring.fd, IORING_REGISTER_BUFFERS, &region, 1) != 0) {
+                error = errno;
+            }
+            free(files);
+        }
+    }
+
+    if (error) {
+        ring_close(&loop.ring);
+        if (loop.bufRing != MAP_FAILED) munmap(loop.bufRing, RECV_BUFFERS * sizeof(struct io_uring_buf));
+        if (loop.bufs != MAP_FAILED) munmap(loop.bufs, RECV_BUFFERS * RECV_BUFFER_SIZE);
+        tx_pool_free(&loop.pool);
+        tw_close(&loop.wheel);
+        free(loop.conns);
+        free(loop.freeList);
+        free(loop.dirty);
+        errno = error;
+        return -1;
+    }
+
+    for (int i = loop.maxConns; i-- > 0; ) {
+        loop.freeList[loop.freeCount++] = i;
+    }
+    arm_accept(&loop);
+    arm_stop(&loop);
+    arm_tick(&loop);
+    arm_publish(&loop);
+    LOG_INFO("Event loop: io_uring%s", loop.fixed ? " (fixed files and buffers)" : "");
+
+    while (!loop.stopped) {
+        // Submit everything prepared and sleep until something completes
+        if (ring_submit(&loop.ring, 1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+            LOG_ERROR("io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        metrics_inc(METRIC_WAKEUPS);
+
+        unsigned head = *loop.ring.cqHead;
+        unsigned tail = __atomic_load_n(loop.ring.cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_completion(&loop, &loop.ring.cqes[head & *loop.ring.cqMask]);
+            head++;
+            // Release each entry: handling may have to wait for free entries
+            __atomic_store_n(loop.ring.cqHead, head, __ATOMIC_RELEASE);
+            if (head == tail) {
+                tail = __atomic_load_n(loop.ring.cqTail, __ATOMIC_ACQUIRE);
+            }
+        }
+
+        // All replies of this iteration, one chain per connection
+        for (int i = 0; i < loop.dirtyCount; i++) {
+            int index = loop.dirty[i];
+            loop.conns[index].dirty = FALSE;
+            if (loop.conns[index].used && !loop.conns[index].closing) {
+                conn_sent(&loop, index);
+            }
+        }
+        loop.dirtyCount = 0;
+
+        if ((net_conn_backlogged() > 0 || loop.lingering > 0) && !loop.timerArmed && !loop.stopped) {
+            arm_timer(&loop);
+        }
+    }
+
+    // Closing the ring cancels all requests; the sockets are closed here
+    ring_close(&loop.ring);
+    for (int i = 0; i < loop.maxConns; i++) {
+        if (loop.conns[i].used && loop.conns[i].conn.sock >= 0) {
+            close(loop.conns[i].conn.sock);
+            net_conn_release(&loop.conns[i].conn);
+        }
+    }
+    munmap(loop.bufRing, RECV_BUFFERS * sizeof(struct io_uring_buf));
+    munmap(loop.bufs, RECV_BUFFERS * RECV_BUFFER_SIZE);
+    tx_pool_free(&loop.pool);
+    tw_close(&loop.wheel);
+    free(loop.conns);
+    free(loop.freeList);
+    free(loop.dirty);
+    return 0;
+}
@@ -0,0 +1,291 @@
+/******************************************************************************/
+/** \file       persist.c
+ *******************************************************************************
+ *
+ * \brief      Device state kept in a memory mapped file across restarts
+ *
+ *             The file holds two slots, each with a generation number and a
+ *             checksum. A save writes the older slot with the next
+ *             generation, so the newest valid slot is always a complete
+ *             state: a save torn by a crash fails its checksum and the
+ *             other slot is used. The flip to the new state is the write
+ *             of the checksum, after all other fields.
+ *
+ *             Saving is a memory copy into the mapping, no system call, so
+ *             it runs on every state change. The page cache keeps the data
+ *             if the server crashes; the kernel writes it back within its
+ *             dirty writeback interval, persist_close syncs it.
+ *
+ *             Saves are ignored until persist_start, so the threads started
+ *             by initWebhouse cannot overwrite the saved state with the
+ *             reset state before it has been restored.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * persist_open
+ * persist_load
+ * persist_start
+ * persist_save
+ * persist_close
+ * * functions  local:
+ * slot_check
+ * slot_valid
+ * newest_slot
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "persist.h"
+
+//----- Macros -----------------------------------------------------------------
+#define PERSIST_MAGIC      0x54534857u     // "WHST"
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;       // the valid slot with the higher one is current
+    float    temp;
+    uint8_t  heat;
+    uint8_t  led1;
+    uint8_t  led2;
+    uint8_t  tv;
+    uint8_t  alarmArmed;
+    uint8_t  dimRLamp;
+    uint8_t  dimSLamp;
+    uint8_t  reserved;
+    uint32_t check;            // slot_check, written last
+} __attribute__((aligned(32))) persist_slot_t;
+
+typedef struct {
+    persist_slot_t slots[2];
+} persist_file_t;
+
+//----- Data -------------------------------------------------------------------
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static persist_file_t *file;       // the mapping, NULL if not open
+static int started;
+static uint32_t savedVersion;      // state version of the last save
+static int saved;                  // savedVersion is set
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    slot_check
+ ******************************************************************************/
+/** \brief        FNV-1a over all fields before the checksum
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static uint32_t slot_check(const persist_slot_t *slot) {
+    const uint8_t *p = (const uint8_t *)slot;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < offsetof(persist_slot_t, check); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*******************************************************************************
+ * function :    slot_valid
+ ******************************************************************************/
+static int slot_valid(const persist_slot_t *slot) {
+    return slot->magic == PERSIST_MAGIC && slot->check == slot_check(slot);
+}
+
+/*******************************************************************************
+ * function :    newest_slot
+ ******************************************************************************/
+/** \brief        Index of the current slot
+ *
+ * \type         static
+ *
+ * \return       0 or 1, -1 if neither slot is valid
+ *
+ ******************************************************************************/
+static int newest_slot(void) {
+    int valid0 = slot_valid(&file->slots[0]);
+    int valid1 = slot_valid(&file->slots[1]);
+
+    if (valid0 && valid1) {
+        // Wrap-around safe comparison of the generations
+        return (int32_t)(file->slots[1].generation - file->slots[0].generation) > 0;
+    }
+    return valid0 ? 0 : valid1 ? 1 : -1;
+}
+
+/*******************************************************************************
+ * function :    persist_open
+ ******************************************************************************/
+/** \brief        Open or create the state file and map it
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 on error (errno set)
+ *
+ ******************************************************************************/
+int persist_open(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    void *map;
+
+    if (fd < 0) {
+        return -1;
+    }
+    // A new or short file reads as zeros: no valid slot
+    if (fstat(fd, &st) != 0
+        || (st.st_size < (off_t)sizeof(persist_file_t)
+            && ftruncate(fd, sizeof(persist_file_t)) != 0)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, sizeof(persist_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    file = map;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    persist_load
+ ******************************************************************************/
+/** \brief        Read the saved state
+ *
+ *               Only the persisted fields are set: the version and the alarm
+ *               sensor are left alone.
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 if the file is not open or holds no state
+ *
+ ******************************************************************************/
+int persist_load(WebhouseState *state) {
+    int result = -1;
+
+    pthread_mutex_lock(&lock);
+    int index = file != NULL ? newest_slot() : -1;
+    if (index >= 0) {
+        const persist_slot_t *slot = &file->slots[index];
+        state->temp = slot->temp;
+        state->heat = slot->heat;
+        state->led1 = slot->led1;
+        state->led2 = slot->led2;
+        state->tv = slot->tv;
+        state->alarmArmed = slot->alarmArmed;
+        state->dimRLamp = slot->dimRLamp;
+        state->dimSLamp = slot->dimSLamp;
+        result = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+/*******************************************************************************
+ * function :    persist_start
+ ******************************************************************************/
+/** \brief        Accept saves from now on, call once the state is restored
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void persist_start(void) {
+    pthread_mutex_lock(&lock);
+    started = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+/*******************************************************************************
+ * function :    persist_save
+ ******************************************************************************/
+/** \brief        Save the state, if it differs from the saved one
+ *
+ *               Called by every state change, from any thread. A state older
+ *               than the last one saved (by version) is ignored, so two
+ *               threads racing cannot leave the older state in the file.
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void persist_save(const WebhouseState *state) {
+    persist_slot_t next;
+
+    memset(&next, 0, sizeof(next));
+    next.magic = PERSIST_MAGIC;
+    next.temp = state->temp;
+    next.heat = state->heat;
+    next.led1 = state->led1;
+    next.led2 = state->led2;
+    next.tv = state->tv;
+    next.alarmArmed = state->alarmArmed;
+    next.dimRLamp = state->dimRLamp;
+    next.dimSLamp = state->dimSLamp;
+
+    pthread_mutex_lock(&lock);
+    if (file == NULL || !started || (saved && (int32_t)(state->version - savedVersion) < 0)) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    savedVersion = state->version;
+    saved = 1;
+
+    int index = newest_slot();
+    if (index >= 0) {
+        persist_slot_t *current = &file->slots[index];
+        next.generation = current->generation;
+        if (memcmp(&next, current, offsetof(persist_slot_t, check)) == 0) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        next.generation++;
+    }
+    next.check = slot_check(&next);
+
+    // Everything but the checksum first: until it is written the slot is
+    // invalid and the other one stays current
+    persist_slot_t *slot = &file->slots[index >= 0 ? !index : 0];
+    slot->check = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot, &next, offsetof(persist_slot_t, check));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->check = next.check;
+    pthread_mutex_unlock(&lock);
+}
+
+/*******************************************************************************
+ * function :    persist_close
+ ******************************************************************************/
+/** \brief        Sync the state file and unmap it
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void persist_close(void) {
+    pthread_mutex_lock(&lock);
+    if (file != NULL) {
+        if (msync(file, sizeof(*file), MS_SYNC) != 0) {
+            perror("State file");
+        }
+        munmap(file, sizeof(*file));
+        file = NULL;
+    }
+    started = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,15 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include "Webhouse.h"
+
+// State file used unless another one is given with -p
+#define PERSIST_DEFAULT_PATH   "webhouse.state"
+
+extern int  persist_open  (const char *path);
+extern int  persist_load  (WebhouseState *state);
+extern void persist_start (void);
+extern void persist_save  (const WebhouseState *state);
+extern void persist_close (void);
+
+#endif // PERSIST_H
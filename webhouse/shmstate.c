@@ -0,0 +1,311 @@
+/******************************************************************************/
+/** \file       shmstate.c
+ *******************************************************************************
+ *
+ * \brief      Device state published in a shared memory page
+ *
+ *             The webhouse writes every new state into the POSIX shared
+ *             memory object SHM_STATE_NAME, guarded by a seqlock: the
+ *             writer makes seq odd, writes the state and makes seq even
+ *             again. A reader copies the state and retries if seq was odd or
+ *             changed meanwhile, so it gets a consistent snapshot without a
+ *             lock and without a system call, and can never block the
+ *             server. Readers map the page read-only.
+ *
+ *             After every write the server wakes the readers blocked in
+ *             FUTEX_WAIT on seq (shm_state_wait). A futex works for any
+ *             process that maps the page; an eventfd would have to be
+ *             passed to each reader over a Unix socket.
+ *
+ *             The object is not removed when the server stops, so readers
+ *             keep their mapping across a restart and seq keeps counting.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * shm_state_open
+ * shm_state_publish
+ * shm_state_close
+ * shm_state_attach
+ * shm_state_read
+ * shm_state_wait
+ * shm_state_detach
+ * * functions  local:
+ * futex
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shmstate.h"
+
+//----- Macros -----------------------------------------------------------------
+#define SHM_STATE_SIZE     4096    // one page, the size the object is created with
+
+_Static_assert(sizeof(shm_state_page_t) <= SHM_STATE_SIZE, "state page too large");
+
+//----- Data -------------------------------------------------------------------
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static shm_state_page_t *page;     // writable mapping of the server
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    futex
+ ******************************************************************************/
+/** \brief        Shared (not process private) futex operation on a word
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static long futex(const uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/*******************************************************************************
+ * function :    shm_state_open
+ ******************************************************************************/
+/** \brief        Create or reuse the shared memory object and map it
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 on error (errno set)
+ *
+ ******************************************************************************/
+int shm_state_open(void) {
+    int fd = shm_open(SHM_STATE_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    shm_state_page_t *map;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, SHM_STATE_SIZE) != 0) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, SHM_STATE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    // A server that died while writing left seq odd: make it even again
+    uint32_t seq = __atomic_load_n(&map->seq, __ATOMIC_RELAXED);
+    if (seq & 1) {
+        __atomic_store_n(&map->seq, seq + 1, __ATOMIC_RELEASE);
+    }
+    map->layout = SHM_STATE_LAYOUT;
+    map->size = sizeof(WebhouseState);
+    map->pid = getpid();
+    __atomic_store_n(&map->magic, SHM_STATE_MAGIC, __ATOMIC_RELEASE);
+    page = map;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    shm_state_publish
+ ******************************************************************************/
+/** \brief        Write a new state and wake the waiting readers
+ *
+ *               Called on every state change, from any thread; the lock
+ *               keeps the writers of the seqlock one at a time.
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void shm_state_publish(const WebhouseState *state) {
+    uint32_t words[SHM_STATE_WORDS];
+
+    memcpy(words, state, sizeof(words));
+
+    pthread_mutex_lock(&lock);
+    if (page == NULL) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (size_t i = 0; i < SHM_STATE_WORDS; i++) {
+        __atomic_store_n(&page->words[i], words[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+    futex(&page->seq, FUTEX_WAKE, INT32_MAX, NULL);
+    pthread_mutex_unlock(&lock);
+}
+
+/*******************************************************************************
+ * function :    shm_state_close
+ ******************************************************************************/
+/** \brief        Unmap the page; it stays for the readers and the next start
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void shm_state_close(void) {
+    pthread_mutex_lock(&lock);
+    if (page != NULL) {
+        page->pid = 0;
+        munmap(page, SHM_STATE_SIZE);
+        page = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*******************************************************************************
+ * function :    shm_state_attach
+ ******************************************************************************/
+/** \brief        Map the state page read-only
+ *
+ * \type         global
+ *
+ * \param[out]   reader   Reader handle
+ *
+ * \return       0 on success, -1 if there is no page (the server never ran)
+ *               or it has another layout (errno set)
+ *
+ ******************************************************************************/
+int shm_state_attach(shm_state_reader_t *reader) {
+    int fd = shm_open(SHM_STATE_NAME, O_RDONLY | O_CLOEXEC, 0);
+    const shm_state_page_t *map;
+
+    reader->page = NULL;
+    if (fd < 0) {
+        return -1;
+    }
+    map = mmap(NULL, SHM_STATE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (__atomic_load_n(&map->magic, __ATOMIC_ACQUIRE) != SHM_STATE_MAGIC
+        || map->layout != SHM_STATE_LAYOUT || map->size != sizeof(WebhouseState)) {
+        munmap((void *)map, SHM_STATE_SIZE);
+        errno = EPROTO;
+        return -1;
+    }
+    reader->page = map;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    shm_state_read
+ ******************************************************************************/
+/** \brief        Copy a consistent snapshot of the state
+ *
+ *               No system call, no lock: retries while the server writes.
+ *
+ * \type         global
+ *
+ * \param[in]    reader   Attached reader
+ * \param[out]   state    Current state
+ *
+ * \return       Sequence number of the snapshot, for shm_state_wait
+ *
+ ******************************************************************************/
+uint32_t shm_state_read(const shm_state_reader_t *reader, WebhouseState *state) {
+    const shm_state_page_t *p = reader->page;
+    uint32_t words[SHM_STATE_WORDS];
+    uint32_t before;
+    uint32_t after;
+
+    do {
+        before = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            after = before + 1;    // being written, try again
+            continue;
+        }
+        for (size_t i = 0; i < SHM_STATE_WORDS; i++) {
+            words[i] = __atomic_load_n(&p->words[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&p->seq, __ATOMIC_RELAXED);
+    } while (before != after);
+
+    memcpy(state, words, sizeof(words));
+    return before;
+}
+
+/*******************************************************************************
+ * function :    shm_state_wait
+ ******************************************************************************/
+/** \brief        Sleep until the state differs from the snapshot seq
+ *
+ * \type         global
+ *
+ * \param[in]    reader      Attached reader
+ * \param[in]    seq         Returned by the last shm_state_read
+ * \param[in]    timeoutMs   Give up after this time, -1 to wait forever
+ *
+ * \return       1 if the state changed, 0 on timeout
+ *
+ ******************************************************************************/
+int shm_state_wait(const shm_state_reader_t *reader, uint32_t seq, int timeoutMs) {
+    const uint32_t *word = &reader->page->seq;
+    struct timespec timeout;
+    struct timespec deadline;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // The word also changes to odd during a write: wait until the write is done
+    for (;;) {
+        uint32_t current = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+        if (current != seq && !(current & 1)) {
+            return 1;
+        }
+        if (timeoutMs >= 0) {
+            // FUTEX_WAIT takes a relative timeout
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+            timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (timeout.tv_nsec < 0) {
+                timeout.tv_sec--;
+                timeout.tv_nsec += 1000000000L;
+            }
+            if (timeout.tv_sec < 0) {
+                return 0;
+            }
+        }
+        if (futex(word, FUTEX_WAIT, current, timeoutMs >= 0 ? &timeout : NULL) != 0
+            && errno == ETIMEDOUT) {
+            return 0;
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    shm_state_detach
+ ******************************************************************************/
+/** \brief        Unmap the page
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void shm_state_detach(shm_state_reader_t *reader) {
+    if (reader->page != NULL) {
+        munmap((void *)reader->page, SHM_STATE_SIZE);
+        reader->page = NULL;
+    }
+}
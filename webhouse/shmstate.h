@@ -0,0 +1,44 @@
+#ifndef SHMSTATE_H
+#define SHMSTATE_H
+
+#include <stdint.h>
+
+#include "Webhouse.h"
+
+// POSIX shared memory object with the current device state, see shmstate.c.
+// Local programs map it read-only instead of polling over the WebSocket.
+#define SHM_STATE_NAME     "/webhouse-state"
+#define SHM_STATE_MAGIC    0x4d534857u     // "WHSM"
+#define SHM_STATE_LAYOUT   1               // bumped on any change of the page
+#define SHM_STATE_WORDS    (sizeof(WebhouseState) / sizeof(uint32_t))
+
+_Static_assert(sizeof(WebhouseState) % sizeof(uint32_t) == 0,
+               "WebhouseState must consist of 32 bit fields");
+
+// The page. seq is a seqlock (odd while the state is written) and the futex
+// word readers wait on; it keeps counting across restarts of the server.
+typedef struct {
+    uint32_t magic;
+    uint32_t layout;
+    uint32_t size;                 // sizeof(WebhouseState)
+    int32_t  pid;                  // of the server, 0 after it closed the page
+    uint32_t seq __attribute__((aligned(64)));
+    uint32_t words[SHM_STATE_WORDS];       // a WebhouseState
+} shm_state_page_t;
+
+// Publisher (the webhouse)
+extern int  shm_state_open    (void);
+extern void shm_state_publish (const WebhouseState *state);
+extern void shm_state_close   (void);
+
+// Reader library
+typedef struct {
+    const shm_state_page_t *page;
+} shm_state_reader_t;
+
+extern int      shm_state_attach (shm_state_reader_t *reader);
+extern uint32_t shm_state_read   (const shm_state_reader_t *reader, WebhouseState *state);
+extern int      shm_state_wait   (const shm_state_reader_t *reader, uint32_t seq, int timeoutMs);
+extern void     shm_state_detach (shm_state_reader_t *reader);
+
+#endif // SHMSTATE_H
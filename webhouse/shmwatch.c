@@ -0,0 +1,81 @@
+/******************************************************************************/
+/** \file       shmwatch.c
+ *******************************************************************************
+ *
+ * \brief      Example reader of the shared memory state page
+ *
+ *             Prints the device state every time it changes, the way a
+ *             display driver or a logger on the Pi would consume it: one
+ *             shm_state_read per change, no socket, no polling. Runs on the
+ *             same machine as the webhouse, as any user.
+ *
+ *             Usage: shmwatch [-1] [-t timeout_ms]
+ *
+ *             -1  print the current state once and exit
+ *             -t  exit if the state does not change for this long
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * main
+ * * functions  local:
+ * print_state
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "shmstate.h"
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    print_state
+ ******************************************************************************/
+static void print_state(const WebhouseState *s) {
+    printf("version %u temp %.2f heat %d led1 %d led2 %d tv %d alarm %s%s dim %d/%d\n",
+           s->version, s->temp, s->heat, s->led1, s->led2, s->tv,
+           s->alarmArmed ? "armed" : "off", s->alarmTriggered ? " TRIGGERED" : "",
+           s->dimRLamp, s->dimSLamp);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * function :    main
+ ******************************************************************************/
+int main(int argc, char **argv) {
+    shm_state_reader_t reader;
+    WebhouseState state;
+    int once = 0;
+    int timeoutMs = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "1t:")) != -1) {
+        switch (opt) {
+        case '1': once = 1; break;
+        case 't': timeoutMs = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-1] [-t timeout_ms]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (shm_state_attach(&reader) != 0) {
+        perror("Cannot map " SHM_STATE_NAME " (is the webhouse running?)");
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        uint32_t seq = shm_state_read(&reader, &state);
+        print_state(&state);
+        if (once || !shm_state_wait(&reader, seq, timeoutMs)) {
+            break;
+        }
+    }
+
+    shm_state_detach(&reader);
+    return EXIT_SUCCESS;
+}
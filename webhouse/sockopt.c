@@ -0,0 +1,126 @@
+/******************************************************************************/
+/** \file       sockopt.c
+ *******************************************************************************
+ *
+ * \brief      Socket options of the server
+ *
+ *             All options are set on the listening socket. Linux copies the
+ *             socket options of the listener into every connection accepted
+ *             from it, so TCP_NODELAY and SO_BUSY_POLL hold for the accepted
+ *             sockets without a setsockopt per connection.
+ *
+ *             TCP_NODELAY       replies go out at once. A batch of replies is
+ *                               already one send, so Nagle would only delay
+ *                               the next batch until the client ACKs, which
+ *                               it may delay by 40 ms.
+ *             TCP_DEFER_ACCEPT  the connection is only handed to accept once
+ *                               the request has arrived, so the loop wakes
+ *                               up once instead of twice per connection and
+ *                               a port scan costs nothing.
+ *             backlog           the listen queue: with the former 5, a burst
+ *                               of connects overflowed it and the dropped
+ *                               SYNs were retried after one second.
+ *             TCP_FASTOPEN      a returning client sends its request with
+ *                               the SYN, one round trip less. Needs the
+ *                               server bit of net.ipv4.tcp_fastopen (2).
+ *             SO_BUSY_POLL      receive polls the device queue for up to the
+ *                               given time instead of waiting for the
+ *                               interrupt; trades CPU for latency, off by
+ *                               default. Above net.core.busy_read it needs
+ *                               CAP_NET_ADMIN.
+ *
+ *             The accept loops take the connections with accept4(), already
+ *             non-blocking, and drain the queue per wakeup (netepoll.c), or
+ *             use a multishot accept (neturing.c).
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * sock_listen
+ * * functions  local:
+ * set_option
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "sockopt.h"
+#include "logger.h"
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    set_option
+ ******************************************************************************/
+/** \brief        setsockopt with an int value; a failure is only logged
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void set_option(int sock, int level, int name, int value, const char *label) {
+    if (setsockopt(sock, level, name, &value, sizeof(value)) != 0) {
+        LOG_WARN("%s: %s", label, strerror(errno));
+    }
+}
+
+/*******************************************************************************
+ * function :    sock_listen
+ ******************************************************************************/
+/** \brief        Open a non-blocking listening socket on all addresses
+ *
+ *               SO_REUSEPORT, so that every worker can open its own socket
+ *               on the same port.
+ *
+ * \type         global
+ *
+ * \param[in]    port      TCP port
+ * \param[in]    options   Options of the socket and its connections
+ *
+ * \return       The socket, -1 with errno set on error
+ *
+ ******************************************************************************/
+int sock_listen(int port, const sock_options_t *options) {
+    struct sockaddr_in addr;
+    int sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+
+    if (sock < 0) {
+        return -1;
+    }
+    set_option(sock, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+    set_option(sock, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+    if (options->noDelay) {
+        set_option(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (options->deferAcceptS > 0) {
+        set_option(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->deferAcceptS, "TCP_DEFER_ACCEPT");
+    }
+    if (options->fastOpenQlen > 0) {
+        set_option(sock, IPPROTO_TCP, TCP_FASTOPEN, options->fastOpenQlen, "TCP_FASTOPEN");
+    }
+    if (options->busyPollUs > 0) {
+        set_option(sock, SOL_SOCKET, SO_BUSY_POLL, options->busyPollUs, "SO_BUSY_POLL");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || listen(sock, options->backlog) < 0) {
+        int error = errno;
+        close(sock);
+        errno = error;
+        return -1;
+    }
+    return sock;
+}
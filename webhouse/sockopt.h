@@ -0,0 +1,21 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+// Options of the listening sockets, see sockopt.c
+#define SOCK_BACKLOG         1024      // listen queue (-q), capped by net.core.somaxconn
+#define SOCK_DEFER_ACCEPT_S  5         // accept only with the request there (-D)
+#define SOCK_FASTOPEN_QLEN   64        // pending TCP Fast Open requests (-F)
+
+typedef struct {
+    int backlog;
+    int deferAcceptS;                  // TCP_DEFER_ACCEPT, 0: off
+    int fastOpenQlen;                  // TCP_FASTOPEN, 0: off
+    int busyPollUs;                    // SO_BUSY_POLL, 0: off (-y)
+    int noDelay;                       // TCP_NODELAY
+} sock_options_t;
+
+#define SOCK_OPTIONS_DEFAULT { SOCK_BACKLOG, SOCK_DEFER_ACCEPT_S, SOCK_FASTOPEN_QLEN, 0, 1 }
+
+extern int sock_listen (int port, const sock_options_t *options);
+
+#endif // SOCKOPT_H
@@ -0,0 +1,342 @@
+/******************************************************************************/
+/** \file       status.c
+ *******************************************************************************
+ *
+ * \brief      Encoding of the status reply sent after every command
+ *
+ *             Text clients get "Temp:%.1f;AlarmArmed:%d;AlarmTriggered:%d".
+ *             Clients that negotiated the webhouse.bin.v1 subprotocol get the
+ *             fixed 8 byte StatusFrame, which also carries every device and
+ *             both dimmer levels.
+ *
+ *             Clients that acknowledge state versions (<GetStatus:version>)
+ *             only get the fields that changed since the acknowledged state,
+ *             plus the new version, or a full snapshot after a gap.
+ *
+ *             The HTTP API (httpapi.c) gets the state as a JSON object,
+ *             written directly into its send buffer (status_encode_json).
+ *
+ *             A client subscribed to some topics (<Subscribe:temp,alarm>)
+ *             is only pushed the states whose changes touch its topics
+ *             (status_topics), and only sees the fields of those topics
+ *             change (status_mask).
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * status_encode_text
+ * status_encode_binary
+ * status_encode_text_delta
+ * status_encode_binary_delta
+ * status_encode_json
+ * status_topics
+ * status_mask
+ * * functions  local:
+ * deviceBits
+ * centiDegrees
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <math.h>
+#include <endian.h>
+
+#include "status.h"
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    deviceBits
+ ******************************************************************************/
+/** \brief        Pack the on/off devices into STATUS_* bits
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static uint8_t deviceBits(const WebhouseState *state) {
+    uint8_t devices = 0;
+
+    if (state->heat)           devices |= STATUS_HEAT;
+    if (state->led1)           devices |= STATUS_LED1;
+    if (state->led2)           devices |= STATUS_LED2;
+    if (state->tv)             devices |= STATUS_TV;
+    if (state->alarmArmed)     devices |= STATUS_ALARM_ARMED;
+    if (state->alarmTriggered) devices |= STATUS_ALARM_TRIGGERED;
+    return devices;
+}
+
+/*******************************************************************************
+ * function :    centiDegrees
+ ******************************************************************************/
+/** \brief        Temperature as fixed-point 1/100 degree
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int16_t centiDegrees(float temp) {
+    return (int16_t)lrintf(temp * 100.0f);
+}
+
+/*******************************************************************************
+ * function :    status_encode_text
+ ******************************************************************************/
+/** \brief        Format the status as the legacy text reply
+ *
+ * \type         global
+ *
+ * \param[in]    state   Device state
+ * \param[out]   out     Text buffer
+ * \param[in]    size    Size of out
+ *
+ * \return       Length of the text
+ *
+ ******************************************************************************/
+int status_encode_text(const WebhouseState *state, char out[], size_t size) {
+    return snprintf(out, size, "Temp:%.1f;AlarmArmed:%d;AlarmTriggered:%d",
+                    state->temp, state->alarmArmed, state->alarmTriggered);
+}
+
+/*******************************************************************************
+ * function :    status_encode_binary
+ ******************************************************************************/
+/** \brief        Fill the binary status frame
+ *
+ * \type         global
+ *
+ * \param[in]    state   Device state
+ * \param[out]   frame   Wire frame, ready to send
+ *
+ * \return       Frame length in bytes
+ *
+ ******************************************************************************/
+int status_encode_binary(const WebhouseState *state, StatusFrame *frame) {
+    frame->format = STATUS_FORMAT_V1;
+    frame->devices = deviceBits(state);
+    frame->temp = (int16_t)htole16((uint16_t)centiDegrees(state->temp));
+    frame->dimRLamp = state->dimRLamp;
+    frame->dimSLamp = state->dimSLamp;
+    frame->reserved = 0;
+    return sizeof(*frame);
+}
+
+/*******************************************************************************
+ * function :    status_encode_text_delta
+ ******************************************************************************/
+/** \brief        Format the fields that differ from the acknowledged state
+ *
+ *               "V:<version>" is always present, followed by "Ack:<id>" if
+ *               the reply acknowledges a command. Without a base, every
+ *               field is sent and "Full:1" marks the snapshot. Field names:
+ *               Temp, Heat, L1, L2, TV, AlarmArmed, AlarmTriggered, Dim1, Dim2.
+ *
+ * \type         global
+ *
+ * \param[in]    base    State the client acknowledged, NULL for a snapshot
+ * \param[in]    state   Current state
+ * \param[in]    ack     Command id to acknowledge, NULL for none
+ * \param[out]   out     Text buffer
+ * \param[in]    size    Size of out
+ *
+ * \return       Length of the text
+ *
+ ******************************************************************************/
+int status_encode_text_delta(const WebhouseState *base, const WebhouseState *state,
+                             const uint32_t *ack, char out[], size_t size) {
+    int full = (base == NULL);
+    int len;
+
+    len = snprintf(out, size, "V:%u", (unsigned)state->version);
+    if (ack != NULL && len < (int)size) {
+        len += snprintf(out + len, size - len, ";Ack:%u", (unsigned)*ack);
+    }
+    if (full && len < (int)size) {
+        len += snprintf(out + len, size - len, ";Full:1");
+    }
+
+#define STATUS_TEXT_FIELD(changed, fmt, value)                              \
+    if ((full || (changed)) && len < (int)size) {                           \
+        len += snprintf(out + len, size - len, fmt, value);                 \
+    }
+
+    STATUS_TEXT_FIELD(lrintf(base->temp * 10.0f) != lrintf(state->temp * 10.0f),
+                      ";Temp:%.1f", state->temp);
+    STATUS_TEXT_FIELD(base->heat != state->heat, ";Heat:%d", state->heat);
+    STATUS_TEXT_FIELD(base->led1 != state->led1, ";L1:%d", state->led1);
+    STATUS_TEXT_FIELD(base->led2 != state->led2, ";L2:%d", state->led2);
+    STATUS_TEXT_FIELD(base->tv != state->tv, ";TV:%d", state->tv);
+    STATUS_TEXT_FIELD(base->alarmArmed != state->alarmArmed, ";AlarmArmed:%d", state->alarmArmed);
+    STATUS_TEXT_FIELD(base->alarmTriggered != state->alarmTriggered,
+                      ";AlarmTriggered:%d", state->alarmTriggered);
+    STATUS_TEXT_FIELD(base->dimRLamp != state->dimRLamp, ";Dim1:%d", state->dimRLamp);
+    STATUS_TEXT_FIELD(base->dimSLamp != state->dimSLamp, ";Dim2:%d", state->dimSLamp);
+
+#undef STATUS_TEXT_FIELD
+
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/*******************************************************************************
+ * function :    status_encode_binary_delta
+ ******************************************************************************/
+/** \brief        Build the binary delta frame (STATUS_FORMAT_DELTA)
+ *
+ * \type         global
+ *
+ * \param[in]    base    State the client acknowledged, NULL for a snapshot
+ * \param[in]    state   Current state
+ * \param[in]    ack     Command id to acknowledge, NULL for none
+ * \param[out]   out     Frame buffer
+ *
+ * \return       Frame length in bytes
+ *
+ ******************************************************************************/
+int status_encode_binary_delta(const WebhouseState *base, const WebhouseState *state,
+                               const uint32_t *ack, uint8_t out[STATUS_DELTA_MAX]) {
+    uint8_t devices = deviceBits(state);
+    int16_t temp = centiDegrees(state->temp);
+    uint8_t fields;
+    int len = 6;
+
+    if (base == NULL) {
+        fields = STATUS_FIELD_FULL | STATUS_FIELD_DEVICES | STATUS_FIELD_TEMP
+               | STATUS_FIELD_DIM_RLAMP | STATUS_FIELD_DIM_SLAMP;
+    } else {
+        fields = 0;
+        if (deviceBits(base) != devices)          fields |= STATUS_FIELD_DEVICES;
+        if (centiDegrees(base->temp) != temp)     fields |= STATUS_FIELD_TEMP;
+        if (base->dimRLamp != state->dimRLamp)    fields |= STATUS_FIELD_DIM_RLAMP;
+        if (base->dimSLamp != state->dimSLamp)    fields |= STATUS_FIELD_DIM_SLAMP;
+    }
+    if (ack != NULL) {
+        fields |= STATUS_FIELD_ACK;
+    }
+
+    out[0] = STATUS_FORMAT_DELTA;
+    out[1] = fields;
+    out[2] = state->version;
+    out[3] = state->version >> 8;
+    out[4] = state->version >> 16;
+    out[5] = state->version >> 24;
+    if (fields & STATUS_FIELD_ACK) {
+        out[len++] = *ack;
+        out[len++] = *ack >> 8;
+        out[len++] = *ack >> 16;
+        out[len++] = *ack >> 24;
+    }
+    if (fields & STATUS_FIELD_DEVICES) {
+        out[len++] = devices;
+    }
+    if (fields & STATUS_FIELD_TEMP) {
+        out[len++] = (uint16_t)temp;
+        out[len++] = (uint16_t)temp >> 8;
+    }
+    if (fields & STATUS_FIELD_DIM_RLAMP) {
+        out[len++] = state->dimRLamp;
+    }
+    if (fields & STATUS_FIELD_DIM_SLAMP) {
+        out[len++] = state->dimSLamp;
+    }
+    return len;
+}
+
+/*******************************************************************************
+ * function :    status_encode_json
+ ******************************************************************************/
+/** \brief        Format the state as a JSON object, for GET /api/state
+ *
+ *               {"version":n,"temp":21.50,"heat":false,"led1":false,
+ *               "led2":false,"tv":false,"alarmArmed":false,
+ *               "alarmTriggered":false,"dimRLamp":0,"dimSLamp":0}
+ *
+ * \type         global
+ *
+ * \param[in]    state   Device state
+ * \param[out]   out     Text buffer, STATUS_JSON_MAX is always enough
+ * \param[in]    size    Size of out
+ *
+ * \return       Length of the text, as snprintf
+ *
+ ******************************************************************************/
+int status_encode_json(const WebhouseState *state, char out[], size_t size) {
+#define STATUS_JSON_BOOL(value) ((value) ? "true" : "false")
+    int len = snprintf(out, size,
+                       "{\"version\":%u,\"temp\":%.2f,\"heat\":%s,\"led1\":%s,\"led2\":%s,"
+                       "\"tv\":%s,\"alarmArmed\":%s,\"alarmTriggered\":%s,"
+                       "\"dimRLamp\":%d,\"dimSLamp\":%d}",
+                       (unsigned)state->version, state->temp,
+                       STATUS_JSON_BOOL(state->heat), STATUS_JSON_BOOL(state->led1),
+                       STATUS_JSON_BOOL(state->led2), STATUS_JSON_BOOL(state->tv),
+                       STATUS_JSON_BOOL(state->alarmArmed), STATUS_JSON_BOOL(state->alarmTriggered),
+                       state->dimRLamp, state->dimSLamp);
+#undef STATUS_JSON_BOOL
+    return len;
+}
+
+/*******************************************************************************
+ * function :    status_topics
+ ******************************************************************************/
+/** \brief        Topics whose fields differ between two states
+ *
+ *               The temperature is compared in 1/10 degree, as the text
+ *               replies and the dashboard show it: a step of the simulation
+ *               (0.05 degree) is not worth a push of its own.
+ *
+ * \type         global
+ *
+ * \param[in]    a   One state
+ * \param[in]    b   Other state
+ *
+ * \return       TOPIC_* bits
+ *
+ ******************************************************************************/
+unsigned status_topics(const WebhouseState *a, const WebhouseState *b) {
+    unsigned topics = 0;
+
+    if (lrintf(a->temp * 10.0f) != lrintf(b->temp * 10.0f)) topics |= TOPIC_TEMP;
+    if (a->heat != b->heat)                                 topics |= TOPIC_HEAT;
+    if (a->led1 != b->led1 || a->led2 != b->led2
+            || a->dimRLamp != b->dimRLamp || a->dimSLamp != b->dimSLamp) {
+        topics |= TOPIC_LIGHTS;
+    }
+    if (a->tv != b->tv)                                     topics |= TOPIC_TV;
+    if (a->alarmArmed != b->alarmArmed || a->alarmTriggered != b->alarmTriggered) {
+        topics |= TOPIC_ALARM;
+    }
+    return topics;
+}
+
+/*******************************************************************************
+ * function :    status_mask
+ ******************************************************************************/
+/** \brief        Keep the fields of the topics not subscribed at their base
+ *               value, so that a delta against base leaves them out
+ *
+ * \type         global
+ *
+ * \param[in,out] state    State to send; the version is kept
+ * \param[in]    base     State the client has
+ * \param[in]    topics   Subscribed TOPIC_* bits
+ *
+ ******************************************************************************/
+void status_mask(WebhouseState *state, const WebhouseState *base, unsigned topics) {
+    if (!(topics & TOPIC_TEMP)) {
+        state->temp = base->temp;
+    }
+    if (!(topics & TOPIC_HEAT)) {
+        state->heat = base->heat;
+    }
+    if (!(topics & TOPIC_LIGHTS)) {
+        state->led1 = base->led1;
+        state->led2 = base->led2;
+        state->dimRLamp = base->dimRLamp;
+        state->dimSLamp = base->dimSLamp;
+    }
+    if (!(topics & TOPIC_TV)) {
+        state->tv = base->tv;
+    }
+    if (!(topics & TOPIC_ALARM)) {
+        state->alarmArmed = base->alarmArmed;
+        state->alarmTriggered = base->alarmTriggered;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Webhouse.h"
+#include "command.h"
+
+// Binary status frame, for connections that negotiated WS_PROTO_BINARY
+// (Sec-WebSocket-Protocol: webhouse.bin.v1). Sent as opcode 0x2.
+// All multi-byte fields are little-endian.
+#define STATUS_FORMAT_V1     1
+
+// Device bits of StatusFrame.devices
+#define STATUS_HEAT              0x01
+#define STATUS_LED1              0x02
+#define STATUS_LED2              0x04
+#define STATUS_TV                0x08
+#define STATUS_ALARM_ARMED       0x10
+#define STATUS_ALARM_TRIGGERED   0x20
+
+typedef struct __attribute__((packed)) {
+    uint8_t  format;        // STATUS_FORMAT_V1
+    uint8_t  devices;       // STATUS_* bits
+    int16_t  temp;          // temperature in 1/100 degree Celsius
+    uint8_t  dimRLamp;      // roof lamp [0,100]
+    uint8_t  dimSLamp;      // stand lamp [0,100]
+    uint16_t reserved;      // 0
+} StatusFrame;
+
+_Static_assert(sizeof(StatusFrame) == 8, "StatusFrame must stay 8 bytes");
+
+// Versioned delta frame, for connections in delta mode (see processCommand):
+//   u8 format (STATUS_FORMAT_DELTA) | u8 fields | u32 version
+//   followed only by the fields flagged in "fields", in this order:
+//   u32 ack | u8 devices | i16 temp [1/100 degree] | u8 dimRLamp | u8 dimSLamp
+#define STATUS_FORMAT_DELTA      2
+#define STATUS_FIELD_DEVICES     0x01
+#define STATUS_FIELD_TEMP        0x02
+#define STATUS_FIELD_DIM_RLAMP   0x04
+#define STATUS_FIELD_DIM_SLAMP   0x08
+#define STATUS_FIELD_ACK         0x10   // id of the last command processed
+#define STATUS_FIELD_FULL        0x80   // snapshot: every field is present
+#define STATUS_DELTA_MAX         15
+
+// State as JSON for the HTTP API, longest with a far off temperature
+#define STATUS_JSON_MAX          256
+
+extern int status_encode_text         (const WebhouseState *state, char out[], size_t size);
+extern int status_encode_binary       (const WebhouseState *state, StatusFrame *frame);
+extern int status_encode_text_delta   (const WebhouseState *base, const WebhouseState *state,
+                                       const uint32_t *ack, char out[], size_t size);
+extern int status_encode_binary_delta (const WebhouseState *base, const WebhouseState *state,
+                                       const uint32_t *ack, uint8_t out[STATUS_DELTA_MAX]);
+extern int status_encode_json         (const WebhouseState *state, char out[], size_t size);
+extern unsigned status_topics         (const WebhouseState *a, const WebhouseState *b);
+extern void status_mask               (WebhouseState *state, const WebhouseState *base,
+                                       unsigned topics);
+
+#endif // STATUS_H
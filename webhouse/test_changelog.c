@@ -0,0 +1,127 @@
+/*
+ * test_changelog.c
+ * Log of recent states for resuming clients (changelog.c): the states
+ * after a version come back oldest first, old ones drop out of the full
+ * log, and a counter that jumps or wraps around is handled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "changelog.h"
+#include "test_util.h"
+
+static WebhouseState out[CHANGELOG_SIZE + 8];
+
+// State of a version, with fields telling the versions apart
+static WebhouseState stateOf(uint32_t version) {
+    WebhouseState state;
+
+    memset(&state, 0, sizeof(state));
+    state.version = version;
+    state.temp = (float)(version % 1000) * 0.25f;
+    state.dimRLamp = version % 101;
+    state.led1 = version & 1;
+    return state;
+}
+
+static void append(uint32_t version) {
+    WebhouseState state = stateOf(version);
+
+    changelog_append(&state);
+}
+
+static int same(const WebhouseState *state, uint32_t version) {
+    WebhouseState expected = stateOf(version);
+
+    return memcmp(state, &expected, sizeof(expected)) == 0;
+}
+
+// changelog_read(after, max) gives the count states after it, in order
+static int reads(uint32_t after, int max, int count) {
+    int n = changelog_read(after, out, max);
+
+    if (n != count) {
+        printf("  [INFO] after %u: %d states, %d expected\n", after, n, count);
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!same(&out[i], after + 1 + i)) {
+            printf("  [INFO] after %u: state %d is version %u\n", after, i, out[i].version);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int has(uint32_t version) {
+    WebhouseState state;
+
+    return changelog_get(version, &state) == 0 && same(&state, version);
+}
+
+int main() {
+    WebhouseState state;
+
+    test_begin("CHANGELOG TEST");
+
+    printf("\n--- Empty ---\n");
+    printStatus("no state", changelog_get(0, &state) == -1);
+    printStatus("no resume", changelog_read(0, out, 8) == -1);
+
+    // A client that has a version gets the ones after it
+    printf("\n--- Resume ---\n");
+    for (uint32_t v = 1; v <= 10; v++) {
+        append(v);
+    }
+    printStatus("state of a version", has(1) && has(5) && has(10));
+    printStatus("no future version", changelog_get(11, &state) == -1);
+    printStatus("no version before the first", changelog_get(0, &state) == -1);
+    printStatus("up to date: nothing", reads(10, 8, 0));
+    printStatus("the states missed", reads(7, 8, 3));
+    printStatus("limited to max", reads(1, 4, 4));
+    printStatus("all of them", reads(1, CHANGELOG_SIZE, 9));
+    printStatus("ahead of the server refused", changelog_read(12, out, 8) == -1);
+
+    // Full: the oldest versions drop out
+    printf("\n--- Wrap ---\n");
+    for (uint32_t v = 11; v <= 1000; v++) {
+        append(v);
+    }
+    uint32_t oldest = 1000 - CHANGELOG_SIZE + 1;
+    printStatus("latest kept", has(1000));
+    printStatus("oldest kept", has(oldest));
+    printStatus("older dropped", changelog_get(oldest - 1, &state) == -1 && !has(1));
+    printStatus("resume from the oldest", reads(oldest, CHANGELOG_SIZE, CHANGELOG_SIZE - 1));
+    printStatus("resume from a dropped one refused", changelog_read(oldest - 1, out, 8) == -1);
+    printStatus("resume in the middle", reads(900, 8, 8) && reads(990, 64, 10));
+
+    // The version counter started over (restart without persisted state):
+    // the log starts over with it
+    printf("\n--- Reset ---\n");
+    append(5);
+    printStatus("new version kept", has(5) && reads(5, 8, 0));
+    printStatus("old log dropped", changelog_get(1000, &state) == -1
+                && changelog_read(999, out, 8) == -1);
+    printStatus("no version before it", changelog_read(4, out, 8) == -1);
+    append(6);
+    printStatus("continues", reads(5, 8, 1));
+    append(6);
+    printStatus("same version again starts over", reads(6, 8, 0)
+                && changelog_read(5, out, 8) == -1);
+
+    // 32 bit version counter wrapping around
+    printf("\n--- Counter wrap ---\n");
+    append(UINT32_MAX - 1);
+    append(UINT32_MAX);
+    append(0);
+    append(1);
+    printStatus("across the wrap", reads(UINT32_MAX - 1, 8, 3));
+    printStatus("after the wrap", has(0) && has(1) && reads(0, 8, 1));
+    printStatus("before the first refused", changelog_get(UINT32_MAX - 2, &state) == -1
+                && changelog_read(UINT32_MAX - 2, out, 8) == -1);
+    printStatus("future after the wrap refused", changelog_get(2, &state) == -1);
+
+    return test_end();
+}
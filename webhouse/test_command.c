@@ -0,0 +1,150 @@
+/*
+ * test_command.c
+ * Parser of the dashboard protocol (command.c): every command, with and
+ * without an id, the values and topics, and the texts it must refuse.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "command.h"
+#include "test_util.h"
+
+// Parses text to type and value, with the id if hasId
+static int parses(const char *text, CommandType type, long value, int hasId, uint32_t id) {
+    Command cmd;
+
+    if (parseCommand(text, &cmd) != type || cmd.type != type || cmd.value != value
+            || cmd.hasId != hasId || (hasId && cmd.id != id)) {
+        printf("  [INFO] %s: %s %ld id %d %u\n", text, commandName(cmd.type), cmd.value,
+               cmd.hasId, cmd.id);
+        return 0;
+    }
+    return 1;
+}
+
+// Not a command, and no id taken from it
+static int refused(const char *text) {
+    return parses(text, CMD_UNKNOWN, 0, 0, 0);
+}
+
+// parseUint32 reads digits and gives value, or refuses (0 digits) and
+// leaves value alone
+static int number(const char *text, int digits, uint32_t value) {
+    uint32_t n = 12345;
+
+    return parseUint32(text, &n) == digits && n == (digits > 0 ? value : 12345);
+}
+
+int main() {
+    static const struct {
+        const char *text;
+        CommandType type;
+    } buttons[] = {
+        { "<HeatOn>",    CMD_HEAT_ON },   { "<HeatOff>",  CMD_HEAT_OFF },
+        { "<L1on>",      CMD_L1_ON },     { "<L1off>",    CMD_L1_OFF },
+        { "<TVon>",      CMD_TV_ON },     { "<TVoff>",    CMD_TV_OFF },
+        { "<AlarmOn>",   CMD_ALARM_ON },  { "<AlarmOff>", CMD_ALARM_OFF },
+        { "<L2on>",      CMD_L2_ON },     { "<L2off>",    CMD_L2_OFF },
+        { "<GetStatus>", CMD_GET_STATUS },
+    };
+    char text[COMMAND_TEXT_MAX * 2];
+    int ok;
+
+    test_begin("COMMAND TEST");
+
+    printf("\n--- Buttons ---\n");
+    ok = 1;
+    for (size_t i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+        ok &= parses(buttons[i].text, buttons[i].type, 0, 0, 0);
+    }
+    printStatus("all buttons", ok);
+    ok = 1;
+    for (size_t i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+        size_t len = strlen(buttons[i].text);
+        snprintf(text, sizeof(text), "%.*s#%zu>", (int)(len - 1), buttons[i].text, i + 1);
+        ok &= parses(text, buttons[i].type, 0, 1, (uint32_t)(i + 1));
+    }
+    printStatus("all buttons with an id", ok);
+
+    printf("\n--- Values ---\n");
+    printStatus("<Dim1:50>", parses("<Dim1:50>", CMD_DIM1, 50, 0, 0));
+    printStatus("<Dim2:0>", parses("<Dim2:0>", CMD_DIM2, 0, 0, 0));
+    printStatus("<SetTemp:22>", parses("<SetTemp:22>", CMD_SET_TEMP, 22, 0, 0));
+    printStatus("<History:3600>", parses("<History:3600>", CMD_HISTORY, 3600, 0, 0));
+    printStatus("<History:0> refused", refused("<History:0>"));
+    printStatus("<Dim1:> refused", refused("<Dim1:>"));
+    printStatus("<GetStatus:17>", parses("<GetStatus:17>", CMD_GET_STATUS_ACK, 17, 0, 0));
+    printStatus("<GetStatus:4294967295>",
+                parses("<GetStatus:4294967295>", CMD_GET_STATUS_ACK, (long)UINT32_MAX, 0, 0));
+    printStatus("<GetStatus:4294967296> refused", refused("<GetStatus:4294967296>"));
+    printStatus("<GetStatus:-1> refused", refused("<GetStatus:-1>"));
+    printStatus("<GetStatus: 1> refused", refused("<GetStatus: 1>"));
+    printStatus("<GetStatus:> refused", refused("<GetStatus:>"));
+    printStatus("<GetStatus:5x> refused", refused("<GetStatus:5x>"));
+
+    // The id sits before the closing '>', also behind a value
+    printf("\n--- Ids ---\n");
+    printStatus("<L1on#42>", parses("<L1on#42>", CMD_L1_ON, 0, 1, 42));
+    printStatus("<Dim1:50#43>", parses("<Dim1:50#43>", CMD_DIM1, 50, 1, 43));
+    printStatus("<GetStatus:7#9>", parses("<GetStatus:7#9>", CMD_GET_STATUS_ACK, 7, 1, 9));
+    printStatus("<Subscribe:tv#3>", parses("<Subscribe:tv#3>", CMD_SUBSCRIBE, TOPIC_TV, 1, 3));
+    printStatus("id 0", parses("<L1on#0>", CMD_L1_ON, 0, 1, 0));
+    printStatus("largest id", parses("<L1on#4294967295>", CMD_L1_ON, 0, 1, 4294967295U));
+    printStatus("leading zeros", parses("<L1on#0042>", CMD_L1_ON, 0, 1, 42));
+    printStatus("id too large refused", refused("<L1on#4294967296>"));
+    printStatus("id far too large refused", refused("<L1on#99999999999999999999>"));
+    printStatus("empty id refused", refused("<L1on#>"));
+    printStatus("negative id refused", refused("<L1on#-1>"));
+    printStatus("id with a sign refused", refused("<L1on#+1>"));
+    printStatus("id with a space refused", refused("<L1on# 1>"));
+    printStatus("id not at the end refused", refused("<L1on#42x>"));
+    printStatus("id before the value refused", refused("<Dim1#4:50>"));
+    printStatus("two ids refused", refused("<L1on#1#2>"));
+    strcpy(text, "<Subscribe:temp");
+    while (strlen(text) < COMMAND_TEXT_MAX) {
+        strcat(text, ",tv");
+    }
+    strcat(text, "#1>");
+    printStatus("too long refused", refused(text));
+
+    printf("\n--- Subscribe ---\n");
+    printStatus("one topic", parses("<Subscribe:temp>", CMD_SUBSCRIBE, TOPIC_TEMP, 0, 0));
+    printStatus("several topics", parses("<Subscribe:temp,alarm>", CMD_SUBSCRIBE,
+                                         TOPIC_TEMP | TOPIC_ALARM, 0, 0));
+    printStatus("all", parses("<Subscribe:all>", CMD_SUBSCRIBE, TOPIC_ALL, 0, 0));
+    printStatus("unknown topic skipped", parses("<Subscribe:temp,weather,tv>", CMD_SUBSCRIBE,
+                                                TOPIC_TEMP | TOPIC_TV, 0, 0));
+    printStatus("prefix is no topic", parses("<Subscribe:te,temps>", CMD_SUBSCRIBE, 0, 0, 0));
+    printStatus("empty list", parses("<Subscribe:>", CMD_SUBSCRIBE, 0, 0, 0));
+    printStatus("without '>' refused", refused("<Subscribe:temp"));
+    printStatus("text after '>' refused", refused("<Subscribe:temp>x"));
+
+    printf("\n--- Unknown ---\n");
+    printStatus("empty text", refused(""));
+    printStatus("unknown command", refused("<Foo>"));
+    printStatus("without brackets", refused("L1on"));
+    printStatus("wrong case", refused("<l1on>"));
+
+    printf("\n--- parseUint32 ---\n");
+    printStatus("0", number("0", 1, 0));
+    printStatus("4294967295", number("4294967295", 10, 4294967295U));
+    printStatus("4294967296 refused", number("4294967296", 0, 0));
+    printStatus("stops at a non-digit", number("12>", 2, 12));
+    printStatus("empty refused", number("", 0, 0));
+    printStatus("sign refused", number("-1", 0, 0));
+    printStatus("space refused", number(" 1", 0, 0));
+
+    printf("\n--- Names ---\n");
+    printStatus("names", strcmp(commandName(CMD_L1_ON), "L1on") == 0
+                && strcmp(commandName(CMD_SUBSCRIBE), "Subscribe") == 0);
+    ok = 1;
+    for (int type = 0; type < CMD_COUNT; type++) {
+        ok &= commandName((CommandType)type) != NULL;
+    }
+    printStatus("no type without a name", ok);
+    printStatus("out of range", strcmp(commandName(CMD_COUNT), "unknown") == 0);
+
+    return test_end();
+}
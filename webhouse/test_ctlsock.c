@@ -0,0 +1,147 @@
+/*
+ * test_ctlsock.c
+ * Control socket (ctlsock.c): every reply is a message of its own, also
+ * the many replies of a resume (<GetStatus:version>), which does not fit
+ * in the socket at once, and a reply spread over several queue chunks.
+ * processCommand stands in for the one of main.c and replays versions the
+ * way resumeSession does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "ctlsock.h"
+#include "netconn.h"
+#include "command.h"
+#include "test_util.h"
+
+#define LATEST         2000            // state version of the stand-in
+#define LONG_REPLY     5000            // more than two queue chunks
+
+static char reply[8192];
+
+// The replies of main.c in short: a resume replays one delta per version
+// missed, then the status follows; <History:n> has a long answer
+void processCommand(char *command, ws_conn_t *conn) {
+    Command cmd;
+    char text[64];
+
+    parseCommand(command, &cmd);
+    if (cmd.type == CMD_GET_STATUS_ACK) {
+        for (uint32_t v = (uint32_t)cmd.value + 1; v <= LATEST; v++) {
+            int len = snprintf(text, sizeof(text), "V:%u;Temp:%u", v, v % 300);
+            ws_conn_send(conn, WS_OP_TEXT, text, len);
+        }
+    }
+    if (cmd.type == CMD_HISTORY) {
+        memset(reply, 'h', LONG_REPLY);
+        ws_conn_send(conn, WS_OP_TEXT, reply, LONG_REPLY);
+        return;
+    }
+    int len = snprintf(text, sizeof(text), "V:%u", LATEST);
+    ws_conn_send(conn, WS_OP_TEXT, text, len);
+}
+
+static int request(int sock, const char *command) {
+    return send(sock, command, strlen(command), 0) == (ssize_t)strlen(command);
+}
+
+// Next message, NUL terminated in reply; its length, -1 if none comes
+static int next(int sock) {
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+    if (poll(&pfd, 1, 2000) != 1) {
+        return -1;
+    }
+    ssize_t n = recv(sock, reply, sizeof(reply) - 1, 0);
+    if (n >= 0) {
+        reply[n] = '\0';
+    }
+    return (int)n;
+}
+
+// The next message is the text, alone
+static int gets(int sock, const char *text) {
+    if (next(sock) < 0 || strcmp(reply, text) != 0) {
+        printf("  [INFO] \"%.60s\", expected \"%s\"\n", reply, text);
+        return 0;
+    }
+    return 1;
+}
+
+// A resume after version: one message per version, in order, then the status
+static int resumes(int sock, uint32_t version) {
+    char text[64];
+
+    for (uint32_t v = version + 1; v <= LATEST; v++) {
+        snprintf(text, sizeof(text), "V:%u;Temp:%u", v, v % 300);
+        if (!gets(sock, text)) {
+            return 0;
+        }
+    }
+    snprintf(text, sizeof(text), "V:%u", LATEST);
+    return gets(sock, text);
+}
+
+int main() {
+    char path[] = "/tmp/test_ctlsock.XXXXXX";
+    struct sockaddr_un addr;
+    int stopFd = eventfd(0, EFD_CLOEXEC);
+    int sock;
+
+    test_begin("CTLSOCK TEST");
+    if (mkdtemp(path) == NULL || stopFd < 0) {
+        perror("test_ctlsock");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ctl", path);
+    printStatus("start", ctl_start(addr.sun_path, -1, stopFd) == 0);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    printStatus("connect", connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    printf("\n--- One reply ---\n");
+    request(sock, "<GetStatus>");
+    printStatus("status", gets(sock, "V:2000"));
+    request(sock, "<Subscribe:temp>");
+    printStatus("no pushes", gets(sock, "<Unsupported>"));
+    request(sock, "<History:60>");
+    printStatus("reply over several chunks", next(sock) == LONG_REPLY
+                && reply[0] == 'h' && reply[LONG_REPLY - 1] == 'h');
+
+    // Each change missed is a message, none glued to the next
+    printf("\n--- Resume ---\n");
+    request(sock, "<GetStatus:1995>");
+    printStatus("resume, a message per change", resumes(sock, 1995));
+    request(sock, "<GetStatus>");
+    printStatus("next reply alone", gets(sock, "V:2000"));
+    request(sock, "<GetStatus:2000>");
+    printStatus("up to date: the status", gets(sock, "V:2000"));
+
+    // More than the socket holds: the rest follows as the client reads
+    request(sock, "<GetStatus:0>");
+    usleep(200 * 1000);
+    request(sock, "<GetStatus>");
+    printStatus("long resume, in order", resumes(sock, 0));
+    printStatus("command behind it answered", gets(sock, "V:2000"));
+    printStatus("nothing more", next(sock) == -1);
+
+    close(sock);
+    uint64_t one = 1;
+    if (write(stopFd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+    }
+    ctl_stop();
+    close(stopFd);
+    rmdir(path);
+
+    return test_end();
+}
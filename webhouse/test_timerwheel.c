@@ -0,0 +1,167 @@
+/*
+ * test_timerwheel.c
+ * Timer wheel of the event loops (timerwheel.c): timers expire with the
+ * first tick at or after their deadline, in order, also past one turn of
+ * the wheel, and the one-shot timerfd is set for the earliest one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include "timerwheel.h"
+#include "metrics.h"
+#include "test_util.h"
+
+#define TICK_NS            ((uint64_t)TW_TICK_MS * 1000000ULL)
+#define MS                 1000000ULL
+
+typedef struct {
+    tw_timer_t *order[16];
+    int         count;
+    tw_timer_t *again;             // scheduled again from its callback
+    uint64_t    againAt;
+} expired_t;
+
+static tw_wheel_t wheel;
+static uint64_t base;              // ns of the wheel's current tick at open
+
+static void expire(tw_timer_t *timer, void *arg) {
+    expired_t *out = arg;
+
+    if (out->count < 16) {
+        out->order[out->count] = timer;
+    }
+    out->count++;
+    if (timer == out->again) {
+        tw_schedule(&wheel, timer, out->againAt);
+    }
+}
+
+static int advance(uint64_t ms, expired_t *out) {
+    memset(out, 0, sizeof(*out));
+    tw_advance(&wheel, base + ms * MS, expire, out);
+    return out->count;
+}
+
+// Tick the wheel expires a deadline ms after base at
+static uint64_t tickOf(uint64_t ms) {
+    return (base + ms * MS + TICK_NS - 1) / TICK_NS;
+}
+
+int main() {
+    tw_timer_t a, b, c, d, e;
+    expired_t out;
+
+    test_begin("TIMERWHEEL TEST");
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&c, 0, sizeof(c));
+    memset(&d, 0, sizeof(d));
+    memset(&e, 0, sizeof(e));
+    if (tw_open(&wheel) != 0) {
+        perror("tw_open");
+        return 1;
+    }
+    base = wheel.tick * TICK_NS;
+    printStatus("empty wheel stopped", wheel.armed == 0 && wheel.count == 0);
+
+    // Set for the earliest timer; a deadline already past is due next tick
+    printf("\n--- Schedule ---\n");
+    tw_schedule(&wheel, &a, base + 1000 * MS);
+    printStatus("armed for the first timer", wheel.armed == tickOf(1000) && tw_pending(&a));
+    tw_schedule(&wheel, &b, base + 600 * MS);
+    printStatus("earlier timer arms earlier", wheel.armed == tickOf(600));
+    tw_schedule(&wheel, &c, base - 5000 * MS);
+    printStatus("deadline past: next tick", c.expires == wheel.tick + 1
+                && wheel.armed == wheel.tick + 1);
+    printStatus("three scheduled", wheel.count == 3);
+
+    // Each at its tick, none early, the timerfd set for the next one
+    printf("\n--- Advance ---\n");
+    printStatus("nothing before a tick", advance(100, &out) == 0
+                && wheel.armed == wheel.tick + 1);
+    printStatus("past deadline expires", advance(250, &out) == 1 && out.order[0] == &c
+                && !tw_pending(&c));
+    printStatus("armed for the next", wheel.armed == tickOf(600) && wheel.count == 2);
+    printStatus("not before the deadline", advance(700, &out) == 0 && tw_pending(&b));
+    printStatus("at the tick after it", advance(750, &out) == 1 && out.order[0] == &b);
+
+    // Cancel and reschedule
+    printf("\n--- Cancel ---\n");
+    tw_schedule(&wheel, &b, base + 2000 * MS);
+    tw_schedule(&wheel, &a, base + 3000 * MS);       // moved later
+    printStatus("rescheduled, not counted twice", wheel.count == 2);
+    printStatus("moved timer not due", advance(1000, &out) == 0);
+    printStatus("armed for the earliest left", wheel.armed == tickOf(2000));
+    tw_cancel(&wheel, &b);
+    tw_cancel(&wheel, &b);
+    printStatus("cancelled twice", !tw_pending(&b) && wheel.count == 1);
+    tw_cancel(&wheel, &a);
+    printStatus("last cancelled: stopped", wheel.armed == 0 && wheel.count == 0);
+    printStatus("cancelled never expire", advance(5000, &out) == 0);
+
+    // Due in one advance: in the order of their ticks, same tick in the
+    // order scheduled; a callback may schedule again
+    printf("\n--- Order ---\n");
+    tw_schedule(&wheel, &c, base + 6000 * MS);
+    tw_schedule(&wheel, &a, base + 5500 * MS);
+    tw_schedule(&wheel, &b, base + 6000 * MS);
+    tw_schedule(&wheel, &d, base + 5250 * MS);
+    memset(&out, 0, sizeof(out));
+    out.again = &a;
+    out.againAt = base + 9000 * MS;
+    tw_advance(&wheel, base + 6100 * MS, expire, &out);
+    printStatus("all due expired", out.count == 4);
+    printStatus("in tick order", out.order[0] == &d && out.order[1] == &a
+                && out.order[2] == &c && out.order[3] == &b);
+    printStatus("scheduled from the callback", tw_pending(&a) && wheel.count == 1
+                && wheel.armed == tickOf(9000));
+    tw_cancel(&wheel, &a);
+
+    // Further than one turn: stays in its slot while the tick goes by
+    printf("\n--- Beyond one turn ---\n");
+    uint64_t turn = (uint64_t)TW_SLOTS * TW_TICK_MS;
+    tw_schedule(&wheel, &e, base + 10000 * MS + 2 * turn * MS);
+    tw_schedule(&wheel, &d, base + 10000 * MS);
+    printStatus("armed for the near one", wheel.armed == tickOf(10000));
+    printStatus("near one expires", advance(10000, &out) == 1 && out.order[0] == &d);
+    printStatus("armed for the far one", wheel.armed == tickOf(10000 + 2 * turn));
+    printStatus("slot passed, not due", advance(10000 + turn + 250, &out) == 0
+                && tw_pending(&e));
+    printStatus("due after two turns", advance(10000 + 2 * turn, &out) == 1
+                && out.order[0] == &e);
+
+    // A loop that stalled for longer than a turn expires everything due
+    tw_schedule(&wheel, &a, base + 200000 * MS);
+    tw_schedule(&wheel, &b, base + 210000 * MS);
+    tw_schedule(&wheel, &c, base + 900000 * MS);
+    printStatus("long stall", advance(400000, &out) == 2 && tw_pending(&c)
+                && wheel.armed == tickOf(900000));
+    tw_cancel(&wheel, &c);
+
+    // The timerfd itself fires at the armed tick; the wheel above ran
+    // ahead of the clock, so on a new one
+    printf("\n--- Timerfd ---\n");
+    tw_close(&wheel);
+    if (tw_open(&wheel) != 0) {
+        perror("tw_open");
+        return 1;
+    }
+    struct pollfd pfd = { .fd = wheel.fd, .events = POLLIN };
+    uint64_t now = metrics_now_ns();
+    printStatus("stopped: no wakeup", poll(&pfd, 1, 2 * TW_TICK_MS) == 0);
+    tw_schedule(&wheel, &a, now);
+    printStatus("fires at the armed tick", poll(&pfd, 1, 4 * TW_TICK_MS) == 1);
+    uint64_t fired;
+    printStatus("read", read(wheel.fd, &fired, sizeof(fired)) == sizeof(fired));
+    memset(&out, 0, sizeof(out));
+    tw_advance(&wheel, metrics_now_ns(), expire, &out);
+    printStatus("timer expired, stopped", out.count == 1 && wheel.armed == 0);
+
+    tw_close(&wheel);
+
+    return test_end();
+}
@@ -0,0 +1,173 @@
+/*
+ * test_tsdb.c
+ * Round trip of the history store (tsdb.c): samples are written and read
+ * back bit for bit, across full blocks, a gap too long for one block, a
+ * reopen and a torn last block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "tsdb.h"
+#include "test_util.h"
+
+#define MAX_SAMPLES 8192
+
+typedef struct {
+    tsdb_sample_t samples[MAX_SAMPLES];
+    long          count;
+} collected_t;
+
+static tsdb_sample_t written[MAX_SAMPLES];
+static long writtenCount;
+static collected_t readBack;
+
+static void collect(const tsdb_sample_t *sample, void *arg) {
+    collected_t *out = arg;
+
+    if (out->count < MAX_SAMPLES) {
+        out->samples[out->count] = *sample;
+    }
+    out->count++;
+}
+
+// Append and remember what the store should give back
+static int append(tsdb_t *db, uint64_t ms, float value, uint32_t state) {
+    if (writtenCount > 0 && ms < written[writtenCount - 1].ms) {
+        ms = written[writtenCount - 1].ms;          // stored as the previous time
+    }
+    written[writtenCount].ms = ms;
+    written[writtenCount].value = value;
+    written[writtenCount].state = state & ((1u << TSDB_STATE_BITS) - 1);
+    writtenCount++;
+    return tsdb_append(db, ms, value, state);
+}
+
+// All samples read back equal the first count written, value bit for bit
+static int sameAsWritten(tsdb_t *db, long count) {
+    readBack.count = 0;
+    if (tsdb_query(db, 0, UINT64_MAX, collect, &readBack) != count || readBack.count != count) {
+        printf("  [INFO] %ld samples read, %ld expected\n", readBack.count, count);
+        return 0;
+    }
+    for (long i = 0; i < count; i++) {
+        const tsdb_sample_t *a = &written[i];
+        const tsdb_sample_t *b = &readBack.samples[i];
+        if (a->ms != b->ms || memcmp(&a->value, &b->value, sizeof(float)) != 0
+                || a->state != b->state) {
+            printf("  [INFO] sample %ld: %llu %g %x, read %llu %g %x\n", i,
+                   (unsigned long long)a->ms, a->value, a->state,
+                   (unsigned long long)b->ms, b->value, b->state);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main() {
+    char path[] = "/tmp/test_tsdb.XXXXXX";
+    int fd = mkstemp(path);
+    tsdb_stats_t stats;
+    uint64_t ms = 1700000000000ULL;
+    uint64_t blocks;
+
+    test_begin("TSDB TEST");
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    tsdb_t *db = tsdb_open(path);
+    printStatus("open", db != NULL);
+    if (db == NULL) {
+        unlink(path);
+        return 1;
+    }
+
+    // Temperature every second with jitter, the heater bit flipping: more
+    // than one block
+    printf("\n--- Full blocks ---\n");
+    for (int i = 0; i < 3000; i++) {
+        ms += 1000 + (i % 7 == 0 ? 3 : 0) - (i % 11 == 0 ? 2 : 0);
+        append(db, ms, 20.0f + (i % 50) * 0.1f, (i / 100) & 1);
+    }
+    tsdb_stats(db, &stats);
+    printStatus("several blocks sealed", stats.blocks >= 2);
+    printStatus("samples counted", stats.samples == 3000);
+    printStatus("round trip, written and in memory", sameAsWritten(db, writtenCount));
+
+    // Odd values and all state bits
+    printf("\n--- Values and states ---\n");
+    append(db, ms += 1000, -0.0f, 0xffffff);
+    append(db, ms += 1000, 1e-30f, 0x123456);
+    append(db, ms += 1000, -3.4e38f, 0xff000001);   // upper bits are not stored
+    append(db, ms += 1000, 22.5f, 0);
+    append(db, ms - 5000, 22.5f, 0);                // clock set back
+    printStatus("round trip, odd values", sameAsWritten(db, writtenCount));
+
+    // A gap longer than INT32_MAX ms does not fit the timestamp encoding:
+    // the block is sealed and the next sample starts a new one
+    printf("\n--- Delta of delta at its limits ---\n");
+    tsdb_stats(db, &stats);
+    blocks = stats.blocks;
+    append(db, ms += 1000, 1.0f, 1);
+    append(db, ms += INT32_MAX, 2.0f, 1);           // largest delta in a block
+    append(db, ms, 3.0f, 1);                        // dod = -INT32_MAX
+    tsdb_stats(db, &stats);
+    printStatus("largest interval in the block", stats.blocks == blocks);
+    append(db, ms += (uint64_t)INT32_MAX + 1, 4.0f, 2);
+    tsdb_stats(db, &stats);
+    printStatus("longer interval starts a block", stats.blocks == blocks + 1);
+    append(db, ms += 1, 5.0f, 2);
+    append(db, ms += 2048, 6.0f, 2);                // dod 2047, 12 bits
+    append(db, ms += 1, 7.0f, 2);                   // dod -2047
+    append(db, ms += 4000, 8.0f, 2);                // dod 3999, 32 bits
+    printStatus("round trip across the split", sameAsWritten(db, writtenCount));
+
+    // Range query: only the samples in [from, to]
+    readBack.count = 0;
+    tsdb_query(db, written[100].ms, written[199].ms, collect, &readBack);
+    printStatus("range query", readBack.count == 100
+                && readBack.samples[0].ms == written[100].ms);
+
+    // Reopen: everything was flushed by close
+    printf("\n--- Reopen ---\n");
+    printStatus("close", tsdb_close(db) == 0);
+    db = tsdb_open(path);
+    printStatus("reopen", db != NULL);
+    if (db == NULL) {
+        unlink(path);
+        return 1;
+    }
+    printStatus("round trip after reopen", sameAsWritten(db, writtenCount));
+
+    // A torn last block is dropped, the blocks before it are kept
+    printf("\n--- Torn block ---\n");
+    tsdb_stats(db, &stats);
+    blocks = stats.blocks;
+    tsdb_close(db);
+    if (truncate(path, blocks * TSDB_BLOCK_SIZE - 100) != 0) {
+        perror("truncate");
+    }
+    db = tsdb_open(path);
+    printStatus("open with a torn block", db != NULL);
+    if (db == NULL) {
+        unlink(path);
+        return 1;
+    }
+    tsdb_stats(db, &stats);
+    printStatus("torn block dropped", stats.blocks == blocks - 1);
+    readBack.count = 0;
+    long kept = tsdb_query(db, 0, UINT64_MAX, collect, &readBack);
+    printStatus("samples before it kept", kept > 0 && kept < writtenCount
+                && sameAsWritten(db, kept));
+    printStatus("append after it", tsdb_append(db, ms + 1000, 1.0f, 0) == 0);
+
+    tsdb_close(db);
+    unlink(path);
+
+    return test_end();
+}
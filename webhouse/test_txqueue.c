@@ -0,0 +1,177 @@
+/*
+ * test_txqueue.c
+ * Send queue of a connection (txqueue.c): small replies collapse into one
+ * chunk, the pool and its heap fallback, the limit, and the cut at a
+ * message boundary when a slow client is evicted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "txqueue.h"
+#include "test_util.h"
+
+#define POOL_CHUNKS 8
+
+static int freeChunks(const tx_pool_t *pool) {
+    int n = 0;
+
+    for (const tx_chunk_t *chunk = pool->free; chunk != NULL; chunk = chunk->next) {
+        n++;
+    }
+    return n;
+}
+
+static int chunks(const tx_queue_t *queue) {
+    int n = 0;
+
+    for (const tx_chunk_t *chunk = queue->head; chunk != NULL; chunk = chunk->next) {
+        n++;
+    }
+    return n;
+}
+
+// The queued bytes, copied out through tx_queue_peek
+static size_t contents(const tx_queue_t *queue, size_t skip, uint8_t *out, size_t size) {
+    struct iovec iov[64];
+    int count = tx_queue_peek(queue, skip, iov, 64);
+    size_t len = 0;
+
+    for (int i = 0; i < count && len + iov[i].iov_len <= size; i++) {
+        memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+// Message i: its length and a fill byte, so a cut inside one shows
+static void message(int i, uint8_t *buf, size_t len) {
+    memset(buf, 'a' + i % 26, len);
+}
+
+int main() {
+    static uint8_t buf[64 * 1024];
+    static uint8_t msg[8 * 1024];
+    tx_pool_t pool;
+    tx_queue_t queue;
+
+    test_begin("TXQUEUE TEST");
+    if (tx_pool_init(&pool, POOL_CHUNKS) != 0) {
+        perror("tx_pool_init");
+        return 1;
+    }
+    tx_queue_init(&queue, &pool);
+
+    // Replies of a batch of commands end up in one chunk, one send
+    printf("\n--- Collapse ---\n");
+    for (int i = 0; i < 20; i++) {
+        message(i, msg, 40);
+        tx_queue_append(&queue, msg, 40);
+    }
+    printStatus("20 replies in one chunk", chunks(&queue) == 1 && queue.bytes == 800);
+    size_t len = contents(&queue, 0, buf, sizeof(buf));
+    printStatus("in order", len == 800 && buf[0] == 'a' && buf[799] == 't');
+    tx_queue_consume(&queue, 300);
+    printStatus("partly sent", queue.bytes == 500 && contents(&queue, 0, buf, sizeof(buf)) == 500
+                && buf[0] == 'h');
+    tx_queue_consume(&queue, 500);
+    printStatus("sent tail freed", queue.head == NULL && queue.tail == NULL
+                && freeChunks(&pool) == POOL_CHUNKS);
+
+    // A message larger than a chunk spans several; past the pool they come
+    // from the heap, and go back where they came from
+    printf("\n--- Pool ---\n");
+    message(0, msg, sizeof(msg));
+    tx_queue_append(&queue, msg, sizeof(msg));
+    printStatus("message over chunks", queue.bytes == sizeof(msg)
+                && chunks(&queue) == (int)((sizeof(msg) + TX_RESERVE_MAX - 1) / TX_RESERVE_MAX));
+    for (int i = 0; i < 4; i++) {
+        tx_queue_append(&queue, msg, sizeof(msg));
+    }
+    printStatus("pool empty, heap chunks", freeChunks(&pool) == 0
+                && queue.bytes == 5 * sizeof(msg));
+    len = contents(&queue, 0, buf, sizeof(buf));
+    printStatus("nothing lost", len == 5 * sizeof(msg) && buf[len - 1] == 'a');
+    tx_queue_clear(&queue);
+    printStatus("pool chunks back", freeChunks(&pool) == POOL_CHUNKS && queue.bytes == 0);
+
+    // Above the limit the client is backlogged
+    printf("\n--- Limit ---\n");
+    queue.limit = 4096;
+    tx_queue_append(&queue, msg, 4096);
+    printStatus("at the limit", !tx_queue_over(&queue));
+    tx_queue_append(&queue, msg, 1);
+    printStatus("over the limit", tx_queue_over(&queue));
+    tx_queue_consume(&queue, 1);
+    printStatus("drained", !tx_queue_over(&queue));
+    tx_queue_clear(&queue);
+    queue.limit = 0;
+
+    // Eviction: the unsent replies are dropped at a message start, so a
+    // close frame can follow; the part in flight stays
+    printf("\n--- Eviction ---\n");
+    size_t lengths[40];
+    size_t total = 0;
+    for (int i = 0; i < 40; i++) {
+        lengths[i] = 100 + (i * 37) % 300;
+        message(i, msg, lengths[i]);
+        tx_queue_append(&queue, msg, lengths[i]);
+        total += lengths[i];
+    }
+    tx_queue_consume(&queue, 150);                  // sent
+    queue.inflight = 250;                           // handed to the kernel
+    size_t dropped = tx_queue_truncate(&queue, queue.inflight);
+    int boundary = 0;
+    size_t end = 150 + queue.bytes;
+    for (size_t sum = 0, i = 0; i < 40 && sum <= end; sum += lengths[i++]) {
+        boundary |= sum == end;
+    }
+    printStatus("bytes dropped", dropped > 0 && queue.bytes + dropped == total - 150);
+    printStatus("in flight kept", queue.bytes >= queue.inflight);
+    printStatus("cut at a message start", boundary);
+    printStatus("queue consistent", contents(&queue, 0, buf, sizeof(buf)) == queue.bytes);
+    uint8_t close[2] = { 0x88, 0x00 };
+    tx_queue_append(&queue, close, sizeof(close));
+    len = contents(&queue, 0, buf, sizeof(buf));
+    printStatus("close frame behind it", buf[len - 2] == 0x88 && buf[len - 3] != 0x88);
+    queue.inflight = 0;
+    tx_queue_clear(&queue);
+
+    // Nothing in flight: everything but the message being sent goes
+    message(1, msg, 3000);
+    tx_queue_append(&queue, msg, 3000);
+    message(2, msg, 3000);
+    tx_queue_append(&queue, msg, 3000);
+    tx_queue_consume(&queue, 10);
+    tx_queue_truncate(&queue, 0);
+    printStatus("started message kept", queue.bytes == 2990);
+    tx_queue_clear(&queue);
+
+    // Written in place: in the tail while it fits, else a new chunk
+    printf("\n--- Reserve ---\n");
+    tx_queue_append(&queue, msg, 100);
+    uint8_t *room = tx_queue_reserve(&queue, 50);
+    printStatus("room in the tail", room == queue.tail->data + 100);
+    memcpy(room, "in place", 8);
+    tx_queue_commit(&queue, 8);
+    printStatus("committed", queue.bytes == 108 && chunks(&queue) == 1);
+    room = tx_queue_reserve(&queue, TX_RESERVE_MAX);
+    printStatus("room in a new chunk", room != NULL && chunks(&queue) == 1);
+    tx_queue_commit(&queue, 0);
+    printStatus("nothing committed", queue.bytes == 108 && freeChunks(&pool) == POOL_CHUNKS - 1);
+    printStatus("too large", tx_queue_reserve(&queue, TX_RESERVE_MAX + 1) == NULL);
+    tx_queue_clear(&queue);
+
+    // Zero-copy sends: sent chunks are held until the kernel is done
+    printf("\n--- Hold ---\n");
+    queue.hold = 1;
+    tx_queue_append(&queue, msg, 100);
+    tx_queue_consume(&queue, 100);
+    printStatus("sent chunk held", queue.held != NULL && freeChunks(&pool) == POOL_CHUNKS - 1);
+    tx_queue_release(&queue);
+    printStatus("released", queue.held == NULL && freeChunks(&pool) == POOL_CHUNKS);
+
+    tx_pool_free(&pool);
+
+    return test_end();
+}
@@ -0,0 +1,32 @@
+/*
+ * test_util.c
+ * Output shared by the unit tests (make test): the banner, one line per
+ * check as in test_hardware, and the result as exit code.
+ */
+
+#include <stdio.h>
+#include "test_util.h"
+
+static int failures;
+
+void test_begin(const char *name) {
+    printf("========================================\n");
+    printf("   %s\n", name);
+    printf("========================================\n");
+}
+
+void printStatus(const char *component, int ok) {
+    printf("  [TEST] %-40s -> %s\n", component, ok ? "OK" : "FEHLER");
+    fflush(stdout);
+    if (!ok) {
+        failures++;
+    }
+}
+
+// Exit code of the test: 0 if every check passed
+int test_end(void) {
+    printf("\n========================================\n");
+    printf("   %s\n", failures == 0 ? "ALLE TESTS OK" : "TESTS FEHLGESCHLAGEN");
+    printf("========================================\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+// Output of the unit tests (make test), as in test_hardware, see test_util.c
+extern void test_begin  (const char *name);
+extern void printStatus (const char *component, int ok);
+extern int  test_end    (void);
+
+#endif // TEST_UTIL_H
@@ -0,0 +1,292 @@
+/******************************************************************************/
+/** \file       timerwheel.c
+ *******************************************************************************
+ *
+ * \brief      Hashed timer wheel
+ *
+ *             The timeouts of the connections (handshake, ping, pong) of one
+ *             event loop. A timer hangs in the slot of its expiry tick
+ *             modulo TW_SLOTS, in a doubly linked list: scheduling and
+ *             cancelling are O(1), and a tick only looks at one slot, so
+ *             tens of thousands of idle connections cost nothing per tick.
+ *             Timers further away than one turn of the wheel stay in their
+ *             slot until their tick comes round.
+ *
+ *             The wheel is driven by one timerfd per loop, set one-shot for
+ *             the tick of the earliest timer and stopped when there are
+ *             none: a loop with one dashboard connected wakes up for its
+ *             ping every 20 s, not every TW_TICK_MS. The loop waits for it
+ *             like for a socket and calls tw_advance when it fired, which
+ *             sets it for the next timer; tw_schedule sets it earlier when
+ *             a timer is due before the one it is set for.
+ *
+ *             Timers are scheduled lazily: a connection that receives data
+ *             does not move its timer, the expiry callback looks at the time
+ *             of the last data and schedules the timer again if it is not
+ *             due yet.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * tw_open
+ * tw_close
+ * tw_schedule
+ * tw_cancel
+ * tw_advance
+ * * functions  local:
+ * list_init
+ * list_add
+ * list_remove
+ * arm
+ * next_expiry
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/timerfd.h>
+
+#include "timerwheel.h"
+#include "metrics.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+#define TICK_NS            ((uint64_t)TW_TICK_MS * 1000000ULL)
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    list_init
+ ******************************************************************************/
+static void list_init(tw_timer_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+/*******************************************************************************
+ * function :    list_add
+ ******************************************************************************/
+static void list_add(tw_timer_t *head, tw_timer_t *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/*******************************************************************************
+ * function :    list_remove
+ ******************************************************************************/
+static void list_remove(tw_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/*******************************************************************************
+ * function :    arm
+ ******************************************************************************/
+/** \brief        Set the timerfd to fire once at a tick, or stop it
+ *
+ * \type         static
+ *
+ * \param[in]    wheel   Wheel
+ * \param[in]    tick    Tick to fire at, 0 to stop
+ *
+ ******************************************************************************/
+static void arm(tw_wheel_t *wheel, uint64_t tick) {
+    struct itimerspec spec;
+
+    if (wheel->armed == tick) {
+        return;
+    }
+    memset(&spec, 0, sizeof(spec));
+    if (tick != 0) {
+        uint64_t ns = tick * TICK_NS;
+        spec.it_value.tv_sec = ns / 1000000000ULL;
+        spec.it_value.tv_nsec = ns % 1000000000ULL;
+    }
+    timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    metrics_inc(METRIC_NET_SYSCALLS);
+    wheel->armed = tick;
+}
+
+/*******************************************************************************
+ * function :    next_expiry
+ ******************************************************************************/
+/** \brief        Tick of the earliest scheduled timer
+ *
+ *               Looks at the slots in the order of their ticks, and stops
+ *               at the first timer due within this turn of the wheel.
+ *
+ * \type         static
+ *
+ * \return       Tick, 0 if no timer is scheduled
+ *
+ ******************************************************************************/
+static uint64_t next_expiry(const tw_wheel_t *wheel) {
+    uint64_t earliest = UINT64_MAX;
+
+    if (wheel->count == 0) {
+        return 0;
+    }
+    for (uint64_t i = 1; i <= TW_SLOTS; i++) {
+        const tw_timer_t *head = &wheel->slots[(wheel->tick + i) & (TW_SLOTS - 1)];
+        for (const tw_timer_t *timer = head->next; timer != head; timer = timer->next) {
+            if (timer->expires < earliest) {
+                earliest = timer->expires;
+            }
+        }
+        if (earliest <= wheel->tick + i) {
+            break;
+        }
+    }
+    return earliest;
+}
+
+/*******************************************************************************
+ * function :    tw_open
+ ******************************************************************************/
+/** \brief        Set up an empty wheel and its timerfd (wheel->fd)
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 on error (errno set)
+ *
+ ******************************************************************************/
+int tw_open(tw_wheel_t *wheel) {
+    memset(wheel, 0, sizeof(*wheel));
+    for (int i = 0; i < TW_SLOTS; i++) {
+        list_init(&wheel->slots[i]);
+    }
+    wheel->tick = metrics_now_ns() / TICK_NS;
+    wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return wheel->fd < 0 ? -1 : 0;
+}
+
+/*******************************************************************************
+ * function :    tw_close
+ ******************************************************************************/
+/** \brief        Close the timerfd; the timers are the owners' business
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void tw_close(tw_wheel_t *wheel) {
+    if (wheel->fd >= 0) {
+        close(wheel->fd);
+        wheel->fd = -1;
+    }
+}
+
+/*******************************************************************************
+ * function :    tw_schedule
+ ******************************************************************************/
+/** \brief        (Re)schedule a timer
+ *
+ *               It expires with the first tick at or after the deadline,
+ *               at the earliest with the next tick.
+ *
+ * \type         global
+ *
+ * \param[in]    wheel         Wheel of the loop
+ * \param[in]    timer         Timer, scheduled or not
+ * \param[in]    deadline_ns   CLOCK_MONOTONIC (metrics_now_ns)
+ *
+ ******************************************************************************/
+void tw_schedule(tw_wheel_t *wheel, tw_timer_t *timer, uint64_t deadline_ns) {
+    uint64_t expires = (deadline_ns + TICK_NS - 1) / TICK_NS;
+
+    if (tw_pending(timer)) {
+        list_remove(timer);
+    } else {
+        wheel->count++;
+    }
+    if (expires <= wheel->tick) {
+        expires = wheel->tick + 1;
+    }
+    timer->expires = expires;
+    list_add(&wheel->slots[expires & (TW_SLOTS - 1)], timer);
+    if (wheel->armed == 0 || expires < wheel->armed) {
+        arm(wheel, expires);
+    }
+}
+
+/*******************************************************************************
+ * function :    tw_cancel
+ ******************************************************************************/
+/** \brief        Cancel a timer if it is scheduled
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void tw_cancel(tw_wheel_t *wheel, tw_timer_t *timer) {
+    if (tw_pending(timer)) {
+        list_remove(timer);
+        wheel->count--;
+        if (wheel->count == 0) {
+            arm(wheel, 0);
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    tw_advance
+ ******************************************************************************/
+/** \brief        Expire the timers due up to now
+ *
+ *               Called when the timerfd fired (after reading it). The due
+ *               timers are taken off the wheel first, then expire is called
+ *               for each; it may schedule or cancel any timer. Afterwards
+ *               the timerfd is set for the next timer left.
+ *
+ * \type         global
+ *
+ * \param[in]    wheel    Wheel of the loop
+ * \param[in]    now_ns   Current time (metrics_now_ns)
+ * \param[in]    expire   Called for every due timer, no longer scheduled
+ * \param[in]    arg      Passed to expire
+ *
+ ******************************************************************************/
+void tw_advance(tw_wheel_t *wheel, uint64_t now_ns, tw_expire_t *expire, void *arg) {
+    uint64_t target = now_ns / TICK_NS;
+    uint64_t steps = target > wheel->tick ? target - wheel->tick : 0;
+    tw_timer_t due;
+
+    list_init(&due);
+    if (steps > TW_SLOTS) {
+        steps = TW_SLOTS;          // every slot once is enough
+    }
+    for (uint64_t i = 1; i <= steps; i++) {
+        tw_timer_t *head = &wheel->slots[(wheel->tick + i) & (TW_SLOTS - 1)];
+        tw_timer_t *timer = head->next;
+        while (timer != head) {
+            tw_timer_t *next = timer->next;
+            if (timer->expires <= target) {
+                list_remove(timer);
+                list_add(&due, timer);
+            }
+            timer = next;
+        }
+    }
+    if (target > wheel->tick) {
+        wheel->tick = target;
+    }
+    if (wheel->armed <= target) {
+        wheel->armed = 0;          // fired, one-shot
+    }
+
+    while (due.next != &due) {
+        tw_timer_t *timer = due.next;
+        list_remove(timer);
+        wheel->count--;
+        expire(timer, arg);
+    }
+    arm(wheel, next_expiry(wheel));
+}
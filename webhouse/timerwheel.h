@@ -0,0 +1,38 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+// Timers of one event loop on a hashed wheel, see timerwheel.c
+#define TW_TICK_MS         250
+#define TW_SLOTS           256     // power of two; one turn is 64 s
+
+// Embedded in the object it times; next is NULL while not scheduled
+typedef struct tw_timer {
+    struct tw_timer *next;
+    struct tw_timer *prev;
+    uint64_t         expires;      // tick
+    void            *data;         // owner, for the expiry callback
+} tw_timer_t;
+
+typedef void tw_expire_t(tw_timer_t *timer, void *arg);
+
+typedef struct {
+    tw_timer_t slots[TW_SLOTS];    // list heads
+    uint64_t   tick;               // last tick handled
+    int        count;              // timers scheduled
+    int        fd;                 // timerfd, one-shot for the next expiry
+    uint64_t   armed;              // tick the timerfd is set for, 0: stopped
+} tw_wheel_t;
+
+extern int  tw_open     (tw_wheel_t *wheel);
+extern void tw_close    (tw_wheel_t *wheel);
+extern void tw_schedule (tw_wheel_t *wheel, tw_timer_t *timer, uint64_t deadline_ns);
+extern void tw_cancel   (tw_wheel_t *wheel, tw_timer_t *timer);
+extern void tw_advance  (tw_wheel_t *wheel, uint64_t now_ns, tw_expire_t *expire, void *arg);
+
+static inline int tw_pending(const tw_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,328 @@
+/******************************************************************************/
+/** \file       trace.c
+ *******************************************************************************
+ *
+ * \brief      Event tracing into per-thread ring buffers
+ *
+ *             Trace points (TRACE_BEGIN/END/INSTANT, see trace.h) write a
+ *             16 byte event into a ring owned by the calling thread, so
+ *             recording takes neither a lock nor a system call. The rings
+ *             are exported in the Chrome trace event format, which
+ *             chrome://tracing and ui.perfetto.dev open directly.
+ *
+ *             Tracing is switched on with -t or SIGUSR2 (toggle). SIGUSR1
+ *             writes the rings to /tmp/webhouse-trace-<pid>.json, GET /trace
+ *             returns the same JSON. Both signals are handled by a thread of
+ *             their own, so the dump never runs in signal context.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * trace_init
+ * trace_thread_name
+ * trace_record
+ * trace_write_json
+ * trace_dump
+ * * functions  local:
+ * trace_register
+ * signal_thread
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRACE_MASK        (TRACE_RING_SIZE - 1)
+#define TRACE_NAME_LEN    16
+#define TRACE_DUMP_PATH   "/tmp/webhouse-trace-%d.json"
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    uint64_t ts;           // CLOCK_MONOTONIC, ns
+    uint32_t arg;
+    uint16_t id;
+    uint8_t  phase;
+    uint8_t  reserved;
+} trace_event_t;
+
+typedef struct {
+    uint64_t      head;    // events written so far, only the owner writes it
+    int           tid;
+    char          name[TRACE_NAME_LEN];
+    trace_event_t events[TRACE_RING_SIZE];
+} trace_ring_t;
+
+//----- Data -------------------------------------------------------------------
+int trace_enabled;
+
+static __thread trace_ring_t *ringSelf;
+static __thread char threadName[TRACE_NAME_LEN];
+
+static trace_ring_t *rings[TRACE_MAX_THREADS];
+static unsigned ringCount;
+
+static const char *traceNames[TRACE_IDS] = {
+    [TRACE_ACCEPT]     = "accept",
+    [TRACE_RECV]       = "recv",
+    [TRACE_HTTP]       = "http",
+    [TRACE_HANDSHAKE]  = "handshake",
+    [TRACE_FRAMES]     = "frames",
+    [TRACE_PARSE]      = "parse",
+    [TRACE_APPLY]      = "apply",
+    [TRACE_STATUS]     = "status",
+    [TRACE_SEND]       = "send",
+    [TRACE_GPIO]       = "gpio",
+    [TRACE_TEMP]       = "temp",
+    [TRACE_PWM_PERIOD] = "pwm_period",
+};
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    signal_thread
+ ******************************************************************************/
+/** \brief        Wait for SIGUSR1 (dump) and SIGUSR2 (toggle tracing)
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void *signal_thread(void *pdata) {
+    sigset_t *set = pdata;
+    char path[64];
+    int sig;
+
+    trace_thread_name("trace");
+    for (;;) {
+        if (sigwait(set, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR2) {
+            int on = !__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED);
+            __atomic_store_n(&trace_enabled, on, __ATOMIC_RELAXED);
+            fprintf(stderr, "Tracing %s\n", on ? "enabled" : "disabled");
+        } else {
+            snprintf(path, sizeof(path), TRACE_DUMP_PATH, (int)getpid());
+            if (trace_dump(path) == 0) {
+                fprintf(stderr, "Trace written to %s\n", path);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * function :    trace_init
+ ******************************************************************************/
+/** \brief        Set up the signal handling for tracing
+ *
+ *               Must be called before any other thread is created: SIGUSR1
+ *               and SIGUSR2 are blocked here and the mask is inherited, so
+ *               only the signal thread receives them.
+ *
+ * \type         global
+ *
+ * \param[in]    enable   Start with tracing enabled
+ *
+ * \return       0 on success, -1 if the signal thread could not be started
+ *
+ ******************************************************************************/
+int trace_init(int enable) {
+    static sigset_t set;
+    pthread_t thread;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    trace_enabled = enable;
+    if (pthread_create(&thread, NULL, signal_thread, &set) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    trace_thread_name
+ ******************************************************************************/
+/** \brief        Name the calling thread, shown as track name in the viewer
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void trace_thread_name(const char *name) {
+    snprintf(threadName, sizeof(threadName), "%s", name);
+    pthread_setname_np(pthread_self(), threadName);
+    if (ringSelf != NULL) {
+        memcpy(ringSelf->name, threadName, sizeof(threadName));
+    }
+}
+
+/*******************************************************************************
+ * function :    trace_register
+ ******************************************************************************/
+/** \brief        Allocate the ring of the calling thread
+ *
+ * \type         static
+ *
+ * \return       The ring, NULL if there are too many threads or no memory
+ *
+ ******************************************************************************/
+static trace_ring_t *trace_register(void) {
+    trace_ring_t *ring;
+    unsigned index = __atomic_load_n(&ringCount, __ATOMIC_RELAXED);
+
+    do {
+        if (index >= TRACE_MAX_THREADS) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&ringCount, &index, index + 1, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->tid = syscall(SYS_gettid);
+    if (threadName[0] != '\0') {
+        memcpy(ring->name, threadName, sizeof(threadName));
+    } else {
+        pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name));
+    }
+
+    ringSelf = ring;
+    __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+    return ring;
+}
+
+/*******************************************************************************
+ * function :    trace_record
+ ******************************************************************************/
+/** \brief        Append an event to the ring of the calling thread
+ *
+ *               Use the TRACE_* macros, which skip the call while tracing is
+ *               disabled.
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void trace_record(trace_id_t id, trace_phase_t phase, uint32_t arg) {
+    trace_ring_t *ring = ringSelf;
+    struct timespec ts;
+
+    if (ring == NULL && (ring = trace_register()) == NULL) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    trace_event_t *e = &ring->events[head & TRACE_MASK];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    e->ts = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    e->arg = arg;
+    e->id = id;
+    e->phase = phase;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ * function :    trace_write_json
+ ******************************************************************************/
+/** \brief        Write all rings in the Chrome trace event format
+ *
+ *               The rings are read while their threads keep writing: an
+ *               event is only exported if it was not overwritten during the
+ *               copy.
+ *
+ * \type         global
+ *
+ * \param[in]    out   Output stream
+ *
+ * \return       0 on success, -1 on error
+ *
+ ******************************************************************************/
+int trace_write_json(FILE *out) {
+    trace_event_t *copy = malloc(sizeof(trace_event_t) * TRACE_RING_SIZE);
+    unsigned count = __atomic_load_n(&ringCount, __ATOMIC_RELAXED);
+    int pid = getpid();
+    int first = 1;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (unsigned r = 0; r < count && r < TRACE_MAX_THREADS; r++) {
+        trace_ring_t *ring = __atomic_load_n(&rings[r], __ATOMIC_ACQUIRE);
+        if (ring == NULL) {
+            continue;
+        }
+
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                     "\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", pid, ring->tid, ring->name);
+        first = 0;
+
+        uint64_t end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        for (uint64_t i = start; i < end; i++) {
+            copy[i & TRACE_MASK] = ring->events[i & TRACE_MASK];
+        }
+        // Events the owner may have overwritten meanwhile are dropped
+        uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (now > TRACE_RING_SIZE && now - TRACE_RING_SIZE > start) {
+            start = now - TRACE_RING_SIZE;
+        }
+
+        for (uint64_t i = start; i < end; i++) {
+            const trace_event_t *e = &copy[i & TRACE_MASK];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,"
+                         "\"pid\":%d,\"tid\":%d%s\"args\":{\"arg\":%u}}",
+                    e->id < TRACE_IDS ? traceNames[e->id] : "?", e->phase,
+                    (unsigned long long)(e->ts / 1000), (unsigned)(e->ts % 1000),
+                    pid, ring->tid, e->phase == TRACE_PH_INSTANT ? ",\"s\":\"t\"," : ",",
+                    e->arg);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    free(copy);
+    return ferror(out) ? -1 : 0;
+}
+
+/*******************************************************************************
+ * function :    trace_dump
+ ******************************************************************************/
+/** \brief        Write the trace JSON to a file
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 on error
+ *
+ ******************************************************************************/
+int trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    int result;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    result = trace_write_json(f);
+    if (fclose(f) != 0) {
+        result = -1;
+    }
+    return result;
+}
@@ -0,0 +1,57 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Trace points, see traceNames in trace.c for the exported names
+typedef enum {
+    TRACE_ACCEPT = 0,      // instant, arg = socket
+    TRACE_RECV,            // instant, arg = bytes received
+    TRACE_HTTP,            // span, arg = status code (end)
+    TRACE_HANDSHAKE,       // span
+    TRACE_FRAMES,          // span, all frames of one recv
+    TRACE_PARSE,           // span, arg = CommandType (end)
+    TRACE_APPLY,           // span, arg = CommandType
+    TRACE_STATUS,          // span, encoding of the status reply
+    TRACE_SEND,            // span, arg = frame length
+    TRACE_GPIO,            // span, arg = pin
+    TRACE_TEMP,            // span, one step of the temperature thread
+    TRACE_PWM_PERIOD,      // instant, start of a software PWM period
+    TRACE_IDS
+} trace_id_t;
+
+typedef enum {
+    TRACE_PH_BEGIN = 'B',
+    TRACE_PH_END = 'E',
+    TRACE_PH_INSTANT = 'i'
+} trace_phase_t;
+
+// Events kept per thread; older ones are overwritten. Power of two.
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE   4096
+#endif
+
+#define TRACE_MAX_THREADS 16
+
+extern int trace_enabled;
+
+extern int  trace_init        (int enable);
+extern void trace_thread_name (const char *name);
+extern void trace_record      (trace_id_t id, trace_phase_t phase, uint32_t arg);
+extern int  trace_write_json  (FILE *out);
+extern int  trace_dump        (const char *path);
+
+// A disabled trace point costs one load and one not-taken branch
+#define TRACE_EVENT(id, phase, arg)                                         \
+    do {                                                                    \
+        if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) { \
+            trace_record((id), (phase), (arg));                             \
+        }                                                                   \
+    } while (0)
+
+#define TRACE_BEGIN(id, arg)    TRACE_EVENT(id, TRACE_PH_BEGIN, arg)
+#define TRACE_END(id, arg)      TRACE_EVENT(id, TRACE_PH_END, arg)
+#define TRACE_INSTANT(id, arg)  TRACE_EVENT(id, TRACE_PH_INSTANT, arg)
+
+#endif // TRACE_H
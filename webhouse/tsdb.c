@@ -0,0 +1,690 @@
+/******************************************************************************/
+/** \file       tsdb.c
+ *******************************************************************************
+ *
+ * \brief      Compressed append-only time series store
+ *
+ *             Samples are compressed as in Facebook's Gorilla: timestamps as
+ *             delta of delta, values as XOR with the previous value, which
+ *             takes one bit for a repeated timestamp interval or value. The
+ *             state word takes one bit when it did not change.
+ *
+ *             The file is a sequence of TSDB_BLOCK_SIZE blocks, each with a
+ *             header (time range, sample count, checksum) and a bit stream.
+ *             A block is filled in memory and written as a whole with
+ *             O_APPEND, so the SD card only ever sees full block writes;
+ *             fdatasync runs once per TSDB_SYNC_BLOCKS blocks. A crash
+ *             loses the block being filled and at most the unsynced blocks.
+ *
+ *             tsdb_open reads the block headers into a sparse index (one
+ *             entry per block) and drops a torn last block. A range query
+ *             looks the blocks up in the index and maps only those.
+ *
+ *             Bit stream of a block, most significant bit first:
+ *               first sample:  32 bit value, TSDB_STATE_BITS bit state
+ *                              (timestamp in the header)
+ *               timestamp:     delta of delta D of the ms timestamp
+ *                              '0'                 D = 0
+ *                              '10'   + 7 bits     D in [-64, 63]
+ *                              '110'  + 9 bits     D in [-256, 255]
+ *                              '1110' + 12 bits    D in [-2048, 2047]
+ *                              '1111' + 32 bits    otherwise
+ *               value:         XOR X with the previous value
+ *                              '0'                 X = 0
+ *                              '10' + bits         meaningful bits of X fit
+ *                                                  the previous window
+ *                              '11' + 5 bits leading zeros
+ *                                   + 5 bits length - 1 + bits
+ *               state:         '0' unchanged, '1' + TSDB_STATE_BITS bits
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * tsdb_open
+ * tsdb_append
+ * tsdb_flush
+ * tsdb_query
+ * tsdb_stats
+ * tsdb_close
+ * * functions  local:
+ * block_check
+ * put_bits
+ * get_bits
+ * sign_extend
+ * encode_sample
+ * decode_block
+ * write_block
+ * index_add
+ * load_index
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "tsdb.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TSDB_MAGIC         0x53544857u     // "WHTS"
+#define TSDB_VERSION       1
+
+#define PAYLOAD_SIZE       (TSDB_BLOCK_SIZE - sizeof(tsdb_header_t))
+#define PAYLOAD_BITS       (PAYLOAD_SIZE * 8)
+
+// Largest encoded sample: timestamp 4 + 32, value 2 + 5 + 5 + 32, state 1 + 24
+#define SAMPLE_MAX_BITS    105
+
+#define STATE_MASK         ((1u << TSDB_STATE_BITS) - 1)
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;        // samples in the block
+    uint64_t first;        // ms of the first sample
+    uint64_t last;         // ms of the last sample
+    uint32_t bits;         // bits used in the payload
+    uint32_t check;        // block_check of header and payload
+} tsdb_header_t;
+
+_Static_assert(sizeof(tsdb_header_t) == 32, "tsdb_header_t must stay 32 bytes");
+
+typedef struct {
+    tsdb_header_t hdr;
+    uint8_t       payload[PAYLOAD_SIZE];
+} tsdb_block_t;
+
+_Static_assert(sizeof(tsdb_block_t) == TSDB_BLOCK_SIZE, "block size mismatch");
+
+// Sparse index, one entry per block in the file
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+} tsdb_index_t;
+
+// Encoder or decoder state of one block
+typedef struct {
+    uint64_t ms;
+    int64_t  delta;
+    uint32_t value;        // bits of the float
+    uint32_t state;
+    int      leading;      // window of the last value written with '11'
+    int      trailing;
+} tsdb_codec_t;
+
+struct tsdb {
+    int           fd;
+    uint64_t      blocks;          // sealed blocks in the file
+    unsigned      unsynced;
+    tsdb_index_t *index;
+    uint64_t      indexSize;
+    tsdb_block_t  block;           // block being filled
+    tsdb_codec_t  codec;
+    tsdb_stats_t  stats;
+};
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    block_check
+ ******************************************************************************/
+/** \brief        FNV-1a over the header (without check) and the used payload
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static uint32_t block_check(const tsdb_block_t *block) {
+    const uint8_t *p = (const uint8_t *)&block->hdr;
+    size_t bytes = (block->hdr.bits + 7) / 8;
+    uint32_t h = 2166136261u;
+
+    if (bytes > PAYLOAD_SIZE) {
+        bytes = PAYLOAD_SIZE;
+    }
+    for (size_t i = 0; i < offsetof(tsdb_header_t, check); i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < bytes; i++) {
+        h = (h ^ block->payload[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*******************************************************************************
+ * function :    put_bits
+ ******************************************************************************/
+/** \brief        Append the low n bits (n <= 32) of value to the payload
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void put_bits(tsdb_block_t *block, uint32_t value, int n) {
+    uint32_t pos = block->hdr.bits;
+    uint8_t *p = &block->payload[pos >> 3];
+    int bytes = ((pos & 7) + n + 7) >> 3;
+    uint64_t w = ((uint64_t)value & ((1ULL << n) - 1)) << (bytes * 8 - (pos & 7) - n);
+
+    // The payload behind pos is still zero, so OR-ing in is enough
+    for (int i = bytes - 1; i >= 0; i--, w >>= 8) {
+        p[i] |= (uint8_t)w;
+    }
+    block->hdr.bits = pos + n;
+}
+
+/*******************************************************************************
+ * function :    get_bits
+ ******************************************************************************/
+/** \brief        Read n bits (n <= 32) at *pos
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static uint32_t get_bits(const uint8_t *payload, uint32_t *pos, int n) {
+    const uint8_t *p = &payload[*pos >> 3];
+    int bytes = ((*pos & 7) + n + 7) >> 3;
+    uint64_t w = 0;
+
+    // Only the bytes holding the bits are read, never past the payload
+    for (int i = 0; i < bytes; i++) {
+        w = (w << 8) | p[i];
+    }
+    w >>= bytes * 8 - (*pos & 7) - n;
+    *pos += n;
+    return (uint32_t)(w & ((1ULL << n) - 1));
+}
+
+/*******************************************************************************
+ * function :    sign_extend
+ ******************************************************************************/
+/** \brief        Interpret the low n bits as two's complement
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static int64_t sign_extend(uint32_t value, int n) {
+    return (int64_t)((int32_t)(value << (32 - n)) >> (32 - n));
+}
+
+/*******************************************************************************
+ * function :    encode_sample
+ ******************************************************************************/
+/** \brief        Append a sample (not the first of the block) to the block
+ *
+ * \type         static
+ *
+ ******************************************************************************/
+static void encode_sample(tsdb_block_t *block, tsdb_codec_t *c,
+                          uint64_t ms, uint32_t value, uint32_t state) {
+    int64_t delta = (int64_t)(ms - c->ms);
+    int64_t dod = delta - c->delta;
+
+    if (dod == 0) {
+        put_bits(block, 0x0, 1);
+    } else if (dod >= -64 && dod <= 63) {
+        put_bits(block, 0x2, 2);
+        put_bits(block, (uint32_t)dod, 7);
+    } else if (dod >= -256 && dod <= 255) {
+        put_bits(block, 0x6, 3);
+        put_bits(block, (uint32_t)dod, 9);
+    } else if (dod >= -2048 && dod <= 2047) {
+        put_bits(block, 0xe, 4);
+        put_bits(block, (uint32_t)dod, 12);
+    } else {
+        put_bits(block, 0xf, 4);
+        put_bits(block, (uint32_t)dod, 32);
+    }
+    c->ms = ms;
+    c->delta = delta;
+
+    uint32_t x = value ^ c->value;
+    if (x == 0) {
+        put_bits(block, 0x0, 1);
+    } else {
+        int leading = __builtin_clz(x);
+        int trailing = __builtin_ctz(x);
+
+        if (c->leading >= 0 && leading >= c->leading && trailing >= c->trailing) {
+            put_bits(block, 0x2, 2);
+            put_bits(block, x >> c->trailing, 32 - c->leading - c->trailing);
+        } else {
+            int length = 32 - leading - trailing;
+            put_bits(block, 0x3, 2);
+            put_bits(block, leading, 5);
+            put_bits(block, length - 1, 5);
+            put_bits(block, x >> trailing, length);
+            c->leading = leading;
+            c->trailing = trailing;
+        }
+    }
+    c->value = value;
+
+    if (state == c->state) {
+        put_bits(block, 0x0, 1);
+    } else {
+        put_bits(block, 0x1, 1);
+        put_bits(block, state, TSDB_STATE_BITS);
+        c->state = state;
+    }
+}
+
+/*******************************************************************************
+ * function :    decode_block
+ ******************************************************************************/
+/** \brief        Call visit for every sample of a block within [from, to]
+ *
+ * \type         static
+ *
+ * \return       Number of samples visited
+ *
+ ******************************************************************************/
+static long decode_block(const tsdb_block_t *block, uint64_t from, uint64_t to,
+                         tsdb_visit_t visit, void *arg) {
+    const uint8_t *payload = block->payload;
+    tsdb_codec_t c;
+    tsdb_sample_t s;
+    uint32_t pos = 0;
+    long visited = 0;
+
+    if (block->hdr.count == 0 || block->hdr.bits > PAYLOAD_BITS) {
+        return 0;
+    }
+    c.ms = block->hdr.first;
+    c.delta = 0;
+    c.value = get_bits(payload, &pos, 32);
+    c.state = get_bits(payload, &pos, TSDB_STATE_BITS);
+    c.leading = -1;
+    c.trailing = 0;
+
+    for (unsigned i = 0; i < block->hdr.count; i++) {
+        if (i > 0) {
+            int64_t dod;
+
+            // tsdb_append starts every sample this far from the end, so a
+            // corrupt block cannot make the decoder read past it
+            if (pos > PAYLOAD_BITS - SAMPLE_MAX_BITS) {
+                break;
+            }
+            if (get_bits(payload, &pos, 1) == 0) {
+                dod = 0;
+            } else if (get_bits(payload, &pos, 1) == 0) {
+                dod = sign_extend(get_bits(payload, &pos, 7), 7);
+            } else if (get_bits(payload, &pos, 1) == 0) {
+                dod = sign_extend(get_bits(payload, &pos, 9), 9);
+            } else if (get_bits(payload, &pos, 1) == 0) {
+                dod = sign_extend(get_bits(payload, &pos, 12), 12);
+            } else {
+                dod = sign_extend(get_bits(payload, &pos, 32), 32);
+            }
+            c.delta += dod;
+            c.ms += c.delta;
+
+            if (get_bits(payload, &pos, 1) != 0) {
+                if (get_bits(payload, &pos, 1) != 0) {
+                    c.leading = get_bits(payload, &pos, 5);
+                    c.trailing = 32 - c.leading - (get_bits(payload, &pos, 5) + 1);
+                }
+                c.value ^= get_bits(payload, &pos, 32 - c.leading - c.trailing) << c.trailing;
+            }
+
+            if (get_bits(payload, &pos, 1) != 0) {
+                c.state = get_bits(payload, &pos, TSDB_STATE_BITS);
+            }
+        }
+        if (pos > block->hdr.bits || c.ms > to) {
+            break;
+        }
+        if (c.ms >= from) {
+            s.ms = c.ms;
+            memcpy(&s.value, &c.value, sizeof(s.value));
+            s.state = c.state;
+            visit(&s, arg);
+            visited++;
+        }
+    }
+    return visited;
+}
+
+/*******************************************************************************
+ * function :    index_add
+ ******************************************************************************/
+/** \brief        Add a block to the sparse index
+ *
+ * \type         static
+ *
+ * \return       0 on success, -1 if out of memory
+ *
+ ******************************************************************************/
+static int index_add(tsdb_t *db, const tsdb_header_t *hdr) {
+    if (db->blocks == db->indexSize) {
+        uint64_t size = db->indexSize ? db->indexSize * 2 : 256;
+        tsdb_index_t *index = realloc(db->index, size * sizeof(*index));
+        if (index == NULL) {
+            return -1;
+        }
+        db->index = index;
+        db->indexSize = size;
+    }
+    db->index[db->blocks].first = hdr->first;
+    db->index[db->blocks].last = hdr->last;
+    db->blocks++;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    write_block
+ ******************************************************************************/
+/** \brief        Seal the block being filled and append it to the file
+ *
+ * \type         static
+ *
+ * \param[in]    sync   Sync now instead of after TSDB_SYNC_BLOCKS blocks
+ *
+ * \return       0 on success, -1 on error
+ *
+ ******************************************************************************/
+static int write_block(tsdb_t *db, int sync) {
+    tsdb_block_t *block = &db->block;
+    const uint8_t *p = (const uint8_t *)block;
+    size_t done = 0;
+
+    if (block->hdr.count > 0) {
+        block->hdr.magic = TSDB_MAGIC;
+        block->hdr.version = TSDB_VERSION;
+        block->hdr.check = block_check(block);
+
+        while (done < TSDB_BLOCK_SIZE) {
+            ssize_t n = write(db->fd, p + done, TSDB_BLOCK_SIZE - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Keep the file a whole number of blocks for the next append
+                if (done > 0 && ftruncate(db->fd, db->blocks * TSDB_BLOCK_SIZE) != 0) {
+                    perror("tsdb");
+                }
+                return -1;
+            }
+            done += n;
+        }
+        if (index_add(db, &block->hdr) != 0) {
+            return -1;
+        }
+        db->unsynced++;
+        memset(block, 0, sizeof(*block));
+    }
+
+    if (db->unsynced > 0 && (sync || db->unsynced >= TSDB_SYNC_BLOCKS)) {
+        if (fdatasync(db->fd) != 0) {
+            return -1;
+        }
+        db->unsynced = 0;
+        db->stats.syncs++;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    load_index
+ ******************************************************************************/
+/** \brief        Read the block headers and cut off a torn last block
+ *
+ * \type         static
+ *
+ * \return       0 on success, -1 on error
+ *
+ ******************************************************************************/
+static int load_index(tsdb_t *db) {
+    struct stat st;
+    uint64_t blocks;
+
+    if (fstat(db->fd, &st) != 0) {
+        return -1;
+    }
+    blocks = st.st_size / TSDB_BLOCK_SIZE;
+
+    // Only the last block can be incomplete: it was written last
+    if (blocks > 0) {
+        tsdb_block_t *last = &db->block;
+        if (pread(db->fd, last, TSDB_BLOCK_SIZE, (blocks - 1) * TSDB_BLOCK_SIZE)
+                != TSDB_BLOCK_SIZE
+            || last->hdr.magic != TSDB_MAGIC || last->hdr.check != block_check(last)) {
+            blocks--;
+        }
+        memset(last, 0, sizeof(*last));
+    }
+    if ((uint64_t)st.st_size != blocks * TSDB_BLOCK_SIZE) {
+        fprintf(stderr, "tsdb: dropping %llu bytes of an incomplete block\n",
+                (unsigned long long)(st.st_size - blocks * TSDB_BLOCK_SIZE));
+        if (ftruncate(db->fd, blocks * TSDB_BLOCK_SIZE) != 0) {
+            return -1;
+        }
+    }
+
+    for (uint64_t b = 0; b < blocks; b++) {
+        tsdb_header_t hdr;
+        if (pread(db->fd, &hdr, sizeof(hdr), b * TSDB_BLOCK_SIZE) != sizeof(hdr)) {
+            return -1;
+        }
+        if (hdr.magic != TSDB_MAGIC || hdr.version != TSDB_VERSION) {
+            // Keep the block numbering; tsdb_query skips the block
+            hdr.first = b > 0 ? db->index[b - 1].last : 0;
+            hdr.last = hdr.first;
+        }
+        if (index_add(db, &hdr) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    tsdb_open
+ ******************************************************************************/
+/** \brief        Open or create a store
+ *
+ * \type         global
+ *
+ * \return       The store, NULL on error (errno set)
+ *
+ ******************************************************************************/
+tsdb_t *tsdb_open(const char *path) {
+    tsdb_t *db = calloc(1, sizeof(*db));
+
+    if (db == NULL) {
+        return NULL;
+    }
+    db->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (db->fd < 0) {
+        free(db);
+        return NULL;
+    }
+    if (load_index(db) != 0) {
+        int err = errno;
+        close(db->fd);
+        free(db->index);
+        free(db);
+        errno = err;
+        return NULL;
+    }
+    return db;
+}
+
+/*******************************************************************************
+ * function :    tsdb_append
+ ******************************************************************************/
+/** \brief        Append a sample
+ *
+ *               Timestamps must not go back; an earlier one (the clock was
+ *               set back) is stored as the time of the previous sample.
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 on a write error
+ *
+ ******************************************************************************/
+int tsdb_append(tsdb_t *db, uint64_t ms, float value, uint32_t state) {
+    tsdb_block_t *block = &db->block;
+    tsdb_codec_t *c = &db->codec;
+    uint32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    state &= STATE_MASK;
+
+    if (block->hdr.count > 0) {
+        if (ms < c->ms) {
+            ms = c->ms;
+        }
+        // Start a new block when full, or if the interval does not fit
+        if (block->hdr.bits + SAMPLE_MAX_BITS > PAYLOAD_BITS
+            || block->hdr.count == UINT16_MAX
+            || ms - c->ms > INT32_MAX) {
+            if (write_block(db, 0) != 0) {
+                return -1;
+            }
+        }
+    } else if (db->blocks > 0 && ms < db->index[db->blocks - 1].last) {
+        ms = db->index[db->blocks - 1].last;
+    }
+
+    if (block->hdr.count == 0) {
+        block->hdr.first = ms;
+        put_bits(block, bits, 32);
+        put_bits(block, state, TSDB_STATE_BITS);
+        c->ms = ms;
+        c->delta = 0;
+        c->value = bits;
+        c->state = state;
+        c->leading = -1;
+        c->trailing = 0;
+    } else {
+        encode_sample(block, c, ms, bits, state);
+    }
+    block->hdr.count++;
+    block->hdr.last = ms;
+    db->stats.samples++;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    tsdb_flush
+ ******************************************************************************/
+/** \brief        Write the block being filled, even if it is not full, and
+ *               sync the file
+ *
+ *               Every flush costs a whole block of space, so call it on
+ *               shutdown rather than periodically.
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 on error
+ *
+ ******************************************************************************/
+int tsdb_flush(tsdb_t *db) {
+    return write_block(db, 1);
+}
+
+/*******************************************************************************
+ * function :    tsdb_query
+ ******************************************************************************/
+/** \brief        Call visit for every sample in [from, to], oldest first
+ *
+ *               The blocks overlapping the range are found by binary search
+ *               in the index and mapped as one region.
+ *
+ * \type         global
+ *
+ * \return       Number of samples visited, -1 on error
+ *
+ ******************************************************************************/
+long tsdb_query(tsdb_t *db, uint64_t from, uint64_t to,
+                tsdb_visit_t visit, void *arg) {
+    uint64_t lo = 0;
+    uint64_t hi = db->blocks;
+    uint64_t end;
+    long visited = 0;
+
+    // First block that ends at or after from
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (db->index[mid].last < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (end = lo; end < db->blocks && db->index[end].first <= to; end++) {
+    }
+
+    if (end > lo) {
+        long page = sysconf(_SC_PAGESIZE);
+        off_t offset = lo * TSDB_BLOCK_SIZE;
+        off_t start = offset - offset % page;
+        size_t length = (end - lo) * TSDB_BLOCK_SIZE + (offset - start);
+        uint8_t *map = mmap(NULL, length, PROT_READ, MAP_SHARED, db->fd, start);
+
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, length, MADV_SEQUENTIAL);
+        for (uint64_t b = lo; b < end; b++) {
+            const tsdb_block_t *block =
+                (const tsdb_block_t *)(map + (offset - start) + (b - lo) * TSDB_BLOCK_SIZE);
+            if (block->hdr.magic == TSDB_MAGIC && block->hdr.version == TSDB_VERSION) {
+                visited += decode_block(block, from, to, visit, arg);
+            }
+        }
+        munmap(map, length);
+    }
+
+    // Samples not written yet
+    if (db->block.hdr.count > 0 && db->block.hdr.last >= from && db->block.hdr.first <= to) {
+        visited += decode_block(&db->block, from, to, visit, arg);
+    }
+    return visited;
+}
+
+/*******************************************************************************
+ * function :    tsdb_stats
+ ******************************************************************************/
+/** \brief        Size and activity of the store
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void tsdb_stats(const tsdb_t *db, tsdb_stats_t *stats) {
+    *stats = db->stats;
+    stats->blocks = db->blocks;
+    stats->bytes = db->blocks * TSDB_BLOCK_SIZE;
+}
+
+/*******************************************************************************
+ * function :    tsdb_close
+ ******************************************************************************/
+/** \brief        Flush and close the store
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 if the last block could not be written
+ *
+ ******************************************************************************/
+int tsdb_close(tsdb_t *db) {
+    int result = tsdb_flush(db);
+
+    if (close(db->fd) != 0) {
+        result = -1;
+    }
+    free(db->index);
+    free(db);
+    return result;
+}
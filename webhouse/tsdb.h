@@ -0,0 +1,41 @@
+#ifndef TSDB_H
+#define TSDB_H
+
+#include <stdint.h>
+
+// Append-only time series file of fixed size blocks, see tsdb.c.
+// Every sample is a timestamp, a float value and a 24 bit state word.
+#define TSDB_BLOCK_SIZE    4096
+#define TSDB_STATE_BITS    24
+
+// Sealed blocks written before the file is synced
+#ifndef TSDB_SYNC_BLOCKS
+#define TSDB_SYNC_BLOCKS   4
+#endif
+
+typedef struct tsdb tsdb_t;
+
+typedef struct {
+    uint64_t ms;           // CLOCK_REALTIME in ms
+    float    value;
+    uint32_t state;        // lower TSDB_STATE_BITS bits
+} tsdb_sample_t;
+
+typedef void (*tsdb_visit_t)(const tsdb_sample_t *sample, void *arg);
+
+typedef struct {
+    uint64_t samples;      // appended since open
+    uint64_t blocks;       // in the file
+    uint64_t bytes;        // file size
+    uint64_t syncs;        // fdatasync calls since open
+} tsdb_stats_t;
+
+extern tsdb_t *tsdb_open   (const char *path);
+extern int     tsdb_append (tsdb_t *db, uint64_t ms, float value, uint32_t state);
+extern int     tsdb_flush  (tsdb_t *db);
+extern long    tsdb_query  (tsdb_t *db, uint64_t from, uint64_t to,
+                            tsdb_visit_t visit, void *arg);
+extern void    tsdb_stats  (const tsdb_t *db, tsdb_stats_t *stats);
+extern int     tsdb_close  (tsdb_t *db);
+
+#endif // TSDB_H
@@ -0,0 +1,361 @@
+/******************************************************************************/
+/** \file       tsdbgen.c
+ *******************************************************************************
+ *
+ * \brief      Fills a time series store with simulated months of history and
+ *             measures its size and query latency
+ *
+ *             Simulates what the history sampler of the webhouse records:
+ *             a sample on every state change plus a heartbeat every
+ *             HISTORY_HEARTBEAT_MS. The heater is switched a few times a
+ *             day and the temperature model moves 0.05 degrees a second
+ *             towards its limit, as in threadTemp; dimmer sliders are
+ *             dragged in the evening and the alarm goes off now and then.
+ *             Timestamps jitter by a few ms like those of a real thread.
+ *
+ *             Reports bytes per sample, append time and the latency of
+ *             range queries of an hour, a day, a week and a month at random
+ *             positions (with the file in the page cache).
+ *
+ *             Usage: tsdbgen [-o file] [-d days] [-q queries] [-j]
+ *
+ *             -j  print the result as one JSON line (for regression tracking)
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * main
+ * * functions  local:
+ * now_ns
+ * next_random
+ * append
+ * simulate
+ * visit_sample
+ * compare_u64
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "history.h"
+#include "tsdb.h"
+
+//----- Macros -----------------------------------------------------------------
+#define TRUE 1
+#define FALSE 0
+
+#define MS_PER_DAY       86400000ULL
+#define NS_PER_SEC       1000000000ULL
+#define TEMP_STEP_MS     1000            // period of the temperature model
+#define MAX_TEMP         40.0f
+#define MIN_TEMP         0.0f
+
+//----- Data types -------------------------------------------------------------
+typedef struct {
+    const char *name;
+    uint64_t    ms;
+} query_range_t;
+
+typedef struct {
+    float  min;
+    float  max;
+    double sum;
+} query_sink_t;
+
+//----- Data -------------------------------------------------------------------
+static const query_range_t ranges[] = {
+    { "hour",  3600000ULL },
+    { "day",   MS_PER_DAY },
+    { "week",  7 * MS_PER_DAY },
+    { "month", 30 * MS_PER_DAY },
+};
+
+static uint64_t randomState = 0x9E3779B97F4A7C15ULL;
+
+static tsdb_t  *db;
+static uint64_t appendNs;
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    now_ns
+ ******************************************************************************/
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * function :    next_random
+ ******************************************************************************/
+/** \brief        xorshift64*, reproducible between runs
+ ******************************************************************************/
+static uint32_t next_random(void) {
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (uint32_t)((randomState * 2685821657736338717ULL) >> 32);
+}
+
+/*******************************************************************************
+ * function :    append
+ ******************************************************************************/
+/** \brief        Append one sample and account for the time it took
+ ******************************************************************************/
+static void append(uint64_t ms, float temp, int heat, int alarm, int dimR, int dimS) {
+    uint64_t start = now_ns();
+
+    if (tsdb_append(db, ms, temp, HISTORY_STATE(heat, alarm, dimR, dimS)) != 0) {
+        perror("tsdb_append");
+        exit(EXIT_FAILURE);
+    }
+    appendNs += now_ns() - start;
+}
+
+/*******************************************************************************
+ * function :    simulate
+ ******************************************************************************/
+/** \brief        Record days of simulated webhouse history
+ *
+ * \param[in]    start   Time of the first sample (ms)
+ * \param[in]    days    Days to simulate
+ *
+ * \return       Number of samples
+ ******************************************************************************/
+static uint64_t simulate(uint64_t start, unsigned days) {
+    uint64_t end = start + days * MS_PER_DAY;
+    uint64_t nextStep = start;           // next step of the temperature model
+    uint64_t nextBeat = start;           // next heartbeat
+    uint64_t nextSwitch = start;         // next heater or alarm event
+    uint64_t nextDrag = start + 18 * 3600000ULL;
+    uint64_t samples = 0;
+    float temp = 18.0f;
+    int heat = FALSE;
+    int alarm = FALSE;
+    int dimR = 0;
+    int dimS = 0;
+
+    while (nextBeat < end) {
+        uint64_t ms = nextBeat;
+        int changed = FALSE;
+
+        if (nextStep < ms) {
+            ms = nextStep;
+        }
+        if (nextSwitch < ms) {
+            ms = nextSwitch;
+        }
+        if (nextDrag < ms) {
+            ms = nextDrag;
+        }
+
+        if (ms == nextStep) {
+            float before = temp;
+            if (heat && temp < MAX_TEMP) {
+                temp += 0.05f;
+            } else if (!heat && temp > MIN_TEMP) {
+                temp -= 0.05f;
+            }
+            changed |= temp != before;
+            nextStep += TEMP_STEP_MS + next_random() % 3;
+        }
+        if (ms == nextSwitch) {
+            // The heater runs for a while a few times a day, the alarm
+            // sensor fires about twice a week for a few seconds
+            if (alarm) {
+                alarm = FALSE;
+                nextSwitch = ms + 1000 + next_random() % 3600000;
+            } else if (next_random() % 64 == 0) {
+                alarm = TRUE;
+                nextSwitch = ms + 2000 + next_random() % 10000;
+            } else {
+                heat = !heat;
+                nextSwitch = ms + 600000 + next_random() % (heat ? 2400000 : 14400000);
+            }
+            changed = TRUE;
+        }
+        if (ms == nextDrag) {
+            // A slider drag: a burst of levels about 50 ms apart
+            int *dim = next_random() % 2 ? &dimR : &dimS;
+            int target = next_random() % 101;
+            while (*dim != target) {
+                *dim += *dim < target ? 1 : -1;
+                if (*dim % 5 == 0 || *dim == target) {
+                    append(ms, temp, heat, alarm, dimR, dimS);
+                    samples++;
+                    ms += 45 + next_random() % 10;
+                }
+            }
+            nextDrag = ms + (next_random() % 4 == 0 ? 60000 : 20 * 3600000ULL)
+                       + next_random() % 3600000;
+            nextBeat = ms + HISTORY_HEARTBEAT_MS;
+            if (nextStep < ms) {
+                nextStep = ms;
+            }
+            if (nextSwitch < ms) {
+                nextSwitch = ms;
+            }
+            continue;
+        }
+
+        if (changed || ms == nextBeat) {
+            append(ms, temp, heat, alarm, dimR, dimS);
+            samples++;
+            nextBeat = ms + HISTORY_HEARTBEAT_MS + next_random() % 3;
+        }
+    }
+    return samples;
+}
+
+/*******************************************************************************
+ * function :    visit_sample
+ ******************************************************************************/
+/** \brief        Query callback: min, max and sum of the values
+ ******************************************************************************/
+static void visit_sample(const tsdb_sample_t *sample, void *arg) {
+    query_sink_t *sink = arg;
+
+    if (sample->value < sink->min) {
+        sink->min = sample->value;
+    }
+    if (sample->value > sink->max) {
+        sink->max = sample->value;
+    }
+    sink->sum += sample->value;
+}
+
+/*******************************************************************************
+ * function :    compare_u64
+ ******************************************************************************/
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*******************************************************************************
+ * function :    main
+ ******************************************************************************/
+int main(int argc, char **argv) {
+    const char *path = "/tmp/webhouse-tsdbgen.db";
+    unsigned days = 90;
+    unsigned queries = 200;
+    int json = FALSE;
+    uint64_t start = 1700000000000ULL;
+    uint64_t samples;
+    uint64_t writeNs;
+    uint64_t openNs;
+    tsdb_stats_t stats;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:d:q:j")) != -1) {
+        switch (opt) {
+        case 'o': path = optarg; break;
+        case 'd': days = atoi(optarg); break;
+        case 'q': queries = atoi(optarg); break;
+        case 'j': json = TRUE; break;
+        default:
+            fprintf(stderr, "Usage: %s [-o file] [-d days] [-q queries per range] [-j]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (days == 0 || queries == 0) {
+        fprintf(stderr, "Need at least one day and one query\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unlink(path);
+    db = tsdb_open(path);
+    if (db == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    writeNs = now_ns();
+    samples = simulate(start, days);
+    if (tsdb_close(db) != 0) {
+        perror("tsdb_close");
+        exit(EXIT_FAILURE);
+    }
+    writeNs = now_ns() - writeNs;
+
+    // Reopening reads the block headers back into the index
+    openNs = now_ns();
+    db = tsdb_open(path);
+    if (db == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    openNs = now_ns() - openNs;
+    tsdb_stats(db, &stats);
+
+    if (json) {
+        printf("{\"days\":%u,\"samples\":%llu,\"blocks\":%llu,\"bytes\":%llu,"
+               "\"bytes_per_sample\":%.3f,\"append_ns\":%.1f,\"write_s\":%.3f,\"open_ms\":%.3f",
+               days, (unsigned long long)samples, (unsigned long long)stats.blocks,
+               (unsigned long long)stats.bytes, (double)stats.bytes / samples,
+               (double)appendNs / samples, writeNs / 1e9, openNs / 1e6);
+    } else {
+        printf("%u days: %llu samples in %llu blocks, %llu bytes\n", days,
+               (unsigned long long)samples, (unsigned long long)stats.blocks,
+               (unsigned long long)stats.bytes);
+        printf("%.3f bytes/sample (%.1f bits), append %.1f ns/sample, write %.3f s, open %.3f ms\n",
+               (double)stats.bytes / samples, stats.bytes * 8.0 / samples,
+               (double)appendNs / samples, writeNs / 1e9, openNs / 1e6);
+    }
+
+    uint64_t *latency = malloc(queries * sizeof(*latency));
+    if (latency == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        uint64_t span = days * MS_PER_DAY;
+        uint64_t visited = 0;
+
+        if (ranges[r].ms > span) {
+            continue;
+        }
+        for (unsigned q = 0; q < queries; q++) {
+            uint64_t from = start + ((uint64_t)next_random() << 16 | (next_random() & 0xffff))
+                                    % (span - ranges[r].ms + 1);
+            query_sink_t sink = { 1e30f, -1e30f, 0 };
+            uint64_t t0 = now_ns();
+            long n = tsdb_query(db, from, from + ranges[r].ms, visit_sample, &sink);
+
+            latency[q] = now_ns() - t0;
+            if (n < 0) {
+                perror("tsdb_query");
+                exit(EXIT_FAILURE);
+            }
+            visited += n;
+        }
+        qsort(latency, queries, sizeof(*latency), compare_u64);
+
+        uint64_t p50 = latency[queries / 2];
+        uint64_t p99 = latency[(queries * 99) / 100 < queries ? (queries * 99) / 100 : queries - 1];
+        if (json) {
+            printf(",\"%s\":{\"samples\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f}",
+                   ranges[r].name, (double)visited / queries, p50 / 1e3, p99 / 1e3);
+        } else {
+            printf("query %-5s: %8.0f samples, p50 %9.1f us, p99 %9.1f us, %.1f ns/sample\n",
+                   ranges[r].name, (double)visited / queries, p50 / 1e3, p99 / 1e3,
+                   (double)p50 * queries / (visited ? visited : 1));
+        }
+    }
+    if (json) {
+        printf("}\n");
+    }
+
+    free(latency);
+    tsdb_close(db);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,445 @@
+/******************************************************************************/
+/** \file       txqueue.c
+ *******************************************************************************
+ *
+ * \brief      Outgoing data of a connection, queued in chunks
+ *
+ *             Replies are appended to the queue of their connection and sent
+ *             by the event loop in one go, so a batch of commands costs one
+ *             send for all replies. The chunks come from a pool per event
+ *             loop: no malloc on the request path, and one mapping that
+ *             io_uring can register as a fixed buffer. If the pool runs dry
+ *             a chunk is allocated, which the io_uring backend sends as a
+ *             normal buffer.
+ *
+ *             Every append is one message. The start of the last message
+ *             in each chunk is marked, so that the queue can be cut at a
+ *             message boundary (tx_queue_truncate) when a connection is
+ *             closed with unsent replies: the close frame must not end up
+ *             in the middle of another frame.
+ *
+ *             A message can also be written in place: tx_queue_reserve hands
+ *             out room for it in one piece, behind the queued bytes, and
+ *             tx_queue_commit queues what was written there. The message is
+ *             formatted right into the chunk that is sent, without a copy.
+ *
+ *             The loops are single threaded, so nothing here is locked.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * tx_pool_init
+ * tx_pool_free
+ * tx_pool_owns
+ * tx_queue_init
+ * tx_queue_append
+ * tx_queue_reserve
+ * tx_queue_commit
+ * tx_queue_peek
+ * tx_queue_consume
+ * tx_queue_truncate
+ * tx_queue_release
+ * tx_queue_clear
+ * * functions  local:
+ * chunk_alloc
+ * chunk_free
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "txqueue.h"
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    tx_pool_init
+ ******************************************************************************/
+/** \brief        Map the chunks of a pool
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 on error (errno set)
+ *
+ ******************************************************************************/
+int tx_pool_init(tx_pool_t *pool, size_t chunks) {
+    memset(pool, 0, sizeof(*pool));
+    pool->size = chunks * sizeof(tx_chunk_t);
+    pool->base = mmap(NULL, pool->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool->base == MAP_FAILED) {
+        pool->base = NULL;
+        return -1;
+    }
+    for (size_t i = chunks; i-- > 0; ) {
+        pool->base[i].next = pool->free;
+        pool->free = &pool->base[i];
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    tx_pool_free
+ ******************************************************************************/
+void tx_pool_free(tx_pool_t *pool) {
+    if (pool->base != NULL) {
+        munmap(pool->base, pool->size);
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+/*******************************************************************************
+ * function :    tx_pool_owns
+ ******************************************************************************/
+/** \brief        Whether p lies in the mapping of the pool
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+int tx_pool_owns(const tx_pool_t *pool, const void *p) {
+    const uint8_t *base = (const uint8_t *)pool->base;
+
+    return base != NULL && (const uint8_t *)p >= base && (const uint8_t *)p < base + pool->size;
+}
+
+/*******************************************************************************
+ * function :    chunk_alloc
+ ******************************************************************************/
+static tx_chunk_t *chunk_alloc(tx_pool_t *pool) {
+    tx_chunk_t *chunk = pool->free;
+
+    if (chunk != NULL) {
+        pool->free = chunk->next;
+        chunk->heap = 0;
+    } else {
+        chunk = aligned_alloc(sizeof(tx_chunk_t), sizeof(tx_chunk_t));
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->heap = 1;
+    }
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = 0;
+    chunk->mark = TX_NO_MARK;
+    return chunk;
+}
+
+/*******************************************************************************
+ * function :    chunk_free
+ ******************************************************************************/
+static void chunk_free(tx_pool_t *pool, tx_chunk_t *chunk) {
+    if (chunk->heap) {
+        free(chunk);
+    } else {
+        chunk->next = pool->free;
+        pool->free = chunk;
+    }
+}
+
+/*******************************************************************************
+ * function :    tx_queue_init
+ ******************************************************************************/
+void tx_queue_init(tx_queue_t *queue, tx_pool_t *pool) {
+    memset(queue, 0, sizeof(*queue));
+    queue->pool = pool;
+}
+
+/*******************************************************************************
+ * function :    tx_queue_append
+ ******************************************************************************/
+/** \brief        Queue a message behind the ones already queued
+ *
+ * \type         global
+ *
+ * \return       0 on success, -1 if out of memory (nothing queued)
+ *
+ ******************************************************************************/
+int tx_queue_append(tx_queue_t *queue, const void *data, size_t len) {
+    const uint8_t *p = data;
+    tx_chunk_t *tail = queue->tail;
+    tx_chunk_t *first = NULL;
+    tx_chunk_t *last = NULL;
+    size_t room = tail != NULL ? sizeof(tail->data) - tail->end : 0;
+
+    // Chain new chunks for what does not fit into the tail first, so that a
+    // failure leaves the queue as it was
+    for (size_t need = len > room ? len - room : 0; need > 0; ) {
+        tx_chunk_t *chunk = chunk_alloc(queue->pool);
+        if (chunk == NULL) {
+            while (first != NULL) {
+                tx_chunk_t *next = first->next;
+                chunk_free(queue->pool, first);
+                first = next;
+            }
+            return -1;
+        }
+        if (last != NULL) {
+            last->next = chunk;
+        } else {
+            first = chunk;
+        }
+        last = chunk;
+        need -= need < sizeof(chunk->data) ? need : sizeof(chunk->data);
+    }
+
+    if (len > 0) {
+        if (room > 0) {
+            tail->mark = tail->end;
+        } else {
+            first->mark = 0;
+        }
+    }
+    if (room > 0) {
+        size_t n = len < room ? len : room;
+        memcpy(tail->data + tail->end, p, n);
+        tail->end += n;
+        p += n;
+        len -= n;
+        queue->bytes += n;
+    }
+    for (tx_chunk_t *chunk = first; chunk != NULL; chunk = chunk->next) {
+        size_t n = len < sizeof(chunk->data) ? len : sizeof(chunk->data);
+        memcpy(chunk->data, p, n);
+        chunk->end = n;
+        p += n;
+        len -= n;
+        queue->bytes += n;
+    }
+    if (first != NULL) {
+        if (tail != NULL) {
+            tail->next = first;
+        } else {
+            queue->head = first;
+        }
+        queue->tail = last;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    tx_queue_reserve
+ ******************************************************************************/
+/** \brief        Room to write a message of up to len bytes in place
+ *
+ *               The room is in the tail chunk if it still fits there, else
+ *               in a new chunk. Nothing is queued until tx_queue_commit,
+ *               which must follow before the queue is used again.
+ *
+ * \type         global
+ *
+ * \return       Start of the room, NULL if len exceeds TX_RESERVE_MAX or
+ *               out of memory
+ *
+ ******************************************************************************/
+void *tx_queue_reserve(tx_queue_t *queue, size_t len) {
+    tx_chunk_t *tail = queue->tail;
+
+    if (len > TX_RESERVE_MAX) {
+        return NULL;
+    }
+    if (tail != NULL && sizeof(tail->data) - tail->end >= len) {
+        return tail->data + tail->end;
+    }
+    queue->reserved = chunk_alloc(queue->pool);
+    return queue->reserved != NULL ? queue->reserved->data : NULL;
+}
+
+/*******************************************************************************
+ * function :    tx_queue_commit
+ ******************************************************************************/
+/** \brief        Queue the first len bytes written to tx_queue_reserve as one
+ *               message, 0 to queue nothing
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void tx_queue_commit(tx_queue_t *queue, size_t len) {
+    tx_chunk_t *chunk = queue->reserved;
+
+    queue->reserved = NULL;
+    if (chunk == NULL) {
+        chunk = queue->tail;
+    } else if (len == 0) {
+        chunk_free(queue->pool, chunk);
+        return;
+    } else if (queue->tail != NULL) {
+        queue->tail->next = chunk;
+        queue->tail = chunk;
+    } else {
+        queue->head = queue->tail = chunk;
+    }
+    if (len > 0) {
+        chunk->mark = chunk->end;
+        chunk->end += len;
+        queue->bytes += len;
+    }
+}
+
+/*******************************************************************************
+ * function :    tx_queue_peek
+ ******************************************************************************/
+/** \brief        Describe the queued bytes as an I/O vector
+ *
+ * \type         global
+ *
+ * \param[in]    queue   Queue
+ * \param[in]    skip    Leave out this many bytes at the front (in flight)
+ * \param[out]   iov     One entry per chunk
+ * \param[in]    max     Size of iov
+ *
+ * \return       Number of entries
+ *
+ ******************************************************************************/
+int tx_queue_peek(const tx_queue_t *queue, size_t skip, struct iovec iov[], int max) {
+    int count = 0;
+
+    for (tx_chunk_t *chunk = queue->head; chunk != NULL && count < max; chunk = chunk->next) {
+        size_t len = chunk->end - chunk->start;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+        iov[count].iov_base = chunk->data + chunk->start + skip;
+        iov[count].iov_len = len - skip;
+        skip = 0;
+        count++;
+    }
+    return count;
+}
+
+/*******************************************************************************
+ * function :    tx_queue_consume
+ ******************************************************************************/
+/** \brief        Drop bytes from the front after they were sent
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void tx_queue_consume(tx_queue_t *queue, size_t len) {
+    queue->bytes -= len;
+    // A completely sent tail is freed as well: appends start a new chunk
+    while (queue->head != NULL) {
+        tx_chunk_t *chunk = queue->head;
+        size_t n = chunk->end - chunk->start;
+        if (len < n) {
+            chunk->start += len;
+            return;
+        }
+        len -= n;
+        queue->head = chunk->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        if (queue->hold) {
+            chunk->next = queue->held;
+            queue->held = chunk;
+        } else {
+            chunk_free(queue->pool, chunk);
+        }
+    }
+}
+
+/*******************************************************************************
+ * function :    tx_queue_truncate
+ ******************************************************************************/
+/** \brief        Drop unsent messages from the back
+ *
+ *               Cuts at the first marked message start after the first skip
+ *               bytes, so only whole messages that were not started yet are
+ *               dropped. The message being sent, and possibly a few after
+ *               it, stay queued.
+ *
+ * \type         global
+ *
+ * \param[in]    queue   Queue
+ * \param[in]    skip    Bytes at the front to keep in any case (in flight)
+ *
+ * \return       Number of bytes dropped
+ *
+ ******************************************************************************/
+size_t tx_queue_truncate(tx_queue_t *queue, size_t skip) {
+    tx_chunk_t *prev = NULL;
+    size_t dropped = 0;
+
+    for (tx_chunk_t *chunk = queue->head; chunk != NULL; prev = chunk, chunk = chunk->next) {
+        size_t len = chunk->end - chunk->start;
+        uint32_t from = chunk->start + (skip < len ? skip : len);
+
+        skip -= skip < len ? skip : len;
+        if (chunk->mark == TX_NO_MARK || chunk->mark < from) {
+            continue;
+        }
+
+        // Cut here: the rest of this chunk and all chunks behind it
+        for (tx_chunk_t *next = chunk->next; next != NULL; ) {
+            tx_chunk_t *drop = next;
+            next = drop->next;
+            dropped += drop->end - drop->start;
+            chunk_free(queue->pool, drop);
+        }
+        dropped += chunk->end - chunk->mark;
+        chunk->end = chunk->mark;
+        chunk->mark = TX_NO_MARK;
+        chunk->next = NULL;
+        queue->tail = chunk;
+        if (chunk->end == chunk->start) {
+            // Nothing of it is left to send
+            if (prev != NULL) {
+                prev->next = NULL;
+            } else {
+                queue->head = NULL;
+            }
+            queue->tail = prev;
+            if (queue->hold && chunk->start > 0) {
+                chunk->next = queue->held;     // its sent part may still be in use
+                queue->held = chunk;
+            } else {
+                chunk_free(queue->pool, chunk);
+            }
+        }
+        break;
+    }
+    queue->bytes -= dropped;
+    return dropped;
+}
+
+/*******************************************************************************
+ * function :    tx_queue_release
+ ******************************************************************************/
+/** \brief        Return the held chunks, once the kernel no longer uses them
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void tx_queue_release(tx_queue_t *queue) {
+    while (queue->held != NULL) {
+        tx_chunk_t *chunk = queue->held;
+        queue->held = chunk->next;
+        chunk_free(queue->pool, chunk);
+    }
+}
+
+/*******************************************************************************
+ * function :    tx_queue_clear
+ ******************************************************************************/
+/** \brief        Drop everything, when the connection is closed
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void tx_queue_clear(tx_queue_t *queue) {
+    while (queue->head != NULL) {
+        tx_chunk_t *chunk = queue->head;
+        queue->head = chunk->next;
+        chunk_free(queue->pool, chunk);
+    }
+    tx_queue_release(queue);
+    queue->tail = NULL;
+    queue->bytes = 0;
+    queue->inflight = 0;
+}
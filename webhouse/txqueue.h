@@ -0,0 +1,70 @@
+#ifndef TXQUEUE_H
+#define TXQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+// Outgoing bytes of a connection, in fixed size chunks, see txqueue.c
+#define TX_CHUNK_SIZE      2048
+#define TX_POOL_CHUNKS     512     // per event loop, 1 MB
+
+#define TX_NO_MARK         UINT32_MAX
+
+typedef struct tx_chunk {
+    struct tx_chunk *next;
+    uint32_t         start;        // first byte not yet sent
+    uint32_t         end;          // end of the queued bytes
+    uint32_t         mark;         // start of the last message in the chunk
+    int              heap;         // allocated because the pool was empty
+    uint8_t          data[TX_CHUNK_SIZE - 2 * sizeof(void *) - 3 * sizeof(uint32_t)
+                          - sizeof(int)];
+} __attribute__((aligned(64))) tx_chunk_t;
+
+_Static_assert(sizeof(tx_chunk_t) == TX_CHUNK_SIZE, "chunk size");
+
+// Chunks of one event loop. base/size is one mapping, so io_uring can
+// register it as a single fixed buffer.
+typedef struct {
+    tx_chunk_t *base;
+    size_t      size;              // bytes
+    tx_chunk_t *free;
+} tx_pool_t;
+
+typedef struct {
+    tx_pool_t  *pool;
+    tx_chunk_t *head;
+    tx_chunk_t *tail;
+    size_t      bytes;             // queued, not yet sent
+    size_t      inflight;          // of those, handed to the kernel (io_uring)
+    size_t      limit;             // backlogged above this, 0: no limit
+    int         hold;              // keep sent chunks until tx_queue_release
+    tx_chunk_t *held;              // (zero-copy sends still reference them)
+    tx_chunk_t *reserved;          // tx_queue_reserve: new chunk, not yet linked
+} tx_queue_t;
+
+extern int    tx_pool_init     (tx_pool_t *pool, size_t chunks);
+extern void   tx_pool_free     (tx_pool_t *pool);
+extern int    tx_pool_owns     (const tx_pool_t *pool, const void *p);
+
+extern void   tx_queue_init    (tx_queue_t *queue, tx_pool_t *pool);
+extern int    tx_queue_append  (tx_queue_t *queue, const void *data, size_t len);
+extern void  *tx_queue_reserve (tx_queue_t *queue, size_t len);
+extern void   tx_queue_commit  (tx_queue_t *queue, size_t len);
+extern int    tx_queue_peek    (const tx_queue_t *queue, size_t skip,
+                                struct iovec iov[], int max);
+extern void   tx_queue_consume (tx_queue_t *queue, size_t len);
+extern size_t tx_queue_truncate(tx_queue_t *queue, size_t skip);
+extern void   tx_queue_release (tx_queue_t *queue);
+extern void   tx_queue_clear   (tx_queue_t *queue);
+
+// Largest message that tx_queue_reserve can place in one piece
+#define TX_RESERVE_MAX     (sizeof(((tx_chunk_t *)0)->data))
+
+// More queued than the limit: the client does not keep up
+static inline int tx_queue_over(const tx_queue_t *queue) {
+    return queue->limit > 0 && queue->bytes > queue->limit;
+}
+
+#endif // TXQUEUE_H
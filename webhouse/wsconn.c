@@ -0,0 +1,168 @@
+/******************************************************************************/
+/** \file       wsconn.c
+ *******************************************************************************
+ *
+ * \brief      One WebSocket connection: handshake, message payloads in and
+ *             framed (optionally compressed) messages out
+ *
+ *             Outgoing frames are only queued; the event loop sends them
+ *             (see netepoll.c, neturing.c).
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * ws_conn_upgrade
+ * ws_conn_message
+ * ws_conn_send
+ * ws_conn_free
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <stdio.h>
+#include <string.h>
+
+#include "wsconn.h"
+#include "metrics.h"
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    ws_conn_upgrade
+ ******************************************************************************/
+/** \brief        Answer the upgrade request and set up the connection state
+ *
+ * \type         global
+ *
+ * \param[out]   conn      Connection state
+ * \param[in]    sock      Connected client socket
+ * \param[in]    tx        Send queue of the connection
+ * \param[in]    request   NUL terminated upgrade request (modified)
+ *
+ * \return       0 on success, -1 if the request is invalid or out of memory
+ *
+ ******************************************************************************/
+int ws_conn_upgrade(ws_conn_t *conn, int sock, tx_queue_t *tx, char request[]) {
+    char response[WS_HS_RESPLEN];
+
+    memset(conn, 0, sizeof(*conn));
+    conn->sock = sock;
+    conn->tx = tx;
+
+    if (get_handshake_response(request, response, &conn->options) < 0) {
+        return -1;
+    }
+    if (ws_deflate_init(&conn->deflate, &conn->options) < 0) {
+        // Out of memory for zlib: the reply must not announce the extension
+        return -1;
+    }
+    if (tx_queue_append(tx, response, strlen(response)) < 0) {
+        ws_deflate_free(&conn->deflate);
+        return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    ws_conn_message
+ ******************************************************************************/
+/** \brief        Get the application payload of a received data frame
+ *
+ *               Compressed frames are inflated; the result is NUL terminated
+ *               so text commands can be handled as C strings.
+ *
+ * \type         global
+ *
+ * \param[in]    conn       Connection state
+ * \param[in]    frame      Decoded frame
+ * \param[out]   out        Payload buffer
+ * \param[in]    out_size   Size of out
+ *
+ * \return       Payload length, -1 on error
+ *
+ ******************************************************************************/
+int ws_conn_message(ws_conn_t *conn, const ws_frame_t *frame, uint8_t out[], size_t out_size) {
+    int len;
+
+    if (frame->rsv1) {
+        len = ws_deflate_decompress(&conn->deflate, frame->payload, frame->length,
+                                    out, out_size - 1);
+    } else if (frame->length < out_size) {
+        memcpy(out, frame->payload, frame->length);
+        len = frame->length;
+    } else {
+        len = -1;
+    }
+
+    if (len >= 0) {
+        out[len] = '\0';
+    }
+    return len;
+}
+
+/*******************************************************************************
+ * function :    ws_conn_send
+ ******************************************************************************/
+/** \brief        Queue one message; compressed if the extension is active
+ *               and the message is large enough. A raw connection (the
+ *               control socket) gets the payload as it is, queued behind
+ *               its length (WS_RAW_HDR), so that it is sent as a message of
+ *               its own (see conn_flush in ctlsock.c).
+ *
+ * \type         global
+ *
+ * \param[in]    conn     Connection state
+ * \param[in]    opcode   WS_OP_TEXT, WS_OP_BINARY, ...
+ * \param[in]    data     Payload
+ * \param[in]    len      Payload length
+ *
+ * \return       0 on success, -1 on error (out of memory)
+ *
+ ******************************************************************************/
+int ws_conn_send(ws_conn_t *conn, int opcode, const void *data, size_t len) {
+    if (conn->raw) {
+        uint8_t record[WS_RAW_HDR + len];
+        uint32_t size = len;
+
+        memcpy(record, &size, WS_RAW_HDR);
+        memcpy(record + WS_RAW_HDR, data, len);
+        return tx_queue_append(conn->tx, record, sizeof(record));
+    }
+
+    uint8_t frame[WS_FRAME_HDR_MAX + ws_deflate_bound(len)];
+    uint8_t packed[ws_deflate_bound(len)];
+    const uint8_t *payload = data;
+    int flags = 0;
+    int frameLen;
+    int packedLen = 0;
+
+    // Control frames are never compressed (RFC 7692, section 6.1)
+    if (opcode < WS_OP_CLOSE) {
+        packedLen = ws_deflate_compress(&conn->deflate, data, len, packed, sizeof(packed));
+        if (packedLen < 0) {
+            return -1;
+        }
+    }
+    if (packedLen > 0) {
+        payload = packed;
+        len = packedLen;
+        flags = WS_RSV1;
+    }
+
+    frameLen = code_outgoing_frame(opcode, flags, payload, len, frame);
+    metrics_inc(METRIC_FRAMES_SENT);
+    metrics_add(METRIC_BYTES_SENT, frameLen);
+    return tx_queue_append(conn->tx, frame, frameLen);
+}
+
+/*******************************************************************************
+ * function :    ws_conn_free
+ ******************************************************************************/
+/** \brief        Release the connection state; the socket is the caller's
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void ws_conn_free(ws_conn_t *conn) {
+    ws_deflate_free(&conn->deflate);
+}
@@ -0,0 +1,42 @@
+#ifndef WSCONN_H
+#define WSCONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Webhouse.h"
+#include "handshake.h"
+#include "wsdeflate.h"
+#include "txqueue.h"
+
+// Length (uint32_t) in front of every message queued on a raw connection
+#define WS_RAW_HDR      4
+
+// State of one upgraded WebSocket connection.
+typedef struct {
+    int           sock;
+    tx_queue_t   *tx;              // outgoing frames, sent by the event loop
+    int           raw;             // payloads behind their length, no frames (ctlsock.c)
+    ws_options_t  options;         // negotiated during the handshake
+    ws_deflate_t  deflate;         // permessage-deflate streams
+
+    // Delta status updates, see processCommand
+    int           delta_mode;      // client acknowledges state versions
+    int           has_sent;        // "sent" is what the client has applied
+    WebhouseState sent;            // state of the last status reply
+    int           status_pending;  // reply held back while tx is over its limit
+    int           ack_pending;     // the next reply acknowledges ack
+    uint32_t      ack;             // id of the last command with one
+    unsigned      topics;          // TOPIC_* pushed to the client, 0: no pushes
+    uint64_t      ping_ns;         // payload of the unanswered ping: its send time
+
+    uint64_t      rx_ns;           // arrival of the data being processed, for metrics
+} ws_conn_t;
+
+extern int  ws_conn_upgrade (ws_conn_t *conn, int sock, tx_queue_t *tx, char request[]);
+extern int  ws_conn_message (ws_conn_t *conn, const ws_frame_t *frame,
+                             uint8_t out[], size_t out_size);
+extern int  ws_conn_send    (ws_conn_t *conn, int opcode, const void *data, size_t len);
+extern void ws_conn_free    (ws_conn_t *conn);
+
+#endif // WSCONN_H
@@ -0,0 +1,234 @@
+/******************************************************************************/
+/** \file       wsdeflate.c
+ *******************************************************************************
+ *
+ * \brief      permessage-deflate WebSocket extension (RFC 7692)
+ *
+ *             Every connection that negotiated the extension owns one raw
+ *             deflate stream for outgoing and one inflate stream for incoming
+ *             messages. Unless no_context_takeover was agreed, the streams
+ *             live as long as the connection, so repeated status messages
+ *             compress against the previous ones: the 40 byte status text
+ *             goes out as about 7 bytes, a 22 byte delta as about 8.
+ *
+ ******************************************************************************/
+/*
+ * functions  global:
+ * ws_deflate_init
+ * ws_deflate_free
+ * ws_deflate_bound
+ * ws_deflate_compress
+ * ws_deflate_decompress
+ * * functions  local:
+ * thread_cpu_ns
+ *
+ ******************************************************************************/
+
+//----- Header-Files -----------------------------------------------------------
+#include <string.h>
+#include <time.h>
+
+#include "wsdeflate.h"
+#include "metrics.h"
+
+//----- Macros -----------------------------------------------------------------
+// zlib memLevel: 8 is the default, smaller values save memory per connection
+#define WS_DEFLATE_MEM_LEVEL 8
+
+//----- Data -------------------------------------------------------------------
+// Empty stored block that terminates every message (RFC 7692, 7.2.1)
+static const uint8_t deflateTail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+//----- Implementation ---------------------------------------------------------
+
+/*******************************************************************************
+ * function :    thread_cpu_ns
+ ******************************************************************************/
+/** \brief        CPU time consumed by the calling thread
+ *
+ * \type         static
+ *
+ * \return       nanoseconds
+ *
+ ******************************************************************************/
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * function :    ws_deflate_init
+ ******************************************************************************/
+/** \brief        Set up the streams for a freshly upgraded connection
+ *
+ * \type         global
+ *
+ * \param[out]   d          Connection compression state
+ * \param[in]    options    Result of the handshake negotiation
+ *
+ * \return       0 on success (also if the extension was not negotiated),
+ *               -1 if zlib could not allocate its state
+ *
+ ******************************************************************************/
+int ws_deflate_init(ws_deflate_t *d, const ws_options_t *options) {
+    memset(d, 0, sizeof(*d));
+    if (!options->deflate) {
+        return 0;
+    }
+
+    if (deflateInit2(&d->tx, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -options->server_max_window_bits, WS_DEFLATE_MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    // The client may use up to 15 bits unless it announced a smaller window
+    if (inflateInit2(&d->rx, -15) != Z_OK) {
+        deflateEnd(&d->tx);
+        return -1;
+    }
+
+    d->tx_reset = options->server_no_context_takeover;
+    d->rx_reset = options->client_no_context_takeover;
+    d->active = 1;
+    return 0;
+}
+
+/*******************************************************************************
+ * function :    ws_deflate_free
+ ******************************************************************************/
+/** \brief        Release the zlib state of a connection
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+void ws_deflate_free(ws_deflate_t *d) {
+    if (d->active) {
+        deflateEnd(&d->tx);
+        inflateEnd(&d->rx);
+        d->active = 0;
+    }
+}
+
+/*******************************************************************************
+ * function :    ws_deflate_bound
+ ******************************************************************************/
+/** \brief        Output buffer size sufficient to compress len bytes
+ *
+ * \type         global
+ *
+ ******************************************************************************/
+int ws_deflate_bound(size_t len) {
+    // deflateBound() does not include the sync flush marker
+    return len + (len >> 10) + 64;
+}
+
+/*******************************************************************************
+ * function :    ws_deflate_compress
+ ******************************************************************************/
+/** \brief        Compress one outgoing message
+ *
+ *               Short messages are left for the caller to send as they
+ *               are: below WS_DEFLATE_MIN_SIZE nothing is saved even against
+ *               the earlier messages, and without context takeover nothing
+ *               below WS_DEFLATE_MIN_SIZE_RESET.
+ *
+ * \type         global
+ *
+ * \param[in]    d          Connection compression state
+ * \param[in]    in         Message payload
+ * \param[in]    len        Payload length
+ * \param[out]   out        Compressed payload (set RSV1 when sending it)
+ * \param[in]    out_size   Size of out, see ws_deflate_bound
+ *
+ * \return       Compressed length, 0 to send uncompressed, -1 on error
+ *
+ ******************************************************************************/
+int ws_deflate_compress(ws_deflate_t *d, const uint8_t in[], size_t len,
+                        uint8_t out[], size_t out_size) {
+    uint64_t start;
+    uint64_t elapsed;
+    size_t produced;
+
+    if (!d->active) {
+        return 0;
+    }
+    if (len < (d->tx_reset ? WS_DEFLATE_MIN_SIZE_RESET : WS_DEFLATE_MIN_SIZE)) {
+        metrics_inc(METRIC_DEFLATE_SKIPPED);
+        return 0;
+    }
+
+    start = thread_cpu_ns();
+
+    d->tx.next_in = (Bytef *)in;
+    d->tx.avail_in = len;
+    d->tx.next_out = out;
+    d->tx.avail_out = out_size;
+    if (deflate(&d->tx, Z_SYNC_FLUSH) != Z_OK || d->tx.avail_in != 0 || d->tx.avail_out == 0) {
+        return -1;
+    }
+
+    produced = out_size - d->tx.avail_out;
+    if (produced >= 4 && memcmp(out + produced - 4, deflateTail, 4) == 0) {
+        produced -= 4;
+    }
+    if (d->tx_reset) {
+        deflateReset(&d->tx);
+    }
+
+    elapsed = thread_cpu_ns() - start;
+    metrics_inc(METRIC_DEFLATE_FRAMES);
+    metrics_add(METRIC_DEFLATE_BYTES_IN, len);
+    metrics_add(METRIC_DEFLATE_BYTES_OUT, produced);
+    metrics_add(METRIC_DEFLATE_CPU_NS, elapsed);
+
+    return produced;
+}
+
+/*******************************************************************************
+ * function :    ws_deflate_decompress
+ ******************************************************************************/
+/** \brief        Inflate one incoming message (frame with RSV1 set)
+ *
+ * \type         global
+ *
+ * \param[in]    d          Connection compression state
+ * \param[in]    in         Compressed payload
+ * \param[in]    len        Payload length
+ * \param[out]   out        Decompressed message
+ * \param[in]    out_size   Size of out
+ *
+ * \return       Decompressed length, -1 on error or if out is too small
+ *
+ ******************************************************************************/
+int ws_deflate_decompress(ws_deflate_t *d, const uint8_t in[], size_t len,
+                          uint8_t out[], size_t out_size) {
+    int ret;
+
+    if (!d->active) {
+        return -1;
+    }
+
+    d->rx.next_out = out;
+    d->rx.avail_out = out_size;
+
+    d->rx.next_in = (Bytef *)in;
+    d->rx.avail_in = len;
+    ret = inflate(&d->rx, Z_SYNC_FLUSH);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || d->rx.avail_in != 0) {
+        return -1;
+    }
+
+    d->rx.next_in = (Bytef *)deflateTail;
+    d->rx.avail_in = sizeof(deflateTail);
+    ret = inflate(&d->rx, Z_SYNC_FLUSH);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) || d->rx.avail_in != 0 || d->rx.avail_out == 0) {
+        return -1;
+    }
+
+    if (d->rx_reset) {
+        inflateReset(&d->rx);
+    }
+    return out_size - d->rx.avail_out;
+}
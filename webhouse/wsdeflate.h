@@ -0,0 +1,38 @@
+#ifndef WSDEFLATE_H
+#define WSDEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "handshake.h"
+
+// Messages shorter than this are sent uncompressed. With context takeover
+// a status message (~40 bytes) or delta (~22 bytes) compresses to 7-10
+// bytes against the ones before it; without, a message only compresses
+// against itself, which does not pay below 64 bytes.
+#ifndef WS_DEFLATE_MIN_SIZE
+#define WS_DEFLATE_MIN_SIZE        16
+#endif
+#ifndef WS_DEFLATE_MIN_SIZE_RESET
+#define WS_DEFLATE_MIN_SIZE_RESET  64  // server_no_context_takeover
+#endif
+
+// Per-connection compressor/decompressor (RFC 7692).
+typedef struct {
+    int      active;            // extension negotiated and streams set up
+    int      tx_reset;          // server_no_context_takeover
+    int      rx_reset;          // client_no_context_takeover
+    z_stream tx;
+    z_stream rx;
+} ws_deflate_t;
+
+extern int  ws_deflate_init       (ws_deflate_t *d, const ws_options_t *options);
+extern void ws_deflate_free       (ws_deflate_t *d);
+extern int  ws_deflate_bound      (size_t len);
+extern int  ws_deflate_compress   (ws_deflate_t *d, const uint8_t in[], size_t len,
+                                   uint8_t out[], size_t out_size);
+extern int  ws_deflate_decompress (ws_deflate_t *d, const uint8_t in[], size_t len,
+                                   uint8_t out[], size_t out_size);
+
+#endif // WSDEFLATE_H